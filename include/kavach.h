@@ -25,12 +25,21 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
 #include <libgen.h>
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <stack>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <bitset>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 
 /* -x--x-x-x-x-x-x-x-x-x-x-x- Blueprints -x-x-x-x--x-x-x-x-x-x-x-x- */
@@ -52,7 +61,8 @@ public:
     enum ftype {
         FT_UND  = 0,        /* undefined: represents a NULL Fhdr entry */
         FT_FILE = 1,        /* a file */
-        FT_DIR  = 2         /* a directory */
+        FT_DIR  = 2,        /* a directory */
+        FT_LINK = 3         /* a hardlink: fh_offset is the FHT index of the (earlier) FT_FILE it links to */
     };
 
     enum encrypt {
@@ -60,9 +70,16 @@ public:
         FET_XOR = 1         /* XOR encryption */
     };
 
+    enum cksum {
+        FCK_UND     = 0,    /* no checksum stored */
+        FCK_CRC32C  = 1,    /* CRC32C (Castagnoli) */
+        FCK_XXH64   = 2     /* XXH64, seed 0 */
+    };
+
     /* constructor */
     Fhdr (): fh_namendx(0), fh_offset(0), fh_ftype(FT_UND), 
-             fh_etype(FET_UND), fh_mode(0), fh_size(0) { }
+             fh_etype(FET_UND), fh_mode(0), fh_size(0),
+             fh_cktype(FCK_UND), fh_cksum(0), fh_chunkndx(0) { }
 
     uint64_t            fh_namendx;     /* index into .kavachstrtab */
     uint64_t            fh_offset;      /* offset into the archived payload (i.e. kavach::payload) */
@@ -73,6 +90,9 @@ public:
     struct timespec     fh_time[2];     /*  for futimens () syscall 
                                             fh_times[0] -> last access time         : atime (st_atim)
                                             fh_times[1] -> last modification time   : mtime (st_mtim) s*/
+    cksum               fh_cktype;      /* checksum algorithm used for fh_cksum */
+    uint64_t            fh_cksum;       /* checksum of the plain (unencrypted) file data */
+    uint64_t            fh_chunkndx;    /* index of the file's first entry in .chunktab */
 
     /* Useful methods */
     bool is_dir_end () {
@@ -90,16 +110,87 @@ public:
                         "\tfh_time[0].s : 0x%lx \n"
                         "\tfh_time[0].ns: 0x%lx \n"
                         "\tfh_time[1].s : 0x%lx \n"
-                        "\tfh_time[1].ns: 0x%lx \n",
+                        "\tfh_time[1].ns: 0x%lx \n"
+                        "\tfh_cktype    : 0x%x \n"
+                        "\tfh_cksum     : 0x%lx \n"
+                        "\tfh_chunkndx  : 0x%lx \n",
 						fh_namendx, fh_offset, fh_ftype,
                         fh_etype, fh_mode, fh_size,
                         fh_time[0].tv_sec, fh_time[0].tv_nsec,
-                        fh_time[1].tv_sec, fh_time[1].tv_nsec);
+                        fh_time[1].tv_sec, fh_time[1].tv_nsec,
+                        fh_cktype, fh_cksum, fh_chunkndx);
 		fprintf(stderr, "\t^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n");
 	}
 };
 
 
+/************************************************************************
+ * Chunk Table Entry:                                                   *
+ *      Every file body is indexed in k_chunksz (KBF_CHUNK_SIZE) pieces *
+ *      of plain data, so that a byte range can be served by locating   *
+ *      and transforming only the chunks covering it. A file's chunks   *
+ *      are contiguous in .chunktab, starting at fh_chunkndx.           *
+ ************************************************************************/
+#define KBF_CHUNK_SIZE      0x100000            /* 1 MiB of plain data per chunk        */
+
+class Kchunk {
+public:
+
+    /* constructor */
+    Kchunk (): c_offset(0), c_size(0), c_crc(0) { }
+
+    uint64_t            c_offset;       /* offset of the stored chunk into archived payload */
+    uint32_t            c_size;         /* stored size of the chunk */
+    uint32_t            c_crc;          /* CRC32C of the plain chunk */
+};
+
+
+/************************************************************************
+ * Checksum:                                                            *
+ *      Running checksum over a file's plain data, fed block by block   *
+ *      in the same pass that reads (pack) or decrypts (unpack) it.     *
+ ************************************************************************/
+class Cksum {
+public:
+
+    /* constructor */
+    Cksum (Fhdr::cksum type);
+
+    void                update      (const uint8_t *data, size_t len);
+    uint64_t            digest      () const;
+
+private:
+    Fhdr::cksum         type;
+    uint32_t            crc;            /* FCK_CRC32C state */
+    uint64_t            acc[4];         /* FCK_XXH64 lanes  */
+    uint64_t            total_len;
+    uint8_t             buffer[32];     /* FCK_XXH64 partial stripe */
+    uint32_t            buffered;
+};
+
+
+/************************************************************************
+ * XOR Key Stream:                                                      *
+ *      <key> repeated back to back into a buffer of a few KiB so that  *
+ *      XOR'ing a block runs over long contiguous spans (which the      *
+ *      compiler vectorizes) instead of a modulo per byte.              *
+ ************************************************************************/
+#define KEYSTREAM_MIN_SIZE  0x1000
+
+class XorKeystream {
+public:
+
+    /* constructor */
+    XorKeystream (const std::string &key);
+
+    void                apply       (uint8_t *data, size_t len, uint64_t offset) const;
+
+private:
+    std::vector<uint8_t> stream;
+    uint64_t            ksize;
+};
+
+
 /************************************************************************
  * Kavach Binary Header:                                                *
  *      Acts as a roadmap to parse the FHT. Stores file offset (i.e.    *
@@ -115,8 +206,25 @@ public:
 class Kbhdr {
 public:
 
+    enum nametab_enc {
+        KNT_RAW     = 0,    /* NUL terminated names, fh_namendx is a byte offset */
+        KNT_FCODED  = 1     /* sorted & front-coded blocks, fh_namendx is a rank */
+    };
+
+    enum flags {
+        KBF_STREAM_ORDER = 0x1, /* every table precedes the payload and file bodies *
+                                 * are laid out in FHT order (ascending fh_offset) */
+        KBF_TRAILER      = 0x2, /* payload comes first, the tables and this header  *
+                                 * trail it (see TRAILER_MAGIC)                    */
+        KBF_VOLUMES      = 0x4  /* the payload lives in volume files next to the   *
+                                 * SFX, described by the volume table (Kvolume)    */
+    };
+
     /* constructor */
-    Kbhdr (): k_fhtoff(0), k_fhnum(0) { }
+    Kbhdr (): k_fhtoff(0), k_fhnum(0), k_fhentsize(0), k_nametaboff(0),
+              k_payloadoff(0), k_payloadsz(0), k_nametabsz(0), k_nametabenc(KNT_RAW),
+              k_chunktaboff(0), k_chunknum(0), k_chunksz(0), k_flags(0),
+              k_voltaboff(0), k_volnum(0) { }
 
     /* attributes of binary data */
     uint64_t            k_fhtoff;       /* File Header Table (FHT) offset */
@@ -125,6 +233,14 @@ public:
     uint64_t            k_nametaboff;   /* offset to .nametab where all file names are stored */
     uint64_t            k_payloadoff;   /* offset to start of 'archived payload' */
     uint64_t            k_payloadsz;    /* total size of all files included in archived payload */
+    uint64_t            k_nametabsz;    /* size of .nametab (in bytes) */
+    uint64_t            k_nametabenc;   /* encoding of .nametab (Kbhdr::nametab_enc) */
+    uint64_t            k_chunktaboff;  /* offset to .chunktab (seek index into file bodies) */
+    uint64_t            k_chunknum;     /* number of entries in .chunktab */
+    uint64_t            k_chunksz;      /* plain bytes covered by each .chunktab entry */
+    uint64_t            k_flags;        /* layout flags (Kbhdr::flags) */
+    uint64_t            k_voltaboff;    /* offset to .voltab (KBF_VOLUMES only) */
+    uint64_t            k_volnum;       /* number of entries in .voltab */
 
     /* Useful methods */	
 	void dump(){
@@ -135,20 +251,364 @@ public:
                         "\tk_nametaboff : 0x%lx \n"
                         "\tk_payloadoff : 0x%lx \n"
                         "\tk_payloadsz  : 0x%lx \n"
+                        "\tk_nametabsz  : 0x%lx \n"
+                        "\tk_nametabenc : 0x%lx \n"
+                        "\tk_chunktaboff: 0x%lx \n"
+                        "\tk_chunknum   : 0x%lx \n"
+                        "\tk_chunksz    : 0x%lx \n"
+                        "\tk_flags      : 0x%lx \n"
+                        "\tk_voltaboff  : 0x%lx \n"
+                        "\tk_volnum     : 0x%lx \n"
                         ,
 						k_fhtoff, k_fhnum, k_fhentsize,
-                        k_nametaboff, k_payloadoff, k_payloadsz);
+                        k_nametaboff, k_payloadoff, k_payloadsz,
+                        k_nametabsz, k_nametabenc,
+                        k_chunktaboff, k_chunknum, k_chunksz, k_flags,
+                        k_voltaboff, k_volnum);
 		fprintf(stderr, "\t^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n");
 	}
 };
 
 
+/************************************************************************
+ * Volume Table Entry:                                                  *
+ *      With --volume-size the payload is split over volume files       *
+ *      (<sfx>.001, <sfx>.002 ...), each holding a VOLUME_HDR_SIZE      *
+ *      header followed by the payload bytes [v_start, v_start+v_size). *
+ *      Volumes start VOLUME_ALIGN aligned, so that every one of them   *
+ *      can be mapped right where it belongs within the payload.        *
+ ************************************************************************/
+class Kvolume {
+public:
+
+    /* constructor */
+    Kvolume (): v_start(0), v_size(0), v_id(0) { }
+    Kvolume (uint64_t start, uint64_t size, uint64_t id): v_start(start), v_size(size), v_id(id) { }
+
+    uint64_t            v_start;        /* offset of the volume into archived payload */
+    uint64_t            v_size;         /* payload bytes held by the volume */
+    uint64_t            v_id;           /* random id shared by the SFX and its volumes */
+};
+
+
+/************************************************************************
+ * Names Table:                                                         *
+ *      Collects file/directory names while packing. Every distinct     *
+ *      name is interned once into an arena (no per-name malloc) and    *
+ *      handed a provisional id which finalize () later rewrites into   *
+ *      the fh_namendx understood by the chosen encoding.               *
+ *                                                                      *
+ * NOTE: KNT_FCODED layout (all offsets relative to nametab start) -    *
+ *                                                                      *
+ *          [ uint64 count ][ uint64 nblocks ][ uint64 boff[nblocks] ]  *
+ *          [ block0 ][ block1 ] ... [ blockN ]                         *
+ *                                                                      *
+ *       Each block holds NAMETAB_FC_BLOCK sorted names. The first one  *
+ *       is stored whole (NUL terminated), the rest as a LEB128 length  *
+ *       of the prefix shared with the previous name followed by the    *
+ *       NUL terminated suffix.                                         *
+ *                                                                      *
+ ************************************************************************/
+#define NAMETAB_FC_BLOCK    16                  /* names per front-coded block          */
+#define NAMETAB_ARENA_SIZE  0x10000             /* bytes per arena chunk                */
+
+class Nametab {
+public:
+
+    /* constructor */
+    Nametab (): arena_cur(nullptr), arena_left(0) { }
+
+    std::vector<char>   bytes;          /* encoded table, valid after finalize () */
+
+    uint64_t            intern      (std::string_view name);
+    bool                finalize    (Kbhdr::nametab_enc enc, std::vector<Fhdr> &fht);
+
+private:
+    std::vector<std::unique_ptr<char[]>>            arena;      /* backing store for names   */
+    char                                            *arena_cur;
+    size_t                                          arena_left;
+    std::vector<std::string_view>                   names;      /* id -> name                */
+    std::unordered_map<std::string_view, uint64_t>  ids;        /* name -> id                */
+};
+
+
+/************************************************************************
+ * Names Table Reader:                                                  *
+ *      Resolves fh_namendx back to a name (and a name back to its      *
+ *      fh_namendx) for both nametab encodings. Lookups in a front-     *
+ *      coded table binary search the block heads and then decode at    *
+ *      most a single block.                                            *
+ ************************************************************************/
+class NametabReader {
+public:
+
+    /* constructor */
+    NametabReader (const uint8_t *base, uint64_t size, uint64_t enc);
+
+    bool                name        (uint64_t ndx, std::string &out) const;
+    int64_t             lookup      (const std::string &name) const;
+
+private:
+    const uint8_t       *base;
+    uint64_t            size;
+    uint64_t            enc;
+    uint64_t            count;          /* KNT_FCODED: number of names  */
+    uint64_t            nblocks;        /* KNT_FCODED: number of blocks */
+    const uint8_t       *boff;          /* KNT_FCODED: block offsets    */
+};
+
+
+/************************************************************************
+ * Exclude Rules:                                                       *
+ *      --exclude/--exclude-from patterns (gitignore syntax) compiled   *
+ *      once before the scan. Plain names ("node_modules") and "*<lit>" *
+ *      suffixes ("*.o") are answered by hash lookups; everything else  *
+ *      goes through a token program matched by a small automaton.      *
+ *      As in gitignore, the last matching rule wins and "!" negates.   *
+ ************************************************************************/
+class Exclude {
+public:
+
+    /* constructor */
+    Exclude () { }
+
+    bool                add         (std::string_view line);
+    bool                load        (const std::string &path);
+    bool                excluded    (std::string_view relpath, bool is_dir) const;
+    bool                empty       () const { return rules.empty(); }
+
+private:
+    struct Token {
+        enum kind : uint8_t { LIT, ANY, CLASS, STAR, GLOBSTAR, DIRS } type;
+        char            c;
+        std::bitset<256> cls;
+    };
+    struct Rule {
+        bool                negate;         /* "!pattern"                       */
+        bool                dir_only;       /* "pattern/"                       */
+        bool                anchored;       /* has a '/': matched on full path  */
+        std::vector<Token>  program;        /* empty for the hashed rules       */
+    };
+
+    bool                compile     (std::string_view glob, std::vector<Token> &program) const;
+    bool                run         (const std::vector<Token> &program, std::string_view s) const;
+    void                best_of     (const std::vector<uint32_t> *hits, bool is_dir, int64_t &best) const;
+
+    std::vector<Rule>                                       rules;
+    std::unordered_map<std::string, std::vector<uint32_t>>  names;          /* literal basenames        */
+    std::unordered_map<std::string, std::vector<uint32_t>>  paths;          /* literal anchored paths   */
+    std::unordered_map<std::string, std::vector<uint32_t>>  suffixes;       /* "*<literal>" basenames   */
+    std::vector<size_t>                                     suffix_lens;    /* distinct suffix lengths  */
+    std::vector<uint32_t>                                   globs;          /* rules left for run ()    */
+};
+
+
+/************************************************************************
+ * Extraction Journal:                                                  *
+ *      Sidecar (<name>_dir.journal) of a journaled unpack. About once  *
+ *      a second everything extracted so far is flushed (syncfs) and    *
+ *      the journal records how far that got: the first FHT entry not   *
+ *      yet done and, for a file in progress, its durable byte count    *
+ *      along with the running checksum state. --resume restarts from  *
+ *      there instead of from scratch.                                  *
+ ************************************************************************/
+class Journal {
+public:
+
+    /* constructor */
+    Journal ();
+    ~Journal ();
+
+    bool                open        (const std::string &path, int rootfd, uint64_t identity, bool resume);
+    bool                checkpoint  (uint64_t next, uint64_t done = 0, const Cksum *state = nullptr, bool force = false);
+    void                finish      ();
+
+    bool                resumed     () const { return resuming; }
+    uint64_t            next        () const { return rec.next; }
+    uint64_t            done        () const { return rec.done; }
+    const Cksum         &state      () const { return rec.state; }
+
+private:
+    struct Record {
+        uint64_t        magic;
+        uint64_t        identity;       /* XXH64 of Kbhdr + FHT of the SFX being extracted  */
+        uint64_t        next;           /* entries [0, next) are on disk                    */
+        uint64_t        done;           /* durable bytes of FHT entry <next> (an FT_FILE)   */
+        Cksum           state;          /* checksum of those <done> plain bytes             */
+        uint64_t        crc;            /* XXH64 of the fields above                        */
+    };
+
+    uint64_t            seal        () const;
+
+    Record              rec;
+    int                 fd;
+    int                 rootfd;
+    bool                resuming;
+    std::string         path;
+    struct timespec     last;           /* CLOCK_MONOTONIC of the last checkpoint */
+};
+
+
+/************************************************************************
+ * Flusher:                                                             *
+ *      Makes an unpack as durable as --durability asks. per-file      *
+ *      fdatasyncs every file as soon as it is written; per-dir queues  *
+ *      them up and has a pool of workers fdatasync a whole batch at    *
+ *      once before their directory is fsync'ed (a directory entry must *
+ *      never outlive the contents it names); end issues one syncfs     *
+ *      for the output filesystem once everything is written.          *
+ ************************************************************************/
+class Flusher {
+public:
+
+    enum policy : uint8_t {
+        FD_NONE         = 0,            /* leave it all to writeback (default)  */
+        FD_END          = 1,
+        FD_PER_FILE     = 2,
+        FD_PER_DIR      = 3
+    };
+
+    ~Flusher ();
+
+    bool                file        (int fd, int dirfd, const std::string &tmp, const std::string &name);
+    bool                flush       ();
+    bool                dir         (int dirfd);
+    bool                finish      (int rootfd, const std::string &root);
+    void                reset       ();
+
+private:
+    struct Pending {
+        int             fd;             /* written, timestamps set, not yet durable         */
+        int             dirfd;
+        std::string     tmp;            /* renamed to <name> once durable (--update)        */
+        std::string     name;
+    };
+
+    std::vector<Pending> pending;
+};
+
+
+/************************************************************************
+ * Throttle:                                                            *
+ *      Token bucket keeping a process under --max-read-bps,            *
+ *      --max-write-bps or --max-cpu. take () books <n> units against   *
+ *      the rate and sleeps off whatever the caller got ahead of it by, *
+ *      so all threads sharing a bucket are paced together. An idle     *
+ *      bucket only saves up THROTTLE_BURST worth of credit, which      *
+ *      keeps the output smooth after a pause. slice () caps a single   *
+ *      I/O at THROTTLE_SLICE while throttled, for the same reason.     *
+ ************************************************************************/
+#define THROTTLE_SLICE      0x10000             /* largest single I/O while throttled   */
+#define THROTTLE_BURST      20000000            /* ns of credit an idle Throttle keeps  */
+
+class Throttle {
+public:
+    Throttle (): rate(0), next(0) { }
+
+    void                set         (uint64_t units_per_sec) { rate = units_per_sec; }
+    bool                active      () const { return rate != 0; }
+    uint64_t            slice       (uint64_t len) const { return (rate && len > THROTTLE_SLICE) ? THROTTLE_SLICE : len; }
+    unsigned            threads     (unsigned n) const;
+    void                take        (uint64_t n);
+    void                take_cpu    ();
+
+private:
+    uint64_t            rate;           /* units (bytes|CPU ns) per second, 0 => unlimited  */
+    std::mutex          lock;
+    uint64_t            next;           /* CLOCK_MONOTONIC ns the booked units are paid off */
+    std::atomic<uint64_t> cpu_seen {0}; /* process CPU ns already booked (take_cpu)        */
+};
+
+
+/************************************************************************
+ * Stats:                                                               *
+ *      What --stats reports at exit (stats.cpp), as a table or with    *
+ *      --stats=json as a JSON document. A PhaseTimer adds the          *
+ *      CLOCK_MONOTONIC time of its scope to a phase: time spent by     *
+ *      every thread adds up, so with run_chunked () a phase can        *
+ *      outlast the wall clock. Counters are relaxed atomics, bumped    *
+ *      at the I/O helpers and payload loops. While --stats is off      *
+ *      both cost a single branch.                                      *
+ ************************************************************************/
+enum stat_phase {
+    SP_TRAVERSE,                    /* walking the pack target, building the FHT        */
+    SP_MAP,                         /* mapping an SFX's KBF (and volumes)               */
+    SP_READ,                        /* read (2)s and faulting in mapped payload         */
+    SP_TRANSFORM,                   /* checksum, codec and cipher stages                */
+    SP_WRITE,                       /* write (2)s and in-kernel copies                  */
+    SP_METADATA,                    /* patching the SFX's ELF metadata                  */
+    SP_SYNC,                        /* --durability fdatasync (2)s and syncfs (2)       */
+    SP_NUM
+};
+
+enum stat_counter {
+    SC_FILES,
+    SC_DIRS,
+    SC_LINKS,
+    SC_BYTES_READ,
+    SC_BYTES_WRITTEN,
+    SC_READS,                       /* read (2)|pread (2) calls                         */
+    SC_WRITES,                      /* write (2)|pwrite (2) calls                       */
+    SC_COPIES,                      /* copy_file_range (2)|sendfile (2) calls           */
+    SC_SHORT_READS,                 /* reads handing back less than asked for           */
+    SC_SHORT_WRITES,
+    SC_NUM
+};
+
+class Stats {
+public:
+    void                enable      (bool as_json);
+    void                count       (stat_counter c, uint64_t n = 1) { if (on) counters[c].fetch_add (n, std::memory_order_relaxed); }
+    void                count_fht   (const Fhdr *fht, uint64_t fhnum);
+    void                time        (stat_phase p, uint64_t ns) { phase_ns[p].fetch_add (ns, std::memory_order_relaxed); }
+    void                report      ();
+
+    static uint64_t     now         () { struct timespec ts; clock_gettime (CLOCK_MONOTONIC, &ts); return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec; }
+
+    bool                on = false;
+
+private:
+    bool                json = false;
+    uint64_t            started = 0;            /* CLOCK_MONOTONIC ns at enable ()  */
+    std::atomic<uint64_t> phase_ns[SP_NUM];
+    std::atomic<uint64_t> counters[SC_NUM];
+};
+
+extern Stats            STATS;                  /* --stats (process wide, see below)    */
+
+/* times the enclosing scope into <phase> (nothing while --stats is off) */
+class PhaseTimer {
+public:
+    PhaseTimer (stat_phase phase): phase(phase), start(STATS.on ? Stats::now () : 0) { }
+    ~PhaseTimer () { if (start) STATS.time (phase, Stats::now () - start); }
+
+    PhaseTimer (const PhaseTimer &) = delete;
+    PhaseTimer &operator= (const PhaseTimer &) = delete;
+
+private:
+    stat_phase          phase;
+    uint64_t            start;
+};
+
+
+/* per-block progress of an extraction: plain bytes written so far and their running checksum */
+typedef std::function<bool (uint64_t, const Cksum &)>   Progress;
+
+
 /************************************************************************
  * Kavach Binary Format:                                                *
  *      Describes the layout of Kavach binary format.                   *
  *                                                                      *
  * NOTE: It simply starts with a header (roadmap to FHT) followed by    * 
- *       the FHT, payload and nametab.                                  *
+ *       the FHT, chunktab, nametab and payload. With every table ahead *
+ *       of the payload (KBF_STREAM_ORDER) an SFX can be extracted     *
+ *       while it is still being read from a pipe.                      *
+ *       An SFX packed onto a pipe (--output -) can't seek back, so it  *
+ *       is laid out the other way round (KBF_TRAILER): payload first,  *
+ *       then chunktab, nametab, FHT and lastly Kbhdr + TRAILER_MAGIC,  *
+ *       found by looking at the end of the file.                       *
+ *       A multi-volume SFX (KBF_VOLUMES) ends with the volume table    *
+ *       instead; its payload is mapped in from the volume files.       *
  *                                                                      *
  *                       ___________________   _                        *
  *                      |                   |   \ --->    KUNDAL        *
@@ -185,6 +645,12 @@ public:
  *                      |      -- FhdrN     |   | ===> Kavach body      *
  *                      |___________________|   |                       *
  *                      |                   |   |                       *
+ *                      |   [ chunktab ]    |   |                       *
+ *                      |___________________|   |                       *
+ *                      |                   |   |                       *
+ *                      |    [ nametab ]    |   |                       *
+ *                      |___________________|   |                       *
+ *                      |                   |   |                       *
  *                      |    [ Payload ]    |   |                       *
  *                      |                   |   |                       *
  *                      |      -- File1     |   |                       *
@@ -193,9 +659,6 @@ public:
  *                      |          ...      |   |                       *
  *                      |          ...      |   |                       *
  *                      |      -- FileN     |   |                       *
- *                      |___________________|   |                       *
- *                      |                   |   |                       *
- *                      |    [ nametab ]    |   |                       *
  *                      |___________________|  _/                       *
  *                                                                      *
  ************************************************************************/
@@ -208,12 +671,49 @@ public:
     /* kavach structure */
     Kbhdr                               header;     /* head */
     std::vector<Fhdr>                   fht;        /* File Header Table */
-    std::vector<std::vector<uint8_t>>   payload;    /* actual archive payload (file bodies) */
-    std::vector<char>                   nametab;    /* names table to store all file/dir names */
+    std::vector<Kchunk>                 chunktab;   /* seek index into file bodies */
+    std::vector<std::string>            payload;    /* source path of every file body (in FHT order), *
+                                                     * streamed into the SFX while attaching           */
+    Nametab                             nametab;    /* names table to store all file/dir names */
 };
 
 
 
+/************************************************************************
+ * Volume Writer:                                                       *
+ *      Spreads the payload of a pack over volumes of --volume-size.   *
+ *      layout () moves a body that would straddle two volumes to the   *
+ *      start of the next one, unless it is bigger than a volume. Such  *
+ *      a body is written into a pipe, from which a splicer thread      *
+ *      hands each volume its share.                                    *
+ ************************************************************************/
+class VolumeWriter {
+public:
+
+    /* constructor */
+    VolumeWriter (const std::string &sfx_name, uint64_t volume_size);
+    ~VolumeWriter ();
+
+    void                layout      (Kavach &ko);
+    int                 open_body   (Fhdr &fhdr);
+    bool                close_body  ();
+    bool                finish      (int sfxfd, Kavach &ko);
+
+private:
+    bool                open_volume (uint64_t v);
+    void                splice_body (uint64_t v, uint64_t offset, uint64_t size);
+
+    std::string         sfx_name;
+    uint64_t            volume_size;    /* payload bytes per volume, multiple of VOLUME_ALIGN */
+    uint64_t            id;
+    std::vector<Kvolume> voltab;
+    std::vector<int>    fds;            /* per volume, -1 until created */
+    int                 pipefd[2];      /* body spanning volumes */
+    std::thread         splicer;
+    bool                spliced;
+};
+
+
 /* -x--x-x-x-x-x-x-x-x-x-x-x- MACROS -x--x-x-x-x-x-x-x-x-x-x-x- */
 #define RESET   "\033[0m"
 #define BLACK   "\033[30m"      /* Black */
@@ -244,23 +744,163 @@ public:
 //#define ORANGE      “\e[38;5;202m” 
 
 
+/************************************************************************
+ * Logging:                                                             *
+ *      --quiet lets errors through only, the default adds a line per   *
+ *      operation, -v one per file and -vv the internals. debug_msg ()  *
+ *      doesn't even build its message while <level> is off, and levels *
+ *      above KAVACH_LOG_MAX are compiled out altogether. Messages let  *
+ *      through are queued on a lock-free ring for a writer thread      *
+ *      (logger.cpp), coloured only when stderr is a terminal.          *
+ ************************************************************************/
+enum log_level { LOG_ERROR, LOG_INFO, LOG_VERBOSE, LOG_DEBUG };
+
+#ifndef KAVACH_LOG_MAX
+#define KAVACH_LOG_MAX      LOG_DEBUG           /* -DKAVACH_LOG_MAX=1 builds -v|-vv out  */
+#endif
+#define LOG_RING_SIZE       4096                /* messages queued for the writer thread */
+
+#define log_on(level)       ((level) <= KAVACH_LOG_MAX && (level) <= LOG_LEVEL)
+#define debug_msg(level, msg)                   \
+    do {                                        \
+        if (log_on (level)) {                   \
+            log_msg ((level), (msg));           \
+        }                                       \
+    } while (0)
+
+
 
 #define SHDR_NAME       ".kavach"               /* Kavach shdr name                     */
 #define FILE_EXTENSION  ".kgs"                  /* (k)avach (g)enerated (s)fx           */
 #define PACK_SIGNATURE  0x4c41444e554b0000      /* Karn's KUNDAL (a pair of earrings)   */
+#define TRAILER_MAGIC   0x4c4941525446424b      /* "KBFTRAIL": ends a KBF_TRAILER KBF   */
+#define PATCH_MAGIC     0x484354415046424b      /* "KBFPATCH": leads a --diff patch     */
+#define PATCH_EXTENSION ".kpatch"               /* --diff output                        */
+#define UPDATE_CHECKSUM 2                       /* UPDATE_FLAG for --update=checksum    */
+#define JOURNAL_MAGIC   0x314c4e524a46424b      /* "KBFJRNL1": leads an unpack journal  */
+#define JOURNAL_INTERVAL 1                      /* seconds between journal checkpoints  */
+#define BLOB_CACHE_MIN  0x10000                 /* smaller bodies aren't worth caching  */
+#define BLOB_CACHE_SIZE 0x40000000              /* default --cache-size (1 GiB)         */
+#define DURABILITY_BATCH 256                    /* files queued by --durability per-dir */
+#define DURABILITY_WORKERS 16                   /* threads fdatasync'ing such a batch   */
+#define VOLUME_MAGIC    0x4d554c4f5646424b      /* "KBFVOLUM": leads every volume       */
+#define VOLUME_ALIGN    0x10000                 /* volumes start (and are sized) on it  */
+#define VOLUME_HDR_SIZE VOLUME_ALIGN            /* volume header, payload follows it    */
+#define VOLUME_WAIT     60                      /* seconds to wait for a missing volume */
+#define WATCH_DEBOUNCE  500                     /* ms of quiet before --watch writes    */
+#define WATCH_LATENCY   5                       /* seconds --watch holds changes at most*/
+#define WATCH_GARBAGE   50                      /* % of dead payload to compact away    */
+#define WATCH_COMPACT_MIN 0x100000              /* less dead payload is never compacted */
+
 
+/* shared data: one copy per thread, so that every thread can work on an archive of its own */
+extern thread_local int              DESTROY_RELICS;         /* flag set by --destroy-relics         */
+extern thread_local int              RELICS_WAIT;            /* --destroy-relics=<secs>, -1 => all   */
+extern thread_local int              UNPACK_FLAG;
+extern thread_local int              PACK_FLAG;
+extern thread_local int              KEY_FLAG;
+extern thread_local int              OFNAME_FLAG;            /* output filename                      */
+extern thread_local int              VERIFY_FLAG;            /* flag set by --verify                 */
+extern thread_local int              STDIN_FLAG;             /* flag set by --unpack - (read stdin)  */
+extern thread_local int              FROM_TAR_FLAG;          /* flag set by --from-tar               */
+extern thread_local int              TO_TAR_FLAG;            /* flag set by --to-tar                 */
+extern thread_local std::string      TAR_PATH;               /* tar stream to read|write, - => stdio */
+extern thread_local int              FILES_FROM_FLAG;        /* flag set by --files-from             */
+extern thread_local std::string      FILES_FROM;             /* NUL separated path list, - => stdin  */
+extern thread_local Exclude          EXCLUDES;               /* set by --exclude/--exclude-from      */
+extern thread_local int              MERGE_FLAG;             /* flag set by --merge                  */
+extern thread_local std::vector<std::string> MERGE_INPUTS;   /* SFXs to merge                        */
+extern thread_local int              EXEC_FLAG;              /* flag set by --exec                   */
+extern thread_local std::string      EXEC_TARGET;            /* archived executable to run           */
+extern thread_local std::vector<std::string> EXEC_ARGS;      /* its arguments (after --)             */
+extern thread_local int              SIBLINGS_FLAG;          /* flag set by --siblings               */
+extern thread_local int              UPDATE_FLAG;            /* set by --update[=checksum]           */
+extern thread_local int              DELETE_FLAG;            /* flag set by --delete                 */
+extern thread_local int              JOURNAL_FLAG;           /* flag set by --journal (or --resume)  */
+extern thread_local int              RESUME_FLAG;            /* flag set by --resume                 */
+extern thread_local int              DIFF_FLAG;              /* flag set by --diff                   */
+extern thread_local int              APPLY_PATCH_FLAG;       /* flag set by --apply-patch            */
+extern thread_local std::vector<std::string> PATCH_INPUTS;   /* old SFX, then new SFX|patch          */
+extern thread_local int              ENCRYPT_FLAG;           /* --encrypt given explicitly           */
+extern thread_local std::string      CACHE_DIR;              /* blob cache directory (--cache-dir)   */
+extern thread_local uint64_t         CACHE_SIZE;             /* blob cache size cap (--cache-size)   */
+extern thread_local uint64_t         VOLUME_SIZE;            /* --volume-size, 0 => single file SFX  */
+extern thread_local int              WATCH_FLAG;             /* flag set by --watch                  */
+extern thread_local int              IDLE_IO_FLAG;           /* flag set by --idle-io                */
+extern thread_local int              CAT_FLAG;               /* flag set by --cat                    */
+extern thread_local std::string      CAT_TARGET;             /* archived path to stream to stdout    */
+extern thread_local uint64_t         RANGE_OFFSET;           /* --range <offset>:<length>            */
+extern thread_local uint64_t         RANGE_LENGTH;           /* (uint64_t) -1 => up to end of file   */
+extern thread_local Fhdr::encrypt    ENCRYPTION_TYPE;
+extern thread_local Flusher::policy  DURABILITY;             /* set by --durability                  */
+extern thread_local Kbhdr::nametab_enc NAMETAB_ENCODING;     /* set by --nametab                     */
+extern thread_local Fhdr::cksum      CHECKSUM_TYPE;          /* set by --checksum                    */
+extern thread_local uint64_t         KAVACH_BINARY_SIZE;     /* size from offset 0 -> SHT end        */
+extern thread_local uint64_t         ARCHIVE_SIZE;           /* size from SHT end  -> KBF end        */
+extern thread_local std::string      es, ds;                 /* error|debug strings                  */
 
-/* shared data */
-extern int              DESTROY_RELICS;         /* flag set by --destroy-relics         */
-extern int              UNPACK_FLAG;
-extern int              PACK_FLAG;
-extern int              KEY_FLAG;
-extern int              OFNAME_FLAG;            /* output filename                      */
-extern Fhdr::encrypt    ENCRYPTION_TYPE;
-extern uint64_t         KAVACH_BINARY_SIZE;     /* size from offset 0 -> SHT end        */
-extern uint64_t         ARCHIVE_SIZE;           /* size from SHT end  -> KBF end        */
+/* shared data: process wide */
+extern Throttle         READ_LIMIT;             /* --max-read-bps (bytes per second)    */
+extern Throttle         WRITE_LIMIT;            /* --max-write-bps (bytes per second)   */
+extern Throttle         CPU_LIMIT;              /* --max-cpu (CPU ns per second)        */
 extern uint64_t         PAGE_SIZE;              /* sysconf (_SC_PAGESIZE);              */
-extern std::string      es, ds;                 /* error|debug strings                  */
+extern int              LOG_LEVEL;              /* --quiet|-v|-vv (log_level)           */
+
+/************************************************************************
+ * Settings:                                                            *
+ *      A copy of the per thread shared data above, defaulted the same  *
+ *      way. Threads started to work on an archive apply () the         *
+ *      capture () of the thread starting them, and the libkavach       *
+ *      objects (libkavach.h) run every call with their own Settings.   *
+ ************************************************************************/
+struct Settings {
+    static Settings         capture     ();
+    void                    apply       () const;
+
+    int                     destroy_relics = 0;
+    int                     relics_wait = -1;
+    int                     unpack_flag = 0;
+    int                     pack_flag = 0;
+    int                     key_flag = 0;
+    int                     ofname_flag = 0;
+    int                     verify_flag = 0;
+    int                     stdin_flag = 0;
+    int                     from_tar_flag = 0;
+    int                     to_tar_flag = 0;
+    std::string             tar_path;
+    int                     files_from_flag = 0;
+    std::string             files_from;
+    Exclude                 excludes;
+    int                     merge_flag = 0;
+    std::vector<std::string> merge_inputs;
+    int                     exec_flag = 0;
+    std::string             exec_target;
+    std::vector<std::string> exec_args;
+    int                     siblings_flag = 0;
+    int                     update_flag = 0;
+    int                     delete_flag = 0;
+    int                     journal_flag = 0;
+    int                     resume_flag = 0;
+    int                     diff_flag = 0;
+    int                     apply_patch_flag = 0;
+    std::vector<std::string> patch_inputs;
+    int                     encrypt_flag = 0;
+    std::string             cache_dir;
+    uint64_t                cache_size = BLOB_CACHE_SIZE;
+    uint64_t                volume_size = 0;
+    int                     watch_flag = 0;
+    int                     idle_io_flag = 0;
+    int                     cat_flag = 0;
+    std::string             cat_target;
+    uint64_t                range_offset = 0;
+    uint64_t                range_length = (uint64_t) -1;
+    Fhdr::encrypt           encryption_type = Fhdr::encrypt::FET_UND;
+    Flusher::policy         durability = Flusher::policy::FD_NONE;
+    Kbhdr::nametab_enc      nametab_encoding = Kbhdr::nametab_enc::KNT_RAW;
+    Fhdr::cksum             checksum_type = Fhdr::cksum::FCK_CRC32C;
+    uint64_t                kavach_binary_size = 0;
+    uint64_t                archive_size = 0;
+};
 
 
 
@@ -277,33 +917,117 @@ extern std::string      es, ds;                 /* error|debug strings
 
 /* pack.o */
 bool pack                   (int kfd, std::string &pack_target, std::string &password_key, std::string &out_filename);
+uint64_t load_payload_fd    (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &password_key, int sfxfd, uint8_t *block);
+bool patch_sfx_metadata     (int sfxfd, uint8_t *map, Kavach &ko);
+void layout_stream          (Kavach &ko);
+void layout_trailer         (Kavach &ko);
+bool write_trailer          (int outfd, Kavach &ko);
+
+/* FHT index of every hardlink target -> its path below the extraction root */
+typedef std::unordered_map<uint64_t, std::string>  LinkTargets;
 
 /* unpack.o */
 bool unpack                 (int kfd, std::string &target_location, std::string &password_key);
+bool verify                 (int kfd, std::string &password_key);
+bool map_kbf                (int sfxfd, uint8_t *&map, uint64_t &map_size, uint64_t &remainder, Kbhdr *&header, bool volumes = true);
+int64_t resolve_path        (Kbhdr *header, Fhdr *fht, NametabReader &nametab, const std::string &path);
+bool tables_in_bounds       (const Kbhdr *header, uint64_t kbf_size);
+bool body_in_bounds         (const Kbhdr *header, const Fhdr &fhdr, uint64_t kbf_size);
+bool unpack_payload         (const uint8_t *body, Fhdr &fhdr, const std::string &password_key, int fd, uint8_t *block, uint64_t &cksum,
+                             uint64_t from = 0, const Cksum *resume = nullptr, const Progress &progress = nullptr);
+bool link_targets           (Fhdr *fht, uint64_t fhnum, NametabReader &nametab, LinkTargets &targets);
+bool make_link              (int rootfd, const std::string &target, int dirfd, const std::string &name, Fhdr &fhdr, Flusher &flusher);
+
+/* relics.o */
+bool destroy_relics         (std::string &path, int wait);
+
+/* stream.o */
+bool unpack_stream          (int infd, std::string &target_location, std::string &password_key);
+
+/* tar.o */
+bool from_tar               (int kfd, int tarfd, std::string &password_key, std::string &out_filename);
+bool to_tar                 (int kfd, int tarfd, std::string &password_key);
+
+/* merge.o */
+bool merge                  (int kfd, std::vector<std::string> &inputs, std::string &password_key, std::string &out_filename);
+
+/* exec.o */
+bool exec_payload           (int kfd, std::string &archived_path, std::vector<std::string> &args, std::string &password_key);
+
+/* delta.o */
+bool make_patch             (std::string &old_path, std::string &new_path, std::string &out_filename);
+bool apply_patch            (std::string &old_path, std::string &patch_path, std::string &out_filename);
+
+/* cache.o */
+namespace BLOBCACHE {
+    uint64_t fetch          (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &password_key, int sfxfd);
+    void store              (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &password_key, int sfxfd);
+    void evict              ();
+}
+
+/* volume.o */
+/* VolumeWriter::layout (), open_body (), close_body () and finish () (declared above) */
+namespace VOLUMES {
+    int  attach             (int sfxfd, uint8_t *kbf, Kbhdr *header, uint64_t v);
+    bool attach_all         (int sfxfd, uint8_t *kbf, Kbhdr *header);
+    bool extract            (int sfxfd, uint8_t *kbf, Kbhdr *header, int rootfd, std::string &key);
+}
+
+/* watch.o */
+bool watch                  (int kfd, std::string &target_path, std::string &password_key, std::string &out_filename);
+
+/* throttle.o */
+/* Throttle::threads (), Throttle::take () and Throttle::take_cpu () (declared above) */
+bool set_idle_io            ();
+
+/* flusher.o */
+/* Flusher::file (), Flusher::flush (), Flusher::dir () and Flusher::finish () (declared above) */
+
+/* exclude.o */
+/* Exclude::add (), Exclude::load () and Exclude::excluded () (declared above) */
+
+/* cat.o */
+bool cat                    (int kfd, std::string &archived_path, std::string &password_key, uint64_t offset, uint64_t length, int outfd);
+
+/* archive.o */
+/* Settings::capture () and Settings::apply () (declared above), ArchiveWriter and ArchiveReader (libkavach.h) */
+bool get_kavach_binary_size (int kfd, uint64_t &KAVACH_BINARY_SIZE);
+
+/* logger.o */
+void log                    (const std::string &source, const std::string &function, int line_no, const std::string &error_string);
+void log_msg                (int level, std::string msg);               /* through debug_msg () */
+void log_flush              ();
+
+/* stats.o */
+/* Stats::enable (), Stats::count_fht () and Stats::report () (declared above) */
+
+/* kavach.o */
+void display_banner         ();
 
 /* parse_cmdline_args.o */
 void parse_cmdline_args     (int argc, char **argv, std::string &password_key, std::string &pack_target, std::string &out_filename);
 void print_usage            ();
 
 /* encrypt.o */
-namespace SCRAMBLE {
-    bool encrypt            (std::vector<uint8_t> &payload, std::string &key, Fhdr::encrypt &etype);
-}
-void pxor                   (std::vector<uint8_t> &payload, std::string &key);
+/* XorKeystream (declared above) */
 
-/* decrypt.o */
-namespace DESCRAMBLE {
-    bool decrypt            (std::vector<uint8_t> &payload, std::string &key, Fhdr::encrypt &etype);
-}
+/* checksum.o */
+/* Cksum (declared above) */
+
+/* nametab.o */
+/* Nametab::intern (), Nametab::finalize () and NametabReader (declared above) */
 
 
 /* helper.o */
 void dump_process_memory    ();                                         /* read /proc/self/maps */
 void dump_memory_range      (void *addr, size_t len);                   /* dump a region of memory */
-void log                    (std::string source, std::string function, int line_no, std::string error_string);
-void debug_msg              (std::string debug_msg);
 void mmap_error             (std::string error_string, int &error);    
 void sendfile_error         (std::string error_string, int &error);
+bool pread_full             (int fd, void *buf, size_t len, uint64_t offset);
+bool pwrite_full            (int fd, const void *buf, size_t len, uint64_t offset);
+bool write_full             (int fd, const void *buf, size_t len);
+bool read_full              (int fd, void *buf, size_t len);
+bool copy_range             (int infd, uint64_t in_off, int outfd, uint64_t *out_off, uint64_t len);
 
 
 #endif      /* _KAVACH_H */
\ No newline at end of file
@@ -0,0 +1,95 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : libkavach.h                                                       *
+ *                                                                              *
+ * Description: Embedding API of libkavach.a. An ArchiveWriter packs|merges|    *
+ *              watches SFXs, an ArchiveReader unpacks|verifies|serves|diffs|   *
+ *              runs one. Each object owns the settings it works with, so any   *
+ *              number of them can be used concurrently, from as many threads,  *
+ *              within one process.                                             *
+ *                                                                              *
+ ********************************************************************************/
+
+
+#ifndef _LIBKAVACH_H
+#define _LIBKAVACH_H
+
+
+#include "kavach.h"
+
+
+/************************************************************************
+ * ArchiveWriter:                                                       *
+ *      Packs directories (or tar streams, or other SFXs) into SFXs     *
+ *      built on <stub>, a kavach binary (this very process when it is  *
+ *      one). Settings are made before packing; pack (), from_tar ()    *
+ *      and merge () may then be called from any number of threads at  *
+ *      once. watch () only returns once it is interrupted.             *
+ ************************************************************************/
+class ArchiveWriter {
+public:
+    ArchiveWriter (const std::string &stub, const std::string &key = "", const Settings &settings = Settings ());
+
+    void                encrypt     (Fhdr::encrypt type, const std::string &key);
+    void                checksum    (Fhdr::cksum type)              { settings.checksum_type = type; }
+    void                nametab     (Kbhdr::nametab_enc encoding)   { settings.nametab_encoding = encoding; }
+    bool                exclude     (const std::string &pattern)    { return settings.excludes.add (pattern); }
+    void                cache       (const std::string &dir, uint64_t size = BLOB_CACHE_SIZE);
+    void                volumes     (uint64_t volume_size)          { settings.volume_size = volume_size; }
+
+    bool                pack        (const std::string &target, const std::string &out_name) const;
+    bool                from_tar    (int tarfd, const std::string &out_name) const;
+    bool                merge       (const std::vector<std::string> &inputs, std::string &out_name) const;
+    bool                watch       (const std::string &target, const std::string &out_name) const;
+
+private:
+    int                 open_stub   () const;
+
+    std::string         stub;
+    std::string         key;
+    Settings            settings;
+};
+
+
+/************************************************************************
+ * ArchiveReader:                                                       *
+ *      Works on the SFX at <path>. unpack () extracts it into          *
+ *      <path stem>_dir (just like running the SFX with --unpack),      *
+ *      diff () and apply_patch () write <out_name> (which they leave   *
+ *      holding the real file name), exec () replaces the process. The  *
+ *      others never touch the filesystem, so a single reader can       *
+ *      serve files from one SFX to many threads at once.               *
+ *      unpack_stream () extracts an SFX that only arrives on a pipe.   *
+ ************************************************************************/
+class ArchiveReader {
+public:
+    ArchiveReader (const std::string &path, const std::string &key, const Settings &settings = Settings ());
+    ~ArchiveReader ();
+
+    ArchiveReader (const ArchiveReader &) = delete;
+    ArchiveReader &operator= (const ArchiveReader &) = delete;
+
+    bool                ok          () const { return sfxfd != -1; }
+    void                durability  (Flusher::policy policy)        { settings.durability = policy; }
+    void                update      (int mode, bool del)            { settings.update_flag = mode; settings.delete_flag = del; }
+
+    bool                unpack      () const;
+    bool                verify      () const;
+    bool                cat         (const std::string &archived_path, int outfd, uint64_t offset = 0, uint64_t length = (uint64_t) -1) const;
+    bool                to_tar      (int tarfd) const;
+    bool                diff        (const std::string &new_path, std::string &out_name) const;
+    bool                apply_patch (const std::string &patch_path, std::string &out_name) const;
+    bool                exec        (const std::string &archived_path, const std::vector<std::string> &args) const;
+
+    static bool         unpack_stream (int infd, const std::string &name, const std::string &key, const Settings &settings = Settings ());
+
+private:
+    std::string         path;
+    std::string         key;
+    int                 sfxfd;
+    Settings            settings;
+};
+
+
+#endif      /* _LIBKAVACH_H */
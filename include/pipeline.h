@@ -0,0 +1,475 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : pipeline.h                                                        *
+ *                                                                              *
+ * Description: Compile time composition of payload transforms. Every block of  *
+ *              a file body is read once and then pushed through all stages     *
+ *              (checksum -> codec -> cipher while packing, the mirror image    *
+ *              while unpacking) while it is still hot in cache.                *
+ *                                                                              *
+ ********************************************************************************/
+
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+
+#include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+
+#include "kavach.h"
+
+
+namespace PIPELINE {
+
+    #define PIPELINE_BLOCK_SIZE     0x40000     /* 256 KiB: a block stays resident in L2 */
+    #define PIPELINE_CHUNK_SIZE     0x400000    /* 4 MiB: unit handed between threads    */
+    #define PIPELINE_PARALLEL_MIN   0x4000000   /* files >= 64 MiB go through run_chunked ()  */
+
+    /* payload codecs. Only the identity codec exists for now, so the codec *
+     * stage compiles away and nothing about it is recorded in the KBF.     */
+    enum class codec {
+        NONE = 0
+    };
+
+
+    /********************************************************************
+     * Stages:                                                          *
+     *      A transform exposes encode () (pack direction) and decode   *
+     *      (unpack direction), both working in place on <len> bytes    *
+     *      that sit at offset <off> within the file body. Forward<>    *
+     *      and Reverse<> pick the direction when composing a pipeline. *
+     ********************************************************************/
+    template <Fhdr::encrypt E>
+    class Cipher;
+
+    /* FET_UND: archive only */
+    template <>
+    class Cipher<Fhdr::encrypt::FET_UND> {
+    public:
+        Cipher (const std::string &) { }
+        void encode (uint8_t *, size_t, uint64_t) { }
+        void decode (uint8_t *, size_t, uint64_t) { }
+    };
+
+    /* FET_XOR: the key stream is expanded once per file */
+    template <>
+    class Cipher<Fhdr::encrypt::FET_XOR> {
+    public:
+        Cipher (const std::string &key): keystream(key) { }
+        void encode (uint8_t *buf, size_t len, uint64_t off) { keystream.apply (buf, len, off); }
+        void decode (uint8_t *buf, size_t len, uint64_t off) { keystream.apply (buf, len, off); }
+    private:
+        XorKeystream keystream;
+    };
+
+
+    template <codec C>
+    class Codec;
+
+    template <>
+    class Codec<codec::NONE> {
+    public:
+        void encode (uint8_t *, size_t, uint64_t) { }
+        void decode (uint8_t *, size_t, uint64_t) { }
+    };
+
+
+    /* checksum of the plain bytes: first stage packing, last stage unpacking */
+    class Checksum {
+    public:
+        Checksum (Fhdr::cksum type): ck(type) { }
+        void        operator()  (uint8_t *buf, size_t len, uint64_t) { ck.update (buf, len); }
+        uint64_t    digest      () const { return ck.digest (); }
+        Cksum       &state      () { return ck; }       /* running state (resumed unpacks) */
+    private:
+        Cksum ck;
+    };
+
+
+    /* fills in a file's .chunktab entries from its plain bytes (fed in order) */
+    class ChunkIndex {
+    public:
+        ChunkIndex (Kchunk *chunks, uint64_t base): chunks(chunks), base(base), ck(Fhdr::cksum::FCK_CRC32C) { }
+
+        void operator() (uint8_t *buf, size_t len, uint64_t off) {
+            while (len) {
+                uint64_t    n       = off / KBF_CHUNK_SIZE;
+                uint64_t    within  = off % KBF_CHUNK_SIZE;
+                size_t      piece   = std::min ((uint64_t) len, KBF_CHUNK_SIZE - within);
+
+                if (within == 0) {
+                    ck                  = Cksum (Fhdr::cksum::FCK_CRC32C);
+                    chunks[n].c_offset  = base + off;       /* stored size == plain size (no codec yet) */
+                    chunks[n].c_size    = 0;
+                }
+                ck.update (buf, piece);
+                chunks[n].c_size   += piece;
+                chunks[n].c_crc     = (uint32_t) ck.digest ();
+
+                buf += piece;
+                off += piece;
+                len -= piece;
+            }
+        }
+
+    private:
+        Kchunk      *chunks;
+        uint64_t    base;           /* fh_offset of the file */
+        Cksum       ck;
+    };
+
+
+    template <typename T>
+    class Forward {
+    public:
+        Forward () = default;
+        explicit Forward (const std::string &key): t(key) { }
+        void operator() (uint8_t *buf, size_t len, uint64_t off) { t.encode (buf, len, off); }
+    private:
+        T t;
+    };
+
+    template <typename T>
+    class Reverse {
+    public:
+        Reverse () = default;
+        explicit Reverse (const std::string &key): t(key) { }
+        void operator() (uint8_t *buf, size_t len, uint64_t off) { t.decode (buf, len, off); }
+    private:
+        T t;
+    };
+
+
+    /********************************************************************
+     * Pipeline:                                                        *
+     *      Runs every stage, in order, over one block before the next  *
+     *      block is touched. The stage list is a template parameter    *
+     *      pack, so a whole pipeline inlines into a single loop body.  *
+     ********************************************************************/
+    template <typename... Stages>
+    class Pipeline {
+    public:
+        Pipeline (Stages... stages): stages(std::move(stages)...) { }
+
+        void run (uint8_t *buf, size_t len, uint64_t off) {
+            std::apply ([&] (auto&... stage) { (stage (buf, len, off), ...); }, stages);
+            CPU_LIMIT.take_cpu ();              /* --max-cpu: duty cycle whoever runs it */
+        }
+
+        template <typename S>
+        S &stage () { return std::get<S> (stages); }
+
+    private:
+        std::tuple<Stages...> stages;
+    };
+
+
+    /* checksum (& chunk index) -> compress -> encrypt */
+    template <Fhdr::encrypt E, codec C>
+    using Packer    = Pipeline<Checksum, ChunkIndex, Forward<Codec<C>>, Forward<Cipher<E>>>;
+
+    /* decrypt -> decompress -> checksum */
+    template <Fhdr::encrypt E, codec C>
+    using Unpacker  = Pipeline<Reverse<Cipher<E>>, Reverse<Codec<C>>, Checksum>;
+
+    /* the transform-only middle of the above, run by run_chunked ()'s workers */
+    template <Fhdr::encrypt E, codec C>
+    using Encoder   = Pipeline<Forward<Codec<C>>, Forward<Cipher<E>>>;
+
+    template <Fhdr::encrypt E, codec C>
+    using Decoder   = Pipeline<Reverse<Cipher<E>>, Reverse<Codec<C>>>;
+
+    template <Fhdr::encrypt E, codec C>
+    Packer<E, C> make_packer (Fhdr::cksum cktype, const std::string &key, Kchunk *chunks, uint64_t base) {
+        return Packer<E, C> (Checksum (cktype), ChunkIndex (chunks, base), Forward<Codec<C>> (), Forward<Cipher<E>> (key));
+    }
+
+    template <Fhdr::encrypt E, codec C>
+    Unpacker<E, C> make_unpacker (Fhdr::cksum cktype, const std::string &key) {
+        return Unpacker<E, C> (Reverse<Cipher<E>> (key), Reverse<Codec<C>> (), Checksum (cktype));
+    }
+
+    template <Fhdr::encrypt E, codec C>
+    Encoder<E, C> make_encoder (const std::string &key) {
+        return Encoder<E, C> (Forward<Codec<C>> (), Forward<Cipher<E>> (key));
+    }
+
+    template <Fhdr::encrypt E, codec C>
+    Decoder<E, C> make_decoder (const std::string &key) {
+        return Decoder<E, C> (Reverse<Cipher<E>> (key), Reverse<Codec<C>> ());
+    }
+
+
+    /********************************************************************
+     * Lock-free rings used to connect the stages of run_chunked ().    *
+     * Both are bounded and carry small trivially copyable values       *
+     * (slot numbers); capacity is rounded up to a power of two.        *
+     ********************************************************************/
+
+    /* single producer, single consumer */
+    template <typename T>
+    class SpscRing {
+    public:
+        SpscRing (size_t capacity): mask(round_up (capacity) - 1), cells(new T[mask + 1]), head(0), tail(0) { }
+
+        bool push (const T &value) {
+            size_t t = tail.load (std::memory_order_relaxed);
+            if (t - head.load (std::memory_order_acquire) > mask) {
+                return false;                       /* full */
+            }
+            cells[t & mask] = value;
+            tail.store (t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop (T &value) {
+            size_t h = head.load (std::memory_order_relaxed);
+            if (h == tail.load (std::memory_order_acquire)) {
+                return false;                       /* empty */
+            }
+            value = cells[h & mask];
+            head.store (h + 1, std::memory_order_release);
+            return true;
+        }
+
+        static size_t round_up (size_t n) {
+            size_t p = 1;
+            while (p < n) {
+                p <<= 1;
+            }
+            return p;
+        }
+
+    private:
+        size_t                              mask;
+        std::unique_ptr<T[]>                cells;
+        alignas(64) std::atomic<size_t>     head;   /* consumer side */
+        alignas(64) std::atomic<size_t>     tail;   /* producer side */
+    };
+
+
+    /* multi producer, multi consumer (Vyukov's bounded queue) */
+    template <typename T>
+    class MpmcRing {
+    public:
+        MpmcRing (size_t capacity): mask(SpscRing<T>::round_up (capacity) - 1), cells(new Cell[mask + 1]), head(0), tail(0) {
+            for (size_t i = 0; i <= mask; ++i) {
+                cells[i].seq.store (i, std::memory_order_relaxed);
+            }
+        }
+
+        bool push (const T &value) {
+            size_t pos = tail.load (std::memory_order_relaxed);
+            for (;;) {
+                Cell    &cell   = cells[pos & mask];
+                size_t  seq     = cell.seq.load (std::memory_order_acquire);
+                intptr_t diff   = (intptr_t) seq - (intptr_t) pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.value = value;
+                        cell.seq.store (pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;                   /* full */
+                }
+                else {
+                    pos = tail.load (std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool pop (T &value) {
+            size_t pos = head.load (std::memory_order_relaxed);
+            for (;;) {
+                Cell    &cell   = cells[pos & mask];
+                size_t  seq     = cell.seq.load (std::memory_order_acquire);
+                intptr_t diff   = (intptr_t) seq - (intptr_t) (pos + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed)) {
+                        value = cell.value;
+                        cell.seq.store (pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;                   /* empty */
+                }
+                else {
+                    pos = head.load (std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t>     seq;
+            T                       value;
+        };
+
+        size_t                              mask;
+        std::unique_ptr<Cell[]>             cells;
+        alignas(64) std::atomic<size_t>     head;
+        alignas(64) std::atomic<size_t>     tail;
+    };
+
+
+    /* transform workers for run_chunked (): leave a CPU each for the reader and the writer *
+     * (and no more of them than --max-cpu lets run)                                         */
+    inline unsigned worker_count () {
+        unsigned ncpu = std::thread::hardware_concurrency ();
+        return CPU_LIMIT.threads ((ncpu > 3) ? ncpu - 2 : 1);
+    }
+
+
+    /* spin a little, then give the CPU away: the stages are I/O bound as often as not. *
+     * Throttled stages wait far longer, yielding there would only burn the CPU budget   */
+    inline void backoff (unsigned &spins) {
+        if (++spins < 64) {
+            __builtin_ia32_pause ();
+        }
+        else if (spins < 1024 || !(READ_LIMIT.active () || WRITE_LIMIT.active () || CPU_LIMIT.active ())) {
+            std::this_thread::yield ();
+        }
+        else {
+            std::this_thread::sleep_for (std::chrono::microseconds (100));
+        }
+    }
+
+
+    /********************************************************************
+     * run_chunked:                                                     *
+     *      Splits <size> bytes into PIPELINE_CHUNK_SIZE chunks that    *
+     *      flow through a bounded three stage pipeline -               *
+     *                                                                  *
+     *        reader (1 thread)  -> read (buf, len, off), in order      *
+     *        workers (N)        -> transform (buf, len, off), any      *
+     *                              order                               *
+     *        writer (caller)    -> write (buf, len, off), in order     *
+     *                                                                  *
+     *      so disk reads, CPU transforms and writes overlap. At most   *
+     *      2N + 2 chunks are in flight, which bounds memory. Any       *
+     *      stage returning false aborts the whole pipeline.            *
+     ********************************************************************/
+    template <typename ReadFn, typename TransformFn, typename WriteFn>
+    bool run_chunked (uint64_t size, unsigned nworkers, ReadFn read, TransformFn transform, WriteFn write) {
+
+        const uint32_t      POISON  = (uint32_t) -1;
+        const uint64_t      nchunks = (size + PIPELINE_CHUNK_SIZE - 1) / PIPELINE_CHUNK_SIZE;
+        const uint32_t      nslots  = 2 * nworkers + 2;
+
+        std::unique_ptr<uint8_t[]>  arena   (new uint8_t[(size_t) nslots * PIPELINE_CHUNK_SIZE]);
+        std::unique_ptr<uint64_t[]> seq_of  (new uint64_t[nslots]);     /* slot -> chunk number  */
+        std::unique_ptr<uint32_t[]> pending (new uint32_t[nslots]);     /* reorder window        */
+        SpscRing<uint32_t>          free_slots  (nslots);               /* writer -> reader      */
+        MpmcRing<uint32_t>          work        (nslots + nworkers);    /* reader -> workers     */
+        MpmcRing<uint32_t>          done        (nslots);               /* workers -> writer     */
+        std::atomic<bool>           failed (false);
+        std::vector<std::thread>    threads;
+
+        auto chunk_len = [&] (uint64_t seq) {
+            return (size_t) std::min ((uint64_t) PIPELINE_CHUNK_SIZE, size - seq * PIPELINE_CHUNK_SIZE);
+        };
+
+        for (uint32_t slot = 0; slot < nslots; ++slot) {
+            free_slots.push (slot);
+            pending[slot] = POISON;
+        }
+
+        /* reader */
+        threads.emplace_back ([&] () {
+            for (uint64_t seq = 0; seq < nchunks && !failed; ++seq) {
+                uint32_t slot = POISON;
+                unsigned spins = 0;
+                while (!free_slots.pop (slot) && !failed) {
+                    backoff (spins);
+                }
+                if (failed) {
+                    break;
+                }
+                seq_of[slot] = seq;
+                if (!read (&arena[(size_t) slot * PIPELINE_CHUNK_SIZE], chunk_len (seq), seq * PIPELINE_CHUNK_SIZE)) {
+                    failed = true;
+                    break;
+                }
+                while (!work.push (slot)) {
+                    backoff (spins);
+                }
+            }
+            for (unsigned w = 0; w < nworkers; ++w) {
+                unsigned spins = 0;
+                while (!work.push (POISON)) {
+                    backoff (spins);
+                }
+            }
+        });
+
+        /* transform workers */
+        for (unsigned w = 0; w < nworkers; ++w) {
+            threads.emplace_back ([&] () {
+                for (;;) {
+                    uint32_t slot = POISON;
+                    unsigned spins = 0;
+                    while (!work.pop (slot)) {
+                        backoff (spins);
+                    }
+                    if (slot == POISON) {
+                        return;
+                    }
+                    if (!failed) {
+                        uint64_t seq = seq_of[slot];
+                        if (!transform (&arena[(size_t) slot * PIPELINE_CHUNK_SIZE], chunk_len (seq), seq * PIPELINE_CHUNK_SIZE)) {
+                            failed = true;
+                        }
+                    }
+                    while (!done.push (slot)) {
+                        backoff (spins);
+                    }
+                }
+            });
+        }
+
+        /* writer: put chunks back in order before handing them to write () */
+        for (uint64_t next = 0; next < nchunks && !failed; ) {
+            uint32_t slot = POISON;
+            unsigned spins = 0;
+            while (!done.pop (slot)) {
+                if (failed) {
+                    break;
+                }
+                backoff (spins);
+            }
+            if (failed) {
+                break;
+            }
+            pending[seq_of[slot] % nslots] = slot;
+
+            while (next < nchunks && (slot = pending[next % nslots]) != POISON) {
+                pending[next % nslots] = POISON;
+                if (!write (&arena[(size_t) slot * PIPELINE_CHUNK_SIZE], chunk_len (next), next * PIPELINE_CHUNK_SIZE)) {
+                    failed = true;
+                    break;
+                }
+                free_slots.push (slot);
+                ++next;
+            }
+        }
+
+        /* the reader always ends by POISON'ing every worker, even after a failure */
+        for (auto &thread: threads) {
+            thread.join ();
+        }
+
+        return !failed;
+    }
+}
+
+
+#endif      /* _PIPELINE_H */
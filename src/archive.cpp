@@ -0,0 +1,454 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : archive.cpp                                                       *
+ *                                                                              *
+ * Description: Module holding what libkavach.a shares between its users: the   *
+ *              shared data (one copy per thread), Settings to carry it around  *
+ *              and the ArchiveWriter|ArchiveReader objects (in libkavach.h)    *
+ *              that the CLI (kavach.cpp) is a client of, as any other program. *
+ *                                                                              *
+ * Code Flow: <main> => <ArchiveWriter::pack>   => <pack>                       *
+ *                   => <ArchiveReader::unpack> => <unpack>                     *
+ *                   ... and likewise for every other mode of the CLI.          *
+ *                                                                              *
+ ********************************************************************************/
+
+#include "libkavach.h"
+
+
+/* [archive.cpp]: shared data, see kavach.h */
+thread_local int                DESTROY_RELICS          = 0;
+thread_local int                RELICS_WAIT             = -1;
+thread_local int                UNPACK_FLAG             = 0;
+thread_local int                PACK_FLAG               = 0;
+thread_local int                KEY_FLAG                = 0;
+thread_local int                OFNAME_FLAG             = 0;
+thread_local int                VERIFY_FLAG             = 0;
+thread_local int                STDIN_FLAG              = 0;
+thread_local int                FROM_TAR_FLAG           = 0;
+thread_local int                TO_TAR_FLAG             = 0;
+thread_local std::string        TAR_PATH;
+thread_local int                FILES_FROM_FLAG         = 0;
+thread_local std::string        FILES_FROM;
+thread_local Exclude            EXCLUDES;
+thread_local int                MERGE_FLAG              = 0;
+thread_local std::vector<std::string> MERGE_INPUTS;
+thread_local int                EXEC_FLAG               = 0;
+thread_local std::string        EXEC_TARGET;
+thread_local std::vector<std::string> EXEC_ARGS;
+thread_local int                SIBLINGS_FLAG           = 0;
+thread_local int                UPDATE_FLAG             = 0;
+thread_local int                DELETE_FLAG             = 0;
+thread_local int                JOURNAL_FLAG            = 0;
+thread_local int                RESUME_FLAG             = 0;
+thread_local int                DIFF_FLAG               = 0;
+thread_local int                APPLY_PATCH_FLAG        = 0;
+thread_local std::vector<std::string> PATCH_INPUTS;
+thread_local int                ENCRYPT_FLAG            = 0;
+thread_local std::string        CACHE_DIR;
+thread_local uint64_t           CACHE_SIZE              = BLOB_CACHE_SIZE;
+thread_local uint64_t           VOLUME_SIZE             = 0;
+thread_local int                WATCH_FLAG              = 0;
+thread_local int                IDLE_IO_FLAG            = 0;
+thread_local int                CAT_FLAG                = 0;
+thread_local std::string        CAT_TARGET;
+thread_local uint64_t           RANGE_OFFSET            = 0;
+thread_local uint64_t           RANGE_LENGTH            = (uint64_t) -1;
+thread_local Fhdr::encrypt      ENCRYPTION_TYPE         = Fhdr::encrypt::FET_UND;
+thread_local Flusher::policy    DURABILITY              = Flusher::policy::FD_NONE;
+thread_local Kbhdr::nametab_enc NAMETAB_ENCODING        = Kbhdr::nametab_enc::KNT_RAW;
+thread_local Fhdr::cksum        CHECKSUM_TYPE           = Fhdr::cksum::FCK_CRC32C;
+thread_local uint64_t           KAVACH_BINARY_SIZE      = 0;
+thread_local uint64_t           ARCHIVE_SIZE            = 0;
+thread_local std::string        es, ds;
+
+Throttle                        READ_LIMIT;
+Throttle                        WRITE_LIMIT;
+Throttle                        CPU_LIMIT;
+uint64_t                        PAGE_SIZE               = sysconf (_SC_PAGESIZE);
+int                             LOG_LEVEL               = LOG_INFO;
+Stats                           STATS;
+
+
+/* runs a libkavach call with the settings of its object, restoring the caller's own after */
+class SettingsScope {
+public:
+    SettingsScope (const Settings &settings): saved(Settings::capture ()) { settings.apply (); }
+    ~SettingsScope () { saved.apply (); }
+private:
+    Settings saved;
+};
+
+
+
+/* snapshot of the calling thread's shared data */
+Settings Settings::capture () {
+
+    Settings s;
+
+    s.destroy_relics       = DESTROY_RELICS;
+    s.relics_wait          = RELICS_WAIT;
+    s.unpack_flag          = UNPACK_FLAG;
+    s.pack_flag            = PACK_FLAG;
+    s.key_flag             = KEY_FLAG;
+    s.ofname_flag          = OFNAME_FLAG;
+    s.verify_flag          = VERIFY_FLAG;
+    s.stdin_flag           = STDIN_FLAG;
+    s.from_tar_flag        = FROM_TAR_FLAG;
+    s.to_tar_flag          = TO_TAR_FLAG;
+    s.tar_path             = TAR_PATH;
+    s.files_from_flag      = FILES_FROM_FLAG;
+    s.files_from           = FILES_FROM;
+    s.excludes             = EXCLUDES;
+    s.merge_flag           = MERGE_FLAG;
+    s.merge_inputs         = MERGE_INPUTS;
+    s.exec_flag            = EXEC_FLAG;
+    s.exec_target          = EXEC_TARGET;
+    s.exec_args            = EXEC_ARGS;
+    s.siblings_flag        = SIBLINGS_FLAG;
+    s.update_flag          = UPDATE_FLAG;
+    s.delete_flag          = DELETE_FLAG;
+    s.journal_flag         = JOURNAL_FLAG;
+    s.resume_flag          = RESUME_FLAG;
+    s.diff_flag            = DIFF_FLAG;
+    s.apply_patch_flag     = APPLY_PATCH_FLAG;
+    s.patch_inputs         = PATCH_INPUTS;
+    s.encrypt_flag         = ENCRYPT_FLAG;
+    s.cache_dir            = CACHE_DIR;
+    s.cache_size           = CACHE_SIZE;
+    s.volume_size          = VOLUME_SIZE;
+    s.watch_flag           = WATCH_FLAG;
+    s.idle_io_flag         = IDLE_IO_FLAG;
+    s.cat_flag             = CAT_FLAG;
+    s.cat_target           = CAT_TARGET;
+    s.range_offset         = RANGE_OFFSET;
+    s.range_length         = RANGE_LENGTH;
+    s.encryption_type      = ENCRYPTION_TYPE;
+    s.durability           = DURABILITY;
+    s.nametab_encoding     = NAMETAB_ENCODING;
+    s.checksum_type        = CHECKSUM_TYPE;
+    s.kavach_binary_size   = KAVACH_BINARY_SIZE;
+    s.archive_size         = ARCHIVE_SIZE;
+
+    return s;
+}
+
+
+
+/* makes the snapshot the calling thread's shared data */
+void Settings::apply () const {
+
+    DESTROY_RELICS       = destroy_relics;
+    RELICS_WAIT          = relics_wait;
+    UNPACK_FLAG          = unpack_flag;
+    PACK_FLAG            = pack_flag;
+    KEY_FLAG             = key_flag;
+    OFNAME_FLAG          = ofname_flag;
+    VERIFY_FLAG          = verify_flag;
+    STDIN_FLAG           = stdin_flag;
+    FROM_TAR_FLAG        = from_tar_flag;
+    TO_TAR_FLAG          = to_tar_flag;
+    TAR_PATH             = tar_path;
+    FILES_FROM_FLAG      = files_from_flag;
+    FILES_FROM           = files_from;
+    EXCLUDES             = excludes;
+    MERGE_FLAG           = merge_flag;
+    MERGE_INPUTS         = merge_inputs;
+    EXEC_FLAG            = exec_flag;
+    EXEC_TARGET          = exec_target;
+    EXEC_ARGS            = exec_args;
+    SIBLINGS_FLAG        = siblings_flag;
+    UPDATE_FLAG          = update_flag;
+    DELETE_FLAG          = delete_flag;
+    JOURNAL_FLAG         = journal_flag;
+    RESUME_FLAG          = resume_flag;
+    DIFF_FLAG            = diff_flag;
+    APPLY_PATCH_FLAG     = apply_patch_flag;
+    PATCH_INPUTS         = patch_inputs;
+    ENCRYPT_FLAG         = encrypt_flag;
+    CACHE_DIR            = cache_dir;
+    CACHE_SIZE           = cache_size;
+    VOLUME_SIZE          = volume_size;
+    WATCH_FLAG           = watch_flag;
+    IDLE_IO_FLAG         = idle_io_flag;
+    CAT_FLAG             = cat_flag;
+    CAT_TARGET           = cat_target;
+    RANGE_OFFSET         = range_offset;
+    RANGE_LENGTH         = range_length;
+    ENCRYPTION_TYPE      = encryption_type;
+    DURABILITY           = durability;
+    NAMETAB_ENCODING     = nametab_encoding;
+    CHECKSUM_TYPE        = checksum_type;
+    KAVACH_BINARY_SIZE   = kavach_binary_size;
+    ARCHIVE_SIZE         = archive_size;
+}
+
+
+
+/**************************************************************************** 
+ * computes the size of ELF binary by using the below method rather than    *
+ * using fstat () to get file attributes -                                  *
+ *                                                                          *
+ * 		filesize = sht_offset + (num_entries_in_sht * size_of_each_entry)   *
+ *                                                                          *
+ * NOTE: The reason I don't use fstat () is because it will include the     *
+ * 		 size of our overall binary (including the archived payload) which  *
+ * 		 would impact the portability for packing.                          *
+ *                                                                          *
+ * In short, this method ensures that -                                     *
+ * 		"Even an archived SFX can archive new files!"                       *
+ *                                                                          *
+ * The header is pread, so that the file position of <kfd> (shared by all  *
+ * threads using it) is left alone.                                         *
+ ****************************************************************************/
+bool get_kavach_binary_size (int kfd, uint64_t &KAVACH_BINARY_SIZE) {
+
+    Elf64_Ehdr ehdr;
+
+    if (pread_full (kfd, &ehdr, sizeof (Elf64_Ehdr), 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "couldn't read elf header");
+        return false;
+    }
+
+    KAVACH_BINARY_SIZE = ehdr.e_shoff + (ehdr.e_shnum * ehdr.e_shentsize);
+    return true;
+}
+
+
+
+ArchiveWriter::ArchiveWriter (const std::string &stub, const std::string &key, const Settings &settings):
+    stub(stub), key(key), settings(settings) {
+
+    this->settings.pack_flag = 1;
+    if (!key.empty()) {
+        this->settings.key_flag = 1;
+    }
+}
+
+
+/* a key without a type is ignored, as on the command line (archive only) */
+void ArchiveWriter::encrypt (Fhdr::encrypt type, const std::string &key) {
+
+    settings.encryption_type = type;
+    settings.encrypt_flag    = 1;
+    settings.key_flag        = !key.empty();
+    this->key                = key;
+}
+
+
+void ArchiveWriter::cache (const std::string &dir, uint64_t size) {
+
+    settings.cache_dir  = dir;
+    settings.cache_size = size;
+    while (settings.cache_dir.size() > 1 && settings.cache_dir.back() == '/') {
+        settings.cache_dir.pop_back ();
+    }
+}
+
+
+
+/* packs <target> into <out_name>.kgs */
+bool ArchiveWriter::pack (const std::string &target, const std::string &out_name) const {
+
+    SettingsScope   scope (settings);
+    std::string     target_path = target, of_name = out_name, password_key = key;
+    int             kfd;
+    bool            status;
+
+    if ((kfd = open_stub ()) == -1) {
+        return false;
+    }
+    status = ::pack (kfd, target_path, password_key, of_name);
+    close (kfd);
+    return status;
+}
+
+
+
+/* converts the tar stream read from <tarfd> into <out_name>.kgs */
+bool ArchiveWriter::from_tar (int tarfd, const std::string &out_name) const {
+
+    SettingsScope   scope (settings);
+    std::string     of_name = out_name, password_key = key;
+    int             kfd;
+    bool            status;
+
+    if ((kfd = open_stub ()) == -1) {
+        return false;
+    }
+    status = ::from_tar (kfd, tarfd, password_key, of_name);
+    close (kfd);
+    return status;
+}
+
+
+
+/* merges the SFXs named in <inputs> into <out_name> (left holding the real file name) */
+bool ArchiveWriter::merge (const std::vector<std::string> &inputs, std::string &out_name) const {
+
+    SettingsScope               scope (settings);
+    std::vector<std::string>    sfx_paths = inputs;
+    std::string                 password_key = key;
+    int                         kfd;
+    bool                        status;
+
+    if ((kfd = open_stub ()) == -1) {
+        return false;
+    }
+    status = ::merge (kfd, sfx_paths, password_key, out_name);
+    close (kfd);
+    return status;
+}
+
+
+
+/* keeps <out_name>.kgs in sync with the directory <target> until interrupted */
+bool ArchiveWriter::watch (const std::string &target, const std::string &out_name) const {
+
+    SettingsScope   scope (settings);
+    std::string     target_path = target, of_name = out_name, password_key = key;
+    int             kfd;
+    bool            status;
+
+    if ((kfd = open_stub ()) == -1) {
+        return false;
+    }
+    status = ::watch (kfd, target_path, password_key, of_name);
+    close (kfd);
+    return status;
+}
+
+
+
+/* a descriptor of its own for every call: pack () copies the stub from the file position */
+int ArchiveWriter::open_stub () const {
+
+    int kfd = open (stub.c_str(), O_RDONLY|O_CLOEXEC);
+
+    if (kfd == -1 || get_kavach_binary_size (kfd, KAVACH_BINARY_SIZE) == false) {
+        es = "while open'ing kavach binary " + stub;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        if (kfd != -1) {
+            close (kfd);
+        }
+        return -1;
+    }
+    return kfd;
+}
+
+
+
+ArchiveReader::ArchiveReader (const std::string &path, const std::string &key, const Settings &settings):
+    path(path), key(key), settings(settings) {
+
+    if (!key.empty()) {
+        this->settings.key_flag = 1;
+    }
+    sfxfd = open (path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (sfxfd == -1) {
+        es = "while open'ing SFX " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+    }
+}
+
+
+ArchiveReader::~ArchiveReader () {
+
+    if (sfxfd != -1) {
+        close (sfxfd);
+    }
+}
+
+
+
+/* extracts the SFX into <path stem>_dir */
+bool ArchiveReader::unpack () const {
+
+    SettingsScope   scope (settings);
+    std::string     target_location = path, password_key = key;
+
+    return ok () && ::unpack (sfxfd, target_location, password_key);
+}
+
+
+
+/* checks every payload checksum without extracting */
+bool ArchiveReader::verify () const {
+
+    SettingsScope   scope (settings);
+    std::string     password_key = key;
+
+    return ok () && ::verify (sfxfd, password_key);
+}
+
+
+
+/* writes (a byte range of) one archived file to <outfd> */
+bool ArchiveReader::cat (const std::string &archived_path, int outfd, uint64_t offset, uint64_t length) const {
+
+    SettingsScope   scope (settings);
+    std::string     target = archived_path, password_key = key;
+
+    return ok () && ::cat (sfxfd, target, password_key, offset, length, outfd);
+}
+
+
+
+/* writes the whole archive to <tarfd> as a tar stream */
+bool ArchiveReader::to_tar (int tarfd) const {
+
+    SettingsScope   scope (settings);
+    std::string     password_key = key;
+
+    return ok () && ::to_tar (sfxfd, tarfd, password_key);
+}
+
+
+
+/* writes the patch turning this SFX into <new_path> to <out_name> (left holding the real file name) */
+bool ArchiveReader::diff (const std::string &new_path, std::string &out_name) const {
+
+    SettingsScope   scope (settings);
+    std::string     old_path = path, neu_path = new_path;
+
+    return ok () && ::make_patch (old_path, neu_path, out_name);
+}
+
+
+
+/* rebuilds the SFX the patch at <patch_path> was made for into <out_name> (left holding the real file name) */
+bool ArchiveReader::apply_patch (const std::string &patch_path, std::string &out_name) const {
+
+    SettingsScope   scope (settings);
+    std::string     old_path = path, patch = patch_path;
+
+    return ok () && ::apply_patch (old_path, patch, out_name);
+}
+
+
+
+/* replaces the calling process with <archived_path>, run with <args>; only returns (false) on failure */
+bool ArchiveReader::exec (const std::string &archived_path, const std::vector<std::string> &args) const {
+
+    SettingsScope               scope (settings);
+    std::string                 target = archived_path, password_key = key;
+    std::vector<std::string>    argv = args;
+
+    return ok () && ::exec_payload (sfxfd, target, argv, password_key);
+}
+
+
+
+/* extracts the SFX arriving on <infd> (which need not be seekable) into <name>_dir */
+bool ArchiveReader::unpack_stream (int infd, const std::string &name, const std::string &key, const Settings &settings) {
+
+    Settings        stream_settings = settings;
+    std::string     target_location = name, password_key = key;
+
+    if (!key.empty()) {
+        stream_settings.key_flag = 1;
+    }
+    SettingsScope   scope (stream_settings);
+    return ::unpack_stream (infd, target_location, password_key);
+}
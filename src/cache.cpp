@@ -0,0 +1,289 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : cache.cpp                                                         *
+ *                                                                              *
+ * Description: Module responsible for the on-disk blob cache (--cache-dir).    *
+ *              A blob holds the already transformed payload of one source      *
+ *              file along with its checksum and .chunktab entries, keyed by    *
+ *              the file's identity and everything the transform depends on.    *
+ *              A hit is copied into the SFX (copy_file_range, so filesystems   *
+ *              that can reflink do) instead of reading & transforming source.  *
+ *                                                                              *
+ * Code Flow: <main> => <pack> => <attach_ko> => <load_archive_payload>         *
+ *                                            => <BLOBCACHE::fetch|store>       *
+ *            <main> => <pack> => <BLOBCACHE::evict>                            *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/file.h>
+#include <algorithm>
+
+#include "kavach.h"
+
+
+#define BLOB_MAGIC          0x31424f4c42484b4b      /* "KKHBLOB1"                            */
+#define BLOB_ALIGN          0x1000                  /* payload offset in a blob (reflinkable) */
+#define BLOB_TMP_MAX_AGE    3600                    /* seconds before an orphaned tmp is swept */
+
+
+/* identity of a cached payload: the source file and everything the transform depends on */
+struct BlobIdentity {
+    uint64_t    dev;
+    uint64_t    ino;
+    uint64_t    size;
+    uint64_t    mtime_ns;
+    uint64_t    etype;
+    uint64_t    cktype;
+    uint64_t    chunksz;
+    uint64_t    key_fingerprint;        /* XXH64 of the key, never the key itself */
+};
+
+/* leads every blob file: identity, then nchunks Kchunk (offsets relative to the body) */
+struct BlobHeader {
+    uint64_t        magic;
+    BlobIdentity    identity;
+    uint64_t        cksum;
+    uint64_t        nchunks;
+};
+
+
+/* function prototypes */
+static bool         identify        (int afd, Fhdr &fhdr, std::string &key, BlobIdentity &identity);
+static std::string  blob_name       (BlobIdentity &identity);
+
+
+
+namespace BLOBCACHE {
+
+/****************************************************************************
+ * Looks up the source open at <afd>. On a hit its transformed body is      *
+ * appended to <sfxfd> (at its current position), fhdr.fh_cksum and the     *
+ * file's <chunks> are filled in and 'payload size' is returned. A miss (or *
+ * an unusable blob) returns 0 with nothing written, -1 is a failure after  *
+ * part of the body may already have been written.                          *
+ ****************************************************************************/
+uint64_t fetch (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd) {
+
+    BlobIdentity    identity;
+    BlobHeader      bh;
+    struct stat     sb;
+    uint64_t        nchunks = (fhdr.fh_size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE;
+    uint64_t        body;
+    int             cfd;
+    bool            status;
+
+
+    if (fhdr.fh_size < BLOB_CACHE_MIN || identify (afd, fhdr, key, identity) == false) {
+        return 0;
+    }
+
+    cfd = open ((CACHE_DIR + "/" + blob_name (identity)).c_str(), O_RDONLY);
+    if (cfd == -1) {
+        return 0;
+    }
+
+    body = (sizeof (BlobHeader) + nchunks * sizeof (Kchunk) + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN;
+
+    /* a blob that isn't exactly what we'd have written is treated as a miss */
+    if ( fstat (cfd, &sb) == -1 || (uint64_t) sb.st_size != body + fhdr.fh_size ||
+         pread_full (cfd, &bh, sizeof (bh), 0) == false || bh.magic != BLOB_MAGIC ||
+         memcmp (&bh.identity, &identity, sizeof (identity)) != 0 || bh.nchunks != nchunks ||
+         pread_full (cfd, chunks, nchunks * sizeof (Kchunk), sizeof (bh)) == false ) {
+        close (cfd);
+        return 0;
+    }
+
+    for (uint64_t n = 0; n < nchunks; ++n) {
+        chunks[n].c_offset += fhdr.fh_offset;
+    }
+    fhdr.fh_cksum = bh.cksum;
+
+    status = copy_range (cfd, body, sfxfd, nullptr, fhdr.fh_size);
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while copying cached payload into SFX");
+    }
+
+    /* most recently used: eviction goes by mtime */
+    futimens (cfd, nullptr);
+    close (cfd);
+
+    /* a partly copied body can't be undone: callers treat it as a failed payload */
+    return status ? fhdr.fh_size : -1;
+}
+
+
+
+/****************************************************************************
+ * Saves the body just written to <sfxfd> (its last fhdr.fh_size bytes) as  *
+ * the blob of the source open at <afd>. The blob is built under a tmp      *
+ * name and renamed into place, so concurrent packs never see a partial    *
+ * one (and racing writers of the same blob write identical bytes).        *
+ * Failing to cache is never an error for the pack itself.                 *
+ ****************************************************************************/
+void store (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd) {
+
+    BlobIdentity        identity;
+    BlobHeader          bh;
+    uint64_t            nchunks = (fhdr.fh_size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE;
+    uint64_t            body;
+    off_t               end;
+    std::string         tmp = CACHE_DIR + "/.tmp.XXXXXX";
+    std::vector<Kchunk> relative (chunks, chunks + nchunks);
+    int                 tfd;
+
+
+    if (fhdr.fh_size < BLOB_CACHE_MIN || identify (afd, fhdr, key, identity) == false) {
+        return;
+    }
+
+    /* pipes (--output -) can't be read back */
+    end = lseek (sfxfd, 0, SEEK_CUR);
+    if (end == -1 || (uint64_t) end < fhdr.fh_size) {
+        return;
+    }
+
+    tfd = mkstemp (&tmp[0]);
+    if (tfd == -1) {
+        return;
+    }
+
+    memset (&bh, 0, sizeof (bh));
+    bh.magic    = BLOB_MAGIC;
+    bh.identity = identity;
+    bh.cksum    = fhdr.fh_cksum;
+    bh.nchunks  = nchunks;
+    for (auto &chunk: relative) {
+        chunk.c_offset -= fhdr.fh_offset;
+    }
+    body = (sizeof (BlobHeader) + nchunks * sizeof (Kchunk) + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN;
+
+    if ( pwrite_full (tfd, &bh, sizeof (bh), 0) == false ||
+         pwrite_full (tfd, relative.data(), nchunks * sizeof (Kchunk), sizeof (bh)) == false ||
+         copy_range (sfxfd, end - fhdr.fh_size, tfd, &body, fhdr.fh_size) == false ||
+         rename (tmp.c_str(), (CACHE_DIR + "/" + blob_name (identity)).c_str()) == -1 ) {
+        unlink (tmp.c_str());
+    }
+
+    close (tfd);
+}
+
+
+
+/****************************************************************************
+ * Trims the cache to CACHE_SIZE bytes, least recently used (oldest mtime)  *
+ * blobs first. Only one process evicts at a time (flock on the directory); *
+ * the others just skip. Unlinking a blob someone still has open is fine.   *
+ ****************************************************************************/
+void evict () {
+
+    struct Entry {
+        struct timespec mtime;
+        uint64_t        size;
+        std::string     name;
+    };
+
+    std::vector<Entry>  entries;
+    uint64_t            total = 0;
+    struct dirent       *dent;
+    struct stat         sb;
+    int                 dfd;
+    DIR                 *dptr;
+
+
+    dfd = open (CACHE_DIR.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd == -1) {
+        return;
+    }
+    if (flock (dfd, LOCK_EX|LOCK_NB) == -1) {
+        close (dfd);
+        return;
+    }
+
+    dptr = fdopendir (dup (dfd));
+    if (dptr == NULL) {
+        close (dfd);
+        return;
+    }
+
+    while ((dent = readdir (dptr)) != NULL) {
+        if (dent->d_name[0] == '.' && strncmp (dent->d_name, ".tmp.", 5) != 0) {
+            continue;
+        }
+        if (fstatat (dfd, dent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG (sb.st_mode)) {
+            continue;
+        }
+
+        /* tmp files of packs that died mid-store */
+        if (dent->d_name[0] == '.') {
+            if (time (nullptr) - sb.st_mtime > BLOB_TMP_MAX_AGE) {
+                unlinkat (dfd, dent->d_name, 0);
+            }
+            continue;
+        }
+
+        entries.push_back ({sb.st_mtim, (uint64_t) sb.st_blocks * 512, dent->d_name});
+        total += entries.back().size;
+    }
+    closedir (dptr);
+
+    if (total > CACHE_SIZE) {
+        std::sort (entries.begin(), entries.end(), [] (const Entry &a, const Entry &b) {
+            return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec
+                                                    : a.mtime.tv_nsec < b.mtime.tv_nsec;
+        });
+        for (auto &entry: entries) {
+            if (total <= CACHE_SIZE) {
+                break;
+            }
+            if (unlinkat (dfd, entry.name.c_str(), 0) == 0 || errno == ENOENT) {
+                total -= entry.size;
+            }
+        }
+    }
+
+    close (dfd);            /* releases the flock */
+}
+
+}   /* namespace BLOBCACHE */
+
+
+
+/* fills <identity> for the source open at <afd>; false if it can't be stat'ed */
+static bool identify (int afd, Fhdr &fhdr, std::string &key, BlobIdentity &identity) {
+
+    struct stat sb;
+    Cksum       fingerprint (Fhdr::cksum::FCK_XXH64);
+
+    if (fstat (afd, &sb) == -1 || (uint64_t) sb.st_size != fhdr.fh_size) {
+        return false;
+    }
+
+    memset (&identity, 0, sizeof (identity));
+    identity.dev        = sb.st_dev;
+    identity.ino        = sb.st_ino;
+    identity.size       = sb.st_size;
+    identity.mtime_ns   = (uint64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+    identity.etype      = fhdr.fh_etype;
+    identity.cktype     = fhdr.fh_cktype;
+    identity.chunksz    = KBF_CHUNK_SIZE;
+    if (fhdr.fh_etype != Fhdr::encrypt::FET_UND) {
+        fingerprint.update ((const uint8_t *) key.data(), key.size());
+        identity.key_fingerprint = fingerprint.digest ();
+    }
+
+    return true;
+}
+
+
+
+/* blob file name: XXH64 of the identity in hex */
+static std::string blob_name (BlobIdentity &identity) {
+
+    Cksum   hash (Fhdr::cksum::FCK_XXH64);
+    char    name[17];
+
+    hash.update ((const uint8_t *) &identity, sizeof (identity));
+    snprintf (name, sizeof (name), "%016lx", (unsigned long) hash.digest ());
+    return name;
+}
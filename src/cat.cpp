@@ -0,0 +1,167 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : cat.cpp                                                           *
+ *                                                                              *
+ * Description: Module responsible for streaming a single archived file (or a   *
+ *              byte range of it) to STDOUT|any fd. Only the .chunktab entries  *
+ *              covering the range are located, transformed and verified.       *
+ *                                                                              *
+ * Code Flow: <main> => <cat>                                                   *
+ *                                                                              *
+ ********************************************************************************/
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+/* function prototypes */
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool cat_chunks          (uint8_t *payload, Fhdr &fhdr, Kchunk *chunks, uint64_t chunksz, std::string &key, uint64_t offset, uint64_t length, int outfd);
+
+
+
+/* writes [offset, offset + length) of <archived_path> to <outfd> (STDOUT for --cat) */
+bool cat (int sfxfd, std::string &archived_path, std::string &key, uint64_t offset, uint64_t length, int outfd) {
+
+    uint8_t     *map;
+    uint64_t    map_size;
+    uint64_t    remainder;
+    int64_t     ndx;
+    bool        status;
+    Kbhdr       *header;
+
+
+    if (map_kbf (sfxfd, map, map_size, remainder, header) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
+        return false;
+    }
+
+    uint8_t             *kbf     = map + remainder;
+    Fhdr                *fht     = (Fhdr *)    &kbf[header->k_fhtoff];
+    Kchunk              *chunks  = (Kchunk *)  &kbf[header->k_chunktaboff];
+    uint8_t             *payload = (uint8_t *) &kbf[header->k_payloadoff];
+    NametabReader       nametab ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+
+    ndx = resolve_path (header, fht, nametab, archived_path);
+    if (ndx != -1 && fht[ndx].fh_ftype == Fhdr::ftype::FT_LINK && fht[ndx].fh_offset < (uint64_t) ndx) {
+        ndx = fht[ndx].fh_offset;           /* a hardlink reads as the file it links to */
+    }
+    if (ndx == -1 || fht[ndx].fh_ftype != Fhdr::ftype::FT_FILE) {
+        es = "no such archived file: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+
+    Fhdr &fhdr = fht[ndx];
+
+    if (body_in_bounds (header, fhdr, map_size - remainder) == false) {
+        es = "file body out of payload bounds: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+
+    /* every chunk of the file has to be in .chunktab */
+    if ( header->k_chunksz == 0 || fhdr.fh_chunkndx > header->k_chunknum ||
+         fhdr.fh_size / header->k_chunksz + (fhdr.fh_size % header->k_chunksz != 0) > header->k_chunknum - fhdr.fh_chunkndx ) {
+        es = "chunk table doesn't cover: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+
+    /* clamp the range to the file */
+    if (offset > fhdr.fh_size) {
+        offset = fhdr.fh_size;
+    }
+    if (length > fhdr.fh_size - offset) {
+        length = fhdr.fh_size - offset;
+    }
+
+    if (fhdr.fh_etype != Fhdr::encrypt::FET_UND && key.empty()) {
+        es = "decryption key not supplied for: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+
+    switch (fhdr.fh_etype) {
+        case Fhdr::encrypt::FET_UND:
+                    status = cat_chunks<Fhdr::encrypt::FET_UND, PIPELINE::codec::NONE> (payload, fhdr, &chunks[fhdr.fh_chunkndx], header->k_chunksz, key, offset, length, outfd);
+                    break;
+        case Fhdr::encrypt::FET_XOR:
+                    status = cat_chunks<Fhdr::encrypt::FET_XOR, PIPELINE::codec::NONE> (payload, fhdr, &chunks[fhdr.fh_chunkndx], header->k_chunksz, key, offset, length, outfd);
+                    break;
+        default:
+                    log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
+                    status = false;
+                    break;
+    }
+
+    munmap (map, map_size);
+    return status;
+}
+
+
+
+/****************************************************************************
+ * Walks the chunks covering [offset, offset + length): each one is decoded *
+ * (into a scratch buffer if it needs transforming), checked against its   *
+ * CRC32C and only the requested slice of it is written to <outfd>. Plain  *
+ * chunks are written straight from the mapping.                           *
+ ****************************************************************************/
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool cat_chunks (uint8_t *payload, Fhdr &fhdr, Kchunk *chunks, uint64_t chunksz, std::string &key, uint64_t offset, uint64_t length, int outfd) {
+
+    constexpr bool              in_place = (E == Fhdr::encrypt::FET_UND && C == PIPELINE::codec::NONE);
+    std::unique_ptr<uint8_t[]>  scratch;
+    auto                        decoder = PIPELINE::make_decoder<E, C> (key);
+
+    if (length == 0) {
+        return true;
+    }
+
+    if constexpr (!in_place) {
+        scratch.reset (new uint8_t[chunksz]);
+    }
+
+    for (uint64_t n = offset / chunksz; n * chunksz < offset + length; ++n) {
+        Kchunk      &chunk  = chunks[n];
+        uint64_t    plain   = n * chunksz;          /* plain offset of chunk start */
+        uint8_t     *buf;
+        Cksum       ck (Fhdr::cksum::FCK_CRC32C);
+
+        if (chunk.c_size > chunksz || chunk.c_offset < fhdr.fh_offset || chunk.c_offset + chunk.c_size > fhdr.fh_offset + fhdr.fh_size) {
+            log (__FILE__, __FUNCTION__, __LINE__, "chunk table entry out of bounds");
+            return false;
+        }
+
+        if constexpr (in_place) {
+            buf = &payload[chunk.c_offset];
+        }
+        else {
+            memcpy (scratch.get(), &payload[chunk.c_offset], chunk.c_size);
+            buf = scratch.get();
+        }
+        decoder.run (buf, chunk.c_size, plain);
+
+        ck.update (buf, chunk.c_size);
+        if ((uint32_t) ck.digest () != chunk.c_crc) {
+            es = "chunk " + std::to_string (n) + " failed CRC32C (corrupt payload or wrong key)";
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        /* slice of this chunk that falls inside the requested range */
+        uint64_t from   = std::max (offset, plain) - plain;
+        uint64_t to     = std::min (offset + length, plain + chunk.c_size) - plain;
+        if (write_full (outfd, buf + from, to - from) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while writing out the archived file");
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,257 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : checksum.cpp                                                      *
+ *                                                                              *
+ * Description: Module responsible for computing per-file payload checksums,    *
+ *              either CRC32C (SSE4.2 crc32 instruction when the CPU has it)    *
+ *              or XXH64 (a fast 64-bit non-cryptographic hash).                *
+ *              Declared as Cksum class (in kavach.h).                          *
+ *                                                                              *
+ * Code Flow: <main> => <pack> => <load_archive_payload> => <Cksum::update>     *
+ *            <main> => <unpack> => <extract> => <Cksum::update>                *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <nmmintrin.h>
+#include <algorithm>
+
+#include "kavach.h"
+
+
+/* function prototypes */
+static uint32_t crc32c_sw       (uint32_t crc, const uint8_t *data, size_t len);
+static uint32_t crc32c_hw       (uint32_t crc, const uint8_t *data, size_t len);
+static uint64_t xxh64_round     (uint64_t acc, uint64_t input);
+static uint64_t xxh64_merge     (uint64_t acc, uint64_t val);
+static uint64_t rotl64          (uint64_t val, int bits);
+static uint64_t read64          (const uint8_t *ptr);
+static uint32_t read32          (const uint8_t *ptr);
+
+#define CRC32C_POLY     0x82f63b78              /* reflected Castagnoli polynomial      */
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+
+/* [checksum.cpp]: global data */
+static uint32_t crc32c_table[8][256];           /* slicing-by-8 tables (software path)  */
+static bool     has_sse42 = false;
+
+
+
+/* builds the software tables and probes the CPU once, before main () */
+__attribute__ ((constructor))
+static void crc32c_init () {
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int slice = 1; slice < 8; ++slice) {
+            uint32_t prev = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+
+    __builtin_cpu_init ();
+    has_sse42 = __builtin_cpu_supports ("sse4.2");
+}
+
+
+
+Cksum::Cksum (Fhdr::cksum type): type(type), crc(0xffffffff), total_len(0), buffered(0) {
+
+    acc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    acc[1] = XXH_PRIME64_2;
+    acc[2] = 0;
+    acc[3] = 0 - XXH_PRIME64_1;
+}
+
+
+
+/* feeds <len> bytes at <data> into the running checksum */
+void Cksum::update (const uint8_t *data, size_t len) {
+
+    switch (type) {
+
+        case Fhdr::cksum::FCK_CRC32C:
+                    crc = has_sse42 ? crc32c_hw (crc, data, len) : crc32c_sw (crc, data, len);
+                    break;
+
+        case Fhdr::cksum::FCK_XXH64: {
+                    const uint8_t *end = data + len;
+                    total_len += len;
+
+                    /* complete a previously buffered stripe first */
+                    if (buffered) {
+                        size_t fill = std::min ((size_t) (32 - buffered), len);
+                        memcpy (buffer + buffered, data, fill);
+                        buffered += fill;
+                        data     += fill;
+                        if (buffered < 32) {
+                            break;
+                        }
+                        for (int lane = 0; lane < 4; ++lane) {
+                            acc[lane] = xxh64_round (acc[lane], read64 (buffer + lane * 8));
+                        }
+                        buffered = 0;
+                    }
+
+                    /* consume whole 32 byte stripes */
+                    for (; data + 32 <= end; data += 32) {
+                        acc[0] = xxh64_round (acc[0], read64 (data));
+                        acc[1] = xxh64_round (acc[1], read64 (data + 8));
+                        acc[2] = xxh64_round (acc[2], read64 (data + 16));
+                        acc[3] = xxh64_round (acc[3], read64 (data + 24));
+                    }
+
+                    memcpy (buffer, data, end - data);
+                    buffered = end - data;
+                    break;
+        }
+
+        default:
+                    break;
+    }
+}
+
+
+
+/* returns the checksum of all bytes fed so far (the state is left untouched) */
+uint64_t Cksum::digest () const {
+
+    switch (type) {
+
+        case Fhdr::cksum::FCK_CRC32C:
+                    return crc ^ 0xffffffff;
+
+        case Fhdr::cksum::FCK_XXH64: {
+                    uint64_t h;
+
+                    if (total_len >= 32) {
+                        h  = rotl64 (acc[0], 1)  + rotl64 (acc[1], 7) +
+                             rotl64 (acc[2], 12) + rotl64 (acc[3], 18);
+                        h  = xxh64_merge (h, acc[0]);
+                        h  = xxh64_merge (h, acc[1]);
+                        h  = xxh64_merge (h, acc[2]);
+                        h  = xxh64_merge (h, acc[3]);
+                    }
+                    else {
+                        h  = XXH_PRIME64_5;     /* seed 0 */
+                    }
+                    h += total_len;
+
+                    /* tail: the bytes still sitting in buffer */
+                    const uint8_t *ptr = buffer;
+                    const uint8_t *end = buffer + buffered;
+                    for (; ptr + 8 <= end; ptr += 8) {
+                        h ^= xxh64_round (0, read64 (ptr));
+                        h  = rotl64 (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+                    }
+                    if (ptr + 4 <= end) {
+                        h ^= (uint64_t) read32 (ptr) * XXH_PRIME64_1;
+                        h  = rotl64 (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+                        ptr += 4;
+                    }
+                    for (; ptr < end; ++ptr) {
+                        h ^= (*ptr) * XXH_PRIME64_5;
+                        h  = rotl64 (h, 11) * XXH_PRIME64_1;
+                    }
+
+                    /* avalanche */
+                    h ^= h >> 33;
+                    h *= XXH_PRIME64_2;
+                    h ^= h >> 29;
+                    h *= XXH_PRIME64_3;
+                    h ^= h >> 32;
+                    return h;
+        }
+
+        default:
+                    return 0;
+    }
+}
+
+
+
+/* CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time */
+__attribute__ ((target ("sse4.2")))
+static uint32_t crc32c_hw (uint32_t crc, const uint8_t *data, size_t len) {
+
+    uint64_t crc64 = crc;
+
+    /* align to 8 bytes so that the 64-bit loads never straddle cache lines */
+    while (len && ((uintptr_t) data & 7)) {
+        crc64 = _mm_crc32_u8 ((uint32_t) crc64, *data++);
+        --len;
+    }
+    for (; len >= 8; len -= 8, data += 8) {
+        crc64 = _mm_crc32_u64 (crc64, read64 (data));
+    }
+    while (len--) {
+        crc64 = _mm_crc32_u8 ((uint32_t) crc64, *data++);
+    }
+
+    return (uint32_t) crc64;
+}
+
+
+
+/* portable CRC32C (slicing-by-8) for CPUs without SSE4.2 */
+static uint32_t crc32c_sw (uint32_t crc, const uint8_t *data, size_t len) {
+
+    for (; len >= 8; len -= 8, data += 8) {
+        uint32_t lo = read32 (data) ^ crc;
+        uint32_t hi = read32 (data + 4);
+        crc = crc32c_table[7][lo & 0xff]         ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff]         ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    }
+
+    return crc;
+}
+
+
+
+static uint64_t xxh64_round (uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc  = rotl64 (acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+
+static uint64_t xxh64_merge (uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round (0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+static uint64_t rotl64 (uint64_t val, int bits) {
+    return (val << bits) | (val >> (64 - bits));
+}
+
+
+static uint64_t read64 (const uint8_t *ptr) {
+    uint64_t val;
+    memcpy (&val, ptr, sizeof (val));
+    return val;
+}
+
+
+static uint32_t read32 (const uint8_t *ptr) {
+    uint32_t val;
+    memcpy (&val, ptr, sizeof (val));
+    return val;
+}
@@ -0,0 +1,623 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : delta.cpp                                                         *
+ *                                                                              *
+ * Description: Module responsible for binary patches between two SFX binaries. *
+ *              A patch rebuilds the new SFX byte for byte as a stream of ops:  *
+ *              COPY a range of the old SFX, or insert LITERAL bytes carried    *
+ *              by the patch. File bodies are matched by path (or content)      *
+ *              through FHT/nametab: unchanged ones become a single COPY,       *
+ *              changed ones get a rolling hash block delta against the old.    *
+ *                                                                              *
+ * Code Flow: <main> => <make_patch>                                            *
+ *            <main> => <apply_patch>                                           *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+#define PATCH_OP_COPY       (1ULL << 63)        /* PatchOp::length flag: copy from old SFX   */
+#define DELTA_BLOCK_MIN     0x800               /* smallest rolling hash block               */
+#define DELTA_BLOCK_MAX     0x20000             /* largest rolling hash block                */
+#define DELTA_MAX_PROBES    16                  /* candidates compared per weak hash hit     */
+
+
+/* leads every patch */
+struct PatchHeader {
+    uint64_t    magic;                  /* PATCH_MAGIC                                      */
+    uint64_t    old_size;               /* size of the SFX this patch applies to            */
+    uint64_t    old_tables;             /* XXH64 of its KBF minus the payload (identity)    */
+    uint64_t    new_size;               /* size of the SFX it rebuilds                      */
+};
+
+/* one op: <length> bytes copied from <old_offset> of the old SFX, or (without  *
+ * PATCH_OP_COPY) <length> literal bytes that follow the op in the patch         */
+struct PatchOp {
+    uint64_t    length;
+    uint64_t    old_offset;
+};
+
+/* an SFX mapped as a whole; all offsets are file offsets */
+struct MappedSfx {
+    int                         fd;
+    uint8_t                     *base;
+    uint64_t                    size;
+    uint64_t                    kbf_off;
+    Kbhdr                       header;
+    uint64_t                    payload_start;
+    uint64_t                    payload_end;
+    std::vector<std::string>    paths;          /* FHT index -> path (FT_FILE|FT_LINK only) */
+};
+
+
+/****************************************************************************
+ * Patch Writer:                                                            *
+ *      Takes the new SFX in order, as literal ranges (of the new mapping)  *
+ *      and copies (of the old SFX), coalescing neighbours before writing.  *
+ ****************************************************************************/
+class PatchWriter {
+public:
+
+    /* constructor */
+    PatchWriter (int fd, const uint8_t *neu): fd(fd), neu(neu), lit_off(0), lit_len(0),
+                                              copy_off(0), copy_len(0), copied(0), inserted(0) { }
+
+    bool        literal     (uint64_t new_off, uint64_t len);
+    bool        copy        (uint64_t old_off, uint64_t len);
+    bool        flush       ();
+
+    uint64_t    copied_bytes    () const { return copied; }
+    uint64_t    literal_bytes   () const { return inserted; }
+
+private:
+    int             fd;
+    const uint8_t   *neu;
+    uint64_t        lit_off, lit_len;       /* pending literal (offset into new SFX) */
+    uint64_t        copy_off, copy_len;     /* pending copy (offset into old SFX)    */
+    uint64_t        copied, inserted;
+};
+
+
+/* function prototypes */
+static bool     map_sfx         (const std::string &path, MappedSfx &sfx);
+static void     unmap_sfx       (MappedSfx &sfx);
+static uint64_t tables_hash     (MappedSfx &sfx);
+static bool     delta           (MappedSfx &old, uint64_t o, uint64_t olen, MappedSfx &neu, uint64_t n, uint64_t nlen, PatchWriter &writer);
+static bool     same_body       (MappedSfx &old, Fhdr &ofhdr, MappedSfx &neu, Fhdr &nfhdr);
+
+
+
+/****************************************************************************
+ * Writes the patch that turns <old_path> into <new_path> to                *
+ * '<of_name>.PATCH_EXTENSION' (stdout for "-"). The new SFX is walked in   *
+ * file order: stub and KBF tables are delta'd against the old ones, every  *
+ * file body against the old body of the same path (or of equal content).   *
+ * On return <of_name> holds the name of the patch file actually written.   *
+ ****************************************************************************/
+bool make_patch (std::string &old_path, std::string &new_path, std::string &of_name) {
+
+    MappedSfx                               old, neu;
+    PatchHeader                             ph;
+    std::unordered_map<std::string, uint64_t>   by_path;        /* old path -> FHT index           */
+    std::unordered_map<uint64_t, uint64_t>      by_content;     /* old (size, cksum) -> FHT index  */
+    std::vector<uint64_t>                   files;              /* new FT_FILEs in payload order   */
+    uint64_t                                pos;
+    int                                     pfd;
+    bool                                    status = true;
+
+
+    if (map_sfx (old_path, old) == false || map_sfx (new_path, neu) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping SFX binaries to diff");
+        return false;
+    }
+
+    Fhdr *ofht = (Fhdr *) (old.base + old.kbf_off + old.header.k_fhtoff);
+    Fhdr *nfht = (Fhdr *) (neu.base + neu.kbf_off + neu.header.k_fhtoff);
+
+    /* an old hardlink name stands for the body of its target */
+    for (uint64_t i = 0; i < old.header.k_fhnum; ++i) {
+        if (ofht[i].fh_ftype == Fhdr::ftype::FT_FILE) {
+            by_path.emplace (old.paths[i], i);
+            by_content.emplace (ofht[i].fh_cksum ^ (ofht[i].fh_size * 0x9e3779b97f4a7c15ULL), i);
+        }
+        else if (ofht[i].fh_ftype == Fhdr::ftype::FT_LINK && ofht[i].fh_offset < i &&
+                 ofht[ofht[i].fh_offset].fh_ftype == Fhdr::ftype::FT_FILE) {
+            by_path.emplace (old.paths[i], ofht[i].fh_offset);
+        }
+    }
+    for (uint64_t i = 0; i < neu.header.k_fhnum; ++i) {
+        if (nfht[i].fh_ftype == Fhdr::ftype::FT_FILE) {
+            files.push_back (i);
+        }
+    }
+    std::sort (files.begin(), files.end(), [nfht] (uint64_t a, uint64_t b) {
+        return nfht[a].fh_offset < nfht[b].fh_offset;
+    });
+
+    if (of_name == "-") {
+        pfd = STDOUT_FILENO;
+    }
+    else {
+        of_name += PATCH_EXTENSION;
+        pfd = open (of_name.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0644);
+        if (pfd == -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while creating patch file");
+            return false;
+        }
+    }
+
+    ph.magic        = PATCH_MAGIC;
+    ph.old_size     = old.size;
+    ph.old_tables   = tables_hash (old);
+    ph.new_size     = neu.size;
+
+    PatchWriter writer (pfd, neu.base);
+    if (write_full (pfd, &ph, sizeof (ph)) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing patch header");
+        status = false;
+    }
+
+    /* old KBF tables: ahead of the payload (stream order) or behind it (trailer) */
+    uint64_t otab     = (old.payload_start > old.kbf_off) ? old.kbf_off : old.payload_end;
+    uint64_t otab_len = (old.payload_start > old.kbf_off) ? old.payload_start - old.kbf_off : old.size - old.payload_end;
+
+    /* stub, then the tables preceding the payload */
+    status = status && delta (old, 0, old.kbf_off, neu, 0, neu.kbf_off, writer)
+                    && delta (old, otab, otab_len, neu, neu.kbf_off, neu.payload_start - neu.kbf_off, writer);
+
+    /* file bodies */
+    pos = neu.payload_start;
+    for (size_t f = 0; status && f < files.size(); ++f) {
+        Fhdr        &nfhdr = nfht[files[f]];
+        uint64_t    body   = neu.payload_start + nfhdr.fh_offset;
+        int64_t     match  = -1;
+
+        if (body < pos || body + nfhdr.fh_size > neu.payload_end) {
+            log (__FILE__, __FUNCTION__, __LINE__, "file body out of payload bounds");
+            status = false;
+            break;
+        }
+        status = writer.literal (pos, body - pos);          /* gap between bodies (if any) */
+
+        auto it = by_path.find (neu.paths[files[f]]);
+        if (it != by_path.end()) {
+            match = it->second;
+        }
+        if (match == -1 || !same_body (old, ofht[match], neu, nfhdr)) {
+            auto ct = by_content.find (nfhdr.fh_cksum ^ (nfhdr.fh_size * 0x9e3779b97f4a7c15ULL));
+            if (ct != by_content.end() && same_body (old, ofht[ct->second], neu, nfhdr)) {
+                match = ct->second;
+            }
+        }
+
+        if (match == -1) {
+            status = status && writer.literal (body, nfhdr.fh_size);
+        }
+        else if (same_body (old, ofht[match], neu, nfhdr)) {
+            status = status && writer.copy (old.payload_start + ofht[match].fh_offset, nfhdr.fh_size);
+        }
+        else {
+            status = status && delta (old, old.payload_start + ofht[match].fh_offset, ofht[match].fh_size,
+                                      neu, body, nfhdr.fh_size, writer);
+        }
+        pos = body + nfhdr.fh_size;
+    }
+
+    /* rest of the payload, then the tables following it */
+    status = status && writer.literal (pos, neu.payload_end - pos)
+                    && delta (old, otab, otab_len, neu, neu.payload_end, neu.size - neu.payload_end, writer)
+                    && writer.flush ();
+
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing patch");
+    }
+    else {
+        ds = "patch: " + std::to_string (writer.copied_bytes ()) + " bytes reused, "
+                       + std::to_string (writer.literal_bytes ()) + " bytes carried";
+        debug_msg (LOG_VERBOSE, ds);
+    }
+
+    if (pfd != STDOUT_FILENO) {
+        close (pfd);
+        if (status == false) {
+            unlink (of_name.c_str());
+        }
+    }
+    unmap_sfx (old);
+    unmap_sfx (neu);
+    return status;
+}
+
+
+
+/****************************************************************************
+ * Rebuilds '<of_name>.FILE_EXTENSION' from <old_path> and the patch at     *
+ * <patch_path> ("-" for stdin). The old SFX must be the exact one the      *
+ * patch was made against (size and KBF tables are checked); COPY ops go    *
+ * through copy_range so that filesystems which can reflink do. On return   *
+ * <of_name> holds the name of the SFX actually written.                    *
+ ****************************************************************************/
+bool apply_patch (std::string &old_path, std::string &patch_path, std::string &of_name) {
+
+    MappedSfx                   old;
+    PatchHeader                 ph;
+    PatchOp                     op;
+    struct stat                 osb;
+    uint64_t                    pos = 0;
+    uint64_t                    len;
+    int                         pfd, outfd;
+    bool                        status = true;
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    if (map_sfx (old_path, old) == false || fstat (old.fd, &osb) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping SFX binary to patch");
+        return false;
+    }
+
+    pfd = (patch_path == "-") ? STDIN_FILENO : open (patch_path.c_str(), O_RDONLY);
+    if (pfd == -1 || read_full (pfd, &ph, sizeof (ph)) == false || ph.magic != PATCH_MAGIC) {
+        log (__FILE__, __FUNCTION__, __LINE__, "not a kavach patch");
+        unmap_sfx (old);
+        return false;
+    }
+    if (ph.old_size != old.size || ph.old_tables != tables_hash (old)) {
+        es = "patch wasn't made against " + old_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        unmap_sfx (old);
+        return false;
+    }
+
+    of_name += FILE_EXTENSION;
+    outfd = open (of_name.c_str(), O_RDWR|O_CREAT|O_EXCL, osb.st_mode);
+    if (outfd == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating SFX binary");
+        unmap_sfx (old);
+        return false;
+    }
+
+    while (status && pos < ph.new_size) {
+        if (read_full (pfd, &op, sizeof (op)) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "patch ended early");
+            status = false;
+            break;
+        }
+
+        len = op.length & ~PATCH_OP_COPY;
+        if (len == 0 || len > ph.new_size - pos) {
+            log (__FILE__, __FUNCTION__, __LINE__, "corrupt patch op");
+            status = false;
+            break;
+        }
+
+        if (op.length & PATCH_OP_COPY) {
+            if (op.old_offset > old.size || len > old.size - op.old_offset) {
+                log (__FILE__, __FUNCTION__, __LINE__, "patch copies beyond the old SFX");
+                status = false;
+                break;
+            }
+            status = copy_range (old.fd, op.old_offset, outfd, &pos, len);
+            continue;
+        }
+
+        for (uint64_t done = 0; status && done < len; ) {
+            size_t chunk = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, len - done);
+            status = read_full (pfd, block.get(), chunk) && pwrite_full (outfd, block.get(), chunk, pos);
+            pos  += chunk;
+            done += chunk;
+        }
+    }
+
+    /* nothing may trail the last op */
+    if (status && read (pfd, block.get(), 1) != 0) {
+        log (__FILE__, __FUNCTION__, __LINE__, "trailing bytes after the last patch op");
+        status = false;
+    }
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while applying patch");
+        unlink (of_name.c_str());
+    }
+
+    if (pfd != STDIN_FILENO) {
+        close (pfd);
+    }
+    close (outfd);
+    unmap_sfx (old);
+    return status;
+}
+
+
+
+/* appends <len> bytes at <new_off> of the new SFX as literal bytes */
+bool PatchWriter::literal (uint64_t new_off, uint64_t len) {
+
+    if (len == 0) {
+        return true;
+    }
+    if (copy_len && flush () == false) {
+        return false;
+    }
+    if (lit_len == 0) {
+        lit_off = new_off;
+    }
+    lit_len  += len;
+    inserted += len;
+    return true;
+}
+
+
+
+/* appends a copy of <len> bytes at <old_off> of the old SFX */
+bool PatchWriter::copy (uint64_t old_off, uint64_t len) {
+
+    if (len == 0) {
+        return true;
+    }
+    if (lit_len && flush () == false) {
+        return false;
+    }
+    if (copy_len && copy_off + copy_len == old_off) {
+        copy_len += len;
+    }
+    else {
+        if (copy_len && flush () == false) {
+            return false;
+        }
+        copy_off = old_off;
+        copy_len = len;
+    }
+    copied += len;
+    return true;
+}
+
+
+
+/* writes out whatever op is pending */
+bool PatchWriter::flush () {
+
+    PatchOp op;
+
+    if (copy_len) {
+        op.length       = copy_len | PATCH_OP_COPY;
+        op.old_offset   = copy_off;
+        copy_len        = 0;
+        return write_full (fd, &op, sizeof (op));
+    }
+    if (lit_len) {
+        op.length       = lit_len;
+        op.old_offset   = 0;
+        lit_len         = 0;
+        return write_full (fd, &op, sizeof (op)) && write_full (fd, neu + lit_off, op.length);
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * rsync style delta of new [n, n + nlen) against old [o, o + olen): old    *
+ * blocks are indexed by a weak rolling checksum, the new range is scanned  *
+ * one byte at a time and every weak hit confirmed by comparing the bytes   *
+ * (both SFXs are mapped, so no strong hash is needed). Matches are grown   *
+ * forward past the block as far as the bytes agree.                        *
+ ****************************************************************************/
+static bool delta (MappedSfx &old, uint64_t o, uint64_t olen, MappedSfx &neu, uint64_t n, uint64_t nlen, PatchWriter &writer) {
+
+    const uint8_t   *src = old.base + o;
+    const uint8_t   *dst = neu.base + n;
+    uint64_t        bs   = DELTA_BLOCK_MIN;
+    uint64_t        nblocks;
+    uint64_t        lit  = 0;                   /* start of pending literal bytes */
+    uint32_t        a = 0, b = 0;
+
+
+    while (bs < DELTA_BLOCK_MAX && bs * bs < olen) {
+        bs <<= 1;
+    }
+    if (olen < bs || nlen < bs) {
+        return writer.literal (n, nlen);
+    }
+
+    auto weak = [bs] (const uint8_t *p, uint32_t &a, uint32_t &b) {
+        a = b = 0;
+        for (uint64_t i = 0; i < bs; ++i) {
+            a += p[i];
+            b += (bs - i) * p[i];
+        }
+    };
+    auto key = [] (uint32_t a, uint32_t b) {
+        return (a & 0xffff) | (b << 16);
+    };
+
+    /* index old blocks: weak checksum -> chain of block numbers */
+    nblocks = olen / bs;
+    std::unordered_map<uint32_t, uint32_t>  head;
+    std::vector<uint32_t>                   next (nblocks, (uint32_t) -1);
+    head.reserve (nblocks);
+    for (uint64_t k = nblocks; k-- > 0; ) {
+        weak (src + k * bs, a, b);
+        auto [it, fresh] = head.emplace (key (a, b), k);
+        if (!fresh) {
+            next[k]     = it->second;
+            it->second  = k;
+        }
+    }
+
+    weak (dst, a, b);
+    for (uint64_t p = 0; p + bs <= nlen; ) {
+
+        int64_t match = -1;
+        auto    it    = head.find (key (a, b));
+        if (it != head.end()) {
+            int probes = 0;
+            for (uint32_t k = it->second; k != (uint32_t) -1 && probes < DELTA_MAX_PROBES; k = next[k], ++probes) {
+                if (memcmp (src + (uint64_t) k * bs, dst + p, bs) == 0) {
+                    match = k;
+                    break;
+                }
+            }
+        }
+
+        if (match != -1) {
+            uint64_t from = (uint64_t) match * bs;
+            uint64_t len  = bs;
+
+            /* grow the match while old and new agree */
+            while (p + len < nlen && from + len < olen) {
+                uint64_t step = std::min ({(uint64_t) 0x1000, nlen - p - len, olen - from - len});
+                if (memcmp (src + from + len, dst + p + len, step) == 0) {
+                    len += step;
+                    continue;
+                }
+                while (src[from + len] == dst[p + len]) {
+                    ++len;
+                }
+                break;
+            }
+
+            if (writer.literal (n + lit, p - lit) == false || writer.copy (o + from, len) == false) {
+                return false;
+            }
+            p  += len;
+            lit = p;
+            if (p + bs <= nlen) {
+                weak (dst + p, a, b);
+            }
+            continue;
+        }
+
+        /* roll the window one byte forward */
+        if (p + bs < nlen) {
+            a += dst[p + bs] - dst[p];
+            b += a - bs * dst[p];
+        }
+        ++p;
+    }
+
+    return writer.literal (n + lit, nlen - lit);
+}
+
+
+
+/* true if the stored bodies of <ofhdr> and <nfhdr> are byte for byte identical */
+static bool same_body (MappedSfx &old, Fhdr &ofhdr, MappedSfx &neu, Fhdr &nfhdr) {
+
+    if ( ofhdr.fh_size != nfhdr.fh_size || ofhdr.fh_etype != nfhdr.fh_etype ||
+         ofhdr.fh_cktype != nfhdr.fh_cktype || ofhdr.fh_cksum != nfhdr.fh_cksum ||
+         old.payload_start + ofhdr.fh_offset + ofhdr.fh_size > old.payload_end ) {
+        return false;
+    }
+
+    return memcmp (old.base + old.payload_start + ofhdr.fh_offset,
+                   neu.base + neu.payload_start + nfhdr.fh_offset, nfhdr.fh_size) == 0;
+}
+
+
+
+/* maps the whole SFX at <path>, locates its KBF (either layout) and resolves the path of every file */
+static bool map_sfx (const std::string &path, MappedSfx &sfx) {
+
+    uint8_t             *map;
+    uint64_t            map_size, remainder;
+    Kbhdr               *header;
+    struct stat         sb;
+    std::vector<std::string> dirs;
+    std::string         name;
+
+
+    sfx.fd = open (path.c_str(), O_RDONLY);
+    if (sfx.fd == -1 || fstat (sfx.fd, &sb) == -1) {
+        es = "while open'ing " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    if (map_kbf (sfx.fd, map, map_size, remainder, header, false) == false) {
+        es = "while mapping kavach binary format of " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    if (header->k_flags & Kbhdr::flags::KBF_VOLUMES) {
+        es = path + " is a multi-volume SFX, patches work on single file SFXs only";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+    sfx.size        = sb.st_size;
+    sfx.kbf_off     = sb.st_size - map_size + remainder;
+    sfx.header      = *header;
+    munmap (map, map_size);
+
+    sfx.payload_start   = sfx.kbf_off + sfx.header.k_payloadoff;
+    sfx.payload_end     = sfx.payload_start + sfx.header.k_payloadsz;
+    if ( sfx.payload_end > sfx.size || sfx.header.k_fhentsize != sizeof (Fhdr) ||
+         sfx.kbf_off + sfx.header.k_fhtoff + sfx.header.k_fhnum * sizeof (Fhdr) > sfx.size ||
+         sfx.kbf_off + sfx.header.k_nametaboff + sfx.header.k_nametabsz > sfx.size ) {
+        es = "corrupt kavach binary header in " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    sfx.base = (uint8_t *) mmap (NULL, sfx.size, PROT_READ, MAP_SHARED, sfx.fd, 0);
+    if (sfx.base == MAP_FAILED) {
+        mmap_error ("while mmap'ing SFX", errno);
+        return false;
+    }
+    madvise (sfx.base, sfx.size, MADV_SEQUENTIAL);
+
+    Fhdr            *fht = (Fhdr *) (sfx.base + sfx.kbf_off + sfx.header.k_fhtoff);
+    NametabReader   nametab (sfx.base + sfx.kbf_off + sfx.header.k_nametaboff, sfx.header.k_nametabsz, sfx.header.k_nametabenc);
+
+    sfx.paths.resize (sfx.header.k_fhnum);
+    for (uint64_t i = 0; i < sfx.header.k_fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (!dirs.empty()) {
+                dirs.pop_back ();
+            }
+            continue;
+        }
+        if ( fht[i].fh_ftype != Fhdr::ftype::FT_DIR && fht[i].fh_ftype != Fhdr::ftype::FT_FILE &&
+             fht[i].fh_ftype != Fhdr::ftype::FT_LINK ) {
+            continue;
+        }
+        if (nametab.name (fht[i].fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            return false;
+        }
+        name = dirs.empty() ? name : dirs.back() + "/" + name;
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+            dirs.push_back (name);
+        }
+        else {
+            sfx.paths[i] = name;
+        }
+    }
+
+    return true;
+}
+
+
+
+static void unmap_sfx (MappedSfx &sfx) {
+
+    munmap (sfx.base, sfx.size);
+    close (sfx.fd);
+}
+
+
+
+/* XXH64 over everything of the KBF but the payload: identifies the exact SFX a patch needs */
+static uint64_t tables_hash (MappedSfx &sfx) {
+
+    Cksum hash (Fhdr::cksum::FCK_XXH64);
+
+    hash.update (sfx.base + sfx.kbf_off, sfx.payload_start - sfx.kbf_off);
+    hash.update (sfx.base + sfx.payload_end, sfx.size - sfx.payload_end);
+    return hash.digest ();
+}
@@ -3,53 +3,61 @@
  * Email    : compilepeace@gmail.com                                            *
  * Filename : encrypt.cpp                                                       *
  *                                                                              *
- * Description: Module responsible for scrambling payload with specific         *
- *              encryption algorithms.                                          *
- *              Declared under SCRAMBLE namespace (in kavach.h).                *
+ * Description: Module responsible for the XOR key stream that scrambles and    *
+ *              descrambles payload (PIPELINE::Cipher<FET_XOR>, pipeline.h).    *
+ *              Declared as XorKeystream class (in kavach.h).                   *
  *                                                                              *
- * Code Flow: <main> => <pack> => <load_archive_payload> => <encrypt>           *
+ * Code Flow: <Cipher<FET_XOR>::encode|decode> => <XorKeystream::apply>         *
  *                                                                              * 
  ********************************************************************************/
 
+#include <algorithm>
+
 #include "kavach.h"
 
 
-/* function prototypes */
-void pxor (std::vector<uint8_t> &payload, std::string &key);
+/* expands <key> to a whole number of copies spanning at least KEYSTREAM_MIN_SIZE bytes */
+XorKeystream::XorKeystream (const std::string &key): ksize(key.length()) {
 
+    if (ksize == 0) {
+        return;
+    }
 
-namespace SCRAMBLE {
+    uint64_t copies = (KEYSTREAM_MIN_SIZE + ksize - 1) / ksize;
+    stream.reserve (copies * ksize);
+    for (uint64_t i = 0; i < copies; ++i) {
+        stream.insert (stream.end(), key.begin(), key.end());
+    }
+}
 
-    /* encrypts the <payload> using encryption type <etype> and password <key> */
-    bool encrypt (std::vector<uint8_t> &payload, std::string &key, Fhdr::encrypt &etype) {
 
-        if (key.length() == 0) {
-            log (__FILE__, __FUNCTION__, __LINE__, "encryption key not present, ARCHIVE ONLY mode set");
-            return true;
-        }
+/* XORs the <len> bytes at <data>, found at <offset> within a file body, with the key stream */
+void XorKeystream::apply (uint8_t *data, size_t len, uint64_t offset) const {
 
-        switch (etype) {
-            case Fhdr::encrypt::FET_UND:    
-                                            break;
-            case Fhdr::encrypt::FET_XOR:    
-                                            pxor (payload, key);
-                                            break;
-            default:
-                        fprintf (stderr, "Unknown encryption type\n");
-                        break;
-        }
-
-        return true;
+    if (ksize == 0) {
+        return;
     }
-}
-    
 
-/* Payload XOR: xor each byte of <payload> using <key> */
-void pxor (std::vector<uint8_t> &payload, std::string &key) {
-    
-    uint64_t ksize = key.length();
+    uint64_t phase = offset % ksize;
+    while (len) {
+        size_t span = std::min ((size_t) (stream.size() - phase), len);
+        const uint8_t *ks = &stream[phase];
+        size_t i = 0;
+
+        /* a word at a time, then the odd tail bytes */
+        for (; i + sizeof (uint64_t) <= span; i += sizeof (uint64_t)) {
+            uint64_t d, k;
+            memcpy (&d, data + i, sizeof (uint64_t));
+            memcpy (&k, ks + i, sizeof (uint64_t));
+            d ^= k;
+            memcpy (data + i, &d, sizeof (uint64_t));
+        }
+        for (; i < span; ++i) {
+            data[i] ^= ks[i];
+        }
 
-    for (int i = 0; i < payload.size(); ++i) {
-        payload[i] = payload[i] ^ key[ i % ksize ];
+        data  += span;
+        len   -= span;
+        phase  = (phase + span) % ksize;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,347 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : exclude.cpp                                                       *
+ *                                                                              *
+ * Description: Module responsible for compiling --exclude/--exclude-from       *
+ *              patterns (gitignore syntax) and matching paths against them     *
+ *              while the pack target is scanned.                               *
+ *              Declared as Exclude class (in kavach.h).                        *
+ *                                                                              *
+ * Code Flow: <main> => <parse_cmdline_args> => <Exclude::add|load>             *
+ *            <main> => <pack> => <load_fpn> => <Exclude::excluded>             *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <algorithm>
+
+#include "kavach.h"
+
+
+/* function prototypes */
+static bool     has_glob_meta   (std::string_view pattern);
+
+
+
+/****************************************************************************
+ * Adds a single gitignore line. Blank lines and "#" comments are ignored,  *
+ * "!" negates, a trailing "/" only matches directories and any other "/"   *
+ * anchors the pattern to the pack root (matched against the whole path    *
+ * instead of the basename). Returns false on a malformed pattern.          *
+ ****************************************************************************/
+bool Exclude::add (std::string_view line) {
+
+    Rule        rule {false, false, false, {}};
+    uint32_t    ndx = rules.size();
+
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix (1);
+    }
+
+    /* trailing spaces are dropped unless escaped */
+    while (!line.empty() && line.back() == ' ' &&
+           !(line.size() >= 2 && line[line.size() - 2] == '\\')) {
+        line.remove_suffix (1);
+    }
+
+    if (line.empty() || line[0] == '#') {
+        return true;
+    }
+
+    if (line[0] == '!') {
+        rule.negate = true;
+        line.remove_prefix (1);
+    }
+    else if (line.size() >= 2 && line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+        line.remove_prefix (1);
+    }
+
+    if (!line.empty() && line.back() == '/') {
+        rule.dir_only = true;
+        line.remove_suffix (1);
+    }
+
+    if (line.find ('/') != std::string_view::npos) {
+        rule.anchored = true;
+        if (line[0] == '/') {
+            line.remove_prefix (1);
+        }
+    }
+
+    if (line.empty()) {
+        return true;
+    }
+
+    /* hashed rules: plain names/paths and "*<literal>" basename suffixes */
+    if (!has_glob_meta (line)) {
+        (rule.anchored ? paths : names)[std::string (line)].push_back (ndx);
+    }
+    else if (!rule.anchored && line.size() > 1 && line[0] == '*' && !has_glob_meta (line.substr (1))) {
+        std::string suffix (line.substr (1));
+        if (std::find (suffix_lens.begin(), suffix_lens.end(), suffix.size()) == suffix_lens.end()) {
+            suffix_lens.push_back (suffix.size());
+        }
+        suffixes[suffix].push_back (ndx);
+    }
+    else {
+        if (compile (line, rule.program) == false) {
+            es = "malformed exclude pattern: " + std::string (line);
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        globs.push_back (ndx);
+    }
+
+    rules.push_back (std::move (rule));
+    return true;
+}
+
+
+
+/* adds every line of the gitignore style file <path> */
+bool Exclude::load (const std::string &path) {
+
+    std::string list;
+    char        buf[0x4000];
+    ssize_t     nread;
+    int         efd = open (path.c_str(), O_RDONLY);
+
+    if (efd == -1) {
+        es = "while open'ing " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    while ((nread = read (efd, buf, sizeof (buf))) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log (__FILE__, __FUNCTION__, __LINE__, "while reading exclude file");
+            close (efd);
+            return false;
+        }
+        list.append (buf, nread);
+    }
+    close (efd);
+
+    for (size_t start = 0; start < list.size(); ) {
+        size_t end = list.find ('\n', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (add (std::string_view (list).substr (start, end - start)) == false) {
+            return false;
+        }
+        start = end + 1;
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Decides whether <relpath> (relative to the pack root) is excluded. The   *
+ * hash lookups are done first; glob rules are then only tried from the     *
+ * last one down to (but not including) the best rule found so far, since  *
+ * the last matching rule wins.                                             *
+ ****************************************************************************/
+bool Exclude::excluded (std::string_view relpath, bool is_dir) const {
+
+    int64_t             best = -1;
+    size_t              slash = relpath.rfind ('/');
+    std::string_view    base = (slash == std::string_view::npos) ? relpath : relpath.substr (slash + 1);
+
+    if (!names.empty()) {
+        auto it = names.find (std::string (base));
+        best_of (it != names.end() ? &it->second : nullptr, is_dir, best);
+    }
+
+    for (size_t len: suffix_lens) {
+        if (len <= base.size()) {
+            auto it = suffixes.find (std::string (base.substr (base.size() - len)));
+            best_of (it != suffixes.end() ? &it->second : nullptr, is_dir, best);
+        }
+    }
+
+    if (!paths.empty()) {
+        auto it = paths.find (std::string (relpath));
+        best_of (it != paths.end() ? &it->second : nullptr, is_dir, best);
+    }
+
+    for (auto it = globs.rbegin(); it != globs.rend() && (int64_t) *it > best; ++it) {
+        const Rule &rule = rules[*it];
+        if (rule.dir_only && !is_dir) {
+            continue;
+        }
+        if (run (rule.program, rule.anchored ? relpath : base)) {
+            best = *it;
+            break;
+        }
+    }
+
+    return best != -1 && !rules[best].negate;
+}
+
+
+
+/* raises <best> to the last rule in <hits> that applies to this entry type */
+void Exclude::best_of (const std::vector<uint32_t> *hits, bool is_dir, int64_t &best) const {
+
+    if (hits == nullptr) {
+        return;
+    }
+
+    for (auto it = hits->rbegin(); it != hits->rend() && (int64_t) *it > best; ++it) {
+        if (!rules[*it].dir_only || is_dir) {
+            best = *it;
+            return;
+        }
+    }
+}
+
+
+
+/****************************************************************************
+ * Compiles a glob into tokens: "*" and "?" never match a '/', "[...]" is a *
+ * character class ("!" or "^" negates), "**" as a whole trailing component *
+ * matches anything and "**" followed by "/" matches zero or more whole     *
+ * directories. A backslash escapes the next character.                     *
+ ****************************************************************************/
+bool Exclude::compile (std::string_view glob, std::vector<Token> &program) const {
+
+    for (size_t i = 0; i < glob.size(); ++i) {
+        Token   token {Token::LIT, glob[i], {}};
+        bool    component_start = (i == 0 || glob[i - 1] == '/');
+
+        switch (glob[i]) {
+            case '\\':
+                        if (++i == glob.size()) {
+                            return false;
+                        }
+                        token.c = glob[i];
+                        break;
+
+            case '*':
+                        if (component_start && i + 1 < glob.size() && glob[i + 1] == '*' &&
+                            (i + 2 == glob.size() || glob[i + 2] == '/')) {
+                            token.type = (i + 2 == glob.size()) ? Token::GLOBSTAR : Token::DIRS;
+                            i += (i + 2 == glob.size()) ? 1 : 2;
+                        }
+                        else {
+                            token.type = Token::STAR;
+                            while (i + 1 < glob.size() && glob[i + 1] == '*') {
+                                ++i;
+                            }
+                        }
+                        break;
+
+            case '?':
+                        token.type = Token::ANY;
+                        break;
+
+            case '[': {
+                        size_t  j = i + 1;
+                        bool    negate = (j < glob.size() && (glob[j] == '!' || glob[j] == '^'));
+
+                        if (negate) {
+                            ++j;
+                        }
+                        for (bool first = true; j < glob.size() && (first || glob[j] != ']'); first = false) {
+                            unsigned char lo = glob[j];
+                            if (lo == '\\' && j + 1 < glob.size()) {
+                                lo = glob[++j];
+                            }
+                            unsigned char hi = lo;
+                            if (j + 2 < glob.size() && glob[j + 1] == '-' && glob[j + 2] != ']') {
+                                hi = glob[j + 2];
+                                j += 2;
+                            }
+                            for (unsigned c = lo; c <= hi; ++c) {
+                                token.cls.set (c);
+                            }
+                            ++j;
+                        }
+
+                        /* no closing bracket: '[' is an ordinary character */
+                        if (j >= glob.size()) {
+                            break;
+                        }
+                        if (negate) {
+                            token.cls.flip ();
+                        }
+                        token.type = Token::CLASS;
+                        i = j;
+                        break;
+                    }
+
+            default:
+                        break;
+        }
+
+        program.push_back (token);
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Runs the token program over <s>. Row t of the table records, for every  *
+ * offset j, whether tokens [t, n) match s[j, len); rows are filled from    *
+ * the last token back so only two of them are alive at a time. That keeps *
+ * matching O(tokens * len) however many stars the pattern has.             *
+ ****************************************************************************/
+bool Exclude::run (const std::vector<Token> &program, std::string_view s) const {
+
+    thread_local std::vector<uint8_t>   next, cur;
+    size_t                              len = s.size();
+
+    next.assign (len + 1, 0);
+    cur.assign (len + 1, 0);
+    next[len] = 1;
+
+    for (size_t t = program.size(); t-- > 0; ) {
+        const Token &token = program[t];
+        bool        tail = false;       /* DIRS: some '/' at or after j ends a prefix */
+
+        for (size_t j = len + 1; j-- > 0; ) {
+            bool more = (j < len);
+
+            switch (token.type) {
+                case Token::LIT:
+                            cur[j] = more && s[j] == token.c && next[j + 1];
+                            break;
+                case Token::ANY:
+                            cur[j] = more && s[j] != '/' && next[j + 1];
+                            break;
+                case Token::CLASS:
+                            cur[j] = more && s[j] != '/' && token.cls[(unsigned char) s[j]] && next[j + 1];
+                            break;
+                case Token::STAR:
+                            cur[j] = next[j] || (more && s[j] != '/' && cur[j + 1]);
+                            break;
+                case Token::GLOBSTAR:
+                            cur[j] = next[j] || (more && cur[j + 1]);
+                            break;
+                case Token::DIRS:
+                            tail   = tail || (more && s[j] == '/' && next[j + 1]);
+                            cur[j] = next[j] || tail;
+                            break;
+            }
+        }
+
+        std::swap (cur, next);
+    }
+
+    return next[0];
+}
+
+
+
+/* true if <pattern> needs the glob matcher */
+static bool has_glob_meta (std::string_view pattern) {
+    return pattern.find_first_of ("*?[\\") != std::string_view::npos;
+}
@@ -0,0 +1,207 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : exec.cpp                                                          *
+ *                                                                              *
+ * Description: Module responsible for running an archived executable without  *
+ *              it ever touching a filesystem (--exec). The entry (and with     *
+ *              --siblings, every file next to it) is decrypted straight into   *
+ *              an anonymous memfd, sealed, and launched with fexecve (2).      *
+ *                                                                              *
+ * Code Flow: <main> => <exec_payload>                                          *
+ *                                                                              *
+ ********************************************************************************/
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+extern char **environ;
+
+
+/* function prototypes */
+static int  load_memfd      (uint8_t *payload, Fhdr &fhdr, const std::string &name, std::string &key, uint8_t *block);
+static bool siblings        (Kbhdr *header, Fhdr *fht, int64_t dirndx, std::vector<uint64_t> &files);
+
+
+
+/****************************************************************************
+ * Replaces this process with <archived_path> of the invoked SFX, run with  *
+ * <args>. With --siblings, the other files of its directory are loaded    *
+ * into memfds as well and left open across the exec; the tool finds them   *
+ * through KAVACH_SIBLINGS ("<name>=/proc/self/fd/<n>" lines). Only returns *
+ * (false) on failure.                                                      *
+ ****************************************************************************/
+bool exec_payload (int sfxfd, std::string &archived_path, std::vector<std::string> &args, std::string &key) {
+
+    uint8_t                     *map;
+    uint64_t                    map_size;
+    uint64_t                    remainder;
+    int64_t                     ndx, dirndx = -1;
+    int                         memfd, fd;
+    Kbhdr                       *header;
+    std::string                 name, env;
+    std::vector<uint64_t>       files;
+    std::vector<char *>         argv;
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    if (map_kbf (sfxfd, map, map_size, remainder, header) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
+        return false;
+    }
+
+    uint8_t             *kbf     = map + remainder;
+    Fhdr                *fht     = (Fhdr *)    &kbf[header->k_fhtoff];
+    uint8_t             *payload = (uint8_t *) &kbf[header->k_payloadoff];
+    NametabReader       nametab ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+
+    ndx = resolve_path (header, fht, nametab, archived_path);
+    if (ndx != -1 && fht[ndx].fh_ftype == Fhdr::ftype::FT_LINK && fht[ndx].fh_offset < (uint64_t) ndx) {
+        ndx = fht[ndx].fh_offset;           /* a hardlink runs the file it links to */
+    }
+    if (ndx == -1 || fht[ndx].fh_ftype != Fhdr::ftype::FT_FILE) {
+        es = "no such archived file: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    if (body_in_bounds (header, fht[ndx], map_size - remainder) == false) {
+        es = "file body out of payload bounds: " + archived_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    name = archived_path.substr (archived_path.find_last_of ('/') + 1);
+    memfd = load_memfd (payload, fht[ndx], name, key, block.get());
+    if (memfd == -1) {
+        return false;
+    }
+
+    if (SIBLINGS_FLAG) {
+        size_t slash = archived_path.find_last_of ('/');
+        if (slash != std::string::npos) {
+            dirndx = resolve_path (header, fht, nametab, archived_path.substr (0, slash));
+        }
+        if (siblings (header, fht, dirndx, files) == false) {
+            return false;
+        }
+        for (uint64_t n: files) {
+            std::string sibling;
+            uint64_t    target = (fht[n].fh_ftype == Fhdr::ftype::FT_LINK) ? fht[n].fh_offset : n;
+
+            if (target == (uint64_t) ndx || nametab.name (fht[n].fh_namendx, sibling) == false) {
+                continue;
+            }
+            if (body_in_bounds (header, fht[target], map_size - remainder) == false) {
+                es = "file body out of payload bounds: " + sibling;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                return false;
+            }
+            fd = load_memfd (payload, fht[target], sibling, key, block.get());
+            if (fd == -1) {
+                return false;
+            }
+            env += sibling + "=/proc/self/fd/" + std::to_string (fd) + "\n";
+        }
+        setenv ("KAVACH_SIBLINGS", env.c_str(), 1);
+    }
+
+    /* the tool sees its archived name as argv[0] */
+    argv.push_back (&name[0]);
+    for (auto &arg: args) {
+        argv.push_back (&arg[0]);
+    }
+    argv.push_back (nullptr);
+
+    munmap (map, map_size);
+    log_flush ();                           /* queued messages don't survive the exec */
+    fcntl (sfxfd, F_SETFD, FD_CLOEXEC);     /* only the memfds are for the tool */
+    fexecve (memfd, argv.data(), environ);
+
+    es = "while executing " + archived_path;
+    log (__FILE__, __FUNCTION__, __LINE__, es);
+    return false;
+}
+
+
+
+/****************************************************************************
+ * Decrypts the FT_FILE <fhdr> into a fresh memfd named <name>, verifies   *
+ * its checksum and seals it against any further change. The fd is left   *
+ * inheritable: an interpreter (#!) script reopens it as /proc/self/fd/N.  *
+ ****************************************************************************/
+static int load_memfd (uint8_t *payload, Fhdr &fhdr, const std::string &name, std::string &key, uint8_t *block) {
+
+    uint64_t    cksum;
+    int         memfd;
+
+    if (fhdr.fh_etype != Fhdr::encrypt::FET_UND && key.empty()) {
+        es = "decryption key not supplied for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return -1;
+    }
+
+    memfd = memfd_create (name.c_str(), MFD_ALLOW_SEALING);
+    if (memfd == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating memfd");
+        return -1;
+    }
+
+    /* size it up front: the pages are then only written once */
+    if ( ftruncate (memfd, fhdr.fh_size) == -1 ||
+         unpack_payload (&payload[fhdr.fh_offset], fhdr, key, memfd, block, cksum) == false ) {
+        es = "while loading " + name + " into memory";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (memfd);
+        return -1;
+    }
+
+    if (fhdr.fh_cktype != Fhdr::cksum::FCK_UND && cksum != fhdr.fh_cksum) {
+        es = "checksum mismatch (corrupt payload or wrong key) for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (memfd);
+        return -1;
+    }
+
+    if ( fchmod (memfd, fhdr.fh_mode & 07777) == -1 || lseek (memfd, 0, SEEK_SET) == -1 ||
+         fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) == -1 ) {
+        es = "while sealing memfd of " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (memfd);
+        return -1;
+    }
+
+    return memfd;
+}
+
+
+
+/* FHT indices of the files (and hardlinks) directly inside directory <dirndx> (-1: top level) */
+static bool siblings (Kbhdr *header, Fhdr *fht, int64_t dirndx, std::vector<uint64_t> &files) {
+
+    uint64_t depth = 0;
+
+    if (dirndx != -1 && fht[dirndx].fh_ftype != Fhdr::ftype::FT_DIR) {
+        log (__FILE__, __FUNCTION__, __LINE__, "parent of --exec target isn't an archived directory");
+        return false;
+    }
+
+    for (uint64_t i = dirndx + 1; i < header->k_fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (depth-- == 0) {
+                break;              /* end of <dirndx> */
+            }
+            continue;
+        }
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+            ++depth;
+        }
+        else if (depth == 0 && (fht[i].fh_ftype == Fhdr::ftype::FT_FILE ||
+                 (fht[i].fh_ftype == Fhdr::ftype::FT_LINK && fht[i].fh_offset < i &&
+                  fht[fht[i].fh_offset].fh_ftype == Fhdr::ftype::FT_FILE))) {
+            files.push_back (i);
+        }
+    }
+
+    return true;
+}
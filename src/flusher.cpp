@@ -0,0 +1,198 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : flusher.cpp                                                       *
+ *                                                                              *
+ * Description: Module responsible for the durability policy (--durability) of  *
+ *              an unpack: when, and how, what it writes is forced to disk.     *
+ *              Declared as Flusher class (in kavach.h).                        *
+ *                                                                              *
+ * Code Flow: <main> => <unpack> => <extract_file> => <Flusher::file>           *
+ *                               => <close_dir>    => <Flusher::dir>            *
+ *                               => <Flusher::finish>                           *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "kavach.h"
+
+
+
+/* an aborted unpack still shouldn't leak the descriptors it queued */
+Flusher::~Flusher () {
+
+    reset ();
+}
+
+
+
+/* drops whatever an aborted unpack left queued (its directories may be closed by now: nothing is renamed) */
+void Flusher::reset () {
+
+    for (auto &p: pending) {
+        close (p.fd);
+    }
+    pending.clear ();
+}
+
+
+
+/****************************************************************************
+ * <fd> (below <dirfd>, named <tmp>) is completely written. Hands it over  *
+ * to the policy and takes ownership of it: closed right away unless it is *
+ * queued for a per-dir batch. A <tmp> differing from <name> is renamed    *
+ * over it only once its contents are durable, so a crash can't leave a    *
+ * truncated file under the final name.                                    *
+ ****************************************************************************/
+bool Flusher::file (int fd, int dirfd, const std::string &tmp, const std::string &name) {
+
+    if (DURABILITY == FD_PER_DIR) {
+        pending.push_back ({fd, dirfd, tmp, name});
+        return pending.size() < DURABILITY_BATCH || flush ();
+    }
+
+    if (DURABILITY == FD_PER_FILE) {
+        PhaseTimer timer (SP_SYNC);
+        if (fdatasync (fd) == -1) {
+            es = "while flushing " + name;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            close (fd);
+            return false;
+        }
+    }
+    close (fd);
+
+    if (tmp != name && renameat (dirfd, tmp.c_str(), dirfd, name.c_str()) == -1) {
+        es = "while replacing " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        unlinkat (dirfd, tmp.c_str(), 0);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Makes every queued file durable. fdatasync (2) mostly waits on the disk *
+ * (and, on journaling filesystems, concurrent calls share one commit), so *
+ * the batch is spread over up to DURABILITY_WORKERS threads regardless of *
+ * the CPU count. Renames wait until the whole batch made it.              *
+ ****************************************************************************/
+bool Flusher::flush () {
+
+    std::atomic<uint64_t>       next (0);
+    std::atomic<uint64_t>       failed (0);
+    std::vector<std::thread>    workers;
+    unsigned                    nthreads;
+    bool                        status = true;
+    PhaseTimer                  timer (SP_SYNC);
+
+    if (pending.empty()) {
+        return true;
+    }
+
+    nthreads = std::min ((size_t) DURABILITY_WORKERS, pending.size());
+    for (unsigned t = 1; t < nthreads; ++t) {
+        workers.emplace_back ([&] () {
+            for (uint64_t n = next++; n < pending.size(); n = next++) {
+                failed += (fdatasync (pending[n].fd) == -1);
+            }
+        });
+    }
+    for (uint64_t n = next++; n < pending.size(); n = next++) {
+        failed += (fdatasync (pending[n].fd) == -1);
+    }
+    for (auto &worker: workers) {
+        worker.join ();
+    }
+
+    if (failed) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while flushing extracted files");
+        status = false;
+    }
+
+    for (auto &p: pending) {
+        close (p.fd);
+        if (p.tmp == p.name) {
+            continue;
+        }
+        if (!status || renameat (p.dirfd, p.tmp.c_str(), p.dirfd, p.name.c_str()) == -1) {
+            if (status) {
+                es = "while replacing " + p.name;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                status = false;
+            }
+            unlinkat (p.dirfd, p.tmp.c_str(), 0);
+        }
+    }
+    pending.clear ();
+
+    return status;
+}
+
+
+
+/* every entry of <dirfd> is written: with per-file|per-dir, make the directory itself durable */
+bool Flusher::dir (int dirfd) {
+
+    if (DURABILITY < FD_PER_FILE) {
+        return true;
+    }
+    if (flush () == false) {
+        return false;
+    }
+    if (fsync (dirfd) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while flushing extracted directory");
+        return false;
+    }
+    return true;
+}
+
+
+
+/****************************************************************************
+ * The unpack below <rootfd> (created as <root>) is complete. end flushes  *
+ * the whole output filesystem in one syncfs (2); per-file|per-dir already *
+ * flushed the tree and only need the entry of <root> in its parent.       *
+ ****************************************************************************/
+bool Flusher::finish (int rootfd, const std::string &root) {
+
+    size_t      slash  = root.find_last_of ('/');
+    std::string parent = (slash == std::string::npos) ? "." : root.substr (0, slash + 1);
+    int         fd;
+
+    switch (DURABILITY) {
+        case FD_NONE:
+                    return true;
+
+        case FD_END: {
+                    PhaseTimer timer (SP_SYNC);
+                    if (syncfs (rootfd) == -1) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "while flushing output filesystem");
+                        return false;
+                    }
+                    return true;
+        }
+
+        default:
+                    if (flush () == false) {
+                        return false;
+                    }
+                    fd = open (parent.c_str(), O_RDONLY|O_DIRECTORY);
+                    if (fd == -1 || fsync (fd) == -1) {
+                        es = "while flushing " + parent;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        if (fd != -1) {
+                            close (fd);
+                        }
+                        return false;
+                    }
+                    close (fd);
+                    return true;
+    }
+}
@@ -32,30 +32,6 @@ void dump_process_memory () {
 } 
 
 
-/* perror() information to debug */
-void log (std::string source, std::string func, int line_no, std::string error_string) {
-    
-    std::string es = BOLDRED "[-] " RESET "(" BOLDBLUE + source + RESET ", " YELLOW 
-                     + func +  RESET ", " CYAN  + std::to_string(line_no) 
-                     + RESET ") => " + error_string;
-                    
-    char buffer[es.length() + 1];
-
-    sprintf (buffer, " %s", es.c_str());
-    perror (buffer);
-}
-
-
-/* print debug messages to stderr */
-void debug_msg (std::string debug_string) {
-    
-    std::string ds = BOLDGREEN "[+] " MAGENTA + debug_string + RESET"\n";
-    
-    fprintf (stderr, " %s",ds.c_str());
-} 
-
-
-
 /* dump a range of memory : [addr, addr + len) */ 
 void dump_memory_range (void *addr, size_t len){    
     /* Used for debugging: Prints the hexdump memory mapping of [addr, addr+len] */
@@ -177,4 +153,171 @@ void sendfile_error (std::string error_string, int &error) {
             return;
     }
     log (__FILE__, __FUNCTION__, __LINE__, error_string);
-}
\ No newline at end of file
+}
+
+
+/* pread () until <len> bytes are in or the file ends early (EOF counts as failure). Like the *
+ * other *_full () helpers and copy_range () below, it is paced by --max-read|write-bps      */
+bool pread_full (int fd, void *buf, size_t len, uint64_t offset) {
+
+    uint8_t     *ptr = (uint8_t *) buf;
+    PhaseTimer  timer (SP_READ);
+
+    while (len) {
+        size_t  want = READ_LIMIT.slice (len);
+        ssize_t n = pread (fd, ptr, want, offset);
+        STATS.count (SC_READS);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_READ, n);
+        STATS.count (SC_SHORT_READS, (size_t) n < want);
+        READ_LIMIT.take (n);
+        ptr     += n;
+        len     -= n;
+        offset  += n;
+    }
+
+    return true;
+}
+
+
+/* pwrite () until all <len> bytes are out */
+bool pwrite_full (int fd, const void *buf, size_t len, uint64_t offset) {
+
+    const uint8_t   *ptr = (const uint8_t *) buf;
+    PhaseTimer      timer (SP_WRITE);
+
+    while (len) {
+        size_t  want = WRITE_LIMIT.slice (len);
+        ssize_t n = pwrite (fd, ptr, want, offset);
+        STATS.count (SC_WRITES);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_WRITTEN, n);
+        STATS.count (SC_SHORT_WRITES, (size_t) n < want);
+        WRITE_LIMIT.take (n);
+        ptr     += n;
+        len     -= n;
+        offset  += n;
+    }
+
+    return true;
+}
+
+
+/* write () until all <len> bytes are out (pipes and sockets take partial writes) */
+bool write_full (int fd, const void *buf, size_t len) {
+
+    const uint8_t   *ptr = (const uint8_t *) buf;
+    PhaseTimer      timer (SP_WRITE);
+
+    while (len) {
+        size_t  want = WRITE_LIMIT.slice (len);
+        ssize_t n = write (fd, ptr, want);
+        STATS.count (SC_WRITES);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_WRITTEN, n);
+        STATS.count (SC_SHORT_WRITES, (size_t) n < want);
+        WRITE_LIMIT.take (n);
+        ptr     += n;
+        len     -= n;
+    }
+
+    return true;
+}
+
+/* read () until <len> bytes are in (pipes hand out partial reads; EOF counts as failure) */
+bool read_full (int fd, void *buf, size_t len) {
+
+    uint8_t     *ptr = (uint8_t *) buf;
+    PhaseTimer  timer (SP_READ);
+
+    while (len) {
+        size_t  want = READ_LIMIT.slice (len);
+        ssize_t n = read (fd, ptr, want);
+        STATS.count (SC_READS);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_READ, n);
+        STATS.count (SC_SHORT_READS, (size_t) n < want);
+        READ_LIMIT.take (n);
+        ptr     += n;
+        len     -= n;
+    }
+
+    return true;
+}
+
+
+
+/* copies <len> bytes at <in_off> of <infd> to <outfd> (at *out_off, or its file position     *
+ * if out_off is NULL). copy_file_range lets the filesystem share extents where it can;       *
+ * sendfile covers the cases it refuses (pipes, cross-filesystem, older kernels).             */
+bool copy_range (int infd, uint64_t in_off, int outfd, uint64_t *out_off, uint64_t len) {
+
+    loff_t      in  = in_off;
+    ssize_t     copied;
+    PhaseTimer  timer (SP_WRITE);
+
+    while (len) {
+        copied = copy_file_range (infd, &in, outfd, (loff_t *) out_off, READ_LIMIT.slice (WRITE_LIMIT.slice (len)), 0);
+        STATS.count (SC_COPIES);
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        }
+        if (copied <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_READ, copied);
+        STATS.count (SC_BYTES_WRITTEN, copied);
+        READ_LIMIT.take (copied);
+        WRITE_LIMIT.take (copied);
+        len -= copied;
+    }
+
+    while (len) {
+        off_t off = in;
+        if (out_off != nullptr && lseek (outfd, *out_off, SEEK_SET) == -1) {
+            return false;
+        }
+        copied = sendfile (outfd, infd, &off, READ_LIMIT.slice (WRITE_LIMIT.slice (len)));
+        STATS.count (SC_COPIES);
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            return false;
+        }
+        STATS.count (SC_BYTES_READ, copied);
+        STATS.count (SC_BYTES_WRITTEN, copied);
+        READ_LIMIT.take (copied);
+        WRITE_LIMIT.take (copied);
+        in  += copied;
+        len -= copied;
+        if (out_off != nullptr) {
+            *out_off += copied;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,152 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : journal.cpp                                                       *
+ *                                                                              *
+ * Description: Module responsible for the extraction journal (--journal) that  *
+ *              lets an interrupted unpack continue (--resume) from its last    *
+ *              checkpoint instead of starting over.                            *
+ *              Declared as Journal class (in kavach.h).                        *
+ *                                                                              *
+ * Code Flow: <main> => <unpack> => <Journal::open>                             *
+ *                   => <extract> => <_extract> => <Journal::checkpoint>        *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <time.h>
+
+#include "kavach.h"
+
+
+
+Journal::Journal (): rec{0, 0, 0, 0, Cksum (Fhdr::cksum::FCK_UND), 0}, fd(-1), rootfd(-1), resuming(false), last{0, 0} { }
+
+
+
+Journal::~Journal () {
+
+    if (fd != -1) {
+        close (fd);
+    }
+}
+
+
+
+/****************************************************************************
+ * Opens the journal at <path> for the SFX identified by <identity>, whose  *
+ * entries are extracted below <rootfd>. Without <resume> a fresh journal   *
+ * is started; with it the existing one has to be intact and belong to the *
+ * same SFX, otherwise the half extracted tree can't be trusted.            *
+ ****************************************************************************/
+bool Journal::open (const std::string &path, int rootfd, uint64_t identity, bool resume) {
+
+    this->path      = path;
+    this->rootfd    = rootfd;
+
+    if (resume) {
+        struct stat sb;
+
+        /* killed before the first checkpoint made it to disk: nothing is known to be done */
+        fd = ::open (path.c_str(), O_RDWR|O_CREAT, 0600);
+        if (fd == -1 || fstat (fd, &sb) == -1) {
+            es = "while open'ing journal " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        if (sb.st_size == 0) {
+            rec.magic       = JOURNAL_MAGIC;
+            rec.identity    = identity;
+        }
+        else if ( pread_full (fd, &rec, sizeof (rec), 0) == false || rec.magic != JOURNAL_MAGIC ||
+                  rec.crc != seal () ) {
+            es = "corrupt journal: " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        if (rec.identity != identity) {
+            es = "journal " + path + " belongs to another SFX";
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        ds = "resuming at FHT entry " + std::to_string (rec.next) + " (+" + std::to_string (rec.done) + " bytes)";
+        debug_msg (LOG_INFO, ds);
+        resuming = true;
+    }
+    else {
+        fd = ::open (path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+        if (fd == -1) {
+            es = "while creating journal " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        rec.magic       = JOURNAL_MAGIC;
+        rec.identity    = identity;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &last);
+    return resuming || checkpoint (0, 0, nullptr, true);
+}
+
+
+
+/****************************************************************************
+ * Records that entries [0, next) and <done> bytes of entry <next> (whose   *
+ * running checksum is <state>) are extracted. Unless <force>d, this only   *
+ * happens once every JOURNAL_INTERVAL seconds: everything written so far   *
+ * is flushed first (syncfs), so the journal never claims more than what   *
+ * survives a crash.                                                        *
+ ****************************************************************************/
+bool Journal::checkpoint (uint64_t next, uint64_t done, const Cksum *state, bool force) {
+
+    struct timespec now;
+
+    if (fd == -1) {
+        return true;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &now);
+    if (!force && now.tv_sec - last.tv_sec < JOURNAL_INTERVAL) {
+        return true;
+    }
+    last = now;
+
+    if (syncfs (rootfd) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while flushing extracted files");
+        return false;
+    }
+
+    rec.next    = next;
+    rec.done    = done;
+    rec.state   = state ? *state : Cksum (Fhdr::cksum::FCK_UND);
+    rec.crc     = seal ();
+    if (pwrite_full (fd, &rec, sizeof (rec), 0) == false || fdatasync (fd) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing journal");
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/* the extraction completed: the journal has nothing left to say */
+void Journal::finish () {
+
+    if (fd != -1) {
+        close (fd);
+        fd = -1;
+        unlink (path.c_str());
+    }
+}
+
+
+
+/* XXH64 of the record up to (not including) its crc: catches torn writes */
+uint64_t Journal::seal () const {
+
+    Cksum hash (Fhdr::cksum::FCK_XXH64);
+
+    hash.update ((const uint8_t *) &rec, (const uint8_t *) &rec.crc - (const uint8_t *) &rec);
+    return hash.digest ();
+}
@@ -7,26 +7,13 @@
  *                                                                              * 
  ********************************************************************************/
 
-#include "kavach.h"
+#include "libkavach.h"
 
 uint8_t 		shdr_entry	__attribute__ ((section (SHDR_NAME)));
-int 			DESTROY_RELICS          = 0;
-int 			UNPACK_FLAG             = 0;
-int				PACK_FLAG               = 0;
-int 			KEY_FLAG                = 0;
-int 			OFNAME_FLAG             = 0;
-Fhdr::encrypt	ENCRYPTION_TYPE         = Fhdr::encrypt::FET_UND;
-uint64_t		KAVACH_BINARY_SIZE      = 0;
-uint64_t		ARCHIVE_SIZE            = 0;
-uint64_t		PAGE_SIZE               = 0;
-std::string 	es, ds;							
 
 
 /* function prototypes */
-bool 		get_kavach_binary_size 	(int kfd, uint64_t &KAVACH_BINARY_SIZE);
 bool 		validate_args			(std::string &password_key);
-static bool destroy_relics 			(std::string &path, std::stack<int> &dirfds);
-static void display_banner 			();
 
 
 
@@ -37,27 +24,28 @@ int main (int argc, char **argv) {
 	std::string 	kgs_name;
 	std::string 	out_filename;
 	int 			kfd = -1;
-	std::stack<int> dirfds;
 
 
-	display_banner ();
 	parse_cmdline_args (argc, argv, password_key, pack_target, out_filename);
 
+	/* --exec: the terminal (and stderr) belong to the archived tool */
+	if (!EXEC_FLAG && LOG_LEVEL > LOG_ERROR) {
+		display_banner ();
+	}
+
 	/* validate cmd line args */
 	if (validate_args (password_key) == false) {
 		log (__FILE__, __FUNCTION__, __LINE__, "while validating supplied cmd line args");
 		return 1;
 	};
 
-	/* set globally shared PAGE_SIZE data member */
-	PAGE_SIZE = sysconf (_SC_PAGESIZE);
-	if (PAGE_SIZE == -1) {
-		log (__FILE__, __FUNCTION__, __LINE__, "while getting _SC_PAGESIZE");
+	/* --idle-io: before any thread is started, so that all of them inherit it */
+	if (IDLE_IO_FLAG && set_idle_io () == false) {
 		return 1;
 	}
 
-	/* open kavach binary */
-	kfd = open (argv[0], O_RDONLY);
+	/* open kavach binary (not inherited by what --exec runs) */
+	kfd = open (argv[0], O_RDONLY|O_CLOEXEC);
 	if (kfd == -1) {
 		log (__FILE__, __FUNCTION__, __LINE__, "while open'ing kavach binary");
 		return 1;
@@ -70,46 +58,143 @@ int main (int argc, char **argv) {
 	}
 	
 
-		if ( PACK_FLAG | UNPACK_FLAG ) {	
+		if ( PACK_FLAG | UNPACK_FLAG | VERIFY_FLAG | CAT_FLAG | FROM_TAR_FLAG | TO_TAR_FLAG | MERGE_FLAG | DIFF_FLAG | APPLY_PATCH_FLAG | EXEC_FLAG | WATCH_FLAG ) {	
 			
 			if (PACK_FLAG) {
-				/* [pack.cpp]: pack target */
-				if ( pack (kfd, pack_target, password_key, out_filename) == false ) {
+				/* [archive.cpp]: pack target (a libkavach client like any other, with our settings) */
+				if ( ArchiveWriter (argv[0], password_key, Settings::capture ()).pack (pack_target, out_filename) == false ) {
 					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't pack the given target" );
 					exit (0xa);
 				}
 
 					/* destroy relics */
 					if (DESTROY_RELICS) {
-						/* recursively delete all <pack_target> content: yet to be implemented 
-						- nftw ()
-						- unlink()
-						- rmdir ()
-						*/
-							
-						debug_msg ("destroying relics.. damn those concealed intentions x_x");
-
-						dirfds.push (AT_FDCWD);
-						/* recursively unlink all directory entries */
-						if (destroy_relics (pack_target, dirfds) == false) {
+						debug_msg (LOG_INFO, "destroying relics.. damn those concealed intentions x_x");
+
+						/* [relics.cpp]: move <pack_target> out of sight, then tear it down in parallel */
+						if (destroy_relics (pack_target, RELICS_WAIT) == false) {
 							log (__FILE__, __FUNCTION__, __LINE__, "while destroying relics");
 							exit (0xa);
 						}
 					}
 
 				ds = "Packed files @ " + pack_target;
-				debug_msg (ds);
+				debug_msg (LOG_INFO, ds);
 			}
 
 			if (UNPACK_FLAG) {
-				/* [unpack.cpp]: extract target */
-				kgs_name = argv[0];
-				if ( unpack (kfd, kgs_name, password_key) == false ) {
-					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't unpack the given target" );
-					exit (0xb);
+				if (STDIN_FLAG) {
+					/* [archive.cpp]: extract an SFX piped into stdin, named after --output (if any) */
+					kgs_name = OFNAME_FLAG ? out_filename : "stdin";
+					if ( ArchiveReader::unpack_stream (STDIN_FILENO, kgs_name, password_key, Settings::capture ()) == false ) {
+						log ( __FILE__, __FUNCTION__, __LINE__, " couldn't unpack the SFX read from stdin" );
+						exit (0xb);
+					}
+				}
+				else {
+					/* [archive.cpp]: extract target */
+					kgs_name = argv[0];
+					if ( ArchiveReader (kgs_name, password_key, Settings::capture ()).unpack () == false ) {
+						log ( __FILE__, __FUNCTION__, __LINE__, " couldn't unpack the given target" );
+						exit (0xb);
+					}
 				}
 				ds = "Unpacked files @ " + kgs_name;
-				debug_msg (ds);
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (VERIFY_FLAG) {
+				/* [archive.cpp]: check payload checksums without extracting */
+				if ( ArchiveReader (argv[0], password_key, Settings::capture ()).verify () == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " archive failed verification" );
+					exit (0xc);
+				}
+			}
+
+			if (FROM_TAR_FLAG) {
+				/* [archive.cpp]: convert a tar stream (- => stdin) into an SFX */
+				int tarfd = (TAR_PATH == "-") ? STDIN_FILENO : open (TAR_PATH.c_str(), O_RDONLY);
+				if ( tarfd == -1 || ArchiveWriter (argv[0], password_key, Settings::capture ()).from_tar (tarfd, out_filename) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't convert the given tar stream" );
+					exit (0xe);
+				}
+				ds = "Converted tar stream @ " + TAR_PATH;
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (TO_TAR_FLAG) {
+				/* [archive.cpp]: stream contents of invoked SFX as a tar (- => stdout) */
+				int tarfd = (TAR_PATH == "-") ? STDOUT_FILENO : open (TAR_PATH.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0644);
+				if ( tarfd == -1 || ArchiveReader (argv[0], password_key, Settings::capture ()).to_tar (tarfd) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't write the tar stream" );
+					exit (0xf);
+				}
+			}
+
+			if (MERGE_FLAG) {
+				/* [archive.cpp]: merge the given SFXs into one, without touching any source file */
+				kgs_name = OFNAME_FLAG ? out_filename : "merged";
+				if ( ArchiveWriter (argv[0], password_key, Settings::capture ()).merge (MERGE_INPUTS, kgs_name) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't merge the given SFX binaries" );
+					exit (0x10);
+				}
+				ds = "Merged SFX binaries @ " + kgs_name;
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (DIFF_FLAG | APPLY_PATCH_FLAG) {
+				if (PATCH_INPUTS.size() != 2) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " --diff|--apply-patch take exactly two SFX|patch files" );
+					exit (0x11);
+				}
+			}
+
+			if (DIFF_FLAG) {
+				/* [archive.cpp]: write the patch turning one SFX into another */
+				kgs_name = OFNAME_FLAG ? out_filename : "patch";
+				if ( ArchiveReader (PATCH_INPUTS[0], password_key, Settings::capture ()).diff (PATCH_INPUTS[1], kgs_name) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't diff the given SFX binaries" );
+					exit (0x11);
+				}
+				/* diff () leaves the real file name (with PATCH_EXTENSION) in kgs_name */
+				ds = (kgs_name == "-") ? "Patch written to stdout" : "Patch written @ " + kgs_name;
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (APPLY_PATCH_FLAG) {
+				/* [archive.cpp]: rebuild the new SFX from the old one and a patch */
+				kgs_name = OFNAME_FLAG ? out_filename : "patched";
+				if ( ArchiveReader (PATCH_INPUTS[0], password_key, Settings::capture ()).apply_patch (PATCH_INPUTS[1], kgs_name) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't apply the given patch" );
+					exit (0x11);
+				}
+				ds = "Patched SFX binary @ " + kgs_name;
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (WATCH_FLAG) {
+				/* [archive.cpp]: keep <out_filename>.kgs in sync with <pack_target> until interrupted */
+				if ( ArchiveWriter (argv[0], password_key, Settings::capture ()).watch (pack_target, out_filename) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't watch the given target" );
+					exit (0x13);
+				}
+				ds = "Stopped watching " + pack_target;
+				debug_msg (LOG_INFO, ds);
+			}
+
+			if (EXEC_FLAG) {
+				/* [archive.cpp]: replace this process with an archived executable, run from memory */
+				ArchiveReader (argv[0], password_key, Settings::capture ()).exec (EXEC_TARGET, EXEC_ARGS);
+				log ( __FILE__, __FUNCTION__, __LINE__, " couldn't execute the given archived file" );
+				exit (0x12);
+			}
+
+			if (CAT_FLAG) {
+				/* [archive.cpp]: stream (a byte range of) one archived file to stdout */
+				if ( ArchiveReader (argv[0], password_key, Settings::capture ()).cat (CAT_TARGET, STDOUT_FILENO, RANGE_OFFSET, RANGE_LENGTH) == false ) {
+					log ( __FILE__, __FUNCTION__, __LINE__, " couldn't cat the given archived file" );
+					exit (0xd);
+				}
 			}
 		}
 
@@ -125,147 +210,67 @@ int main (int argc, char **argv) {
 }
 
 
-/**************************************************************************** 
- * computes the size of ELF binary by using the below method rather than    *
- * using fstat () to get file attributes -                                  *
- *                                                                          *
- * 		filesize = sht_offset + (num_entries_in_sht * size_of_each_entry)   *
- *                                                                          *
- * NOTE: The reason I don't use fstat () is because it will include the     *
- * 		 size of our overall binary (including the archived payload) which  *
- * 		 would impact the portability for packing.                          *
- *                                                                          *
- * In short, this method ensures that -                                     *
- * 		"Even an archived SFX can archive new files!"                       *
- *                                                                          *
- ****************************************************************************/
-bool get_kavach_binary_size (int kfd, uint64_t &KAVACH_BINARY_SIZE) {
+/* function to validate user supplied arguments supplied */
+bool validate_args (std::string &password_key) {
 	
-	Elf64_Ehdr ehdr;
-
-	if (read (kfd, &ehdr, sizeof (Elf64_Ehdr)) != sizeof (Elf64_Ehdr)) {
-		log (__FILE__, __FUNCTION__, __LINE__, "couldn't read elf header");
+	/* --destroy-relics deletes pack_target recursively, which would be the path list itself */
+	if (FILES_FROM_FLAG && DESTROY_RELICS) {
+		log (__FILE__, __FUNCTION__, __LINE__, "--destroy-relics can't be combined with --files-from");
 		return false;
 	}
 
-	KAVACH_BINARY_SIZE = ehdr.e_shoff + (ehdr.e_shnum * ehdr.e_shentsize);
-
-	/* set the file pointer back to the beginning of the file */
-	if (lseek (kfd, 0, SEEK_SET) != 0) {
-		log (__FILE__, __FUNCTION__, __LINE__, "couldn't set the kavach file position back to the beginning");
+	/* volumes are laid out by --pack only */
+	if (VOLUME_SIZE && (FROM_TAR_FLAG | MERGE_FLAG | APPLY_PATCH_FLAG)) {
+		log (__FILE__, __FUNCTION__, __LINE__, "--volume-size only goes with --pack");
 		return false;
 	}
 
-	return true;	
-}
-
+	/* --watch owns its SFX: it needs a name, and packs nothing else */
+	if (WATCH_FLAG && !OFNAME_FLAG) {
+		log (__FILE__, __FUNCTION__, __LINE__, "--watch needs an --output <name> to keep in sync");
+		return false;
+	}
+	if (WATCH_FLAG && (PACK_FLAG | FILES_FROM_FLAG | DESTROY_RELICS | VOLUME_SIZE)) {
+		log (__FILE__, __FUNCTION__, __LINE__, "--watch can't be combined with --pack, --files-from, --destroy-relics or --volume-size");
+		return false;
+	}
 
-/* function to validate user supplied arguments supplied */
-bool validate_args (std::string &password_key) {
-	
 	/* validate Encryption type and password key supplied */
 	if (ENCRYPTION_TYPE == Fhdr::encrypt::FET_UND) {
 		if (KEY_FLAG) {
-			debug_msg ("launched in ARCHIVE ONLY mode, ignoring key...");
+			debug_msg (LOG_DEBUG, "launched in ARCHIVE ONLY mode, ignoring key...");
 			return true;
 		}
 			
 		else {
-			debug_msg ("launched in ARCHIVE ONLY mode...");
+			debug_msg (LOG_DEBUG, "launched in ARCHIVE ONLY mode...");
 			return true;
 		}
 	}
+	else if (!KEY_FLAG && ((FROM_TAR_FLAG && TAR_PATH == "-") || (FILES_FROM_FLAG && FILES_FROM == "-"))) {
+		/* stdin may carry the tar stream / path list, there's nobody to ask */
+		log (__FILE__, __FUNCTION__, __LINE__, "--key is required to encrypt a tar stream or path list read from stdin");
+		return false;
+	}
 	else if (!KEY_FLAG) {
 		/* get secret key interactively if --key flag not set */
+		log_flush ();
 		while (password_key.length() == 0) {
 			fprintf (stderr, "[-] Please provide the secret key: ");
 			getline (std::cin, password_key);
 		}
 	}
 	else {
-		debug_msg ("launched in ENCRYPT mode...");
+		debug_msg (LOG_DEBUG, "launched in ENCRYPT mode...");
 	}
 
 	return true;
 }
 
 
-/* performs the unlinkat () syscall (with AT_REMOVEDIR flag) */
-bool destroy_relics (std::string &pathname, std::stack<int> &dfds) {
-
-	struct stat sb;
-	int fd = -1;
-	DIR *dptr;
-	struct dirent *dentry;
-	std::string dentry_name;
-	bool status = false;
-
-
-	/* open up filename */
-	fd = openat (dfds.top(), pathname.c_str(), O_RDONLY);
-	if (fd == -1) {
-		es = "while opening " + pathname + ": " + std::to_string(dfds.top());
-		log (__FILE__, __FUNCTION__, __LINE__, es);
-		return false;
-	}
-
-	if (fstat (fd, &sb) == -1) {
-		log (__FILE__, __FUNCTION__, __LINE__, "while stat'ing target");
-		return false;
-	}
-
-	if (S_ISREG (sb.st_mode)) {
-		if (unlinkat(dfds.top(), pathname.c_str(), 0) == -1) {
-			es = "while unlinkat'ing file: " + pathname;
-			log (__FILE__, __FUNCTION__, __LINE__, es);
-			return false;
-		}
-	}
-
-	if (S_ISDIR (sb.st_mode)) {
-		/* open up directory to read directory entries */
-		dfds.push (fd);
-		
-		/* open directory */
-		if ((dptr = fdopendir (fd)) == NULL) {
-			es = "error opening up directory: " + pathname;
-			log (__FILE__, __FUNCTION__, __LINE__, es);
-			return false;
-		}
-
-		/* read directory entries */
-		errno = 0;
-		while ( (dentry = readdir (dptr)) != NULL) { 
-			dentry_name = dentry->d_name;
-			if (dentry_name != "." && dentry_name != "..") {					
-					/* if any error occured while reading directory entries */
-					if (errno != 0 && errno != EBADF) {
-						es = "while reading directory entries for: " + dentry_name;
-						log (__FILE__, __FUNCTION__, __LINE__, es);
-						errno = 0;
-					}
-				status = destroy_relics ( dentry_name, dfds);
-			}
-		}
-		
-		dfds.pop ();
-
-
-		/* close and unlink the directory itself */
-		closedir (dptr);
-		if (unlinkat (dfds.top(), pathname.c_str(), AT_REMOVEDIR) == -1) {
-			es = "while unlinkat'ing directory: " +  pathname;
-			log (__FILE__, __FUNCTION__, __LINE__, es);
-			return false;
-		}
-	}
-	
-	close (fd);
-	return status;
-}
-
-
+/* shown once: either up front or along with the usage */
 void display_banner () {
+	static bool shown = false;
 	const char banner[] = BOLDRED                                                      
 			"                @@@  @@@    @@@@@@    @@@  @@@    @@@@@@     @@@@@@@   @@@  @@@  \n"
 			"                @@@  @@@   @@@@@@@@   @@@  @@@   @@@@@@@@   @@@@@@@@   @@@  @@@  \n"
@@ -280,6 +285,15 @@ void display_banner () {
 			"                                                                                 \n"
 			"                                                                                 \n" RESET;
 
-	system ("clear");
+	/* it's all escape codes: only for a terminal */
+	if (shown || !isatty (STDERR_FILENO)) {
+		return;
+	}
+	shown = true;
+
+	/* don't scribble escape codes into piped output (--cat) */
+	if (isatty (STDOUT_FILENO)) {
+		system ("clear");
+	}
 	fprintf (stderr, "\n\n\n\n%s\n", banner);
 }
\ No newline at end of file
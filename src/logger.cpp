@@ -0,0 +1,286 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : logger.cpp                                                        *
+ *                                                                              *
+ * Description: Module responsible for everything kavach has to say on stderr.  *
+ *              Messages let through by --quiet|-v|-vv (see debug_msg () in     *
+ *              kavach.h) are pushed onto a lock-free ring, and a writer        *
+ *              thread hands them to stderr in batches, so that packing a       *
+ *              million files doesn't wait on a million write (2)s.             *
+ *                                                                              *
+ * Code Flow: <debug_msg> | <log> => <log_msg> => <Logger::push>                *
+ *            <Logger::run> (writer thread) => <write_out>                      *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+#define LOG_BATCH       0x10000     /* bytes gathered into a single write (2)   */
+
+
+/* a message on its way to stderr */
+struct LogLine {
+    int                 level;
+    std::string         text;
+};
+
+
+/************************************************************************
+ * Logger:                                                              *
+ *      The ring and its writer thread, both started by the first       *
+ *      message. Producers never take a lock: they push onto the MPMC   *
+ *      ring, and only make a syscall when the writer sleeps on its     *
+ *      eventfd. queued|written tell flush () when stderr caught up.    *
+ ************************************************************************/
+class Logger {
+public:
+    Logger ();
+    ~Logger ();
+
+    void                push        (LogLine *line);
+    void                flush       ();
+
+private:
+    void                run         ();
+    void                wake        ();
+
+    PIPELINE::MpmcRing<LogLine *>   ring;
+    std::atomic<uint64_t>           queued;     /* pushed onto the ring         */
+    std::atomic<uint64_t>           written;    /* handed to write (2)          */
+    std::atomic<bool>               asleep;     /* writer blocked on <efd>      */
+    std::atomic<bool>               stopping;
+    int                             efd;
+    std::thread                     writer;
+};
+
+
+/* function prototypes */
+static Logger           *logger         ();
+static void             format          (std::string &out, const LogLine &line);
+static void             write_out       (std::string &out);
+
+
+static bool             colour = isatty (STDERR_FILENO);   /* escape codes are for terminals only  */
+static bool             forked = false;                     /* fork (2)ed child: no writer thread   */
+static std::atomic<bool> started (false);                   /* the first message came by            */
+static std::atomic<bool> closed (false);                    /* exit () tore the logger down already */
+
+
+
+Logger::Logger (): ring(LOG_RING_SIZE), queued(0), written(0), asleep(false), stopping(false) {
+
+    efd = eventfd (0, EFD_CLOEXEC);
+    pthread_atfork (NULL, NULL, [] () { forked = true; });
+    writer = std::thread (&Logger::run, this);
+    started = true;
+}
+
+
+
+/* exit (): whatever is still queued makes it out before the process goes */
+Logger::~Logger () {
+
+    stopping = true;
+    wake ();
+    writer.join ();
+    closed = true;
+    if (efd != -1) {
+        close (efd);
+    }
+}
+
+
+
+/* queues <line> (owned by the writer from now on). A full ring means stderr can't keep up: wait for it */
+void Logger::push (LogLine *line) {
+
+    while (ring.push (line) == false) {
+        wake ();
+        std::this_thread::yield ();
+    }
+    ++queued;
+    if (asleep.exchange (false)) {
+        wake ();
+    }
+}
+
+
+
+/* returns once every message queued so far is written out (before fexecve (2), prompts ...) */
+void Logger::flush () {
+
+    uint64_t target = queued;
+
+    while (written < target) {
+        wake ();
+        std::this_thread::sleep_for (std::chrono::microseconds (100));
+    }
+}
+
+
+
+void Logger::wake () {
+
+    uint64_t one = 1;
+
+    if (efd != -1 && write (efd, &one, sizeof (one)) == -1) {
+        /* the counter is saturated: the writer is awake anyway */
+    }
+}
+
+
+
+/****************************************************************************
+ * Writer thread: drains the ring into one buffer, written out whenever    *
+ * the ring runs dry (or the buffer is LOG_BATCH full). Going to sleep is  *
+ * announced in <asleep> before the last look at <queued>, so a producer   *
+ * either sees the flag (and wakes us) or its message is seen here.        *
+ ****************************************************************************/
+void Logger::run () {
+
+    LogLine     *line;
+    std::string out;
+    uint64_t    popped = 0;
+    uint64_t    count;
+    sigset_t    all;
+
+    /* signals are for the threads doing the work (--watch polls for SIGINT) */
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        while (ring.pop (line)) {
+            format (out, *line);
+            delete line;
+            ++popped;
+            if (out.size() >= LOG_BATCH) {
+                write_out (out);
+                written = popped;
+            }
+        }
+        write_out (out);
+        written = popped;
+
+        if (queued != popped) {
+            std::this_thread::yield ();         /* a push is half way through */
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+
+        asleep = true;
+        if (queued != popped || stopping) {
+            asleep = false;
+            continue;
+        }
+        if (efd == -1) {
+            std::this_thread::sleep_for (std::chrono::milliseconds (1));
+        }
+        else {
+            while (read (efd, &count, sizeof (count)) == -1 && errno == EINTR);
+        }
+        asleep = false;
+    }
+}
+
+
+
+/* the logger, started by the first message (none in a fork (2)ed child or after exit () began) */
+static Logger *logger () {
+
+    static Logger instance;
+
+    return &instance;
+}
+
+
+
+/* hands <msg> to the writer thread. Use debug_msg (), which doesn't even build <msg> when <level> is off */
+void log_msg (int level, std::string msg) {
+
+    int         saved = errno;
+    LogLine     *line = new LogLine {level, std::move (msg)};
+    std::string out;
+
+    if (forked || closed) {
+        format (out, *line);
+        write_out (out);
+        delete line;
+    }
+    else {
+        logger ()->push (line);
+    }
+    errno = saved;
+}
+
+
+
+/* perror () information to debug: where it went wrong, what the caller was doing and errno */
+void log (const std::string &source, const std::string &function, int line_no, const std::string &error_string) {
+
+    const char  *reason = strerror (errno);
+
+    if (colour) {
+        log_msg (LOG_ERROR, "(" BOLDBLUE + source + RESET ", " YELLOW + function + RESET ", " CYAN + std::to_string (line_no) +
+                            RESET ") => " + error_string + ": " + reason);
+    }
+    else {
+        log_msg (LOG_ERROR, "(" + source + ", " + function + ", " + std::to_string (line_no) + ") => " + error_string + ": " + reason);
+    }
+}
+
+
+
+/* waits for stderr to catch up with the messages queued so far */
+void log_flush () {
+
+    if (started && !forked && !closed) {
+        logger ()->flush ();
+    }
+}
+
+
+
+/* one line per message: " [-] " for errors, " [+] " for the rest */
+static void format (std::string &out, const LogLine &line) {
+
+    if (line.level == LOG_ERROR) {
+        out += colour ? " " BOLDRED "[-] " RESET : " [-] ";
+        out += line.text;
+    }
+    else {
+        out += colour ? " " BOLDGREEN "[+] " MAGENTA : " [+] ";
+        out += line.text;
+        out += colour ? RESET : "";
+    }
+    out += '\n';
+}
+
+
+
+/* stderr isn't payload: no --max-write-bps here. Nothing sensible is left to do if it's gone */
+static void write_out (std::string &out) {
+
+    size_t      done = 0;
+    ssize_t     n;
+
+    while (done < out.size()) {
+        n = write (STDERR_FILENO, out.data() + done, out.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    out.clear ();
+}
@@ -0,0 +1,399 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : merge.cpp                                                         *
+ *                                                                              *
+ * Description: Module responsible for merging the KBFs of several SFX          *
+ *              binaries into a single new SFX. Every input becomes a top-      *
+ *              level directory (named after it) of the merged FHT; payload     *
+ *              regions are copied across as they are (copy_file_range, so     *
+ *              filesystems that can reflink do) without reading source files.  *
+ *                                                                              *
+ * Code Flow: <main> => <merge>                                                 *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <set>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+/* an SFX being merged */
+struct MergeInput {
+    int                 fd;
+    uint8_t             *map;
+    uint64_t            map_size;
+    uint8_t             *kbf;           /* map + remainder                   */
+    uint64_t            kbf_off;        /* file offset of kbf                */
+    Kbhdr               *header;
+    bool                transcode;      /* some body needs re-encrypting     */
+};
+
+
+/* function prototypes */
+static bool     add_input           (MergeInput &in, const std::string &path, const std::string &top_name, Kavach &ko, uint64_t payload_base, std::string &key);
+static bool     check_key           (MergeInput &in, const std::string &path, std::string &key);
+static bool     copy_payload        (MergeInput &in, Kavach &ko, uint64_t fht_base, uint64_t payload_base, int outfd, uint64_t out_off, std::string &key, uint8_t *block);
+template <Fhdr::encrypt EI, Fhdr::encrypt EO>
+static bool     transcode_body      (const uint8_t *body, uint64_t size, std::string &key, int outfd, uint64_t out_off, uint8_t *block);
+static bool     transcode           (const uint8_t *body, Fhdr &fhdr, std::string &key, int outfd, uint64_t out_off, uint8_t *block);
+
+
+
+/****************************************************************************
+ * Merges the SFXs named in <inputs> into '<of_name>.FILE_EXTENSION'. Each  *
+ * one's FHT is nested under a new FT_DIR entry (its name without .kgs),    *
+ * fh_offset/fh_chunkndx/FT_LINK targets are rebased and the names are     *
+ * re-interned into a single nametab. Payloads are copied verbatim, unless  *
+ * --encrypt asked for a different encryption than a body was stored with.  *
+ ****************************************************************************/
+bool merge (int kfd, std::vector<std::string> &inputs, std::string &key, std::string &of_name) {
+
+    Kavach                      ko;
+    std::vector<MergeInput>     in (inputs.size());
+    std::vector<uint64_t>       fht_base (inputs.size());
+    std::vector<uint64_t>       payload_base (inputs.size());
+    std::set<std::string>       top_names;
+    std::string                 top_name;
+    struct stat                 ksb;
+    uint64_t                    signature = PACK_SIGNATURE;
+    uint64_t                    payload_pos = 0;
+    int                         outfd;
+    bool                        status = true;
+    std::unique_ptr<uint8_t[]>  stub (new uint8_t[KAVACH_BINARY_SIZE]);
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    /* collect every input's FHT, chunk table and names */
+    for (size_t n = 0; n < inputs.size(); ++n) {
+
+        /* the top-level directory: named after the SFX (less its extension) */
+        top_name = inputs[n].substr (inputs[n].find_last_of ('/') + 1);
+        if ( top_name.size() > strlen (FILE_EXTENSION) &&
+             top_name.compare (top_name.size() - strlen (FILE_EXTENSION), std::string::npos, FILE_EXTENSION) == 0 ) {
+            top_name.resize (top_name.size() - strlen (FILE_EXTENSION));
+        }
+        if (top_names.insert (top_name).second == false) {
+            es = "two SFXs to merge would both become top-level directory: " + top_name;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        fht_base[n]     = ko.fht.size() + 1;            /* after its top-level directory entry */
+        payload_base[n] = payload_pos;
+        if (add_input (in[n], inputs[n], top_name, ko, payload_pos, key) == false) {
+            es = "while reading SFX to merge: " + inputs[n];
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        payload_pos += in[n].header->k_payloadsz;
+    }
+
+    if (ko.nametab.finalize (NAMETAB_ENCODING, ko.fht) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while encoding nametab");
+        return false;
+    }
+    ko.header.k_nametabenc  = NAMETAB_ENCODING;
+    ko.header.k_payloadsz   = payload_pos;
+    layout_stream (ko);
+    ARCHIVE_SIZE = ko.header.k_payloadoff + ko.header.k_payloadsz;
+
+    /* signed stub with .kavach shdr accounting for the merged KBF */
+    of_name += FILE_EXTENSION;
+    if (fstat (kfd, &ksb) == -1 || pread_full (kfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading kavach binary");
+        return false;
+    }
+    memcpy (&stub[0x8], &signature, 0x8);
+    patch_sfx_metadata (-1, stub.get(), ko);
+
+    outfd = open (of_name.c_str(), O_RDWR|O_CREAT|O_EXCL, ksb.st_mode);
+    if (outfd == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating SFX binary");
+        return false;
+    }
+
+    /* payload regions, one input after the other (re-encrypting bodies updates their Fhdr) */
+    for (size_t n = 0; status && n < in.size(); ++n) {
+        status = copy_payload (in[n], ko, fht_base[n], payload_base[n], outfd,
+                               KAVACH_BINARY_SIZE + ko.header.k_payloadoff + payload_base[n], key, block.get());
+        if (status == false) {
+            es = "while copying payload of " + inputs[n];
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+        }
+    }
+
+    if ( status && (
+         pwrite_full (outfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false ||
+         pwrite_full (outfd, &ko.header, sizeof (Kbhdr), KAVACH_BINARY_SIZE) == false ||
+         pwrite_full (outfd, ko.fht.data(), ko.header.k_fhnum * sizeof (Fhdr), KAVACH_BINARY_SIZE + ko.header.k_fhtoff) == false ||
+         pwrite_full (outfd, ko.chunktab.data(), ko.header.k_chunknum * sizeof (Kchunk), KAVACH_BINARY_SIZE + ko.header.k_chunktaboff) == false ||
+         pwrite_full (outfd, ko.nametab.bytes.data(), ko.header.k_nametabsz, KAVACH_BINARY_SIZE + ko.header.k_nametaboff) == false )) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing kavach tables to SFX binary");
+        status = false;
+    }
+
+    for (auto &input: in) {
+        munmap (input.map, input.map_size);
+        close (input.fd);
+    }
+    close (outfd);
+
+    if (status == false) {
+        unlink (of_name.c_str());
+    }
+    return status;
+}
+
+
+
+/* maps the SFX at <path> and appends its FHT (under a new top-level directory), chunk table *
+ * and names to <ko>, rebasing payload offsets by <payload_base>. An encrypted SFX has to    *
+ * open with <key>, the one key the merged SFX is unpacked with.                             */
+static bool add_input (MergeInput &in, const std::string &path, const std::string &top_name, Kavach &ko, uint64_t payload_base, std::string &key) {
+
+    uint64_t            remainder;
+    uint64_t            fht_base;
+    uint64_t            chunk_base = ko.chunktab.size();
+    struct stat         sb;
+    std::string         name;
+    Fhdr                top;
+
+
+    in.fd = open (path.c_str(), O_RDONLY);
+    if (in.fd == -1 || fstat (in.fd, &sb) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while open'ing SFX binary");
+        return false;
+    }
+    if (map_kbf (in.fd, in.map, in.map_size, remainder, in.header, false) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
+        close (in.fd);
+        return false;
+    }
+    /* bodies are copied by file offset, a multi-volume SFX has none in its own file */
+    if (in.header->k_flags & Kbhdr::flags::KBF_VOLUMES) {
+        es = path + " is a multi-volume SFX, unpack and repack it to merge it";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    in.kbf          = in.map + remainder;
+    in.kbf_off      = sb.st_size - in.map_size + remainder;
+    in.transcode    = false;
+
+    Kbhdr           *header  = in.header;
+    Fhdr            *fht     = (Fhdr *)   &in.kbf[header->k_fhtoff];
+    Kchunk          *chunks  = (Kchunk *) &in.kbf[header->k_chunktaboff];
+    NametabReader   nametab  ((uint8_t *) &in.kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+
+    if (header->k_fhentsize != sizeof (Fhdr) || header->k_chunksz != KBF_CHUNK_SIZE) {
+        log (__FILE__, __FUNCTION__, __LINE__, "SFX uses a different FHT entry or chunk size");
+        return false;
+    }
+
+    /* the SFX becomes a directory, stamped with the SFX's own times */
+    top.fh_ftype    = Fhdr::FT_DIR;
+    top.fh_mode     = S_IFDIR | 0755;
+    top.fh_namendx  = ko.nametab.intern (top_name);
+    memmove (&top.fh_time[0], &sb.st_atim, sizeof (struct timespec));
+    memmove (&top.fh_time[1], &sb.st_mtim, sizeof (struct timespec));
+    ko.fht.push_back (top);
+    fht_base = ko.fht.size();
+
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        Fhdr fhdr = fht[i];
+
+        if (!fhdr.is_dir_end ()) {
+            if (nametab.name (fhdr.fh_namendx, name) == false) {
+                log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+                return false;
+            }
+            fhdr.fh_namendx = ko.nametab.intern (name);
+        }
+
+        if (fhdr.fh_ftype == Fhdr::ftype::FT_FILE) {
+            if (body_in_bounds (header, fhdr, in.map_size - remainder) == false) {
+                log (__FILE__, __FUNCTION__, __LINE__, "file body out of payload bounds");
+                return false;
+            }
+            if (ENCRYPT_FLAG && fhdr.fh_etype != ENCRYPTION_TYPE) {
+                in.transcode = true;
+            }
+            fhdr.fh_offset   += payload_base;
+            fhdr.fh_chunkndx += chunk_base;
+        }
+        else if (fhdr.fh_ftype == Fhdr::ftype::FT_LINK) {
+            fhdr.fh_offset   += fht_base;
+        }
+        ko.fht.push_back (fhdr);
+    }
+    ko.fht.push_back (Fhdr ());                 /* end of the top-level directory */
+
+    for (uint64_t c = 0; c < header->k_chunknum; ++c) {
+        ko.chunktab.push_back (chunks[c]);
+        ko.chunktab.back().c_offset += payload_base;
+    }
+
+    return check_key (in, path, key);
+}
+
+
+
+/****************************************************************************
+ * Bodies are copied (or re-encrypted) with the one --key, so an encrypted  *
+ * input packed with another key would leave a merged SFX no single key    *
+ * opens. The first chunk of its first encrypted body, decrypted with      *
+ * <key>, has to match its CRC32C. XOR bodies can't be re-keyed here.      *
+ ****************************************************************************/
+static bool check_key (MergeInput &in, const std::string &path, std::string &key) {
+
+    Kbhdr           *header  = in.header;
+    Fhdr            *fht     = (Fhdr *)   &in.kbf[header->k_fhtoff];
+    Kchunk          *chunks  = (Kchunk *) &in.kbf[header->k_chunktaboff];
+    const uint8_t   *payload = &in.kbf[header->k_payloadoff];
+
+
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        Fhdr    &fhdr = fht[i];
+        Cksum   ck (Fhdr::cksum::FCK_CRC32C);
+
+        if (fhdr.fh_ftype != Fhdr::ftype::FT_FILE || fhdr.fh_etype == Fhdr::encrypt::FET_UND || fhdr.fh_size == 0) {
+            continue;
+        }
+
+        if (key.empty()) {
+            es = path + " is encrypted, merging it needs its --key";
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        if (fhdr.fh_chunkndx >= header->k_chunknum) {
+            log (__FILE__, __FUNCTION__, __LINE__, "chunk index out of chunk table bounds");
+            return false;
+        }
+        Kchunk &chunk = chunks[fhdr.fh_chunkndx];
+        if ( chunk.c_size > header->k_chunksz || chunk.c_offset < fhdr.fh_offset ||
+             chunk.c_offset + chunk.c_size > fhdr.fh_offset + fhdr.fh_size ) {
+            log (__FILE__, __FUNCTION__, __LINE__, "chunk table entry out of bounds");
+            return false;
+        }
+
+        std::unique_ptr<uint8_t[]> scratch (new uint8_t[chunk.c_size]);
+        memcpy (scratch.get(), &payload[chunk.c_offset], chunk.c_size);
+
+        switch (fhdr.fh_etype) {
+            case Fhdr::encrypt::FET_XOR:
+                        PIPELINE::make_decoder<Fhdr::encrypt::FET_XOR, PIPELINE::codec::NONE> (key).run (scratch.get(), chunk.c_size, 0);
+                        break;
+            default:
+                        log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
+                        return false;
+        }
+
+        ck.update (scratch.get(), chunk.c_size);
+        if ((uint32_t) ck.digest () != chunk.c_crc) {
+            es = path + " was packed with another key than --key, unpack and repack it to merge it";
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        return true;                            /* one body tells the key */
+    }
+
+    return true;
+}
+
+
+
+/* copies the payload region of <in> to <outfd> at <out_off>. Without anything to        *
+ * re-encrypt it is a single copy_range; otherwise bodies are walked one by one and those *
+ * stored with another encryption are decrypted and re-encrypted on the way.              */
+static bool copy_payload (MergeInput &in, Kavach &ko, uint64_t fht_base, uint64_t payload_base, int outfd, uint64_t out_off, std::string &key, uint8_t *block) {
+
+    const uint8_t   *payload = &in.kbf[in.header->k_payloadoff];
+    uint64_t        in_off   = in.kbf_off + in.header->k_payloadoff;
+    uint64_t        dst;
+
+
+    if (in.transcode == false) {
+        dst = out_off;
+        return copy_range (in.fd, in_off, outfd, &dst, in.header->k_payloadsz);
+    }
+
+    for (uint64_t i = fht_base; i < fht_base + in.header->k_fhnum; ++i) {
+        Fhdr        &fhdr = ko.fht[i];
+        uint64_t    body  = fhdr.fh_offset - payload_base;      /* offset into the input's payload */
+
+        if (fhdr.fh_ftype != Fhdr::ftype::FT_FILE) {
+            continue;
+        }
+
+        if (fhdr.fh_etype == ENCRYPTION_TYPE) {
+            dst = out_off + body;
+            if (copy_range (in.fd, in_off + body, outfd, &dst, fhdr.fh_size) == false) {
+                return false;
+            }
+            continue;
+        }
+
+        if (key.empty()) {
+            log (__FILE__, __FUNCTION__, __LINE__, "re-encrypting a body needs --key");
+            return false;
+        }
+        if (transcode (payload + body, fhdr, key, outfd, out_off + body, block) == false) {
+            return false;
+        }
+
+        /* checksums and chunk CRCs cover the plain bytes, so only the etype changes */
+        fhdr.fh_etype = ENCRYPTION_TYPE;
+    }
+
+    return true;
+}
+
+
+
+/* dispatches on (stored, wanted) encryption of the body of <fhdr> */
+static bool transcode (const uint8_t *body, Fhdr &fhdr, std::string &key, int outfd, uint64_t out_off, uint8_t *block) {
+
+    switch (fhdr.fh_etype) {
+        case Fhdr::encrypt::FET_UND:
+                    if (ENCRYPTION_TYPE == Fhdr::encrypt::FET_XOR) {
+                        return transcode_body<Fhdr::encrypt::FET_UND, Fhdr::encrypt::FET_XOR> (body, fhdr.fh_size, key, outfd, out_off, block);
+                    }
+                    break;
+        case Fhdr::encrypt::FET_XOR:
+                    if (ENCRYPTION_TYPE == Fhdr::encrypt::FET_UND) {
+                        return transcode_body<Fhdr::encrypt::FET_XOR, Fhdr::encrypt::FET_UND> (body, fhdr.fh_size, key, outfd, out_off, block);
+                    }
+                    break;
+        default:
+                    break;
+    }
+
+    log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
+    return false;
+}
+
+
+
+/* decrypts a body stored with <EI> and re-encrypts it with <EO>, a block at a time */
+template <Fhdr::encrypt EI, Fhdr::encrypt EO>
+static bool transcode_body (const uint8_t *body, uint64_t size, std::string &key, int outfd, uint64_t out_off, uint8_t *block) {
+
+    auto decoder = PIPELINE::make_decoder<EI, PIPELINE::codec::NONE> (key);
+    auto encoder = PIPELINE::make_encoder<EO, PIPELINE::codec::NONE> (key);
+
+    for (uint64_t off = 0; off < size; off += PIPELINE_BLOCK_SIZE) {
+        size_t len = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, size - off);
+
+        memcpy (block, body + off, len);
+        decoder.run (block, len, off);
+        encoder.run (block, len, off);
+        if (pwrite_full (outfd, block, len, out_off + off) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while writing re-encrypted body");
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,314 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : nametab.cpp                                                       *
+ *                                                                              *
+ * Description: Module responsible for building (pack) and resolving (unpack)   *
+ *              the names table in either of its encodings.                     *
+ *              Declared as Nametab & NametabReader classes (in kavach.h).      *
+ *                                                                              *
+ * Code Flow: <main> => <pack> => <load_kavach_object> => <finalize>            *
+ *            <main> => <unpack> => <extract> => <NametabReader::name>          *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <algorithm>
+
+#include "kavach.h"
+
+
+/* function prototypes */
+static void     put_uleb128     (std::vector<char> &out, uint64_t value);
+static bool     get_uleb128     (const uint8_t *&ptr, const uint8_t *end, uint64_t &value);
+static bool     get_cstring     (const uint8_t *&ptr, const uint8_t *end, std::string_view &out);
+
+
+
+/* Interns <name>, copying it into the arena the first time it is seen.  *
+ * Returns the provisional id of name (rewritten later by finalize ())   */
+uint64_t Nametab::intern (std::string_view name) {
+
+    auto it = ids.find (name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+
+    /* grab a fresh arena chunk when the current one can't hold name */
+    if (name.size() > arena_left) {
+        size_t chunk_size = std::max ((size_t) NAMETAB_ARENA_SIZE, name.size());
+        arena.emplace_back (new char[chunk_size]);
+        arena_cur   = arena.back().get();
+        arena_left  = chunk_size;
+    }
+
+    memcpy (arena_cur, name.data(), name.size());
+    std::string_view interned (arena_cur, name.size());
+    arena_cur   += name.size();
+    arena_left  -= name.size();
+
+    uint64_t id = names.size();
+    names.push_back (interned);
+    ids.emplace (interned, id);
+    return id;
+}
+
+
+
+/* Encodes all interned names into <bytes> and rewrites fh_namendx of every *
+ * non-NULL entry in <fht> from provisional id to its final index.          *
+ * Sorting the distinct names keeps this O(n log n) overall.                */
+bool Nametab::finalize (Kbhdr::nametab_enc enc, std::vector<Fhdr> &fht) {
+
+    std::vector<uint64_t> final_ndx (names.size());
+
+    bytes.clear ();
+
+    switch (enc) {
+
+        case Kbhdr::nametab_enc::KNT_RAW:
+                    /* NUL terminated names, fh_namendx is the byte offset */
+                    for (uint64_t id = 0; id < names.size(); ++id) {
+                        final_ndx[id] = bytes.size();
+                        bytes.insert (bytes.end(), names[id].begin(), names[id].end());
+                        bytes.push_back ('\x00');
+                    }
+                    break;
+
+        case Kbhdr::nametab_enc::KNT_FCODED: {
+                    std::vector<uint64_t> order (names.size());
+                    uint64_t count      = names.size();
+                    uint64_t nblocks    = (count + NAMETAB_FC_BLOCK - 1) / NAMETAB_FC_BLOCK;
+                    uint64_t header_sz  = (2 + nblocks) * sizeof (uint64_t);
+
+                    for (uint64_t id = 0; id < count; ++id) {
+                        order[id] = id;
+                    }
+                    std::sort (order.begin(), order.end(),
+                               [this] (uint64_t a, uint64_t b) { return names[a] < names[b]; });
+
+                    bytes.resize (header_sz);
+                    memcpy (&bytes[0], &count, sizeof (uint64_t));
+                    memcpy (&bytes[sizeof (uint64_t)], &nblocks, sizeof (uint64_t));
+
+                    std::string_view prev;
+                    for (uint64_t rank = 0; rank < count; ++rank) {
+                        std::string_view cur = names[order[rank]];
+                        final_ndx[order[rank]] = rank;
+
+                        if (rank % NAMETAB_FC_BLOCK == 0) {
+                            /* block head: record its offset and store it whole */
+                            uint64_t boff = bytes.size() - header_sz;
+                            memcpy (&bytes[(2 + rank / NAMETAB_FC_BLOCK) * sizeof (uint64_t)], &boff, sizeof (uint64_t));
+                            bytes.insert (bytes.end(), cur.begin(), cur.end());
+                        }
+                        else {
+                            size_t shared = 0;
+                            while (shared < prev.size() && shared < cur.size() && prev[shared] == cur[shared]) {
+                                ++shared;
+                            }
+                            put_uleb128 (bytes, shared);
+                            bytes.insert (bytes.end(), cur.begin() + shared, cur.end());
+                        }
+                        bytes.push_back ('\x00');
+                        prev = cur;
+                    }
+                    break;
+        }
+
+        default:
+                    log (__FILE__, __FUNCTION__, __LINE__, "unknown nametab encoding");
+                    return false;
+    }
+
+    for (auto &fhdr: fht) {
+        if (fhdr.is_dir_end ()) {
+            continue;
+        }
+        fhdr.fh_namendx = final_ndx[fhdr.fh_namendx];
+    }
+
+    return true;
+}
+
+
+
+/* validates the front-coded table header so that later lookups can trust it */
+NametabReader::NametabReader (const uint8_t *base, uint64_t size, uint64_t enc):
+        base(base), size(size), enc(enc), count(0), nblocks(0), boff(nullptr) {
+
+    if (enc != Kbhdr::nametab_enc::KNT_FCODED) {
+        return;
+    }
+
+    if (size < 2 * sizeof (uint64_t)) {
+        log (__FILE__, __FUNCTION__, __LINE__, "front-coded nametab is truncated");
+        this->size = 0;
+        return;
+    }
+
+    memcpy (&count, base, sizeof (uint64_t));
+    memcpy (&nblocks, base + sizeof (uint64_t), sizeof (uint64_t));
+    if ( nblocks != (count + NAMETAB_FC_BLOCK - 1) / NAMETAB_FC_BLOCK ||
+         nblocks > (size / sizeof (uint64_t)) - 2 ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "front-coded nametab has a corrupt block index");
+        this->size = count = nblocks = 0;
+        return;
+    }
+    boff = base + 2 * sizeof (uint64_t);
+}
+
+
+
+/* resolves fh_namendx <ndx> into <out>. Returns false if ndx is out of bounds */
+bool NametabReader::name (uint64_t ndx, std::string &out) const {
+
+    if (enc == Kbhdr::nametab_enc::KNT_RAW) {
+        if (ndx >= size) {
+            return false;
+        }
+        const uint8_t *end = (const uint8_t *) memchr (base + ndx, '\x00', size - ndx);
+        if (end == NULL) {
+            return false;
+        }
+        out.assign ((const char *) base + ndx, end - (base + ndx));
+        return true;
+    }
+
+    if (ndx >= count) {
+        return false;
+    }
+
+    /* decode block (ndx / NAMETAB_FC_BLOCK) up to the requested rank */
+    const uint8_t   *data   = boff + nblocks * sizeof (uint64_t);
+    const uint8_t   *end    = base + size;
+    const uint8_t   *ptr;
+    uint64_t        block_off;
+    std::string_view piece;
+
+    /* nametab isn't necessarily 8 byte aligned inside the SFX */
+    memcpy (&block_off, boff + (ndx / NAMETAB_FC_BLOCK) * sizeof (uint64_t), sizeof (uint64_t));
+    if (block_off >= (uint64_t) (end - data)) {
+        return false;
+    }
+    ptr = data + block_off;
+
+    if ( get_cstring (ptr, end, piece) == false) {
+        return false;
+    }
+    out.assign (piece);
+
+    for (uint64_t i = 0; i < ndx % NAMETAB_FC_BLOCK; ++i) {
+        uint64_t shared;
+        if ( get_uleb128 (ptr, end, shared) == false || shared > out.size() ||
+             get_cstring (ptr, end, piece) == false ) {
+            return false;
+        }
+        out.resize (shared);
+        out.append (piece);
+    }
+
+    return true;
+}
+
+
+
+/* Returns the fh_namendx of <name> or -1 if it isn't present. Front-coded  *
+ * tables are binary searched over block heads; raw tables are scanned.     */
+int64_t NametabReader::lookup (const std::string &name) const {
+
+    std::string cur;
+
+    if (enc == Kbhdr::nametab_enc::KNT_RAW) {
+        for (uint64_t off = 0; off < size; off += cur.size() + 1) {
+            if (this->name (off, cur) == false) {
+                return -1;
+            }
+            if (cur == name) {
+                return off;
+            }
+        }
+        return -1;
+    }
+
+    /* find the last block whose head is <= name */
+    uint64_t lo = 0, hi = nblocks;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (this->name (mid * NAMETAB_FC_BLOCK, cur) == false) {
+            return -1;
+        }
+        if (cur <= name) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+
+    /* scan that block */
+    uint64_t first = (lo - 1) * NAMETAB_FC_BLOCK;
+    uint64_t last  = std::min (first + NAMETAB_FC_BLOCK, count);
+    for (uint64_t rank = first; rank < last; ++rank) {
+        if (this->name (rank, cur) == false) {
+            return -1;
+        }
+        if (cur == name) {
+            return rank;
+        }
+        if (cur > name) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+
+/* appends <value> to <out> as an unsigned LEB128 */
+static void put_uleb128 (std::vector<char> &out, uint64_t value) {
+
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        out.push_back ((char) byte);
+    } while (value);
+}
+
+
+
+/* reads an unsigned LEB128 at <ptr> (advancing it) without crossing <end> */
+static bool get_uleb128 (const uint8_t *&ptr, const uint8_t *end, uint64_t &value) {
+
+    value = 0;
+    for (int shift = 0; ptr < end && shift < 64; shift += 7) {
+        uint8_t byte = *ptr++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/* reads a NUL terminated string at <ptr> (advancing it past the NUL) */
+static bool get_cstring (const uint8_t *&ptr, const uint8_t *end, std::string_view &out) {
+
+    const uint8_t *nul = (const uint8_t *) memchr (ptr, '\x00', end - ptr);
+    if (nul == NULL) {
+        return false;
+    }
+
+    out = std::string_view ((const char *) ptr, nul - ptr);
+    ptr = nul + 1;
+    return true;
+}
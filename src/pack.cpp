@@ -11,23 +11,38 @@
  ********************************************************************************/
 
 
+#include <algorithm>
+
 #include "kavach.h"
+#include "pipeline.h"
 
 /* Function Prototypes */
 static int      create_copy             (std::string &out_filename, int kfd);
 static bool     inject_signature        (int fd, uint64_t signature);
-static bool     load_kavach_object      (std::string &target_path, Kavach &ko, std::string &key);
-static bool     load_fpn                (std::string &target_path, std::vector<Fhdr> &fht, std::vector<char> &nametab, std::vector<std::vector<uint8_t>> &payload, std::string &key);
-static char*    create_string_copy      (std::string &original_string);
-static ssize_t  add_to_nametab          (std::string &target_path, std::vector<char> &nametab, bool is_dir);
-static uint64_t load_archive_payload    (std::string &target_path, const uint64_t &size, std::vector< std::vector<uint8_t> > &payload, std::string &key, Fhdr::encrypt &etype);
-static bool     attach_ko               (int sfxfd, Kavach &ko);
-static bool     patch_sfx_metadata      (int sfxfd, uint8_t *map, Kavach &ko);
-
-/* [pack.cpp]: global data */
-static uint64_t total_archive_size  = 0;
-static uint64_t total_archive_count = 0;
-static size_t   cur_payload_offset  = 0;
+static bool     load_kavach_object      (std::string &target_path, Kavach &ko);
+static bool     load_fpn                (std::string &target_path, std::vector<Fhdr> &fht, Nametab &nametab, std::vector<std::string> &payload);
+static ssize_t  add_to_nametab          (std::string &target_path, Nametab &nametab, bool is_dir);
+static bool     load_fpn_list           (std::string &list_path, std::vector<Fhdr> &fht, Nametab &nametab, std::vector<std::string> &payload);
+static bool     read_path_list          (std::string &list_path, std::vector<std::string> &paths);
+static bool     path_less               (const std::string &a, const std::string &b);
+static uint64_t load_archive_payload    (std::string &target_path, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd, uint8_t *block);
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static uint64_t stream_payload          (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd, uint8_t *block);
+static bool     attach_ko               (int sfxfd, Kavach &ko, std::string &key, VolumeWriter *volumes);
+static bool     pack_to_pipe            (int kfd, int outfd, std::string &target_path, std::string &key);
+static bool     write_padding           (int fd, uint64_t count);
+static bool     as_hardlink             (struct stat &tsb, Fhdr &fhdr, std::vector<Fhdr> &fht);
+
+/* [pack.cpp]: global data (per thread: every thread may be packing an archive of its own) */
+static thread_local size_t   cur_payload_offset  = 0;
+static thread_local size_t   pack_root_len       = 0;    /* strlen of pack target, exclude rules match below it */
+
+struct InodeHash {
+    size_t operator() (const std::pair<dev_t, ino_t> &inode) const {
+        return std::hash<uint64_t> () (inode.second * 0x9e3779b97f4a7c15ULL ^ inode.first);
+    }
+};
+static thread_local std::unordered_map<std::pair<dev_t, ino_t>, uint64_t, InodeHash> packed_inodes;    /* (st_dev, st_ino) -> FHT index */
 
 
 
@@ -40,9 +55,28 @@ bool pack (int kfd, std::string &target_path, std::string &key, std::string &of_
     int         sfxfd;
     struct stat sfxsb;
 
+    /* left over by an earlier pack on this thread */
+    cur_payload_offset = 0;
+    packed_inodes.clear ();
+
+    /* --output - : write the SFX to stdout in a single forward pass */
+    if (of_name == "-") {
+        if (VOLUME_SIZE) {
+            log (__FILE__, __FUNCTION__, __LINE__, "--volume-size needs an --output file to put the volumes next to");
+            return false;
+        }
+        if (pack_to_pipe (kfd, STDOUT_FILENO, target_path, key) == false) {
+            return false;
+        }
+        if (!CACHE_DIR.empty()) {
+            BLOBCACHE::evict ();            /* as below: the pipe path fills the cache too */
+        }
+        return true;
+    }
 
     /* create a copy of kavach binary named [of_name].FILE_EXTENSION */
     of_name += FILE_EXTENSION;
+    VolumeWriter volumes (of_name, VOLUME_SIZE);
     sfxfd = create_copy (of_name, kfd);
     if (sfxfd == -1) {
         log ( __FILE__, __FUNCTION__, __LINE__, " while creating kavach copy (SFX)");
@@ -59,7 +93,7 @@ bool pack (int kfd, std::string &target_path, std::string &key, std::string &of_
     inject_signature (sfxfd, PACK_SIGNATURE);
 
     /* load Kavach object */
-    if (load_kavach_object (target_path, ko, key) == false) {
+    if (load_kavach_object (target_path, ko) == false) {
         log (__FILE__, __FUNCTION__, __LINE__, "while loading Kavach File Header Table");
         return false;
     }
@@ -67,29 +101,38 @@ bool pack (int kfd, std::string &target_path, std::string &key, std::string &of_
 
     /* write Kavach object to End Of Kavach binary (sfxfd). Populate Kavach   *
      * Header too before writing                                            */
-    if (attach_ko (sfxfd, ko) == false) {
+    if (attach_ko (sfxfd, ko, key, VOLUME_SIZE ? &volumes : nullptr) == false) {
         log (__FILE__, __FUNCTION__, __LINE__, "while writing kavach object");
         return false;
     }
 
-    /* map SFX binary */
-    map = (uint8_t *) mmap (NULL, sfxsb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, sfxfd, 0);
-    if (map == MAP_FAILED) {
-        mmap_error ("while mmap'ing SFX", errno);
-        return false;
-    }
+    {
+        PhaseTimer timer (SP_METADATA);
+
+        /* map SFX binary */
+        map = (uint8_t *) mmap (NULL, sfxsb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, sfxfd, 0);
+        if (map == MAP_FAILED) {
+            mmap_error ("while mmap'ing SFX", errno);
+            return false;
+        }
 
-    /********************************************************************
-     * Tamper SHT & PHT                                                 *
-     * > Patch .kavach shdr entry to account for kbf (kavach binary     *
-     *   format). This is done to ensure that programs like `strip`     *
-     *   doesn't remove unaccounted archived content.                   *
-     ********************************************************************/
-    patch_sfx_metadata (sfxfd, map, ko);
+        /********************************************************************
+         * Tamper SHT & PHT                                                 *
+         * > Patch .kavach shdr entry to account for kbf (kavach binary     *
+         *   format). This is done to ensure that programs like `strip`     *
+         *   doesn't remove unaccounted archived content.                   *
+         ********************************************************************/
+        patch_sfx_metadata (sfxfd, map, ko);
 
 
-    munmap ((void *)map, sfxsb.st_size);
+        munmap ((void *)map, sfxsb.st_size);
+    }
     close (sfxfd);
+
+    /* keep the blob cache under its size cap */
+    if (!CACHE_DIR.empty()) {
+        BLOBCACHE::evict ();
+    }
     return true;
 }
 
@@ -97,7 +140,7 @@ bool pack (int kfd, std::string &target_path, std::string &key, std::string &of_
 
 /* Patch SFX's SHT entry named .kavach to account for ko.                   *
  * Returns false in case of failure and true for success                    */
-static bool patch_sfx_metadata (int sfxfd, uint8_t *map, Kavach &ko) {
+bool patch_sfx_metadata (int sfxfd, uint8_t *map, Kavach &ko) {
 
     Elf64_Shdr  kshdr;
     // Elf64_Phdr  kphdr;
@@ -180,15 +223,40 @@ static bool patch_sfx_metadata (int sfxfd, uint8_t *map, Kavach &ko) {
 
 
 
-/* load Kavach object with the content of target (file/directory).  */
-static bool load_kavach_object (std::string &target_path, Kavach &ko, std::string &key) {
+/* load Kavach object with the metadata of target (file/directory). File bodies are   *
+ * only read later, when attach_ko () streams them into the SFX.                    */
+static bool load_kavach_object (std::string &target_path, Kavach &ko) {
+
+    PhaseTimer timer (SP_TRAVERSE);
 
-    /* load FHT, archive payload & nametab */
-    if (load_fpn (target_path, ko.fht, ko.nametab, ko.payload, key) == false) {
+    pack_root_len = target_path.size();
+
+    /* load FHT, archive payload sources & nametab (from an explicit list with --files-from) */
+    bool status = FILES_FROM_FLAG ? load_fpn_list (target_path, ko.fht, ko.nametab, ko.payload)
+                                  : load_fpn (target_path, ko.fht, ko.nametab, ko.payload);
+    if (status == false) {
         log (__FILE__, __FUNCTION__, __LINE__, "while loading kavach FHT");
         return false;
     }
 
+    /* encode interned names and point every fh_namendx at its final slot */
+    if (ko.nametab.finalize (NAMETAB_ENCODING, ko.fht) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while encoding nametab");
+        return false;
+    }
+    ko.header.k_nametabenc = NAMETAB_ENCODING;
+
+    /* give every file body its run of KBF_CHUNK_SIZE entries in .chunktab */
+    uint64_t nchunks = 0;
+    for (auto &fhdr: ko.fht) {
+        if (fhdr.fh_ftype == Fhdr::FT_FILE) {
+            fhdr.fh_chunkndx = nchunks;
+            nchunks += (fhdr.fh_size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE;
+        }
+    }
+    ko.chunktab.resize (nchunks);
+    STATS.count_fht (ko.fht.data(), ko.fht.size());
+
     /* load kavach binary header (kbhdr) -  performed at the time of writing all    *
      * components of Kavach object to SFX binary.                                   */
 
@@ -197,9 +265,9 @@ static bool load_kavach_object (std::string &target_path, Kavach &ko, std::strin
 
 
 
-/* Loads FHT, archive payload (i.e. a vector of strings) and nametab. Depth first recursive parsing is used to create FHT */
-static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vector<char> &nametab,
-                      std::vector<std::vector<uint8_t>> &payload, std::string &key) {
+/* Loads FHT, archive payload (i.e. a vector of source paths) and nametab. Depth first recursive parsing is used to create FHT */
+static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, Nametab &nametab,
+                      std::vector<std::string> &payload) {
 
     struct stat tsb;        /* target stat buffer */
     Fhdr cur_fhdr;          /* current file header */
@@ -214,6 +282,7 @@ static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vec
             /* Loading file attributes into Fhdr */ 
             cur_fhdr.fh_offset  = 0;                     // set for S_ISDIR(). for S_ISREG(), it is set to cur_payload_offset 
             cur_fhdr.fh_etype   = ENCRYPTION_TYPE;
+            cur_fhdr.fh_cktype  = Fhdr::cksum::FCK_UND;  // set for S_ISDIR(). for S_ISREG(), it is set to CHECKSUM_TYPE
             cur_fhdr.fh_mode    = tsb.st_mode;
             cur_fhdr.fh_size    = tsb.st_size;
             // while unpacking, we use futimens() that will use this fhdr's timestamp /
@@ -224,28 +293,29 @@ static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vec
         /* file encountered */
         if  ( S_ISREG (tsb.st_mode) ) {
             
-            ds = "\tpacking: " + target_path;
-            debug_msg (ds);
+            debug_msg (LOG_VERBOSE, "\tpacking: " + target_path);
 
             /* Load filetype and nametable index attribute of cur_fhdr (implicitly adding filename into nametab vector) */            
             cur_fhdr.fh_ftype   = Fhdr::FT_FILE;
             cur_fhdr.fh_offset  = cur_payload_offset;
+            cur_fhdr.fh_cktype  = CHECKSUM_TYPE;
             cur_fhdr.fh_namendx = add_to_nametab (target_path, nametab, false);
 
-            /* append current file header (cur_fhdr) into FHT if add_to_nametab() didn't return -1 */ 
-            if (cur_fhdr.fh_namendx != (uint64_t ) -1) {
+            /* a further name of an inode already packed is only a link to its FHT entry */
+            if (cur_fhdr.fh_namendx != (uint64_t ) -1 && as_hardlink (tsb, cur_fhdr, fht)) {
                 fht.push_back (cur_fhdr);
+                return true;
             }
 
-            /* Load archive payload */
-            uint64_t payload_size = load_archive_payload (target_path, tsb.st_size, payload, key, cur_fhdr.fh_etype);
-            if ( payload_size == -1) {
-                log (__FILE__, __FUNCTION__, __LINE__, "while loading archive payload");
-                return false;
+            /* append current file header (cur_fhdr) into FHT if add_to_nametab() didn't return -1 */ 
+            if (cur_fhdr.fh_namendx != (uint64_t ) -1) {
+                fht.push_back (cur_fhdr);
+                payload.push_back (target_path);
             }
 
-            /* Load fh_offset (i.e. offset to file bodies/payloads) */
-            cur_payload_offset += payload_size;
+            /* Load fh_offset (i.e. offset to file bodies/payloads). Bodies are stored *
+             * untransformed in size, so st_size is all that is needed to lay them out */
+            cur_payload_offset += tsb.st_size;
         }
 
 
@@ -256,8 +326,7 @@ static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vec
             std::string current_dir = ".";
             std::string parent_dir  = "..";
 
-            ds = "\tpacking: " + target_path;
-            debug_msg (ds);
+            debug_msg (LOG_VERBOSE, "\tpacking: " + target_path);
 
             /* Load filetype attribute, add filename into nametab vector and append cur_fhdr to FHT */
             cur_fhdr.fh_ftype   = Fhdr::FT_DIR;
@@ -281,7 +350,17 @@ static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vec
                         if ( (dent->d_type == DT_DIR || dent->d_type == DT_REG) &&
                              (dent->d_name != current_dir && dent->d_name != parent_dir) ) {
                             std::string new_target_path = target_path + "/" + dent->d_name;
-                            load_fpn (new_target_path, fht, nametab, payload, key);
+
+                            /* excluded entries are dropped before stat'ing (or opendir'ing) them */
+                            if (!EXCLUDES.empty()) {
+                                std::string_view relpath = std::string_view (new_target_path).substr (pack_root_len);
+                                relpath.remove_prefix (std::min (relpath.find_first_not_of ('/'), relpath.size()));
+                                if (EXCLUDES.excluded (relpath, dent->d_type == DT_DIR)) {
+                                    debug_msg (LOG_VERBOSE, "\texcluding: " + new_target_path);
+                                    continue;
+                                }
+                            }
+                            load_fpn (new_target_path, fht, nametab, payload);
                         }
                     }
 
@@ -303,36 +382,264 @@ static bool load_fpn (std::string &target_path, std::vector<Fhdr> &fht, std::vec
 
 
 
-/* Adds file/directory name to nametab vector . Returns an offset into the nametab or -1 on failure */
-static ssize_t add_to_nametab (std::string &target_path, std::vector<char> &nametab, bool is_dir) {
-    
-    /* add dirname to nametab and get 'cur_fhdr.fh_namendx' */
-    uint64_t offset = nametab.size(); 
-    char *path_copy;
-    std::string name;
-
-    /* create a copy of target_path to pass it to basename () which may modify the passed copy */
-    path_copy = create_string_copy (target_path);
-    if (path_copy == NULL) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while creating path copy");
+/****************************************************************************
+ * Loads FHT, payload sources and nametab from the NUL separated list of    *
+ * paths in <list_path> ("-" for stdin) instead of walking a tree: only the *
+ * listed paths (and the directories leading to them) are ever stat'ed.     *
+ * Paths are sorted so that every directory's contents are contiguous, then *
+ * a single pass keeps a stack of open directories, emitting an FT_DIR      *
+ * Fhdr for each one entered and an FT_UND sentinel for each one left.      *
+ * Listed directories are archived as (empty) directories, not recursed.    *
+ * A path matching --exclude (or below a directory that does) is skipped.   *
+ ****************************************************************************/
+static bool load_fpn_list (std::string &list_path, std::vector<Fhdr> &fht, Nametab &nametab,
+                           std::vector<std::string> &payload) {
+
+    std::vector<std::string>    paths;
+    std::vector<std::string>    open_dirs;          /* components of the directory being filled */
+    struct stat                 tsb;
+
+    if (read_path_list (list_path, paths) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading --files-from list");
         return false;
     }
 
-    name = basename (path_copy);
+    std::sort (paths.begin(), paths.end(), path_less);
+    paths.erase (std::unique (paths.begin(), paths.end()), paths.end());
+
+    for (auto &path: paths) {
+
+        /* split into components; the leading '/' of an absolute path is kept for stat () only */
+        std::vector<std::string> components;
+        std::string              real = (path[0] == '/') ? "/" : "";
+        size_t                   start = 0;
+
+        while (start <= path.size()) {
+            size_t end = path.find ('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (end > start) {
+                components.push_back (path.substr (start, end - start));
+            }
+            start = end + 1;
+        }
+        if (components.empty()) {
+            continue;
+        }
+
+        /* leave the directories this path isn't in */
+        size_t common = 0;
+        while ( common < open_dirs.size() && common + 1 < components.size() &&
+                open_dirs[common] == components[common] ) {
+            ++common;
+        }
+        while (open_dirs.size() > common) {
+            fht.push_back (Fhdr ());                /* end of directory sentinel */
+            open_dirs.pop_back ();
+        }
+
+        /* enter the ones leading to it (and the path itself if it's a directory) */
+        std::string relpath;
+        for (size_t level = 0; level < components.size(); ++level) {
+            real    += (level ? "/" : "") + components[level];
+            relpath += (level ? "/" : "") + components[level];
+            if (level < open_dirs.size()) {
+                continue;
+            }
+
+            if (stat (real.c_str(), &tsb) == -1) {
+                es = "while stat'ing listed path: " + real;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                return false;
+            }
+
+            /* --exclude applies to listed paths as to walked ones, directories leading to them included */
+            if (!EXCLUDES.empty() && EXCLUDES.excluded (relpath, S_ISDIR (tsb.st_mode))) {
+                debug_msg (LOG_VERBOSE, "\texcluding: " + real);
+                break;
+            }
+
+            Fhdr cur_fhdr;
+            cur_fhdr.fh_etype   = ENCRYPTION_TYPE;
+            cur_fhdr.fh_mode    = tsb.st_mode;
+            cur_fhdr.fh_size    = tsb.st_size;
+            cur_fhdr.fh_namendx = nametab.intern (components[level]);
+            memmove ( &cur_fhdr.fh_time[0], &tsb.st_atim, sizeof (struct timespec) );
+            memmove ( &cur_fhdr.fh_time[1], &tsb.st_mtim, sizeof (struct timespec) );
+
+            if (S_ISDIR (tsb.st_mode)) {
+                cur_fhdr.fh_ftype   = Fhdr::FT_DIR;
+                fht.push_back (cur_fhdr);
+                open_dirs.push_back (components[level]);
+            }
+            else if (S_ISREG (tsb.st_mode) && level + 1 == components.size() && as_hardlink (tsb, cur_fhdr, fht)) {
+                fht.push_back (cur_fhdr);
+            }
+            else if (S_ISREG (tsb.st_mode) && level + 1 == components.size()) {
+                cur_fhdr.fh_ftype   = Fhdr::FT_FILE;
+                cur_fhdr.fh_offset  = cur_payload_offset;
+                cur_fhdr.fh_cktype  = CHECKSUM_TYPE;
+                fht.push_back (cur_fhdr);
+                payload.push_back (real);
+                cur_payload_offset += tsb.st_size;
+
+                debug_msg (LOG_VERBOSE, "\tpacking: " + real);
+            }
+            else {
+                es = "listed path is neither a regular file nor a directory: " + real;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                return false;
+            }
+        }
+    }
+
+    while (!open_dirs.empty()) {
+        fht.push_back (Fhdr ());
+        open_dirs.pop_back ();
+    }
+
+    return true;
+}
+
+
+
+/* reads the NUL separated paths in <list_path> ("-" for stdin). "." components,   *
+ * repeated slashes and trailing slashes are dropped; ".." is refused since it      *
+ * would let an entry escape the directory it's unpacked into.                      */
+static bool read_path_list (std::string &list_path, std::vector<std::string> &paths) {
+
+    std::string list;
+    char        buf[0x10000];
+    ssize_t     nread;
+    int         lfd = (list_path == "-") ? STDIN_FILENO : open (list_path.c_str(), O_RDONLY);
+
+    if (lfd == -1) {
+        es = "while open'ing " + list_path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    while ((nread = read (lfd, buf, sizeof (buf))) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log (__FILE__, __FUNCTION__, __LINE__, "while reading path list");
+            return false;
+        }
+        list.append (buf, nread);
+    }
+    if (lfd != STDIN_FILENO) {
+        close (lfd);
+    }
+
+    for (size_t start = 0; start < list.size(); ) {
+        size_t end = list.find ('\x00', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        std::string path = (list[start] == '/') ? "/" : "";
+        for (size_t c = start; c < end; ) {
+            size_t slash = list.find ('/', c);
+            if (slash == std::string::npos || slash > end) {
+                slash = end;
+            }
+            std::string component = list.substr (c, slash - c);
+            if (component == "..") {
+                es = "refusing path with '..' component: " + list.substr (start, end - start);
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                return false;
+            }
+            if (!component.empty() && component != ".") {
+                if (!path.empty() && path.back() != '/') {
+                    path += '/';
+                }
+                path += component;
+            }
+            c = slash + 1;
+        }
+
+        if (!path.empty() && path != "/") {
+            paths.push_back (path);
+        }
+        start = end + 1;
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Hardlinked files (st_nlink > 1) are tracked by (st_dev, st_ino): the     *
+ * first name seen is packed as usual (it will be FHT entry fht.size()),    *
+ * every later one turns <fhdr> into an FT_LINK to that entry and returns   *
+ * true, so its body is neither stored nor read again.                      *
+ ****************************************************************************/
+static bool as_hardlink (struct stat &tsb, Fhdr &fhdr, std::vector<Fhdr> &fht) {
+
+    if (tsb.st_nlink < 2) {
+        return false;
+    }
+
+    auto [it, first] = packed_inodes.emplace (std::make_pair (tsb.st_dev, tsb.st_ino), fht.size());
+    if (first) {
+        return false;
+    }
+
+    fhdr.fh_ftype   = Fhdr::FT_LINK;
+    fhdr.fh_offset  = it->second;
+    fhdr.fh_size    = fht[it->second].fh_size;
+    fhdr.fh_etype   = Fhdr::encrypt::FET_UND;
+    fhdr.fh_cktype  = Fhdr::cksum::FCK_UND;
+    return true;
+}
+
+
+
+/* orders paths so that a directory's contents directly follow it ('/' sorts first) */
+static bool path_less (const std::string &a, const std::string &b) {
+
+    size_t n = std::min (a.size(), b.size());
+
+    for (size_t i = 0; i < n; ++i) {
+        if (a[i] != b[i]) {
+            if (a[i] == '/') return true;
+            if (b[i] == '/') return false;
+            return (unsigned char) a[i] < (unsigned char) b[i];
+        }
+    }
+
+    return a.size() < b.size();
+}
+
+
+
+/* Interns file/directory name into nametab. Returns its (provisional) nametab id or -1 on failure */
+static ssize_t add_to_nametab (std::string &target_path, Nametab &nametab, bool is_dir) {
+    
+    /* slice out the last path component (what basename () would return) *
+     * rather than malloc'ing a copy of target_path for every name       */
+    std::string_view name = target_path;
+    size_t end = name.find_last_not_of ('/');
+
+    if (end == std::string_view::npos) {
+        name = name.empty() ? "." : "/";
+    }
+    else {
+        name = name.substr (0, end + 1);
+        name = name.substr (name.find_last_of ('/') + 1);
+    }
+
     if ( is_dir && (name == "." || name == "..") ) {
         /* skip directories named '.' and '..' */
         return -1;                                  
     }
 
     /* add name (of file or directory) to nametab */
-    for (char c: name) {
-        nametab.push_back (c);
-    }
-    nametab.push_back ('\x00');
-
-
-    free (path_copy);
-    return offset;
+    return nametab.intern (name);
 }
 
 
@@ -360,13 +667,17 @@ static int create_copy (std::string &out_filename, int kfd) {
     /* copy [kfd] to [out_filename] using sendfile () */
     uint64_t bytes_copied = 0;
     uint64_t total_bytes_copied = 0;
+    PhaseTimer timer (SP_WRITE);
     while ( bytes_copied = sendfile (ofd, kfd, NULL, KAVACH_BINARY_SIZE - total_bytes_copied) ) { 
         
+        STATS.count (SC_COPIES);
         if (bytes_copied == -1) {   /* error occured */
             sendfile_error ("while copying [kavach binary] -> [out_filename]", errno);
             return -1;
         }
 
+        STATS.count (SC_BYTES_READ, bytes_copied);
+        STATS.count (SC_BYTES_WRITTEN, bytes_copied);
         total_bytes_copied += bytes_copied;
         if (total_bytes_copied == KAVACH_BINARY_SIZE) {
             /* copy complete */
@@ -393,31 +704,14 @@ static bool inject_signature (int fd, uint64_t signature) {
 
 
 
-/* returns a pointer to copy of os (original string) allocated on heap segment */
-static char *create_string_copy (std::string &os) {
-    
-    size_t os_size = os.length();
-    char *copy = (char *) malloc (os_size + 1);
-    if (copy == NULL) {
-        es = "while malloc'ing " + std::to_string(os_size + 1) + "bytes";
-        log (__FILE__, __FUNCTION__, __LINE__, es);
-    }
-
-    memmove (copy, os.c_str(), os_size);
-    copy[os_size] = '\x00';
-
-    return copy;
-}
-
-
-
-/* loads the content of <target_path> filename to payload vector. Returns 'payload size' or -1 on failure */
-static uint64_t load_archive_payload ( std::string &path, const uint64_t &size, std::vector<std::vector<uint8_t>> &payload,
-                                       std::string &key, Fhdr::encrypt &etype) {
+/* streams the content of <path> into <sfxfd> (at its current file position) through the   *
+ * pack pipeline selected by fhdr.fh_etype, filling in fhdr.fh_cksum and the file's        *
+ * .chunktab entries (<chunks>) on the way.                                                *
+ * <block> is a PIPELINE_BLOCK_SIZE scratch buffer. Returns 'payload size' or -1 on failure */
+static uint64_t load_archive_payload (std::string &path, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd, uint8_t *block) {
     
     int afd;
-    std::vector<uint8_t> archive_content;
-    archive_content.resize(size);
+    uint64_t payload_size;
     
 
     /* archive file descriptor */
@@ -428,26 +722,149 @@ static uint64_t load_archive_payload ( std::string &path, const uint64_t &size,
         return -1;
     }
 
-    if (read (afd, &archive_content[0], size) != size) {
-        es = "while reading from " + path;
-        log (__FILE__, __FUNCTION__, __LINE__, es);
-        return -1;
+    /* --cache-dir: an unchanged source may already have its transformed body cached */
+    if (!CACHE_DIR.empty()) {
+        payload_size = BLOBCACHE::fetch (afd, fhdr, chunks, key, sfxfd);
+        if (payload_size != 0) {
+            if (payload_size == (uint64_t) -1) {
+                es = "while copying cached payload of " + path;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+            }
+            close (afd);
+            return payload_size;
+        }
     }
 
-    /*  If user supplied --encrypt and --key flags,         * 
-     *  scramble <archive_content> with user-supplied <key> */
-    if (etype != Fhdr::encrypt::FET_UND) {
-        SCRAMBLE::encrypt (archive_content, key, etype);
+    posix_fadvise (afd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    payload_size = load_payload_fd (afd, fhdr, chunks, key, sfxfd, block);
+    if (payload_size == (uint64_t) -1) {
+        es = "while streaming payload of " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+    }
+    else if (!CACHE_DIR.empty()) {
+        BLOBCACHE::store (afd, fhdr, chunks, key, sfxfd);
     }
-        
-    payload.push_back (archive_content);
-    
-    
-    // fprintf (stderr, "target: %s\n\tsize: %ld\n\tfile content: ", path.c_str(), size);
-    // dump_memory_range (&archive_content[0], size);
     
     close (afd);
-    return archive_content.size();
+    return payload_size;
+}
+
+
+
+/* streams the next fhdr.fh_size bytes of <afd> (a file or any pipe, read strictly in order) *
+ * into <sfxfd>. Returns 'payload size' or -1 on failure.                                    */
+uint64_t load_payload_fd (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd, uint8_t *block) {
+
+    /*  If user supplied --encrypt and --key flags,         * 
+     *  scramble the content with user-supplied <key>       */
+    switch (fhdr.fh_etype) {
+        case Fhdr::encrypt::FET_UND:
+                    return stream_payload<Fhdr::encrypt::FET_UND, PIPELINE::codec::NONE> (afd, fhdr, chunks, key, sfxfd, block);
+        case Fhdr::encrypt::FET_XOR:
+                    return stream_payload<Fhdr::encrypt::FET_XOR, PIPELINE::codec::NONE> (afd, fhdr, chunks, key, sfxfd, block);
+        default:
+                    log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
+                    return -1;
+    }
+}
+
+
+
+/* reads <afd> a block at a time, pushing each block through every pack stage    *
+ * (checksum -> compress -> encrypt) before writing it out to <sfxfd>             */
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static uint64_t stream_payload (int afd, Fhdr &fhdr, Kchunk *chunks, std::string &key, int sfxfd, uint8_t *block) {
+
+    auto        packer  = PIPELINE::make_packer<E, C> (fhdr.fh_cktype, key, chunks, fhdr.fh_offset);
+    uint64_t    done    = 0;
+    ssize_t     nread;
+
+    /* large bodies: overlap reading, transforming and writing chunks of one file */
+    if (fhdr.fh_size >= PIPELINE_PARALLEL_MIN) {
+        PIPELINE::Checksum  checksum (fhdr.fh_cktype);
+        PIPELINE::ChunkIndex chunk_index (chunks, fhdr.fh_offset);
+        off_t               base = lseek (sfxfd, 0, SEEK_CUR);
+        bool                seekable = (base != -1);
+
+        /* a pipe can't be pwrite'd, but the writer sees chunks in order anyway */
+        if (!seekable && errno != ESPIPE) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while lseek'ing SFX");
+            return -1;
+        }
+
+        bool status = PIPELINE::run_chunked (fhdr.fh_size, PIPELINE::worker_count (),
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                /* reader: chunks are read (and checksummed) strictly in order */
+                if (read_full (afd, buf, len) == false) {
+                    log (__FILE__, __FUNCTION__, __LINE__, "short read while loading payload");
+                    return false;
+                }
+                PhaseTimer timer (SP_TRANSFORM);
+                checksum (buf, len, off);
+                chunk_index (buf, len, off);
+                return true;
+            },
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                /* workers: compress -> encrypt */
+                PhaseTimer timer (SP_TRANSFORM);
+                PIPELINE::make_encoder<E, C> (key).run (buf, len, off);
+                return true;
+            },
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                if ((seekable ? pwrite_full (sfxfd, buf, len, base + off) : write_full (sfxfd, buf, len)) == false) {
+                    es = "while writing payload offset: " + std::to_string (fhdr.fh_offset + off);
+                    log (__FILE__, __FUNCTION__, __LINE__, es);
+                    return false;
+                }
+                return true;
+            });
+
+        if (status == false || (seekable && lseek (sfxfd, base + fhdr.fh_size, SEEK_SET) == -1)) {
+            return -1;
+        }
+
+        fhdr.fh_cksum = checksum.digest ();
+        return fhdr.fh_size;
+    }
+
+    while (done < fhdr.fh_size) {
+        size_t want = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, fhdr.fh_size - done);
+        want = std::min ((uint64_t) want, KBF_CHUNK_SIZE - (done % KBF_CHUNK_SIZE));
+
+        {
+            PhaseTimer timer (SP_READ);
+            want  = READ_LIMIT.slice (want);
+            nread = read (afd, block, want);
+        }
+        STATS.count (SC_READS);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            /* file shrank since it was stat'ed: its laid out size can't be honoured */
+            log (__FILE__, __FUNCTION__, __LINE__, "short read while loading payload");
+            return -1;
+        }
+        STATS.count (SC_BYTES_READ, nread);
+        STATS.count (SC_SHORT_READS, (size_t) nread < want);
+        READ_LIMIT.take (nread);
+
+        {
+            PhaseTimer timer (SP_TRANSFORM);
+            packer.run (block, nread, done);
+        }
+
+        if (write_full (sfxfd, block, nread) == false) {
+            es = "while writing payload offset: " + std::to_string (fhdr.fh_offset + done);
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return -1;
+        }
+        done += nread;
+    }
+
+    fhdr.fh_cksum = packer.template stage<PIPELINE::Checksum> ().digest ();
+    return done;
 }
 
 
@@ -457,86 +874,96 @@ static uint64_t load_archive_payload ( std::string &path, const uint64_t &size,
  * Returns false on failure.                                                                   *
  * NOTE: All offsets being written to kavach binary header are relative offsets (to the start  *
  *       of Kbhdr (unpack it accordingly).                                                     *
+ *       Space for the FHT and chunk table is reserved up front and both are written last,     *
+ *       once the payload has been streamed in and every checksum is known. The nametab is     *
+ *       already final, so it is written before the payload (see KBF_STREAM_ORDER).            *
  ***********************************************************************************************/
-static bool attach_ko (int sfxfd, Kavach &ko) {
+static bool attach_ko (int sfxfd, Kavach &ko, std::string &key, VolumeWriter *volumes) {
     
-    uint64_t bytes_written;
     uint64_t write_size;
     uint64_t offset;
+    uint64_t payload_size;
+    int      outfd = sfxfd;
+    std::unique_ptr<uint8_t[]> block (new uint8_t[PIPELINE_BLOCK_SIZE]);
 
 
-    /* seek to the end of file + sizeof(Kbhdr) */
-    offset = lseek (sfxfd, sizeof(Kbhdr), SEEK_END);
-    if ( offset == -1 ) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while lseek'ing to the end of SFX + sizeof(Kbhdr)");
-        return false;
+    /* lay out header, FHT, chunk table, nametab and payload right after the end of SFX */
+    layout_stream (ko);
+
+    /* --volume-size: file bodies move out into volumes, the volume table follows nametab */
+    if (volumes) {
+        volumes->layout (ko);
     }
-    ko.header.k_fhtoff = offset - KAVACH_BINARY_SIZE;   
 
-    /* write FHT */
-    ko.header.k_fhentsize   = sizeof (Fhdr);
-    ko.header.k_fhnum       = ko.fht.size();
-    write_size = sizeof(Fhdr);
-    for (auto fhdr: ko.fht) {
-        if (write (sfxfd, &fhdr, write_size) != write_size) {
-            es  = "while writing file header of: ";
-            es += &ko.nametab[fhdr.fh_namendx];
-            es += "to SFX binary";
-            log (__FILE__, __FUNCTION__, __LINE__, es);
-            return false;
-        }
+    /* names are final by now, write names table to file */
+    write_size = ko.header.k_nametabsz;
+    if (pwrite_full (sfxfd, ko.nametab.bytes.data(), write_size, KAVACH_BINARY_SIZE + ko.header.k_nametaboff) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing ko.nametab to SFX binary");
+        return false;
     }
 
-    /* write archive payload */
-    offset = lseek (sfxfd, 0, SEEK_CUR);
-    if (offset == -1) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while loading ko.header.k_payloadoff (lseek failed)");
+    offset = lseek (sfxfd, KAVACH_BINARY_SIZE + ko.header.k_payloadoff, SEEK_SET);
+    if ( offset == -1 ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while lseek'ing to the start of archive payload");
         return false;
     }
-    ko.header.k_payloadoff = offset - KAVACH_BINARY_SIZE;
 
+    /* stream archive payload, one file body after the other (in FHT order) */
     uint64_t current_offset = 0;
-    for (auto file: ko.payload) {
+    uint64_t file_ndx       = 0;
+    for (auto &fhdr: ko.fht) {
 
-        write_size = file.size();
-        if (write (sfxfd, &file[0], write_size) != write_size) {
-            es = "while writing payload offset: " + std::to_string (current_offset);
-            log (__FILE__, __FUNCTION__, __LINE__, es);
+        if (fhdr.fh_ftype != Fhdr::FT_FILE) {
+            continue;
+        }
+
+        if (volumes && (outfd = volumes->open_body (fhdr)) == -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while opening volume for archive payload");
+            return false;
+        }
+        payload_size = load_archive_payload (ko.payload[file_ndx++], fhdr, ko.chunktab.data() + fhdr.fh_chunkndx, key, outfd, block.get());
+        if (volumes && volumes->close_body () == false) {
+            payload_size = -1;
+        }
+        if (payload_size == (uint64_t) -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while loading archive payload");
             return false;
         }
-        current_offset += write_size;
+        current_offset += payload_size;
     }
 
-    ko.header.k_payloadsz = current_offset;
     if (current_offset != cur_payload_offset) {
         log (__FILE__, __FUNCTION__, __LINE__, "Payload not completely written to SFX binary");
         return false;
     }
 
-
-    /* write names table to file */
-    offset = lseek (sfxfd, 0, SEEK_CUR);
-    if (offset == -1) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while loading ko.header.nametaboff (lseek failed)");
-        return false;
+    /* getting size of archive (excluding size of SFX). With volumes, the SFX ends at the *
+     * volume table (k_payloadsz, set by layout (), spans the volumes, gaps included)      */
+    if (volumes) {
+        if (volumes->finish (sfxfd, ko) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while writing volumes");
+            return false;
+        }
+        ARCHIVE_SIZE = ko.header.k_voltaboff + ko.header.k_volnum * sizeof (Kvolume);
+    }
+    else {
+        ko.header.k_payloadsz = current_offset;
+        ARCHIVE_SIZE = ko.header.k_payloadoff + ko.header.k_payloadsz;
     }
-    ko.header.k_nametaboff = offset - KAVACH_BINARY_SIZE;
 
-    write_size = ko.nametab.size();
-    if (write (sfxfd, &ko.nametab[0], write_size) != write_size) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while writing ko.nametab to SFX binary");
+    /* pwrite FHT into the space reserved for it */
+    write_size = ko.header.k_fhnum * ko.header.k_fhentsize;
+    if (pwrite (sfxfd, ko.fht.data(), write_size, KAVACH_BINARY_SIZE + ko.header.k_fhtoff) != write_size) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing FHT to SFX binary");
         return false;
     }
 
-    /* getting size of archive (excluding size of SFX) */
-    offset = lseek (sfxfd, 0, SEEK_CUR);
-    if (offset == -1) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while leek'ing to KBF end (getting ARCHIVE_SIZE)");
+    /* pwrite chunk table next to it */
+    write_size = ko.header.k_chunknum * sizeof (Kchunk);
+    if (pwrite_full (sfxfd, ko.chunktab.data(), write_size, KAVACH_BINARY_SIZE + ko.header.k_chunktaboff) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing chunk table to SFX binary");
         return false;
     }
-    else {
-        ARCHIVE_SIZE = offset - KAVACH_BINARY_SIZE;
-    }
 
     /* pwrite kavach binary header @ end of SFX's SHT == kavach_start */
     write_size = sizeof(Kbhdr);
@@ -546,4 +973,153 @@ static bool attach_ko (int sfxfd, Kavach &ko) {
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+
+
+/***********************************************************************************************
+ * packs <target_path> onto <outfd>, which may be a pipe, without ever seeking: the stub is    *
+ * copied (signature and .kavach shdr patched in memory), followed by the payload and the      *
+ * tables, with Kbhdr + TRAILER_MAGIC at the very end (KBF_TRAILER). Every size is known up    *
+ * front since the payload is stored at its plain size, so is the patched ARCHIVE_SIZE.        *
+ ***********************************************************************************************/
+static bool pack_to_pipe (int kfd, int outfd, std::string &target_path, std::string &key) {
+
+    Kavach                      ko;
+    uint64_t                    signature = PACK_SIGNATURE;
+    uint64_t                    payload_size;
+    uint64_t                    current_offset = 0;
+    uint64_t                    file_ndx       = 0;
+    std::unique_ptr<uint8_t[]>  stub (new uint8_t[KAVACH_BINARY_SIZE]);
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    if (isatty (outfd)) {
+        log (__FILE__, __FUNCTION__, __LINE__, "refusing to write an SFX binary to a terminal");
+        return false;
+    }
+
+    if (load_kavach_object (target_path, ko) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while loading Kavach File Header Table");
+        return false;
+    }
+
+    ko.header.k_payloadsz = cur_payload_offset;
+    layout_trailer (ko);
+
+    /* stub: a signed, patched copy of kavach binary */
+    if (pread_full (kfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading kavach binary");
+        return false;
+    }
+    memcpy (&stub[0x8], &signature, 0x8);
+    patch_sfx_metadata (outfd, stub.get(), ko);
+
+    if (write_full (outfd, stub.get(), KAVACH_BINARY_SIZE) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing SFX stub");
+        return false;
+    }
+
+    /* stream archive payload, one file body after the other (in FHT order) */
+    for (auto &fhdr: ko.fht) {
+
+        if (fhdr.fh_ftype != Fhdr::FT_FILE) {
+            continue;
+        }
+
+        payload_size = load_archive_payload (ko.payload[file_ndx++], fhdr, ko.chunktab.data() + fhdr.fh_chunkndx, key, outfd, block.get());
+        if (payload_size == (uint64_t) -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while loading archive payload");
+            return false;
+        }
+        current_offset += payload_size;
+    }
+
+    if (current_offset != ko.header.k_payloadsz) {
+        log (__FILE__, __FUNCTION__, __LINE__, "Payload not completely written to SFX binary");
+        return false;
+    }
+
+    if (write_trailer (outfd, ko) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing kavach tables to SFX binary");
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/* lays out the tables trailing a payload of ko.header.k_payloadsz bytes (KBF_TRAILER)  *
+ * and sets ARCHIVE_SIZE accordingly. Tables are kept 8 byte aligned with zero padding. */
+void layout_trailer (Kavach &ko) {
+
+    ko.header.k_payloadoff  = 0;
+    ko.header.k_chunktaboff = (ko.header.k_payloadsz + 7) & ~7ULL;
+    ko.header.k_chunknum    = ko.chunktab.size();
+    ko.header.k_chunksz     = KBF_CHUNK_SIZE;
+    ko.header.k_nametaboff  = ko.header.k_chunktaboff + ko.header.k_chunknum * sizeof (Kchunk);
+    ko.header.k_nametabsz   = ko.nametab.bytes.size();
+    ko.header.k_fhtoff      = (ko.header.k_nametaboff + ko.header.k_nametabsz + 7) & ~7ULL;
+    ko.header.k_fhentsize   = sizeof (Fhdr);
+    ko.header.k_fhnum       = ko.fht.size();
+    ko.header.k_flags       = Kbhdr::flags::KBF_TRAILER;
+
+    ARCHIVE_SIZE = ko.header.k_fhtoff + ko.header.k_fhnum * ko.header.k_fhentsize + sizeof (Kbhdr) + sizeof (uint64_t);
+}
+
+
+
+/* lays out header, FHT, chunk table, nametab and payload (in that order) of a KBF. Every *
+ * table goes ahead of the payload so that the SFX can be unpacked as a stream.           */
+void layout_stream (Kavach &ko) {
+
+    ko.header.k_fhtoff      = sizeof(Kbhdr);
+    ko.header.k_fhentsize   = sizeof (Fhdr);
+    ko.header.k_fhnum       = ko.fht.size();
+    ko.header.k_chunktaboff = ko.header.k_fhtoff + ko.header.k_fhnum * ko.header.k_fhentsize;
+    ko.header.k_chunknum    = ko.chunktab.size();
+    ko.header.k_chunksz     = KBF_CHUNK_SIZE;
+    ko.header.k_nametaboff  = ko.header.k_chunktaboff + ko.header.k_chunknum * sizeof (Kchunk);
+    ko.header.k_nametabsz   = ko.nametab.bytes.size();
+    ko.header.k_payloadoff  = ko.header.k_nametaboff + ko.header.k_nametabsz;
+    ko.header.k_flags       = Kbhdr::flags::KBF_STREAM_ORDER;
+}
+
+
+
+/* writes the tables laid out by layout_trailer () right after the payload: chunk table, *
+ * nametab, FHT, header and the magic that finds it                                      */
+bool write_trailer (int outfd, Kavach &ko) {
+
+    uint64_t magic = TRAILER_MAGIC;
+    uint64_t pad;
+
+    pad = ko.header.k_chunktaboff - ko.header.k_payloadsz;
+    if ( write_padding (outfd, pad) == false ||
+         write_full (outfd, ko.chunktab.data(), ko.header.k_chunknum * sizeof (Kchunk)) == false ||
+         write_full (outfd, ko.nametab.bytes.data(), ko.header.k_nametabsz) == false ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing chunk table & nametab to SFX binary");
+        return false;
+    }
+
+    pad = ko.header.k_fhtoff - (ko.header.k_nametaboff + ko.header.k_nametabsz);
+    if ( write_padding (outfd, pad) == false ||
+         write_full (outfd, ko.fht.data(), ko.header.k_fhnum * ko.header.k_fhentsize) == false ||
+         write_full (outfd, &ko.header, sizeof (Kbhdr)) == false ||
+         write_full (outfd, &magic, sizeof (magic)) == false ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing FHT & kavach header to SFX binary");
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/* writes <count> (< 8) zero bytes */
+static bool write_padding (int fd, uint64_t count) {
+
+    const uint8_t zeros[8] = { 0 };
+    return write_full (fd, zeros, count);
+}
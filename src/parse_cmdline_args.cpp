@@ -20,6 +20,12 @@
 void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::string &pack_target, std::string &out_filename) {
     
     std::string encryption_type;
+    std::string nametab_encoding;
+    std::string checksum_type;
+    std::string range;
+    std::string durability;
+    char        *end;
+    uint64_t    limit;
     static struct option long_options[] = {
         {"pack",            required_argument,  NULL,   'p'},
         {"unpack",          no_argument,        NULL,   'u'},
@@ -27,7 +33,38 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
         {"output",          required_argument,  NULL,   'o'},
         {"encrypt",         required_argument,  NULL,   'e'},
         {"help",            no_argument,        NULL,   'h'},
-        {"destroy-relics",  no_argument,        NULL,   'd'},
+        {"destroy-relics",  optional_argument,  NULL,   'd'},
+        {"nametab",         required_argument,  NULL,   'n'},
+        {"checksum",        required_argument,  NULL,   'c'},
+        {"verify",          no_argument,        NULL,   'V'},
+        {"cat",             required_argument,  NULL,   'C'},
+        {"range",           required_argument,  NULL,   'r'},
+        {"from-tar",        required_argument,  NULL,   'T'},
+        {"to-tar",          required_argument,  NULL,   't'},
+        {"files-from",      required_argument,  NULL,   'F'},
+        {"exclude",         required_argument,  NULL,   'x'},
+        {"exclude-from",    required_argument,  NULL,   'X'},
+        {"cache-dir",       required_argument,  NULL,   'b'},
+        {"merge",           required_argument,  NULL,   'm'},
+        {"cache-size",      required_argument,  NULL,   'B'},
+        {"exec",            required_argument,  NULL,   'i'},
+        {"siblings",        no_argument,        NULL,   's'},
+        {"update",          optional_argument,  NULL,   'U'},
+        {"delete",          no_argument,        NULL,   'E'},
+        {"journal",         no_argument,        NULL,   'J'},
+        {"resume",          no_argument,        NULL,   'R'},
+        {"durability",      required_argument,  NULL,   'y'},
+        {"diff",            required_argument,  NULL,   'D'},
+        {"apply-patch",     required_argument,  NULL,   'a'},
+        {"volume-size",     required_argument,  NULL,   'L'},
+        {"watch",           required_argument,  NULL,   'W'},
+        {"max-read-bps",    required_argument,  NULL,   'I'},
+        {"max-write-bps",   required_argument,  NULL,   'O'},
+        {"max-cpu",         required_argument,  NULL,   'P'},
+        {"idle-io",         no_argument,        NULL,   'l'},
+        {"quiet",           no_argument,        NULL,   'q'},
+        {"verbose",         no_argument,        NULL,   'v'},
+        {"stats",           optional_argument,  NULL,   'S'},
         {0, 0, 0, 0}
     };
     int flag = 0;
@@ -37,12 +74,19 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
         exit (-1);
     }
 
-    while ( (flag = getopt_long (argc, argv, "de:hk:o:p:u:", long_options, nullptr)) != -1) {
+    while ( (flag = getopt_long (argc, argv, "a:B:b:C:c:D:d::Ee:F:hI:i:JL:k:lm:n:O:o:P:p:qRr:S::sT:t:U::u:vVW:x:X:y:", long_options, nullptr)) != -1) {
     
         switch (flag) {
 
-            case 'd':   /* --destroy-relics */
+            case 'd':   /* --destroy-relics[=<seconds>] (wait at most that long, the rest goes on in the background) */
                         DESTROY_RELICS = 1;
+                        if (optarg) {
+                            RELICS_WAIT = strtol (optarg, &end, 10);
+                            if (*end != '\x00' || RELICS_WAIT < 0) {
+                                fprintf (stderr, "[-] malformed --destroy-relics wait: %s\n", optarg);
+                                print_usage ();
+                            }
+                        }
                         break;
 
             case 'p':   /* --pack */
@@ -57,8 +101,10 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
                             KEY_FLAG = 1;
                         break;
 
-            case 'u':   /* --unpack */
+            case 'u':   /* --unpack [-] */
                         UNPACK_FLAG = 1;
+                        if (optarg && std::string (optarg) == "-")
+                            STDIN_FLAG = 1;
                         break;
 
             case 'o':   /* --output */
@@ -68,6 +114,7 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
                         break;
 
             case 'e':   /* --encrypt */
+                        ENCRYPT_FLAG    = 1;
                         encryption_type = optarg;
                         if (encryption_type == "xor") {
                             ENCRYPTION_TYPE = Fhdr::encrypt::FET_XOR;
@@ -77,6 +124,259 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
                         }
                         break;
 
+            case 'n':   /* --nametab */
+                        nametab_encoding = optarg;
+                        if (nametab_encoding == "front-coded" || nametab_encoding == "fc") {
+                            NAMETAB_ENCODING = Kbhdr::nametab_enc::KNT_FCODED;
+                        }
+                        else if (nametab_encoding == "raw") {
+                            NAMETAB_ENCODING = Kbhdr::nametab_enc::KNT_RAW;
+                        }
+                        else {
+                            fprintf (stderr, "[-] unknown --nametab: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'c':   /* --checksum */
+                        checksum_type = optarg;
+                        if (checksum_type == "xxh64") {
+                            CHECKSUM_TYPE = Fhdr::cksum::FCK_XXH64;
+                        }
+                        else if (checksum_type == "none") {
+                            CHECKSUM_TYPE = Fhdr::cksum::FCK_UND;
+                        }
+                        else if (checksum_type == "crc32c") {
+                            CHECKSUM_TYPE = Fhdr::cksum::FCK_CRC32C;
+                        }
+                        else {
+                            fprintf (stderr, "[-] unknown --checksum: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'V':   /* --verify */
+                        VERIFY_FLAG = 1;
+                        break;
+
+            case 'C':   /* --cat */
+                        CAT_TARGET = optarg;
+                        if (!CAT_TARGET.empty())
+                            CAT_FLAG = 1;
+                        break;
+
+            case 'r':   /* --range <offset>:<length>, empty length => to EOF */
+                        range = optarg;
+                        RANGE_OFFSET = strtoull (range.c_str(), &end, 0);
+                        if (*end == ':' && *(end + 1) != '\x00') {
+                            RANGE_LENGTH = strtoull (end + 1, &end, 0);
+                        }
+                        else if (*end == ':') {
+                            ++end;
+                        }
+                        if (*end != '\x00') {
+                            fprintf (stderr, "[-] malformed --range: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'T':   /* --from-tar <file|-> */
+                        TAR_PATH = optarg;
+                        if (!TAR_PATH.empty())
+                            FROM_TAR_FLAG = 1;
+                        break;
+
+            case 't':   /* --to-tar <file|-> */
+                        TAR_PATH = optarg;
+                        if (!TAR_PATH.empty())
+                            TO_TAR_FLAG = 1;
+                        break;
+
+            case 'F':   /* --files-from <file|-> : NUL separated list of paths to pack */
+                        FILES_FROM  = optarg;
+                        pack_target = FILES_FROM;
+                        if (!FILES_FROM.empty()) {
+                            PACK_FLAG       = 1;
+                            FILES_FROM_FLAG = 1;
+                        }
+                        break;
+
+            case 'x':   /* --exclude <pattern> (gitignore syntax, repeatable) */
+                        if (EXCLUDES.add (optarg) == false) {
+                            print_usage ();
+                        }
+                        break;
+
+            case 'X':   /* --exclude-from <file> : one gitignore pattern per line */
+                        if (EXCLUDES.load (optarg) == false) {
+                            print_usage ();
+                        }
+                        break;
+
+            case 'b':   /* --cache-dir <dir> : reuse transformed bodies across packs */
+                        CACHE_DIR = optarg;
+                        while (CACHE_DIR.size() > 1 && CACHE_DIR.back() == '/') {
+                            CACHE_DIR.pop_back ();
+                        }
+                        if (mkdir (CACHE_DIR.c_str(), S_IRWXU) == -1 && errno != EEXIST) {
+                            fprintf (stderr, "[-] can't create --cache-dir: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'B':   /* --cache-size <bytes>[K|M|G] */
+                        CACHE_SIZE = strtoull (optarg, &end, 0);
+                        switch (*end) {
+                            case 'G': case 'g':     CACHE_SIZE <<= 10;      /* fall through */
+                            case 'M': case 'm':     CACHE_SIZE <<= 10;      /* fall through */
+                            case 'K': case 'k':     CACHE_SIZE <<= 10;
+                                                    ++end;
+                                                    break;
+                        }
+                        if (*end != '\x00') {
+                            fprintf (stderr, "[-] malformed --cache-size: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'L':   /* --volume-size <bytes>[K|M|G] (split the payload into volumes) */
+                        VOLUME_SIZE = strtoull (optarg, &end, 0);
+                        switch (*end) {
+                            case 'G': case 'g':     VOLUME_SIZE <<= 10;     /* fall through */
+                            case 'M': case 'm':     VOLUME_SIZE <<= 10;     /* fall through */
+                            case 'K': case 'k':     VOLUME_SIZE <<= 10;
+                                                    ++end;
+                                                    break;
+                        }
+                        if (*end != '\x00' || VOLUME_SIZE == 0) {
+                            fprintf (stderr, "[-] malformed --volume-size: %s\n", optarg);
+                            print_usage ();
+                        }
+                        if (VOLUME_SIZE < VOLUME_HDR_SIZE + VOLUME_ALIGN) {
+                            fprintf (stderr, "[-] --volume-size too small (a volume takes at least %uK): %s\n",
+                                     (VOLUME_HDR_SIZE + VOLUME_ALIGN) >> 10, optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'W':   /* --watch <dir> (keep --output in sync with it) */
+                        WATCH_FLAG  = 1;
+                        pack_target = optarg;
+                        break;
+
+            case 'I':   /* --max-read-bps <bytes>[K|M|G] */
+            case 'O':   /* --max-write-bps <bytes>[K|M|G] */
+                        limit = strtoull (optarg, &end, 0);
+                        switch (*end) {
+                            case 'G': case 'g':     limit <<= 10;           /* fall through */
+                            case 'M': case 'm':     limit <<= 10;           /* fall through */
+                            case 'K': case 'k':     limit <<= 10;
+                                                    ++end;
+                                                    break;
+                        }
+                        if (*end != '\x00' || limit == 0) {
+                            fprintf (stderr, "[-] malformed --max-%s-bps: %s\n", (flag == 'I') ? "read" : "write", optarg);
+                            print_usage ();
+                        }
+                        (flag == 'I' ? READ_LIMIT : WRITE_LIMIT).set (limit);
+                        break;
+
+            case 'P':   /* --max-cpu <percent> (of one CPU, 200 => two of them) */
+                        limit = strtoull (optarg, &end, 10);
+                        if (*end != '\x00' || limit == 0) {
+                            fprintf (stderr, "[-] malformed --max-cpu: %s\n", optarg);
+                            print_usage ();
+                        }
+                        CPU_LIMIT.set (limit * 10000000);           /* CPU ns per second */
+                        break;
+
+            case 'l':   /* --idle-io (idle I/O scheduling class) */
+                        IDLE_IO_FLAG = 1;
+                        break;
+
+            case 'q':   /* --quiet (errors only) */
+                        LOG_LEVEL = LOG_ERROR;
+                        break;
+
+            case 'v':   /* --verbose, once per level (-v: every file, -vv: internals too) */
+                        LOG_LEVEL = std::min (LOG_LEVEL + 1, (int) LOG_DEBUG);
+                        break;
+
+            case 'S':   /* --stats[=table|json] (report timings, counters and resource usage at exit) */
+                        if (optarg && std::string (optarg) != "table" && std::string (optarg) != "json") {
+                            fprintf (stderr, "[-] unknown --stats format: %s\n", optarg);
+                            print_usage ();
+                        }
+                        STATS.enable (optarg && std::string (optarg) == "json");
+                        break;
+
+            case 'm':   /* --merge <a.kgs> [b.kgs ...] (the rest are picked up as operands) */
+                        MERGE_FLAG = 1;
+                        MERGE_INPUTS.push_back (optarg);
+                        break;
+
+            case 'i':   /* --exec <archived_path> [-- args ...] (the args are picked up as operands) */
+                        EXEC_FLAG   = 1;
+                        EXEC_TARGET = optarg;
+                        break;
+
+            case 's':   /* --siblings (with --exec) */
+                        SIBLINGS_FLAG = 1;
+                        break;
+
+            case 'U':   /* --update[=checksum] (only rewrite what differs from the existing <name>_dir) */
+                        UPDATE_FLAG = 1;
+                        if (optarg && std::string (optarg) == "checksum")
+                            UPDATE_FLAG = UPDATE_CHECKSUM;
+                        else if (optarg) {
+                            fprintf (stderr, "[-] unknown --update mode: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'E':   /* --delete (with --update: remove what the archive doesn't hold) */
+                        DELETE_FLAG = 1;
+                        break;
+
+            case 'J':   /* --journal */
+                        JOURNAL_FLAG = 1;
+                        break;
+
+            case 'R':   /* --resume (journaled, continues from <name>_dir.journal) */
+                        JOURNAL_FLAG = 1;
+                        RESUME_FLAG  = 1;
+                        break;
+
+            case 'y':   /* --durability <none|end|per-file|per-dir> (of what --unpack writes) */
+                        durability = optarg;
+                        if (durability == "none") {
+                            DURABILITY = Flusher::policy::FD_NONE;
+                        }
+                        else if (durability == "end") {
+                            DURABILITY = Flusher::policy::FD_END;
+                        }
+                        else if (durability == "per-file") {
+                            DURABILITY = Flusher::policy::FD_PER_FILE;
+                        }
+                        else if (durability == "per-dir") {
+                            DURABILITY = Flusher::policy::FD_PER_DIR;
+                        }
+                        else {
+                            fprintf (stderr, "[-] unknown --durability: %s\n", optarg);
+                            print_usage ();
+                        }
+                        break;
+
+            case 'D':   /* --diff <old.kgs> <new.kgs> (the new one is picked up as an operand) */
+                        DIFF_FLAG = 1;
+                        PATCH_INPUTS.push_back (optarg);
+                        break;
+
+            case 'a':   /* --apply-patch <old.kgs> <patch> (the patch is picked up as an operand) */
+                        APPLY_PATCH_FLAG = 1;
+                        PATCH_INPUTS.push_back (optarg);
+                        break;
+
             case 'h':   /* --help */
                         print_usage (); 
                         break;
@@ -88,20 +388,72 @@ void parse_cmdline_args (int argc, char **argv, std::string &password_key, std::
                         break;
         }
     }
+
+    /* "--unpack -" leaves the '-' behind as an operand: read the SFX from stdin. *
+     * With --merge, every operand is another SFX to merge; with --diff and      *
+     * --apply-patch the operand is the new SFX|patch; with --exec, operands     *
+     * (everything after "--") are the arguments of the archived executable.      */
+    for (; optind < argc; ++optind) {
+        if (UNPACK_FLAG && std::string (argv[optind]) == "-") {
+            STDIN_FLAG = 1;
+        }
+        else if (MERGE_FLAG) {
+            MERGE_INPUTS.push_back (argv[optind]);
+        }
+        else if (DIFF_FLAG | APPLY_PATCH_FLAG) {
+            PATCH_INPUTS.push_back (argv[optind]);
+        }
+        else if (EXEC_FLAG) {
+            EXEC_ARGS.push_back (argv[optind]);
+        }
+    }
 }
 
 
 void print_usage () {
 
+    display_banner ();
+
     std::cout << "\n" BOLDRED
               << "[-]" BOLDCYAN
               << " Usage: " BOLDGREEN "kavach " BOLDWHITE "[-p <target> | -u] -k <key> [-dh]\n\t" RESET
-	          << BOLDBLUE "-u" RESET " | " BOLDBLUE "--unpack                           " RESET ":" DIM YELLOW " unpack the data content from invoked SFX\n\t" RESET
+	          << BOLDBLUE "-u" RESET " | " BOLDBLUE "--unpack  [-]                      " RESET ":" DIM YELLOW " unpack the data content from invoked SFX (or an SFX piped into stdin)\n\t" RESET
+              << BOLDBLUE "-U" RESET " | " BOLDBLUE "--update[=checksum]                " RESET ":" DIM YELLOW " with --unpack, only rewrite files differing (size|mtime, or content) from <name>_dir\n\t" RESET
+              << BOLDBLUE "-E" RESET " | " BOLDBLUE "--delete                           " RESET ":" DIM YELLOW " with --update, delete what is no longer in the archive\n\t" RESET
+              << BOLDBLUE "-J" RESET " | " BOLDBLUE "--journal                          " RESET ":" DIM YELLOW " with --unpack, checkpoint progress every second into <name>_dir.journal\n\t" RESET
+              << BOLDBLUE "-R" RESET " | " BOLDBLUE "--resume                           " RESET ":" DIM YELLOW " with --unpack, continue an interrupted journaled unpack\n\t" RESET
+              << BOLDBLUE "-y" RESET " | " BOLDBLUE "--durability <mode>                " RESET ":" DIM YELLOW " with --unpack, none|end (one syncfs)|per-file|per-dir (batched fdatasync) (default: none)\n\t" RESET
               << BOLDBLUE "-p" RESET " | " BOLDBLUE "--pack    <target_location>        " RESET ":" DIM YELLOW " pack target @ (dir|file) location\n\t" RESET
-              << BOLDBLUE "-d" RESET " | " BOLDBLUE "--destroy-relics                   " RESET ":" DIM YELLOW " delete all files after packing into kavach generated SFX binary\n\t" RESET
-              << BOLDBLUE "-o" RESET " | " BOLDBLUE "--output                           " RESET ":" DIM YELLOW " output filename for kavach generated SFX binary\n\t" RESET
+              << BOLDBLUE "-W" RESET " | " BOLDBLUE "--watch <dir>                      " RESET ":" DIM YELLOW " keep <output>.kgs in sync with dir until interrupted (appends only what changed)\n\t" RESET
+              << BOLDBLUE "-F" RESET " | " BOLDBLUE "--files-from <file|->              " RESET ":" DIM YELLOW " pack exactly the NUL separated paths listed (instead of --pack)\n\t" RESET
+              << BOLDBLUE "-x" RESET " | " BOLDBLUE "--exclude <pattern>                " RESET ":" DIM YELLOW " skip paths matching a gitignore style pattern while packing\n\t" RESET
+              << BOLDBLUE "-X" RESET " | " BOLDBLUE "--exclude-from <file>              " RESET ":" DIM YELLOW " read exclude patterns (one per line) from file\n\t" RESET
+              << BOLDBLUE "-b" RESET " | " BOLDBLUE "--cache-dir <dir>                  " RESET ":" DIM YELLOW " reuse scrambled bodies of unchanged files across packs\n\t" RESET
+              << BOLDBLUE "-B" RESET " | " BOLDBLUE "--cache-size <bytes>[K|M|G]        " RESET ":" DIM YELLOW " evict least recently used cache blobs beyond this (default: 1G)\n\t" RESET
+              << BOLDBLUE "-L" RESET " | " BOLDBLUE "--volume-size <bytes>[K|M|G]       " RESET ":" DIM YELLOW " split the payload into <output>.kgs.001, .002 ... of at most this size (128K or more)\n\t" RESET
+              << BOLDBLUE "-I" RESET " | " BOLDBLUE "--max-read-bps <bytes>[K|M|G]      " RESET ":" DIM YELLOW " pace payload reads to at most this many bytes per second\n\t" RESET
+              << BOLDBLUE "-O" RESET " | " BOLDBLUE "--max-write-bps <bytes>[K|M|G]     " RESET ":" DIM YELLOW " pace payload writes to at most this many bytes per second\n\t" RESET
+              << BOLDBLUE "-P" RESET " | " BOLDBLUE "--max-cpu <percent>                " RESET ":" DIM YELLOW " keep kavach's CPU use under this percentage of one CPU (200 => two CPUs)\n\t" RESET
+              << BOLDBLUE "-l" RESET " | " BOLDBLUE "--idle-io                          " RESET ":" DIM YELLOW " only do disk I/O when nothing else wants the disk (idle I/O class)\n\t" RESET
+              << BOLDBLUE "-q" RESET " | " BOLDBLUE "--quiet                            " RESET ":" DIM YELLOW " only report errors\n\t" RESET
+              << BOLDBLUE "-v" RESET " | " BOLDBLUE "--verbose                          " RESET ":" DIM YELLOW " report every file (-v) and kavach's internals too (-vv)\n\t" RESET
+              << BOLDBLUE "-S" RESET " | " BOLDBLUE "--stats[=table|json]               " RESET ":" DIM YELLOW " at exit, report time per phase, files, bytes, syscalls, CPU time and peak RSS\n\t" RESET
+              << BOLDBLUE "-d" RESET " | " BOLDBLUE "--destroy-relics[=<seconds>]       " RESET ":" DIM YELLOW " delete all files after packing into kavach generated SFX binary (waiting at most <seconds>)\n\t" RESET
+              << BOLDBLUE "-o" RESET " | " BOLDBLUE "--output  <name|->                 " RESET ":" DIM YELLOW " output filename for kavach generated SFX binary (- for stdout)\n\t" RESET
               << BOLDBLUE "-e" RESET " | " BOLDBLUE "--encrypt <encrytion_type>         " RESET ":" DIM YELLOW " encrypt the payload before archiving\n\t" RESET
               << BOLDBLUE "-k" RESET " | " BOLDBLUE "--key     <password_key>           " RESET ":" DIM YELLOW " password key to pack|unpack\n\t" RESET
+              << BOLDBLUE "-n" RESET " | " BOLDBLUE "--nametab <raw|front-coded>        " RESET ":" DIM YELLOW " encoding of the names table (default: raw)\n\t" RESET
+              << BOLDBLUE "-c" RESET " | " BOLDBLUE "--checksum <crc32c|xxh64|none>     " RESET ":" DIM YELLOW " per-file payload checksum (default: crc32c)\n\t" RESET
+              << BOLDBLUE "-V" RESET " | " BOLDBLUE "--verify                           " RESET ":" DIM YELLOW " check every payload of invoked SFX without extracting\n\t" RESET
+              << BOLDBLUE "-C" RESET " | " BOLDBLUE "--cat     <archived_path>          " RESET ":" DIM YELLOW " write one archived file of invoked SFX to stdout\n\t" RESET
+              << BOLDBLUE "-i" RESET " | " BOLDBLUE "--exec    <archived_path> [-- args]" RESET ":" DIM YELLOW " run an archived executable of invoked SFX straight from memory\n\t" RESET
+              << BOLDBLUE "-s" RESET " | " BOLDBLUE "--siblings                         " RESET ":" DIM YELLOW " with --exec, also load the files next to it (see KAVACH_SIBLINGS)\n\t" RESET
+              << BOLDBLUE "-r" RESET " | " BOLDBLUE "--range   <offset>:[length]        " RESET ":" DIM YELLOW " with --cat, only write the given byte range\n\t" RESET
+              << BOLDBLUE "-m" RESET " | " BOLDBLUE "--merge   <a.kgs> [b.kgs ...]      " RESET ":" DIM YELLOW " merge SFX binaries into one (named by --output), each under its own directory\n\t" RESET
+              << BOLDBLUE "-D" RESET " | " BOLDBLUE "--diff    <old.kgs> <new.kgs>      " RESET ":" DIM YELLOW " write a patch (named by --output, - for stdout) turning old into new\n\t" RESET
+              << BOLDBLUE "-a" RESET " | " BOLDBLUE "--apply-patch <old.kgs> <patch|->  " RESET ":" DIM YELLOW " rebuild the new SFX binary (named by --output) from old and a patch\n\t" RESET
+              << BOLDBLUE "-T" RESET " | " BOLDBLUE "--from-tar <file|->                " RESET ":" DIM YELLOW " pack a tar stream into an SFX binary (named by --output)\n\t" RESET
+              << BOLDBLUE "-t" RESET " | " BOLDBLUE "--to-tar   <file|->                " RESET ":" DIM YELLOW " write contents of invoked SFX as a tar stream\n\t" RESET
               << BOLDBLUE "-h" RESET " | " BOLDBLUE "--help                             " RESET ":" DIM YELLOW " display help\n\t" RESET
               << "\n" RED 
               << "NOTE" RESET ": By default, kavach doesn't delete the files after packing.\n\n";
@@ -0,0 +1,291 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : relics.cpp                                                        *
+ *                                                                              *
+ * Description: Module responsible for destroying the relics (--destroy-relics) *
+ *              left behind by a pack. The packed tree is first renamed into a  *
+ *              hidden trash directory (gone from sight in a single syscall),   *
+ *              then torn down by a pool of threads, either while we wait or,   *
+ *              past a bounded wait, by a detached background process.          *
+ *                                                                              *
+ * Code Flow: <main> => <pack> => <destroy_relics> => <remove_relics>           *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "kavach.h"
+
+
+#define RELICS_DENTS_SIZE   0x8000              /* getdents64 buffer of every worker    */
+
+
+/* getdents64 (2) record, glibc has no wrapper for it */
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+/* a directory being emptied. Its fd stays open (subdirectories are opened and removed *
+ * relative to it) until the last of them is gone, then it removes itself.            */
+struct Relic {
+    Relic                   *parent;
+    int                     atfd;           /* parent's fd (the root: where it lives)   */
+    int                     fd;
+    std::string             name;
+    std::atomic<int64_t>    pending;        /* subdirectories left, +1 while it's read  */
+};
+
+/* directories waiting for a worker: LIFO keeps the walk depth first, and the number   *
+ * of directories held open close to (depth x workers)                                 */
+struct Trash {
+    std::vector<Relic *>    todo;
+    std::mutex              lock;
+    std::condition_variable ready;
+    unsigned                busy = 0;
+    std::atomic<uint64_t>   failed {0};
+};
+
+
+/* function prototypes */
+static bool remove_relics       (int atfd, const std::string &name);
+static void empty_relic         (Trash &trash, Relic *relic, uint8_t *dents);
+static void release_relic       (Trash &trash, Relic *relic);
+
+
+
+/****************************************************************************
+ * Destroys <path> (what was just packed). A directory is renamed into     *
+ * .kavach-trash-<pid> next to it first, so it is gone from view at once   *
+ * and a half deleted tree is never left under its own name. <wait> < 0    *
+ * waits for the removal to finish; otherwise it is handed to a detached   *
+ * process after <wait> seconds at most (0: immediately).                  *
+ ****************************************************************************/
+bool destroy_relics (std::string &path, int wait) {
+
+    struct stat     sb;
+    std::string     target = path;
+    std::string     parent, trash;
+    int             pipefd[2];
+    int             status;
+    pid_t           pid;
+    struct pollfd   pfd;
+
+    while (target.size() > 1 && target.back() == '/') {
+        target.pop_back ();
+    }
+    if (fstatat (AT_FDCWD, target.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        es = "while stat'ing " + target;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    if (!S_ISDIR (sb.st_mode)) {
+        if (unlink (target.c_str()) == -1) {
+            es = "while unlink'ing file: " + target;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        return true;
+    }
+
+    /* the trash lives in the same directory (hence filesystem): renaming into it is atomic */
+    size_t slash = target.find_last_of ('/');
+    parent = (slash == std::string::npos) ? "." : target.substr (0, slash);
+    trash  = parent + "/.kavach-trash-" + std::to_string (getpid ());
+    if (mkdir (trash.c_str(), S_IRWXU) == 0) {
+        if (rename (target.c_str(), (trash + "/relics").c_str()) == 0) {
+            target = trash;
+        }
+        else {
+            rmdir (trash.c_str());
+        }
+    }
+    if (target != trash) {
+        /* e.g. "." or a mount point: no way around deleting it in place */
+        debug_msg (LOG_DEBUG, "couldn't move " + target + " out of the way, deleting it in place");
+    }
+
+    if (wait < 0) {
+        return remove_relics (AT_FDCWD, target);
+    }
+
+    /* the child owns the removal; the pipe's EOF tells us it's done (or died) */
+    if (pipe (pipefd) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating pipe to relics remover");
+        return false;
+    }
+    pid = fork ();
+    if (pid == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while forking relics remover");
+        return false;
+    }
+    if (pid == 0) {
+        close (pipefd[0]);
+        setsid ();                              /* outlives our terminal session */
+        signal (SIGHUP, SIG_IGN);
+        _exit (remove_relics (AT_FDCWD, target) ? 0 : 1);
+    }
+    close (pipefd[1]);
+
+    pfd = {pipefd[0], POLLIN, 0};
+    while ((status = poll (&pfd, 1, wait * 1000)) == -1 && errno == EINTR);
+    close (pipefd[0]);
+
+    if (status == 0) {
+        ds = "relics are being removed in the background (pid " + std::to_string (pid) + ")";
+        debug_msg (LOG_INFO, ds);
+        return true;
+    }
+    if (waitpid (pid, &status, 0) == -1 || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+        log (__FILE__, __FUNCTION__, __LINE__, "relics remover failed");
+        return false;
+    }
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Removes the directory <name> (relative to <atfd>) with all its contents *
+ * using one worker per CPU. Each worker reads whole directories with      *
+ * getdents64 (2) and unlinks what it finds straight away; subdirectories  *
+ * go back on the shared stack, and a directory removes itself once the    *
+ * last of them is gone.                                                   *
+ ****************************************************************************/
+static bool remove_relics (int atfd, const std::string &name) {
+
+    Trash                       trash;
+    std::vector<std::thread>    workers;
+    unsigned                    nthreads;
+    struct rlimit               rl;
+
+    /* every directory being emptied holds an fd */
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &rl);
+    }
+
+    trash.todo.push_back (new Relic {nullptr, atfd, -1, name, {1}});
+
+    nthreads = std::max (1u, std::thread::hardware_concurrency ());
+    for (unsigned t = 0; t < nthreads; ++t) {
+        workers.emplace_back ([&trash] () {
+            std::unique_ptr<uint8_t[]> dents (new uint8_t[RELICS_DENTS_SIZE]);
+            Relic *relic;
+
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> guard (trash.lock);
+                    trash.ready.wait (guard, [&trash] () { return !trash.todo.empty() || trash.busy == 0; });
+                    if (trash.todo.empty()) {
+                        break;              /* nothing queued and nobody left to queue more */
+                    }
+                    relic = trash.todo.back ();
+                    trash.todo.pop_back ();
+                    ++trash.busy;
+                }
+
+                empty_relic (trash, relic, dents.get());
+
+                {
+                    std::lock_guard<std::mutex> guard (trash.lock);
+                    --trash.busy;
+                }
+                trash.ready.notify_all ();
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join ();
+    }
+
+    if (trash.failed) {
+        es = std::to_string (trash.failed) + " relic(s) couldn't be removed";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    return true;
+}
+
+
+
+/* unlinks every non-directory in <relic> and queues its subdirectories */
+static void empty_relic (Trash &trash, Relic *relic, uint8_t *dents) {
+
+    long            nread;
+    linux_dirent64  *dent;
+
+    relic->fd = openat (relic->atfd, relic->name.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (relic->fd == -1) {
+        debug_msg (LOG_ERROR, "while opening relic " + relic->name + ": " + strerror (errno));
+        ++trash.failed;
+        release_relic (trash, relic);
+        return;
+    }
+
+    while ((nread = syscall (SYS_getdents64, relic->fd, dents, RELICS_DENTS_SIZE)) > 0) {
+        for (long off = 0; off < nread; off += dent->d_reclen) {
+            dent = (linux_dirent64 *) (dents + off);
+            if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0) {
+                continue;
+            }
+
+            /* DT_UNKNOWN (some filesystems): a directory shows itself through EISDIR */
+            if ( dent->d_type != DT_DIR && (unlinkat (relic->fd, dent->d_name, 0) == 0 || errno == ENOENT) ) {
+                continue;
+            }
+            if (dent->d_type != DT_DIR && errno != EISDIR && errno != EPERM) {
+                debug_msg (LOG_ERROR, "while unlinking relic " + std::string (dent->d_name) + ": " + strerror (errno));
+                ++trash.failed;
+                continue;
+            }
+
+            ++relic->pending;
+            {
+                std::lock_guard<std::mutex> guard (trash.lock);
+                trash.todo.push_back (new Relic {relic, relic->fd, -1, dent->d_name, {1}});
+            }
+            trash.ready.notify_one ();
+        }
+    }
+    if (nread == -1) {
+        debug_msg (LOG_ERROR, "while reading relic " + relic->name + ": " + strerror (errno));
+        ++trash.failed;
+    }
+
+    release_relic (trash, relic);
+}
+
+
+
+/* drops one reference to <relic>: the last one removes it, which may complete its parent */
+static void release_relic (Trash &trash, Relic *relic) {
+
+    Relic *parent;
+
+    while (relic && --relic->pending == 0) {
+        if (relic->fd != -1) {
+            close (relic->fd);
+        }
+        if (unlinkat (relic->atfd, relic->name.c_str(), AT_REMOVEDIR) == -1 && errno != ENOENT) {
+            debug_msg (LOG_ERROR, "while removing relic " + relic->name + ": " + strerror (errno));
+            ++trash.failed;
+        }
+        parent = relic->parent;
+        delete relic;
+        relic = parent;
+    }
+}
@@ -0,0 +1,149 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : stats.cpp                                                         *
+ *                                                                              *
+ * Description: Module responsible for --stats: where a run spent its time      *
+ *              (phase timers), what it did (files, bytes, syscalls) and what   *
+ *              it cost (getrusage (2)), reported on stderr at exit as a table  *
+ *              or as a JSON document (--stats=json) for tooling.               *
+ *              Declared as Stats class (in kavach.h).                          *
+ *                                                                              *
+ * Code Flow: <parse_cmdline_args> => <Stats::enable>                           *
+ *            <exit> => <Stats::report>                                         *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/resource.h>
+
+#include "kavach.h"
+
+
+/* names as reported (JSON keys), in enum order */
+static const char *phase_names[SP_NUM]      = {"traverse", "map", "read", "transform", "write", "metadata", "sync"};
+static const char *counter_names[SC_NUM]    = {"files", "dirs", "links", "bytes_read", "bytes_written",
+                                               "reads", "writes", "copies", "short_reads", "short_writes"};
+
+
+/* function prototypes */
+static void     report_at_exit      ();
+static double   seconds             (uint64_t ns);
+static double   tv_seconds          (const struct timeval &tv);
+
+
+
+/* --stats[=json]: start the clock, the report is printed at exit () (or when main returns) */
+void Stats::enable (bool as_json) {
+
+    json    = as_json;
+    started = now ();
+    if (!on) {
+        on = true;
+        atexit (report_at_exit);
+    }
+}
+
+
+
+/* archive contents by type (pack: once the FHT is built, unpack: once it is mapped) */
+void Stats::count_fht (const Fhdr *fht, uint64_t fhnum) {
+
+    if (!on) {
+        return;
+    }
+    for (uint64_t i = 0; i < fhnum; ++i) {
+        switch (fht[i].fh_ftype) {
+            case Fhdr::ftype::FT_FILE:  count (SC_FILES);   break;
+            case Fhdr::ftype::FT_DIR:   count (SC_DIRS);    break;
+            case Fhdr::ftype::FT_LINK:  count (SC_LINKS);   break;
+            default:                    break;
+        }
+    }
+}
+
+
+
+/****************************************************************************
+ * Prints the report on stderr (stdout may carry --cat|--to-tar output).   *
+ * Phase times add up every thread, shares are of the wall clock and may   *
+ * thus add up to more than 100%. Throughput is over the wall clock too.   *
+ ****************************************************************************/
+void Stats::report () {
+
+    struct rusage   ru;
+    uint64_t        wall = now () - started;
+    std::string     out;
+    char            line[0x100];
+
+    getrusage (RUSAGE_SELF, &ru);
+    log_flush ();                   /* don't interleave with queued messages */
+
+    if (json) {
+        out = "{\"wall_s\": " + std::to_string (seconds (wall)) + ", \"phases_s\": {";
+        for (int p = 0; p < SP_NUM; ++p) {
+            out += std::string (p ? ", " : "") + "\"" + phase_names[p] + "\": " + std::to_string (seconds (phase_ns[p]));
+        }
+        out += "}, \"counters\": {";
+        for (int c = 0; c < SC_NUM; ++c) {
+            out += std::string (c ? ", " : "") + "\"" + counter_names[c] + "\": " + std::to_string (counters[c].load ());
+        }
+        out += "}, \"rusage\": {\"user_s\": "   + std::to_string (tv_seconds (ru.ru_utime)) +
+               ", \"system_s\": "               + std::to_string (tv_seconds (ru.ru_stime)) +
+               ", \"max_rss_kb\": "             + std::to_string (ru.ru_maxrss) +
+               ", \"major_faults\": "           + std::to_string (ru.ru_majflt) +
+               ", \"minor_faults\": "           + std::to_string (ru.ru_minflt) +
+               ", \"voluntary_switches\": "     + std::to_string (ru.ru_nvcsw) +
+               ", \"involuntary_switches\": "   + std::to_string (ru.ru_nivcsw) +
+               ", \"blocks_in\": "              + std::to_string (ru.ru_inblock) +
+               ", \"blocks_out\": "             + std::to_string (ru.ru_oublock) + "}}\n";
+        fputs (out.c_str(), stderr);
+        return;
+    }
+
+    snprintf (line, sizeof (line), "\n --stats (wall clock %.3f s)\n\n   %-16s %12s %8s\n", seconds (wall), "phase", "time (s)", "share");
+    out += line;
+    for (int p = 0; p < SP_NUM; ++p) {
+        snprintf (line, sizeof (line), "   %-16s %12.3f %7.1f%%\n", phase_names[p], seconds (phase_ns[p]),
+                  wall ? 100.0 * phase_ns[p] / wall : 0.0);
+        out += line;
+    }
+    out += "\n";
+    snprintf (line, sizeof (line), "   %-16s %12s\n", "counter", "value");
+    out += line;
+    for (int c = 0; c < SC_NUM; ++c) {
+        snprintf (line, sizeof (line), "   %-16s %12lu\n", counter_names[c], (unsigned long) counters[c].load ());
+        out += line;
+    }
+    out += "\n";
+    snprintf (line, sizeof (line), "   %-16s %12.1f MiB/s\n", "read rate", wall ? counters[SC_BYTES_READ] / seconds (wall) / 0x100000 : 0.0);
+    out += line;
+    snprintf (line, sizeof (line), "   %-16s %12.1f MiB/s\n", "write rate", wall ? counters[SC_BYTES_WRITTEN] / seconds (wall) / 0x100000 : 0.0);
+    out += line;
+    snprintf (line, sizeof (line), "   %-16s %12.3f s\n   %-16s %12.3f s\n", "user time", tv_seconds (ru.ru_utime), "system time", tv_seconds (ru.ru_stime));
+    out += line;
+    snprintf (line, sizeof (line), "   %-16s %12ld KiB\n   %-16s %12ld\n   %-16s %12ld\n", "peak rss", ru.ru_maxrss,
+              "major faults", ru.ru_majflt, "ctx switches", ru.ru_nvcsw + ru.ru_nivcsw);
+    out += line;
+    fputs (out.c_str(), stderr);
+}
+
+
+
+static void report_at_exit () {
+
+    STATS.report ();
+}
+
+
+
+static double seconds (uint64_t ns) {
+
+    return ns / 1e9;
+}
+
+
+
+static double tv_seconds (const struct timeval &tv) {
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,349 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : stream.cpp                                                        *
+ *                                                                              *
+ * Description: Module responsible for extracting an SFX read sequentially from *
+ *              a pipe (e.g. `cat x.kgs | ssh host kavach --unpack -`). Files   *
+ *              are written out as their bytes arrive; apart from the tables    *
+ *              nothing but a single PIPELINE_BLOCK_SIZE block is buffered.     *
+ *                                                                              *
+ * Code Flow: <main> => <unpack_stream>                                         *
+ *                                                                              *
+ ********************************************************************************/
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+/* function prototypes */
+static bool skip_bytes          (int infd, uint64_t count, uint8_t *block);
+static bool read_tables         (int infd, Kbhdr &header, std::vector<uint8_t> &tables, uint8_t *block);
+static bool stream_extract      (int infd, Kbhdr &header, std::vector<uint8_t> &tables, int entry_dirfd, std::string &key, uint8_t *block, Flusher &flusher);
+static bool receive_payload     (int infd, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum);
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool receive_body        (int infd, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum);
+
+
+
+/* Entry point to unpacking an SFX arriving on <infd> (which need not be seekable) */
+bool unpack_stream (int infd, std::string &target_location, std::string &key) {
+
+    Kbhdr                       header;
+    std::vector<uint8_t>        tables;
+    std::string                 out_archive;
+    int                         entry_dirfd;
+    bool                        status;
+    Flusher                     flusher;
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    posix_fadvise (infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (read_tables (infd, header, tables, block.get()) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading kavach binary format from stream");
+        return false;
+    }
+
+    /* create a directory by the name of target_location, same as unpack () does */
+    out_archive = target_location.substr(0, target_location.find_last_of("."));
+    out_archive += "_dir";
+    if (mkdir (out_archive.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
+        es = "while creating " + out_archive + " directory";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    entry_dirfd = open (out_archive.c_str(), O_RDONLY);
+    if ( entry_dirfd == -1) {
+        es = "while opening " + out_archive;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    status = stream_extract (infd, header, tables, entry_dirfd, key, block.get(), flusher);
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while extracting payload from stream");
+    }
+    else if (flusher.finish (entry_dirfd, out_archive) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while making extracted files durable");
+        status = false;
+    }
+
+    close (entry_dirfd);
+    return status;
+}
+
+
+
+/****************************************************************************
+ * Skips over the ELF stub (its size is derived from its own ELF header,    *
+ * just like get_kavach_binary_size () does) and reads Kbhdr followed by    *
+ * every table up to the start of the payload into <tables>, indexed by    *
+ * the same KBF relative offsets that the header records.                  *
+ ****************************************************************************/
+static bool read_tables (int infd, Kbhdr &header, std::vector<uint8_t> &tables, uint8_t *block) {
+
+    Elf64_Ehdr  ehdr;
+    uint64_t    signature;
+    uint64_t    stub_size;
+
+
+    if (read_full (infd, &ehdr, sizeof (Elf64_Ehdr)) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "couldn't read elf header of SFX");
+        return false;
+    }
+
+    memcpy (&signature, &ehdr.e_ident[0x8], sizeof (signature));
+    if (signature != PACK_SIGNATURE) {
+        log (__FILE__, __FUNCTION__, __LINE__, "stream isn't a packed kavach binary");
+        return false;
+    }
+
+    stub_size = ehdr.e_shoff + (ehdr.e_shnum * ehdr.e_shentsize);
+    if (stub_size < sizeof (Elf64_Ehdr) || skip_bytes (infd, stub_size - sizeof (Elf64_Ehdr), block) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "stream ended inside the ELF stub");
+        return false;
+    }
+
+    if (read_full (infd, &header, sizeof (Kbhdr)) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "couldn't read kavach binary header");
+        return false;
+    }
+
+    if ((header.k_flags & Kbhdr::flags::KBF_STREAM_ORDER) == 0) {
+        log (__FILE__, __FUNCTION__, __LINE__, "archive isn't stream ordered (repack it to unpack from a pipe)");
+        return false;
+    }
+
+    /* every table has to sit between the header and the payload */
+    if (header.k_fhtoff < sizeof (Kbhdr) || tables_in_bounds (&header, header.k_payloadoff) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "corrupt kavach binary header");
+        return false;
+    }
+
+    tables.resize (header.k_payloadoff);
+    memcpy (tables.data(), &header, sizeof (Kbhdr));
+    if (read_full (infd, tables.data() + sizeof (Kbhdr), header.k_payloadoff - sizeof (Kbhdr)) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "stream ended inside the kavach tables");
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Walks the FHT in order (iteratively, one dirfds entry per open dir) and  *
+ * pulls every file body off <infd> as the walk reaches it. Payload is     *
+ * consumed strictly forward, so file bodies must appear in FHT order.     *
+ * Directory timestamps are restored once their contents are written and   *
+ * <flusher> applies --durability to every file and directory.             *
+ ****************************************************************************/
+static bool stream_extract (int infd, Kbhdr &header, std::vector<uint8_t> &tables, int entry_dirfd, std::string &key, uint8_t *block, Flusher &flusher) {
+
+    Fhdr                *fht     = (Fhdr *) &tables[header.k_fhtoff];
+    NametabReader       nametab (&tables[header.k_nametaboff], header.k_nametabsz, header.k_nametabenc);
+    std::stack<int>     dirfds;
+    std::stack<uint64_t> dirndx;                /* FHT index of every dir on dirfds */
+    std::string         name;
+    uint64_t            position = 0;           /* bytes of payload consumed so far */
+    uint64_t            cksum;
+    int                 fd;
+    LinkTargets         links;
+
+
+    /* hardlinks point back at files that are already written by the time they are reached */
+    if (link_targets (fht, header.k_fhnum, nametab, links) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while resolving hardlink targets");
+        return false;
+    }
+
+    dirfds.push (entry_dirfd);
+
+    for (uint64_t i = 0; i < header.k_fhnum; ++i) {
+
+        Fhdr &fhdr = fht[i];
+
+        if (fhdr.is_dir_end ()) {
+            if (dirndx.empty()) {
+                log (__FILE__, __FUNCTION__, __LINE__, "unbalanced end of directory in FHT");
+                return false;
+            }
+            if (futimens (dirfds.top(), fht[dirndx.top()].fh_time) == -1) {
+                log (__FILE__, __FUNCTION__, __LINE__, "while writing saved timestamps for directory");
+                return false;
+            }
+            if (flusher.dir (dirfds.top()) == false) {
+                return false;
+            }
+            close (dirfds.top());
+            dirfds.pop ();
+            dirndx.pop ();
+            continue;
+        }
+
+        if (nametab.name (fhdr.fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            return false;
+        }
+
+        switch (fhdr.fh_ftype) {
+
+            case Fhdr::ftype::FT_FILE:
+                    if (fhdr.fh_etype != Fhdr::encrypt::FET_UND && key.empty()) {
+                        es = "decryption key not supplied for: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+
+                    /* bodies only ever move forward through the stream */
+                    if (fhdr.fh_offset < position) {
+                        es = "payload of " + name + " isn't in FHT order";
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    if (skip_bytes (infd, fhdr.fh_offset - position, block) == false) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "stream ended inside the payload");
+                        return false;
+                    }
+                    position = fhdr.fh_offset;
+
+                    fd = openat (dirfds.top(), name.c_str(), O_CREAT|O_WRONLY|O_TRUNC, fhdr.fh_mode);
+                    if (fd == -1) {
+                        es = "while creating file named: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+
+                    if (receive_payload (infd, fhdr, key, fd, block, cksum) == false) {
+                        es = "while writing payload to file: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        close (fd);
+                        return false;
+                    }
+                    position += fhdr.fh_size;
+
+                    if (fhdr.fh_cktype != Fhdr::cksum::FCK_UND && cksum != fhdr.fh_cksum) {
+                        es = "checksum mismatch (corrupt payload or wrong key) for: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        close (fd);
+                        return false;
+                    }
+
+                    /* timestamps go last, writing the body would bump them */
+                    if (futimens (fd, fhdr.fh_time) == -1) {
+                        es = "while writing saved timestamps for: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        close (fd);
+                        return false;
+                    }
+                    if (flusher.file (fd, dirfds.top(), name, name) == false) {
+                        return false;
+                    }
+                    break;
+
+            case Fhdr::ftype::FT_LINK:
+                    if (make_link (entry_dirfd, links[fhdr.fh_offset], dirfds.top(), name, fhdr, flusher) == false) {
+                        es = "while creating hardlink: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    break;
+
+            case Fhdr::ftype::FT_DIR:
+                    if (mkdirat (dirfds.top(), name.c_str(), fhdr.fh_mode) == -1) {
+                        es = "while creating directory: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+
+                    fd = openat (dirfds.top(), name.c_str(), O_RDONLY|O_DIRECTORY);
+                    if (fd == -1) {
+                        es = "while opening newly created directory: " + name;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    dirfds.push (fd);
+                    dirndx.push (i);
+                    break;
+
+            default:
+                    log (__FILE__, __FUNCTION__, __LINE__, "no such file type (while parsing FHT)");
+                    return false;
+        }
+    }
+
+    if (!dirndx.empty()) {
+        log (__FILE__, __FUNCTION__, __LINE__, "FHT ended inside a directory");
+        return false;
+    }
+    if (flusher.dir (entry_dirfd) == false) {
+        return false;
+    }
+
+    /* drain whatever trails the last body so the writer never sees EPIPE */
+    while (read (infd, block, PIPELINE_BLOCK_SIZE) > 0);
+
+    return true;
+}
+
+
+
+/* dispatches on the encryption type of <fhdr>, just like unpack_payload () */
+static bool receive_payload (int infd, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum) {
+
+    switch (fhdr.fh_etype) {
+        case Fhdr::encrypt::FET_UND:
+                    return receive_body<Fhdr::encrypt::FET_UND, PIPELINE::codec::NONE> (infd, fhdr, key, fd, block, cksum);
+        case Fhdr::encrypt::FET_XOR:
+                    return receive_body<Fhdr::encrypt::FET_XOR, PIPELINE::codec::NONE> (infd, fhdr, key, fd, block, cksum);
+        default:
+                    log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
+                    return false;
+    }
+}
+
+
+
+/* reads the body of <fhdr> off <infd> a block at a time: decrypt -> decompress -> checksum -> write */
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool receive_body (int infd, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum) {
+
+    auto unpacker = PIPELINE::make_unpacker<E, C> (fhdr.fh_cktype, key);
+
+    for (uint64_t off = 0; off < fhdr.fh_size; off += PIPELINE_BLOCK_SIZE) {
+        size_t len = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, fhdr.fh_size - off);
+
+        if (read_full (infd, block, len) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "stream ended inside a file body");
+            return false;
+        }
+
+        unpacker.run (block, len, off);
+
+        if (write_full (fd, block, len) == false) {
+            return false;
+        }
+    }
+
+    cksum = unpacker.template stage<PIPELINE::Checksum> ().digest ();
+    return true;
+}
+
+
+
+/* reads and throws away <count> bytes of <infd> */
+static bool skip_bytes (int infd, uint64_t count, uint8_t *block) {
+
+    while (count) {
+        size_t len = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, count);
+        if (read_full (infd, block, len) == false) {
+            return false;
+        }
+        count -= len;
+    }
+
+    return true;
+}
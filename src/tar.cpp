@@ -0,0 +1,848 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : tar.cpp                                                           *
+ *                                                                              *
+ * Description: Module responsible for converting between POSIX tar streams     *
+ *              and SFX binaries without touching the filesystem in between.    *
+ *              --from-tar builds an SFX (KBF_TRAILER layout) in one pass over  *
+ *              a tar stream, --to-tar streams an SFX's contents as a tar.      *
+ *              Understands ustar, GNU long names|links, pax path/size/mtime    *
+ *              and hardlinks (both ways, as FT_LINK entries).                  *
+ *                                                                              *
+ * Code Flow: <main> => <from_tar>                                              *
+ *            <main> => <to_tar>                                                *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <map>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_MAX_META_SIZE   0x100000            /* cap on GNU long name & pax header data   */
+#define TAR_MAX_OCTAL_SIZE  077777777777ULL     /* largest size an 11 digit field can hold  */
+
+/* POSIX ustar header (one TAR_BLOCK_SIZE block) */
+struct TarHeader {
+    char    name[100];
+    char    mode[8];
+    char    uid[8];
+    char    gid[8];
+    char    size[12];
+    char    mtime[12];
+    char    chksum[8];
+    char    typeflag;
+    char    linkname[100];
+    char    magic[6];
+    char    version[2];
+    char    uname[32];
+    char    gname[32];
+    char    devmajor[8];
+    char    devminor[8];
+    char    prefix[155];
+    char    pad[12];
+};
+static_assert (sizeof (TarHeader) == TAR_BLOCK_SIZE, "ustar header must fill one block");
+
+/* a tar entry waiting for its place in FHT (tar streams needn't be depth first) */
+struct TarNode {
+    Fhdr                            fhdr;
+    std::map<std::string, uint64_t> children;   /* name -> index into nodes, kept sorted */
+    std::string                     link;       /* FT_LINK: path of the file it links to */
+};
+
+
+/* function prototypes */
+static bool     read_entry_data     (int tarfd, uint64_t size, std::string &out);
+static bool     skip_entry_data     (int tarfd, uint64_t size, uint8_t *block);
+static bool     skip_padding        (int tarfd, uint64_t size, uint8_t *block);
+static bool     parse_number        (const char *field, size_t len, uint64_t &value);
+static bool     check_header        (TarHeader &hdr);
+static bool     is_zero_block       (TarHeader &hdr);
+static void     parse_pax           (const std::string &records, std::map<std::string, std::string> &pax);
+static bool     split_path          (const std::string &path, std::vector<std::string> &components);
+static int64_t  add_node            (std::vector<TarNode> &nodes, const std::string &path, Fhdr &fhdr);
+static int64_t  find_node           (std::vector<TarNode> &nodes, const std::string &path);
+static void     emit_fht            (std::vector<TarNode> &nodes, uint64_t n, Kavach &ko, std::vector<uint64_t> &at);
+static bool     link_nodes          (std::vector<TarNode> &nodes, std::vector<uint64_t> &at, Kavach &ko);
+static bool     write_entries       (uint8_t *kbf, uint64_t kbf_size, Kbhdr *header, int tarfd, std::string &key);
+static bool     write_header        (int tarfd, const std::string &path, Fhdr &fhdr, char type, const std::string &linkname);
+static void     fill_header         (TarHeader &hdr, const std::string &prefix, const std::string &name, mode_t mode, uint64_t size, int64_t mtime, char type, const std::string &linkname);
+
+
+
+/****************************************************************************
+ * Reads a tar stream from <tarfd> and writes an SFX to                     *
+ * <of_name>.FILE_EXTENSION (or stdout for "-"). Bodies are piped straight  *
+ * through the pack pipeline into the SFX as they arrive; the tree is kept  *
+ * as metadata only and turned into FHT, nametab & chunktab at the end.    *
+ ****************************************************************************/
+bool from_tar (int kfd, int tarfd, std::string &key, std::string &of_name) {
+
+    Kavach                      ko;
+    std::vector<TarNode>        nodes (1);              /* nodes[0]: the (unnamed) root */
+    std::vector<uint64_t>       at;                     /* node -> its FHT index        */
+    std::map<std::string, std::string> pax;
+    std::string                 long_name;
+    std::string                 long_link;
+    std::string                 meta;
+    std::string                 path;
+    TarHeader                   hdr;
+    struct stat                 ksb;
+    uint64_t                    signature = PACK_SIGNATURE;
+    uint64_t                    payload_pos = 0;
+    uint64_t                    size, mtime, mode;
+    int64_t                     ndx;
+    int                         outfd;
+    std::unique_ptr<uint8_t[]>  stub (new uint8_t[KAVACH_BINARY_SIZE]);
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+
+
+    if (of_name == "-") {
+        outfd = STDOUT_FILENO;
+        if (isatty (outfd)) {
+            log (__FILE__, __FUNCTION__, __LINE__, "refusing to write an SFX binary to a terminal");
+            return false;
+        }
+    }
+    else {
+        of_name += FILE_EXTENSION;
+        if (fstat (kfd, &ksb) == -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while fstat'ing kavach binary");
+            return false;
+        }
+        outfd = open (of_name.c_str(), O_RDWR|O_CREAT|O_EXCL, ksb.st_mode);
+        if (outfd == -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while creating SFX binary");
+            return false;
+        }
+    }
+
+    /* stub: a signed copy of kavach binary, .kavach shdr is patched once sizes are known */
+    if (pread_full (kfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading kavach binary");
+        return false;
+    }
+    memcpy (&stub[0x8], &signature, 0x8);
+    if (write_full (outfd, stub.get(), KAVACH_BINARY_SIZE) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing SFX stub");
+        return false;
+    }
+
+    while (true) {
+
+        if (read_full (tarfd, &hdr, sizeof (hdr)) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "tar stream ended without an end-of-archive marker");
+            return false;
+        }
+
+        /* a zero block marks the end of archive */
+        if (is_zero_block (hdr)) {
+            break;
+        }
+
+        if ( check_header (hdr) == false ||
+             parse_number (hdr.size, sizeof (hdr.size), size) == false ||
+             parse_number (hdr.mtime, sizeof (hdr.mtime), mtime) == false ||
+             parse_number (hdr.mode, sizeof (hdr.mode), mode) == false ) {
+            log (__FILE__, __FUNCTION__, __LINE__, "corrupt tar header");
+            return false;
+        }
+
+        /* metadata entries describe the entry that follows them */
+        if (hdr.typeflag == 'L' || hdr.typeflag == 'K' || hdr.typeflag == 'x') {
+            if (size > TAR_MAX_META_SIZE || read_entry_data (tarfd, size, meta) == false) {
+                log (__FILE__, __FUNCTION__, __LINE__, "while reading tar extended header");
+                return false;
+            }
+            if (hdr.typeflag == 'L') {
+                long_name = meta.substr (0, meta.find ('\x00'));
+            }
+            else if (hdr.typeflag == 'K') {
+                long_link = meta.substr (0, meta.find ('\x00'));
+            }
+            else {
+                parse_pax (meta, pax);
+            }
+            continue;
+        }
+
+        /* resolve this entry's path and attributes (pax > GNU long name > ustar) */
+        if (pax.count ("path")) {
+            path = pax["path"];
+        }
+        else if (!long_name.empty()) {
+            path = long_name;
+        }
+        else {
+            path.assign (hdr.name, strnlen (hdr.name, sizeof (hdr.name)));
+            if (memcmp (hdr.magic, "ustar", 5) == 0 && hdr.prefix[0] != '\x00') {
+                path = std::string (hdr.prefix, strnlen (hdr.prefix, sizeof (hdr.prefix))) + "/" + path;
+            }
+        }
+        if (pax.count ("size")) {
+            size = strtoull (pax["size"].c_str(), NULL, 10);
+        }
+        if (pax.count ("mtime")) {
+            mtime = strtoull (pax["mtime"].c_str(), NULL, 10);
+        }
+
+        Fhdr fhdr;
+        fhdr.fh_mode            = mode & 07777;
+        fhdr.fh_time[0].tv_sec  = pax.count ("atime") ? strtoull (pax["atime"].c_str(), NULL, 10) : mtime;
+        fhdr.fh_time[0].tv_nsec = 0;
+        fhdr.fh_time[1].tv_sec  = mtime;
+        fhdr.fh_time[1].tv_nsec = 0;
+
+        switch (hdr.typeflag) {
+
+            case '0':
+            case '7':
+            case '\x00':
+                    fhdr.fh_ftype       = Fhdr::FT_FILE;
+                    fhdr.fh_mode       |= S_IFREG;
+                    fhdr.fh_etype       = ENCRYPTION_TYPE;
+                    fhdr.fh_cktype      = CHECKSUM_TYPE;
+                    fhdr.fh_size        = size;
+                    fhdr.fh_offset      = payload_pos;
+                    fhdr.fh_chunkndx    = ko.chunktab.size();
+                    ko.chunktab.resize (ko.chunktab.size() + (size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE);
+
+                    ndx = add_node (nodes, path, fhdr);
+                    if (ndx == -1) {
+                        es = "tar entry doesn't fit in the tree: " + path;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+
+                    debug_msg (LOG_VERBOSE, "\tpacking: " + path);
+
+                    /* the body goes straight through the pack pipeline into the SFX */
+                    if (load_payload_fd (tarfd, fhdr, ko.chunktab.data() + fhdr.fh_chunkndx, key, outfd, block.get()) != size) {
+                        es = "while streaming tar entry: " + path;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    nodes[ndx].fhdr.fh_cksum = fhdr.fh_cksum;
+                    payload_pos += size;
+
+                    if (skip_padding (tarfd, size, block.get()) == false) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "tar stream ended inside an entry");
+                        return false;
+                    }
+                    break;
+
+            case '5':
+                    fhdr.fh_ftype       = Fhdr::FT_DIR;
+                    fhdr.fh_mode       |= S_IFDIR;
+                    if (add_node (nodes, path, fhdr) == -1) {
+                        es = "tar entry doesn't fit in the tree: " + path;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    if (skip_entry_data (tarfd, size, block.get()) == false) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "tar stream ended inside an entry");
+                        return false;
+                    }
+                    break;
+
+            case '1':
+                    /* a hardlink: resolved to an FT_LINK once the whole tree is known */
+                    fhdr.fh_ftype       = Fhdr::FT_LINK;
+                    fhdr.fh_mode       |= S_IFREG;
+                    ndx = add_node (nodes, path, fhdr);
+                    if (ndx == -1) {
+                        es = "tar entry doesn't fit in the tree: " + path;
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+                    }
+                    if (pax.count ("linkpath")) {
+                        nodes[ndx].link = pax["linkpath"];
+                    }
+                    else if (!long_link.empty()) {
+                        nodes[ndx].link = long_link;
+                    }
+                    else {
+                        nodes[ndx].link.assign (hdr.linkname, strnlen (hdr.linkname, sizeof (hdr.linkname)));
+                    }
+                    debug_msg (LOG_VERBOSE, "\tlinking: " + path);
+                    if (skip_entry_data (tarfd, size, block.get()) == false) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "tar stream ended inside an entry");
+                        return false;
+                    }
+                    break;
+
+            default:
+                    /* symlinks, devices, fifos & global headers have no KBF counterpart */
+                    if (hdr.typeflag != 'g') {
+                        debug_msg (LOG_INFO, "\tskipping (unsupported tar entry type): " + path);
+                    }
+                    if (skip_entry_data (tarfd, size, block.get()) == false) {
+                        log (__FILE__, __FUNCTION__, __LINE__, "tar stream ended inside an entry");
+                        return false;
+                    }
+                    break;
+        }
+
+        pax.clear ();
+        long_name.clear ();
+        long_link.clear ();
+    }
+
+    /* depth first FHT (with sentinels) out of the collected tree, hardlinks pointing into it */
+    at.resize (nodes.size());
+    emit_fht (nodes, 0, ko, at);
+    if (link_nodes (nodes, at, ko) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while resolving hardlinks");
+        return false;
+    }
+    if (ko.nametab.finalize (NAMETAB_ENCODING, ko.fht) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while encoding nametab");
+        return false;
+    }
+    ko.header.k_nametabenc  = NAMETAB_ENCODING;
+    ko.header.k_payloadsz   = payload_pos;
+    layout_trailer (ko);
+
+    if (write_trailer (outfd, ko) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing kavach tables to SFX binary");
+        return false;
+    }
+
+    /* patch .kavach shdr now that ARCHIVE_SIZE is known (impossible on a pipe) */
+    patch_sfx_metadata (outfd, stub.get(), ko);
+    if (pwrite_full (outfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false) {
+        if (errno != ESPIPE) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while patching SFX metadata");
+            return false;
+        }
+        debug_msg (LOG_DEBUG, "SFX written to a pipe, .kavach section header left unpatched");
+    }
+
+    /* drain whatever trails the end-of-archive marker so the writer never sees EPIPE */
+    while (read (tarfd, block.get(), PIPELINE_BLOCK_SIZE) > 0);
+
+    if (outfd != STDOUT_FILENO) {
+        close (outfd);
+    }
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Streams every entry of the invoked SFX to <tarfd> as a POSIX tar. Plain  *
+ * bodies are written straight out of the mapping, the rest goes through    *
+ * the unpack pipeline a block at a time; checksums are verified on the     *
+ * way. Paths too long for ustar are carried in pax headers.               *
+ ****************************************************************************/
+bool to_tar (int sfxfd, int tarfd, std::string &key) {
+
+    uint8_t     *map;
+    uint64_t    map_size;
+    uint64_t    remainder;
+    Kbhdr       *header;
+    bool        status;
+
+
+    if (isatty (tarfd)) {
+        log (__FILE__, __FUNCTION__, __LINE__, "refusing to write a tar stream to a terminal");
+        return false;
+    }
+
+    if (map_kbf (sfxfd, map, map_size, remainder, header) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
+        return false;
+    }
+
+    madvise (map, map_size, MADV_SEQUENTIAL);
+
+    status = write_entries (map + remainder, map_size - remainder, header, tarfd, key);
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing tar stream");
+    }
+
+    munmap (map, map_size);
+    return status;
+}
+
+
+
+/* walks FHT of the KBF at <kbf>, writing a tar entry for each FHT entry + the end-of-archive marker */
+static bool write_entries (uint8_t *kbf, uint64_t kbf_size, Kbhdr *header, int tarfd, std::string &key) {
+
+    Fhdr                        *fht     = (Fhdr *)    &kbf[header->k_fhtoff];
+    uint8_t                     *payload = (uint8_t *) &kbf[header->k_payloadoff];
+    NametabReader               nametab ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+    std::vector<std::string>    dirs;
+    std::string                 name;
+    std::string                 path;
+    uint64_t                    cksum;
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+    static const uint8_t        zeros[2 * TAR_BLOCK_SIZE] = { 0 };
+    LinkTargets                 links;
+
+
+    /* hardlinks become type '1' entries naming the (earlier) file they link to */
+    if (link_targets (fht, header->k_fhnum, nametab, links) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while resolving hardlink targets");
+        return false;
+    }
+
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+
+        Fhdr &fhdr = fht[i];
+
+        if (fhdr.is_dir_end ()) {
+            if (!dirs.empty()) {
+                dirs.pop_back ();
+            }
+            continue;
+        }
+
+        if (nametab.name (fhdr.fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            return false;
+        }
+        path = dirs.empty() ? name : dirs.back() + "/" + name;
+
+        if (fhdr.fh_ftype == Fhdr::ftype::FT_DIR) {
+            if (write_header (tarfd, path + "/", fhdr, '5', "") == false) {
+                return false;
+            }
+            dirs.push_back (path);
+            continue;
+        }
+
+        if (fhdr.fh_etype != Fhdr::encrypt::FET_UND && key.empty()) {
+            es = "decryption key not supplied for: " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        if (fhdr.fh_ftype == Fhdr::ftype::FT_LINK) {
+            if (write_header (tarfd, path, fhdr, '1', links[fhdr.fh_offset]) == false) {
+                es = "while writing tar entry: " + path;
+                log (__FILE__, __FUNCTION__, __LINE__, es);
+                return false;
+            }
+            continue;
+        }
+
+        if (body_in_bounds (header, fhdr, kbf_size) == false) {
+            es = "file body out of payload bounds: " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        if ( write_header (tarfd, path, fhdr, '0', "") == false ||
+             unpack_payload (&payload[fhdr.fh_offset], fhdr, key, tarfd, block.get(), cksum) == false ||
+             write_full (tarfd, zeros, (TAR_BLOCK_SIZE - fhdr.fh_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE) == false ) {
+            es = "while writing tar entry: " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+
+        if (fhdr.fh_cktype != Fhdr::cksum::FCK_UND && cksum != fhdr.fh_cksum) {
+            es = "checksum mismatch (corrupt payload or wrong key) for: " + path;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+    }
+
+    /* end of archive: two zero blocks */
+    return write_full (tarfd, zeros, sizeof (zeros));
+}
+
+
+
+/* reads <size> bytes of entry data (plus block padding) into <out> */
+static bool read_entry_data (int tarfd, uint64_t size, std::string &out) {
+
+    uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    out.resize (padded);
+    if (read_full (tarfd, &out[0], padded) == false) {
+        return false;
+    }
+    out.resize (size);
+    return true;
+}
+
+
+
+/* skips <size> bytes of entry data (plus block padding) */
+static bool skip_entry_data (int tarfd, uint64_t size, uint8_t *block) {
+
+    uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    while (padded) {
+        size_t len = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, padded);
+        if (read_full (tarfd, block, len) == false) {
+            return false;
+        }
+        padded -= len;
+    }
+
+    return true;
+}
+
+
+
+/* skips the padding that follows <size> bytes of already consumed entry data */
+static bool skip_padding (int tarfd, uint64_t size, uint8_t *block) {
+
+    return read_full (tarfd, block, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+
+
+/* parses a numeric header field: octal text, or GNU base-256 if the top bit is set */
+static bool parse_number (const char *field, size_t len, uint64_t &value) {
+
+    size_t i = 0;
+
+    value = 0;
+    if ((uint8_t) field[0] & 0x80) {
+        value = (uint8_t) field[0] & 0x7f;
+        for (i = 1; i < len; ++i) {
+            value = (value << 8) | (uint8_t) field[i];
+        }
+        return true;
+    }
+
+    while (i < len && field[i] == ' ') {
+        ++i;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | (field[i] - '0');
+    }
+
+    return i == len || field[i] == ' ' || field[i] == '\x00';
+}
+
+
+
+/* checks the header checksum (sum of all bytes with the chksum field read as spaces) */
+static bool check_header (TarHeader &hdr) {
+
+    const uint8_t   *bytes = (const uint8_t *) &hdr;
+    uint64_t        stored;
+    uint64_t        sum = 0;
+
+    for (size_t i = 0; i < sizeof (TarHeader); ++i) {
+        bool in_chksum = (i >= offsetof (TarHeader, chksum) && i < offsetof (TarHeader, chksum) + sizeof (hdr.chksum));
+        sum += in_chksum ? ' ' : bytes[i];
+    }
+
+    return parse_number (hdr.chksum, sizeof (hdr.chksum), stored) && stored == sum;
+}
+
+
+
+/* splits pax records ("<len> <key>=<value>\n") into <pax> */
+static void parse_pax (const std::string &records, std::map<std::string, std::string> &pax) {
+
+    size_t pos = 0;
+
+    while (pos < records.size()) {
+        char    *end;
+        size_t  len = strtoull (records.c_str() + pos, &end, 10);
+        size_t  key = end - records.c_str() + 1;
+
+        if (len == 0 || pos + len > records.size() || *end != ' ') {
+            return;
+        }
+
+        size_t eq = records.find ('=', key);
+        if (eq != std::string::npos && eq < pos + len) {
+            pax[records.substr (key, eq - key)] = records.substr (eq + 1, pos + len - eq - 2);
+        }
+        pos += len;
+    }
+}
+
+
+
+/* splits <path> into its components (less "" and "."). False if it is empty or escapes the root via ".." */
+static bool split_path (const std::string &path, std::vector<std::string> &components) {
+
+    size_t      start = 0;
+
+    while (start <= path.size()) {
+        size_t end = path.find ('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string component = path.substr (start, end - start);
+        if (component == "..") {
+            return false;
+        }
+        if (!component.empty() && component != ".") {
+            components.push_back (component);
+        }
+        start = end + 1;
+    }
+
+    return !components.empty();
+}
+
+
+
+/* Places <fhdr> at <path> in the tree, creating missing parent directories on the way. *
+ * A later entry for the same path replaces the earlier one (as tar itself does).       *
+ * Returns the node index or -1 if <path> is unusable (e.g. escapes the root via "..") */
+static int64_t add_node (std::vector<TarNode> &nodes, const std::string &path, Fhdr &fhdr) {
+
+    std::vector<std::string>    components;
+    uint64_t                    cur = 0;
+
+    if (split_path (path, components) == false) {
+        return -1;
+    }
+
+    for (size_t level = 0; level < components.size(); ++level) {
+        auto it = nodes[cur].children.find (components[level]);
+        uint64_t next;
+
+        if (it == nodes[cur].children.end()) {
+            /* implied parent directory (tar streams may omit directory entries) */
+            next = nodes.size();
+            nodes.emplace_back ();
+            nodes[next].fhdr.fh_ftype   = Fhdr::FT_DIR;
+            nodes[next].fhdr.fh_mode    = S_IFDIR | 0755;
+            nodes[next].fhdr.fh_time[0] = fhdr.fh_time[0];
+            nodes[next].fhdr.fh_time[1] = fhdr.fh_time[1];
+            nodes[cur].children.emplace (components[level], next);
+        }
+        else {
+            next = it->second;
+        }
+
+        if (level + 1 < components.size() && nodes[next].fhdr.fh_ftype != Fhdr::FT_DIR) {
+            return -1;
+        }
+        cur = next;
+    }
+
+    /* a file can't replace a directory that already has contents (nor vice versa) */
+    if (nodes[cur].fhdr.fh_ftype != fhdr.fh_ftype && !nodes[cur].children.empty()) {
+        return -1;
+    }
+
+    nodes[cur].fhdr = fhdr;
+    return cur;
+}
+
+
+
+/* the node at <path>, or -1 if there is none */
+static int64_t find_node (std::vector<TarNode> &nodes, const std::string &path) {
+
+    std::vector<std::string>    components;
+    uint64_t                    cur = 0;
+
+    if (split_path (path, components) == false) {
+        return -1;
+    }
+    for (auto &component: components) {
+        auto it = nodes[cur].children.find (component);
+        if (it == nodes[cur].children.end()) {
+            return -1;
+        }
+        cur = it->second;
+    }
+    return cur;
+}
+
+
+
+/* appends the subtree below node <n> to ko.fht, depth first in name order (<at>: node -> FHT index) */
+static void emit_fht (std::vector<TarNode> &nodes, uint64_t n, Kavach &ko, std::vector<uint64_t> &at) {
+
+    for (auto &child: nodes[n].children) {
+        Fhdr fhdr = nodes[child.second].fhdr;
+
+        fhdr.fh_namendx = ko.nametab.intern (child.first);
+        at[child.second] = ko.fht.size();
+        ko.fht.push_back (fhdr);
+
+        if (fhdr.fh_ftype == Fhdr::FT_DIR) {
+            emit_fht (nodes, child.second, ko, at);
+            ko.fht.push_back (Fhdr ());         /* end of directory sentinel */
+        }
+    }
+}
+
+
+
+/****************************************************************************
+ * Turns the hardlink nodes into FT_LINK entries. An FT_LINK has to point   *
+ * back at an earlier FT_FILE, but the FHT is in name order: when a link    *
+ * is emitted before its file, the link takes over the body and the file   *
+ * becomes a link to it (hardlinks share mode and times anyway).           *
+ ****************************************************************************/
+static bool link_nodes (std::vector<TarNode> &nodes, std::vector<uint64_t> &at, Kavach &ko) {
+
+    std::map<uint64_t, std::vector<uint64_t>>   groups;     /* file node -> nodes sharing its body */
+
+    for (uint64_t n = 1; n < nodes.size(); ++n) {
+        int64_t     target = n;
+
+        if (nodes[n].fhdr.fh_ftype != Fhdr::FT_LINK) {
+            continue;
+        }
+        /* a link may name another link (of the same file) */
+        for (uint64_t hops = 0; target != -1 && nodes[target].fhdr.fh_ftype == Fhdr::FT_LINK && hops < nodes.size(); ++hops) {
+            target = find_node (nodes, nodes[target].link);
+        }
+        if (target == -1 || nodes[target].fhdr.fh_ftype != Fhdr::FT_FILE) {
+            es = "hardlink to a file missing from the tar stream: " + nodes[n].link;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        groups[target].push_back (n);
+    }
+
+    for (auto &[file, links]: groups) {
+        Fhdr        body  = ko.fht[at[file]];
+        uint64_t    first = at[file];
+
+        links.push_back (file);
+        for (uint64_t n: links) {
+            first = std::min (first, at[n]);
+        }
+
+        for (uint64_t n: links) {
+            Fhdr        &fhdr    = ko.fht[at[n]];
+            uint64_t    namendx  = fhdr.fh_namendx;
+
+            if (at[n] == first) {
+                fhdr            = body;
+                fhdr.fh_namendx = namendx;
+                continue;
+            }
+            fhdr.fh_ftype       = Fhdr::FT_LINK;
+            fhdr.fh_mode        = body.fh_mode;
+            fhdr.fh_offset      = first;
+            fhdr.fh_size        = body.fh_size;
+            fhdr.fh_etype       = Fhdr::encrypt::FET_UND;
+            fhdr.fh_cktype      = Fhdr::cksum::FCK_UND;
+            fhdr.fh_cksum       = 0;
+            fhdr.fh_chunkndx    = 0;
+        }
+    }
+
+    return true;
+}
+
+
+
+/* writes the ustar header for <path>, preceded by a pax header when path or size don't fit */
+static bool write_header (int tarfd, const std::string &path, Fhdr &fhdr, char type, const std::string &linkname) {
+
+    TarHeader   hdr;
+    std::string records;
+    std::string name   = path;
+    uint64_t    size   = (type == '0') ? fhdr.fh_size : 0;
+    int64_t     mtime  = fhdr.fh_time[1].tv_sec;
+    size_t      split  = std::string::npos;
+
+    /* ustar: up to 155 bytes of prefix + '/' + up to 100 bytes of name */
+    if (path.size() > sizeof (hdr.name)) {
+        for (size_t slash = path.find ('/'); slash != std::string::npos && slash < path.size() - 1; slash = path.find ('/', slash + 1)) {
+            if (slash <= sizeof (hdr.prefix) && path.size() - slash - 1 <= sizeof (hdr.name)) {
+                split = slash;
+                break;
+            }
+        }
+    }
+
+    auto add_record = [&records] (const std::string &key, const std::string &value) {
+        std::string body = " " + key + "=" + value + "\n";
+        size_t      len  = body.size() + 1;
+        while (std::to_string (len).size() + body.size() != len) {
+            ++len;
+        }
+        records += std::to_string (len) + body;
+    };
+
+    if (path.size() > sizeof (hdr.name) && split == std::string::npos) {
+        add_record ("path", path);
+        name = path.substr (path.size() - sizeof (hdr.name));
+    }
+    if (size > TAR_MAX_OCTAL_SIZE) {
+        add_record ("size", std::to_string (size));
+    }
+    if (linkname.size() > sizeof (hdr.linkname)) {
+        add_record ("linkpath", linkname);
+    }
+
+    if (!records.empty()) {
+        static const uint8_t zeros[TAR_BLOCK_SIZE] = { 0 };
+
+        fill_header (hdr, "", "PaxHeader", 0644, records.size(), mtime, 'x', "");
+        if ( write_full (tarfd, &hdr, sizeof (hdr)) == false ||
+             write_full (tarfd, records.data(), records.size()) == false ||
+             write_full (tarfd, zeros, (TAR_BLOCK_SIZE - records.size() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE) == false ) {
+            return false;
+        }
+    }
+
+    if (split != std::string::npos) {
+        fill_header (hdr, path.substr (0, split), path.substr (split + 1), fhdr.fh_mode, size, mtime, type, linkname);
+    }
+    else {
+        fill_header (hdr, "", name, fhdr.fh_mode, size, mtime, type, linkname);
+    }
+
+    return write_full (tarfd, &hdr, sizeof (hdr));
+}
+
+
+
+/* fills a ustar header (checksum included) */
+static void fill_header (TarHeader &hdr, const std::string &prefix, const std::string &name, mode_t mode, uint64_t size, int64_t mtime, char type, const std::string &linkname) {
+
+    const uint8_t   *bytes = (const uint8_t *) &hdr;
+    uint64_t        sum = 0;
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.name, name.data(), std::min (name.size(), sizeof (hdr.name)));
+    memcpy (hdr.prefix, prefix.data(), std::min (prefix.size(), sizeof (hdr.prefix)));
+    memcpy (hdr.linkname, linkname.data(), std::min (linkname.size(), sizeof (hdr.linkname)));
+
+    snprintf (hdr.mode,  sizeof (hdr.mode),  "%07o",   (unsigned) (mode & 07777));
+    snprintf (hdr.uid,   sizeof (hdr.uid),   "%07o",   0u);
+    snprintf (hdr.gid,   sizeof (hdr.gid),   "%07o",   0u);
+    snprintf (hdr.size,  sizeof (hdr.size),  "%011lo", (unsigned long) (size > TAR_MAX_OCTAL_SIZE ? 0 : size));
+    snprintf (hdr.mtime, sizeof (hdr.mtime), "%011lo", (unsigned long) std::max<int64_t> (0, std::min<int64_t> (mtime, TAR_MAX_OCTAL_SIZE)));
+    hdr.typeflag = type;
+    memcpy (hdr.magic, "ustar", 6);
+    memcpy (hdr.version, "00", 2);
+
+    memset (hdr.chksum, ' ', sizeof (hdr.chksum));
+    for (size_t i = 0; i < sizeof (hdr); ++i) {
+        sum += bytes[i];
+    }
+    snprintf (hdr.chksum, sizeof (hdr.chksum), "%06lo", (unsigned long) sum);
+}
+
+
+
+/* true for the all-zero blocks that end a tar archive */
+static bool is_zero_block (TarHeader &hdr) {
+
+    const uint8_t *bytes = (const uint8_t *) &hdr;
+
+    for (size_t i = 0; i < sizeof (hdr); ++i) {
+        if (bytes[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
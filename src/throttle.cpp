@@ -0,0 +1,113 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : throttle.cpp                                                      *
+ *                                                                              *
+ * Description: Module responsible for keeping kavach a good neighbour on busy  *
+ *              hosts: token buckets pacing payload reads (--max-read-bps),     *
+ *              writes (--max-write-bps) and the CPU burnt by the transforms    *
+ *              (--max-cpu), and the idle I/O scheduling class (--idle-io).     *
+ *              Declared as Throttle class (in kavach.h).                       *
+ *                                                                              *
+ * Code Flow: <main> => <set_idle_io>                                           *
+ *            <*_full> | <copy_range> | <drain_payload> => <Throttle::take>     *
+ *            <Pipeline::run> => <Throttle::take_cpu>                           *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "kavach.h"
+
+
+/* ioprio_set (2) has no glibc wrapper (nor header) */
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+
+/* function prototypes */
+static uint64_t clock_ns        (clockid_t clock);
+
+
+
+/****************************************************************************
+ * Books <n> units against the rate: the booking is paid off once the      *
+ * bucket's clock (next) has moved past it, and the caller sleeps until    *
+ * it is at most THROTTLE_BURST ahead of real time. Callers are expected   *
+ * to book small amounts (see slice ()) so that nobody sleeps for long.    *
+ ****************************************************************************/
+void Throttle::take (uint64_t n) {
+
+    uint64_t        now, wait = 0;
+    struct timespec ts;
+
+    if (rate == 0 || n == 0) {
+        return;
+    }
+
+    now = clock_ns (CLOCK_MONOTONIC);
+    {
+        std::lock_guard<std::mutex> guard (lock);
+
+        /* credit saved up while idle is capped: no burst after a pause */
+        if (next + THROTTLE_BURST < now) {
+            next = now - THROTTLE_BURST;
+        }
+        next += (uint64_t) ((unsigned __int128) n * 1000000000 / rate);
+        if (next > now + THROTTLE_BURST) {
+            wait = next - now - THROTTLE_BURST;
+        }
+    }
+
+    ts = {(time_t) (wait / 1000000000), (long) (wait % 1000000000)};
+    while (wait && nanosleep (&ts, &ts) == -1 && errno == EINTR);
+}
+
+
+
+/* books the CPU time the whole process burnt since the last call (by any thread) */
+void Throttle::take_cpu () {
+
+    uint64_t now;
+
+    if (rate == 0) {
+        return;
+    }
+    now = clock_ns (CLOCK_PROCESS_CPUTIME_ID);
+    take (now - std::min (now, cpu_seen.exchange (now)));
+}
+
+
+
+/* caps a pool of <n> threads at as many as a CPU bucket lets run at full speed */
+unsigned Throttle::threads (unsigned n) const {
+
+    if (rate == 0) {
+        return n;
+    }
+    return std::max (1u, std::min (n, (unsigned) ((rate + 999999999) / 1000000000)));
+}
+
+
+
+/* --idle-io: only touch the disk when nobody else wants it. Threads started later inherit it */
+bool set_idle_io () {
+
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while switching to the idle I/O class");
+        return false;
+    }
+    return true;
+}
+
+
+
+static uint64_t clock_ns (clockid_t clock) {
+
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -11,50 +11,102 @@
  ********************************************************************************/
 
 #include "kavach.h"
+#include "pipeline.h"
+
+
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <unordered_set>
+
+
+/* a directory being extracted into: its fd, its FHT entry (timestamps are set once its   *
+ * contents are complete) and, for --delete, the names the archive holds for it           */
+struct OpenDir {
+    int                             fd;
+    int64_t                         ndx;        /* -1: the extraction root */
+    std::unordered_set<std::string> names;
+};
+
+/* --update tallies (per thread, as is everything an unpack keeps) */
+static thread_local uint64_t updated, unchanged, deleted;
+
+/* --durability of everything this unpack writes */
+static thread_local Flusher  flusher;
 
 
 /* function prototypes */
 static bool is_packed           (int kfd);
-static bool extract             (uint8_t *map, int entry_dirfd, std::string &key);
-static bool _extract            (uint8_t *map, Kbhdr *header, uint8_t *nametab, uint8_t *payload, std::string &key, Fhdr *fht, uint64_t i, std::stack<int> &dirfds);
+static bool unpack_kbf          (int sfxfd, uint8_t *kbf, uint64_t kbf_size, Kbhdr *header, std::string &target_location, std::string &key);
+static bool extract             (uint8_t *map, uint64_t kbf_size, Kbhdr *header, int entry_dirfd, std::string &key, Journal *journal);
+static bool _extract            (Kbhdr *header, NametabReader &nametab, uint8_t *payload, std::string &key, Fhdr *fht, uint64_t i, std::stack<OpenDir> &dirfds, uint8_t *block, LinkTargets &links, int rootfd, Journal *journal);
+static bool extract_file        (uint8_t *payload, Fhdr &fhdr, std::string &key, int dirfd, const std::string &name, uint8_t *block, uint64_t i, Journal *journal);
+static uint64_t kbf_identity    (uint8_t *kbf, Kbhdr *header);
+static int  up_to_date          (int dirfd, const std::string &name, Fhdr &fhdr, uint8_t *block);
+static bool close_dir           (OpenDir &dir, Fhdr *fht);
+static bool remove_tree         (int dirfd, const char *name);
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool drain_payload       (const uint8_t *body, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum,
+                                 uint64_t from, const Cksum *resume, const Progress &progress);
 
 
 /* Entry point to unpacking SFX binary */
 bool unpack (int sfxfd, std::string &target_location, std::string &key) {
 
-    struct stat sfxsb;
     uint8_t     *map;
-    uint64_t    map_offset;
+    uint64_t    map_size;
     uint64_t    remainder;
-    std::string out_archive;
-    int         entry_dirfd;
+    Kbhdr       *header;
+    bool        status;
 
 
-    /* Verify that I am a packed binary */
-    if (is_packed (sfxfd) == false) {
-        log (__FILE__, __FUNCTION__, __LINE__, "this program is not a packed kavach binary");
-        return false;
-    }
+    /* nothing an earlier (failed) unpack on this thread queued is ours to flush */
+    flusher.reset ();
 
-    if ( fstat(sfxfd, &sfxsb) == -1) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while fstat'ing SFX binary");
+    /* Verify that I am a packed binary and map the kavach binary format (volumes are *
+     * mapped while extracting, as they turn up)                                      */
+    if (map_kbf (sfxfd, map, map_size, remainder, header, false) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
         return false;
     }
 
-    /* mmap kavach binary format. Offset to mmap must be a multiple of PAGE_SIZE. */
-    remainder   = (KAVACH_BINARY_SIZE % PAGE_SIZE);
-    map_offset  = KAVACH_BINARY_SIZE - remainder;
+    status = unpack_kbf (sfxfd, map + remainder, map_size - remainder, header, target_location, key);
 
-    map = (uint8_t *) mmap (NULL, sfxsb.st_size - map_offset, PROT_READ, MAP_SHARED, sfxfd, map_offset);
-    if (map == MAP_FAILED) {
-        log (__FILE__, __FUNCTION__, __LINE__, "while mmap'ing kavach binary format");
-        return false;
-    }
+    munmap (map, map_size);
+    return status;
+}
+
+
+
+/* unpacks the (mapped) KBF at <kbf>, <kbf_size> bytes of SFX <sfxfd>, into <target_location> less its extension + "_dir" */
+static bool unpack_kbf (int sfxfd, uint8_t *kbf, uint64_t kbf_size, Kbhdr *header, std::string &target_location, std::string &key) {
+
+    std::string out_archive;
+    int         entry_dirfd;
+    Journal     journal;
+    bool        volumes;
+
+
+    volumes = (header->k_flags & Kbhdr::flags::KBF_VOLUMES);
+    updated = unchanged = deleted = 0;
+    STATS.count_fht ((Fhdr *) &kbf[header->k_fhtoff], header->k_fhnum);
 
     /* create a directory by the name of packed binary (target_location) */
     out_archive = target_location.substr(0, target_location.find_last_of("."));
     out_archive += "_dir";
-    if (mkdir (out_archive.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
+    if (JOURNAL_FLAG && UPDATE_FLAG) {
+        log (__FILE__, __FUNCTION__, __LINE__, "--update can simply be rerun, it doesn't take --journal|--resume");
+        return false;
+    }
+    if (volumes && (JOURNAL_FLAG || UPDATE_FLAG)) {
+        log (__FILE__, __FUNCTION__, __LINE__, "a multi-volume SFX can't be unpacked with --update|--journal|--resume");
+        return false;
+    }
+    if (DELETE_FLAG && !UPDATE_FLAG) {
+        log (__FILE__, __FUNCTION__, __LINE__, "--delete only goes with --update");
+        return false;
+    }
+    if (mkdir (out_archive.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1 && !((RESUME_FLAG || UPDATE_FLAG) && errno == EEXIST)) {
         es = "while creating " + out_archive + " directory";
         log (__FILE__, __FUNCTION__, __LINE__, es);
         return false;
@@ -68,12 +120,39 @@ bool unpack (int sfxfd, std::string &target_location, std::string &key) {
         return false;
     }
 
+    /* --journal: checkpoint progress into <out_archive>.journal (--resume: continue from it) */
+    if ( JOURNAL_FLAG &&
+         journal.open (out_archive + ".journal", entry_dirfd, kbf_identity (kbf, header), RESUME_FLAG) == false ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while opening extraction journal");
+        close (entry_dirfd);
+        return false;
+    }
+
     /* parse kavach binary format */
-    if (extract (map + remainder, entry_dirfd, key) == false) {
+    if ( volumes ? VOLUMES::extract (sfxfd, kbf, header, entry_dirfd, key) == false
+                 : extract (kbf, kbf_size, header, entry_dirfd, key, JOURNAL_FLAG ? &journal : nullptr) == false ) {
         log (__FILE__, __FUNCTION__, __LINE__, "while extracting kbf");
+        flusher.reset ();
+        close (entry_dirfd);
         return false;
     }
 
+    /* the journal only goes once the tree is as durable as asked for */
+    if (flusher.finish (entry_dirfd, out_archive) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while making extracted files durable");
+        flusher.reset ();
+        close (entry_dirfd);
+        return false;
+    }
+    journal.finish ();
+
+    if (UPDATE_FLAG) {
+        ds = "updated " + std::to_string (updated) + " file(s), " + std::to_string (unchanged) + " unchanged";
+        if (DELETE_FLAG) {
+            ds += ", " + std::to_string (deleted) + " deleted";
+        }
+        debug_msg (LOG_INFO, ds);
+    }
 
     close (entry_dirfd);
     return true;
@@ -82,19 +161,40 @@ bool unpack (int sfxfd, std::string &target_location, std::string &key) {
 
 
 /* Parse Kavach object and extract the payload in directory represented by entry_dirfd */
-static bool extract (uint8_t *map, int entry_dirfd, std::string &key) {
+static bool extract (uint8_t *map, uint64_t kbf_size, Kbhdr *header, int entry_dirfd, std::string &key, Journal *journal) {
 
-    Kbhdr               *header  = (Kbhdr *)   map;
     Fhdr                *fht     = (Fhdr *)    &map[header->k_fhtoff];
     uint8_t             *payload = (uint8_t *) &map[header->k_payloadoff];
-    uint8_t             *nametab = (uint8_t *) &map[header->k_nametaboff]; 
-    std::stack<int>     dirfds;
+    NametabReader       nametab ((uint8_t *) &map[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+    std::stack<OpenDir> dirfds;
+    std::unique_ptr<uint8_t[]> block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+    LinkTargets         links;
 
-    /* parse FHT recursively starting from 0th entry and extract each entry *
+    /* paths (below entry_dirfd) of the files that hardlinks point at */
+    if (link_targets (fht, header->k_fhnum, nametab, links) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while resolving hardlink targets");
+        return false;
+    }
+
+    /* refuse a corrupt FHT before anything is written */
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_FILE && body_in_bounds (header, fht[i], kbf_size) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "file body out of payload bounds");
+            return false;
+        }
+    }
+
+    /* walk the FHT starting from 0th entry and extract each entry           *
      * Also, initialize dirfds stack with entry point directory fd          */
-    dirfds.push (entry_dirfd);
-    if ( _extract (map, header, nametab, payload, key, fht, 0, dirfds) == false ) {
+    dirfds.push ({entry_dirfd, -1, {}});
+    if ( _extract (header, nametab, payload, key, fht, 0, dirfds, block.get(), links, entry_dirfd, journal) == false ) {
         log (__FILE__, __FUNCTION__, __LINE__, "while extracting payload");
+        for (; dirfds.size() > 1; dirfds.pop ()) {
+            close (dirfds.top().fd);        /* entry_dirfd is the caller's */
+        }
+        return false;
+    }
+    if (close_dir (dirfds.top(), fht) == false) {
         return false;
     }
     dirfds.pop ();          /* pop entry_dirfd */
@@ -110,125 +210,935 @@ static bool extract (uint8_t *map, int entry_dirfd, std::string &key) {
 
 
 /****************************************************************************
- * Parse FHT recursively to create an unpacked directory tree.              *
+ * Walk the FHT (from entry <i>) to create an unpacked directory tree.      *
  * NOTE: To create a directory tree, we leverage a stack of directory file  *
  *       descriptors <dirfds> and empty Fhdr entries in FHT.                *
- *       dirfds.top() always gets the file descriptor of the directory in   *
- *       which the files are currently being extracted.                     *
+ *       dirfds.top().fd always gets the file descriptor of the directory  *
+ *       in which the files are currently being extracted.                  *
  *       A NULL FHT entry marks as the EOD (End Of Directory contents).     *
+ *       With --update, files that already match are left alone and the     *
+ *       others are replaced atomically (see extract_file ()).              *
  ****************************************************************************/
-static bool _extract ( uint8_t *map, Kbhdr *header, uint8_t *nametab, uint8_t *payload,
-                      std::string &key, Fhdr *fht, uint64_t i, std::stack<int> &dirfds) {
+static bool _extract ( Kbhdr *header, NametabReader &nametab, uint8_t *payload,
+                      std::string &key, Fhdr *fht, uint64_t i, std::stack<OpenDir> &dirfds, uint8_t *block,
+                      LinkTargets &links, int rootfd, Journal *journal) {
 
-    std::vector<uint8_t>    d_payload;      /* payload to decrypt */                                
     std::string             name;
-    bool                    status;
+    bool                    replay;
+    bool                    redo   = (journal && journal->resumed()) || UPDATE_FLAG;   /* may be on disk */
+    struct stat             sb, tsb;
     int                     fd;
     
 
-    if (i >= header->k_fhnum) {
-        return true;
-    }
+    for (; i < header->k_fhnum; ++i) {
+
+        replay = (journal && i < journal->next());      /* --resume: done before */
 
-    switch (fht[i].fh_ftype)
-    {
-        case Fhdr::ftype::FT_FILE:  
-                                    /* decrypt and dump to disk */
-
-                                    /* create a file */
-                                    name = (char *) &nametab[fht[i].fh_namendx];
-                                    fd = openat ( dirfds.top(), name.c_str(), O_CREAT|O_WRONLY, fht[i].fh_mode);
-                                    if (fd == -1) {
-                                        es = "while creating file named: " + name ;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    /* write its saved last access and modification time */
-                                    if ( futimens (fd, fht[i].fh_time) == -1) {
-                                        es = "while writing saved timestamps for: " + name;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    /* move the payload into d_payload vector (of raw bytes) */
-                                    d_payload.resize(fht[i].fh_size);
-                                    memmove (&d_payload[0], &map[header->k_payloadoff + fht[i].fh_offset], fht[i].fh_size);
-
-                                    /* check if it is encrypted */
-                                    if (fht[i].fh_etype != Fhdr::encrypt::FET_UND) {
-                                        
-                                        if ( KEY_FLAG && !key.empty() ) {
-                                            /* decrypt if encrypted */
-                                            if ( DESCRAMBLE::decrypt (d_payload, key, fht[i].fh_etype) == false) {
-                                                es = "while decrypting payload for: " + name;
-                                                log (__FILE__, __FUNCTION__, __LINE__, es);
-                                            }
-                                        }
-                                        
-                                        else {
-                                            es = "decryption key not supplied for: " + name;
+        /* everything up to entry i is extracted (a resumed partial file keeps its own progress) */
+        if ( journal && !replay && !(i == journal->next() && journal->done()) &&
+             journal->checkpoint (i) == false ) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while checkpointing extraction");
+            return false;
+        }
+
+        switch (fht[i].fh_ftype)
+        {
+            case Fhdr::ftype::FT_FILE:  
+                                        /* decrypt and dump to disk */
+                                        if (nametab.name (fht[i].fh_namendx, name) == false) {
+                                            log (__FILE__, __FUNCTION__, __LINE__, "file name index out of nametab bounds");
+                                            return false;
+                                        }
+                                        if (DELETE_FLAG) {
+                                            dirfds.top().names.insert (name);
+                                        }
+                                        if (!replay && extract_file (payload, fht[i], key, dirfds.top().fd, name, block, i, journal) == false) {
+                                            return false;
+                                        }
+                                        break;
+
+            case Fhdr::ftype::FT_DIR:   
+                                        /* create a directory and append its name to path */
+                                        if (nametab.name (fht[i].fh_namendx, name) == false) {
+                                            log (__FILE__, __FUNCTION__, __LINE__, "directory name index out of nametab bounds");
+                                            return false;
+                                        }
+                                        if (DELETE_FLAG) {
+                                            dirfds.top().names.insert (name);
+                                        }
+
+                                        /* --update: something other than a directory may be in the way */
+                                        if ( UPDATE_FLAG && fstatat (dirfds.top().fd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                             !S_ISDIR (sb.st_mode) && unlinkat (dirfds.top().fd, name.c_str(), 0) == -1 ) {
+                                            es = "while replacing " + name + " with a directory";
+                                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                                            return false;
+                                        }
+                                        if (mkdirat (dirfds.top().fd, name.c_str(), fht[i].fh_mode) == -1 && !(redo && errno == EEXIST)) {
+                                            es = "while creating directory: " + name;
                                             log (__FILE__, __FUNCTION__, __LINE__, es);
                                             return false;
                                         }
 
-                                    }
-
-                                    /* write d_payload bytes to file */
-                                    if (write (fd, &d_payload[0], d_payload.size()) != d_payload.size()) {
-                                        es = "while writing payload to file: " + name;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    /* save the created file and extract next file header */
-                                    close (fd);                 
-                                    status = _extract (map, header, nametab, payload, key, fht, i + 1, dirfds); 
-                                    break;
-
-        case Fhdr::ftype::FT_DIR:   
-                                    /* create a directory and append its name to path */
-                                    name = (char *) &nametab[fht[i].fh_namendx];
-                                    if (mkdirat (dirfds.top(), name.c_str(), fht[i].fh_mode) == -1) {
-                                        es = "while creating directory: " + name;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    fd = openat (dirfds.top(), name.c_str(), O_RDONLY);
-                                    if (fd == -1) {
-                                        es = "while opening newly created directory: " + name ;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    /* write its saved last access and modification time */
-                                    if ( futimens (fd, fht[i].fh_time) == -1) {
-                                        es = "while writing saved timestamps for directory: " + name;
-                                        log (__FILE__, __FUNCTION__, __LINE__, es);
-                                        return false;
-                                    }
-
-                                    /* push the current directory file descriptor to dirfds stack */
-                                    dirfds.push (fd);
-
-                                    /* extract next file header */
-                                    status = _extract (map, header, nametab, payload, key, fht, i + 1, dirfds);
-                                    close (fd);
-                                    break;
-
-        case Fhdr::ftype::FT_UND:   
-                                    /* A NULL fhdr entry, meaning return to previous path */
-                                    dirfds.pop();
-                                    status = _extract (map, header, nametab, payload, key, fht, i + 1, dirfds);
-                                    break;
+                                        fd = openat (dirfds.top().fd, name.c_str(), O_RDONLY|O_DIRECTORY);
+                                        if (fd == -1) {
+                                            es = "while opening newly created directory: " + name ;
+                                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                                            return false;
+                                        }
+
+                                        /* push the current directory file descriptor to dirfds stack *
+                                         * (its timestamps are written once its contents are done)     */
+                                        dirfds.push ({fd, (int64_t) i, {}});
+                                        break;
+
+            case Fhdr::ftype::FT_LINK:
+                                        /* hardlink to a file extracted earlier (copied where linking isn't allowed) */
+                                        if (nametab.name (fht[i].fh_namendx, name) == false) {
+                                            log (__FILE__, __FUNCTION__, __LINE__, "file name index out of nametab bounds");
+                                            return false;
+                                        }
+                                        if (DELETE_FLAG) {
+                                            dirfds.top().names.insert (name);
+                                        }
+
+                                        /* --update with per-dir durability: its target may still wait to be renamed in */
+                                        if (UPDATE_FLAG && flusher.flush () == false) {
+                                            return false;
+                                        }
+
+                                        /* --update: already a link to the right file */
+                                        if ( UPDATE_FLAG && fstatat (dirfds.top().fd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                             fstatat (rootfd, links[fht[i].fh_offset].c_str(), &tsb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                             sb.st_dev == tsb.st_dev && sb.st_ino == tsb.st_ino ) {
+                                            ++unchanged;
+                                            replay = true;
+                                        }
+                                        if (redo && !replay) {
+                                            remove_tree (dirfds.top().fd, name.c_str());
+                                        }
+                                        if (!replay && make_link (rootfd, links[fht[i].fh_offset], dirfds.top().fd, name, fht[i], flusher) == false) {
+                                            es = "while creating hardlink: " + name;
+                                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                                            return false;
+                                        }
+                                        break;
+
+            case Fhdr::ftype::FT_UND:   
+                                        /* A NULL fhdr entry, meaning return to previous path */
+                                        if (dirfds.top().ndx == -1) {
+                                            log (__FILE__, __FUNCTION__, __LINE__, "unbalanced end of directory in FHT");
+                                            return false;
+                                        }
+                                        if (close_dir (dirfds.top(), fht) == false) {
+                                            return false;
+                                        }
+                                        close (dirfds.top().fd);
+                                        dirfds.pop();
+                                        break;
+
+            default:
+                        log (__FILE__, __FUNCTION__, __LINE__, "no such file type (while parsing FHT)");
+                        return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Creates <name> below <dirfd> and writes the plain bytes of the FT_FILE   *
+ * <fhdr> (FHT entry <i>) into it. When a journaled unpack is resumed at    *
+ * this very file, its durable prefix is kept and writing continues right  *
+ * after it, seeded with the checksum state the journal saved.             *
+ * With --update, a file already matching <fhdr> is left alone; any other  *
+ * is written to a temporary name and renamed over the old one, so readers *
+ * of a deployed tree never see a partly written file. The finished file   *
+ * goes to the flusher, which closes (and renames) it per --durability.    *
+ ****************************************************************************/
+static bool extract_file (uint8_t *payload, Fhdr &fhdr, std::string &key, int dirfd, const std::string &name,
+                          uint8_t *block, uint64_t i, Journal *journal) {
+
+    uint64_t    cksum;
+    uint64_t    from  = (journal && journal->resumed() && i == journal->next()) ? journal->done() : 0;
+    int         flags = O_CREAT|O_WRONLY | ((journal && journal->resumed() && from == 0) ? O_TRUNC : 0);
+    int         fd;
+    Progress    progress;
+    std::string path  = name;
+
+
+    if (UPDATE_FLAG) {
+        switch (up_to_date (dirfd, name, fhdr, block)) {
+            case 1:     ++unchanged;
+                        return true;
+            case -1:    return false;
+        }
+        path  = "." + name + ".kavach-tmp";
+        flags = O_CREAT|O_WRONLY|O_TRUNC;
+        ++updated;
+    }
+
+    /* check if it is encrypted */
+    if ( fhdr.fh_etype != Fhdr::encrypt::FET_UND && !(KEY_FLAG && !key.empty()) ) {
+        es = "decryption key not supplied for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    fd = openat (dirfd, path.c_str(), flags, fhdr.fh_mode);
+    if (fd == -1) {
+        es = "while creating file named: " + path ;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    /* drop whatever was written past the last checkpoint */
+    if (from && (from > fhdr.fh_size || ftruncate (fd, from) == -1 || lseek (fd, from, SEEK_SET) == -1)) {
+        es = "while resuming partly extracted file: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        return false;
+    }
+
+    if (journal) {
+        progress = [journal, i] (uint64_t done, const Cksum &state) {
+            return journal->checkpoint (i, done, &state);
+        };
+    }
+
+    /* decrypt, checksum and write the payload a block at a time */
+    if (unpack_payload (&payload[fhdr.fh_offset], fhdr, key, fd, block, cksum, from, from ? &journal->state() : nullptr, progress) == false) {
+        es = "while writing payload to file: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        if (path != name) {
+            unlinkat (dirfd, path.c_str(), 0);
+        }
+        return false;
+    }
+
+    /* verify plain bytes against the checksum recorded while packing */
+    if (fhdr.fh_cktype != Fhdr::cksum::FCK_UND && cksum != fhdr.fh_cksum) {
+        es = "checksum mismatch (corrupt payload or wrong key) for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        if (path != name) {
+            unlinkat (dirfd, path.c_str(), 0);
+        }
+        return false;
+    }
+
+    /* write its saved last access and modification time (last: writing the body bumps mtime) */
+    if ( futimens (fd, fhdr.fh_time) == -1) {
+        es = "while writing saved timestamps for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        return false;
+    }
+
+    /* --update: swap the new contents in */
+    return flusher.file (fd, dirfd, path, name);
+}
+
+
+
+/****************************************************************************
+ * --update: 1 if <name> below <dirfd> already holds the file <fhdr>, 0 if  *
+ * it has to be (re)written, -1 on errors. Size and mtime decide, unless   *
+ * --update=checksum, which checksums files of the right size instead (a   *
+ * match just gets its timestamps fixed). A directory in the way is        *
+ * removed so the file can be renamed into place.                          *
+ ****************************************************************************/
+static int up_to_date (int dirfd, const std::string &name, Fhdr &fhdr, uint8_t *block) {
+
+    struct stat sb;
+    ssize_t     nread;
+    int         fd;
+
+    if (fstatat (dirfd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        es = "while stat'ing " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return -1;
+    }
+    if (S_ISDIR (sb.st_mode)) {
+        return remove_tree (dirfd, name.c_str()) ? 0 : -1;
+    }
+    if (!S_ISREG (sb.st_mode) || (uint64_t) sb.st_size != fhdr.fh_size) {
+        return 0;
+    }
+
+    bool same_time = sb.st_mtim.tv_sec == fhdr.fh_time[1].tv_sec && sb.st_mtim.tv_nsec == fhdr.fh_time[1].tv_nsec;
+    if (UPDATE_FLAG != UPDATE_CHECKSUM) {
+        return same_time;
+    }
+    if (fhdr.fh_cktype == Fhdr::cksum::FCK_UND) {
+        return 0;
+    }
+
+    fd = openat (dirfd, name.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    Cksum ck (fhdr.fh_cktype);
+    while ((nread = read (fd, block, PIPELINE_BLOCK_SIZE)) > 0) {
+        ck.update (block, nread);
+    }
+    close (fd);
+    if (nread == -1 || ck.digest () != fhdr.fh_cksum) {
+        return 0;
+    }
+
+    if (!same_time && utimensat (dirfd, name.c_str(), fhdr.fh_time, AT_SYMLINK_NOFOLLOW) == -1) {
+        es = "while writing saved timestamps for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/* a directory's contents are complete: with --delete drop what the archive doesn't   *
+ * hold, then write its saved timestamps (creating entries in it bumped mtime) and    *
+ * make it as durable as --durability asks                                           */
+static bool close_dir (OpenDir &dir, Fhdr *fht) {
+
+    struct dirent   *dent;
+    DIR             *dptr;
+    int             fd;
+
+    /* queued files may still carry their --update temporary names */
+    if (flusher.flush () == false) {
+        return false;
+    }
+
+    if (DELETE_FLAG) {
+        fd   = openat (dir.fd, ".", O_RDONLY|O_DIRECTORY);
+        dptr = (fd == -1) ? NULL : fdopendir (fd);
+        if (dptr == NULL) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while scanning directory for --delete");
+            return false;
+        }
+        while ((dent = readdir (dptr)) != NULL) {
+            if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0 || dir.names.count (dent->d_name)) {
+                continue;
+            }
+            if (remove_tree (dir.fd, dent->d_name) == false) {
+                closedir (dptr);
+                return false;
+            }
+            ++deleted;
+        }
+        closedir (dptr);
+    }
+
+    if (dir.ndx != -1 && futimens (dir.fd, fht[dir.ndx].fh_time) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing saved timestamps for directory");
+        return false;
+    }
+
+    return flusher.dir (dir.fd);
+}
+
+
+
+/* unlinks <name> below <dirfd>, whole subtree included if it's a directory */
+static bool remove_tree (int dirfd, const char *name) {
+
+    struct dirent   *dent;
+    DIR             *dptr;
+    int             fd;
+
+    if (unlinkat (dirfd, name, 0) == 0 || errno == ENOENT) {
+        return true;
+    }
+    if (errno != EISDIR && errno != EPERM) {
+        es = "while removing " + std::string (name);
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    fd   = openat (dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    dptr = (fd == -1) ? NULL : fdopendir (fd);
+    if (dptr == NULL) {
+        es = "while open'ing " + std::string (name) + " to remove it";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    while ((dent = readdir (dptr)) != NULL) {
+        if (strcmp (dent->d_name, ".") != 0 && strcmp (dent->d_name, "..") != 0 &&
+            remove_tree (fd, dent->d_name) == false) {
+            closedir (dptr);
+            return false;
+        }
+    }
+    closedir (dptr);
+
+    if (unlinkat (dirfd, name, AT_REMOVEDIR) == -1) {
+        es = "while removing directory " + std::string (name);
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    return true;
+}
+
+
+
+/* XXH64 of Kbhdr + FHT: ties a journal to the SFX it was written for */
+static uint64_t kbf_identity (uint8_t *kbf, Kbhdr *header) {
+
+    Cksum hash (Fhdr::cksum::FCK_XXH64);
+
+    hash.update ((const uint8_t *) header, sizeof (Kbhdr));
+    hash.update (&kbf[header->k_fhtoff], header->k_fhnum * header->k_fhentsize);
+    return hash.digest ();
+}
+
+
+
+/****************************************************************************
+ * Checks every payload in the SFX against its recorded checksum without    *
+ * writing anything to disk. Files are handed out to one worker thread per  *
+ * CPU straight from the mmap'ed archive; only encrypted payloads are       *
+ * copied (a block at a time) into a per-thread scratch buffer to decrypt.  *
+ ****************************************************************************/
+bool verify (int sfxfd, std::string &key) {
+
+    uint8_t                 *map;
+    uint64_t                map_size;
+    uint64_t                remainder;
+    std::vector<uint64_t>   files;          /* FHT indices of FT_FILE entries   */
+    std::vector<std::string> paths;         /* path of every FHT entry          */
+    std::vector<std::string> dirs;
+    std::string             name;
+    std::atomic<uint64_t>   next (0);
+    std::atomic<uint64_t>   failed (0);
+    std::atomic<uint64_t>   unchecked (0);
+    uint64_t                outside = 0;    /* bodies past the payload: corrupt */
+    std::vector<std::thread> workers;
+    unsigned                nthreads;
+    Kbhdr                   *header;
+    Settings                settings;       /* handed down to the workers       */
+
 
+    if (map_kbf (sfxfd, map, map_size, remainder, header) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mapping kavach binary format");
+        return false;
+    }
+
+    uint8_t             *kbf     = map + remainder;
+    Fhdr                *fht     = (Fhdr *)    &kbf[header->k_fhtoff];
+    uint8_t             *payload = (uint8_t *) &kbf[header->k_payloadoff];
+    NametabReader       nametab ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+
+    /* resolve full paths up front (for reporting) and collect the files to check */
+    paths.resize (header->k_fhnum);
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (!dirs.empty()) {
+                dirs.pop_back ();
+            }
+            continue;
+        }
+        if (nametab.name (fht[i].fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            munmap (map, map_size);
+            return false;
+        }
+        paths[i] = dirs.empty() ? name : dirs.back() + "/" + name;
+
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+            dirs.push_back (paths[i]);
+        }
+        else if (fht[i].fh_ftype == Fhdr::ftype::FT_FILE) {
+            if (body_in_bounds (header, fht[i], map_size - remainder) == false) {
+                ++outside;
+                debug_msg (LOG_ERROR, "file body out of payload bounds: " + paths[i]);
+                continue;
+            }
+            files.push_back (i);
+        }
+    }
+
+    for (uint64_t n: files) {
+        if (fht[n].fh_etype != Fhdr::encrypt::FET_UND && key.empty()) {
+            log (__FILE__, __FUNCTION__, __LINE__, "payload is encrypted, supply --key to verify it");
+            munmap (map, map_size);
+            return false;
+        }
+    }
+
+    madvise (map, map_size, MADV_SEQUENTIAL);
+
+    settings = Settings::capture ();
+    nthreads = CPU_LIMIT.threads (std::thread::hardware_concurrency ());
+    nthreads = std::max (1u, std::min (nthreads, (unsigned) files.size()));
+    for (unsigned t = 0; t < nthreads; ++t) {
+        workers.emplace_back ([&] () {
+            std::unique_ptr<uint8_t[]> block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+            uint64_t cksum;
+
+            settings.apply ();      /* the options are thread_local */
+            for (uint64_t n = next++; n < files.size(); n = next++) {
+                Fhdr &fhdr = fht[files[n]];
+                if (fhdr.fh_cktype == Fhdr::cksum::FCK_UND) {
+                    ++unchecked;
+                    continue;
+                }
+                /* fd -1: run the unpack pipeline without writing anything */
+                unpack_payload (&payload[fhdr.fh_offset], fhdr, key, -1, block.get(), cksum);
+                if (cksum != fhdr.fh_cksum) {
+                    ++failed;
+                    debug_msg (LOG_ERROR, "checksum mismatch: " + paths[files[n]]);
+                }
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join ();
+    }
+
+    failed += outside;
+    ds = "verified " + std::to_string (files.size() + outside - unchecked) + " file(s): " + std::to_string (failed) + " corrupt";
+    if (unchecked) {
+        ds += ", " + std::to_string (unchecked) + " without checksum";
+    }
+    debug_msg (LOG_INFO, ds);
+
+    munmap (map, map_size);
+    return failed == 0;
+}
+
+
+
+/* pushes the payload at <body> (described by <fhdr>) through the unpack pipeline selected  *
+ * by its encryption type, writing the plain bytes to <fd> unless fd is -1. The checksum of  *
+ * the plain bytes is returned in <cksum>. Returns false if writing to fd failed.           *
+ * A resumed file starts at plain offset <from> with checksum state <resume>; <progress>    *
+ * (if any) hears about every block written.                                                */
+bool unpack_payload (const uint8_t *body, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum,
+                     uint64_t from, const Cksum *resume, const Progress &progress) {
+
+    switch (fhdr.fh_etype) {
+        case Fhdr::encrypt::FET_UND:
+                    return drain_payload<Fhdr::encrypt::FET_UND, PIPELINE::codec::NONE> (body, fhdr, key, fd, block, cksum, from, resume, progress);
+        case Fhdr::encrypt::FET_XOR:
+                    return drain_payload<Fhdr::encrypt::FET_XOR, PIPELINE::codec::NONE> (body, fhdr, key, fd, block, cksum, from, resume, progress);
         default:
-                    log (__FILE__, __FUNCTION__, __LINE__, "no such file type (while parsing FHT)");
+                    log (__FILE__, __FUNCTION__, __LINE__, "Unknown encryption type");
                     return false;
     }
-    
-    return status;
+}
+
+
+
+/* mirror image of pack's stream_payload (): decrypt -> decompress -> checksum -> write,  *
+ * one PIPELINE_BLOCK_SIZE block at a time. Plain payloads are checksummed and written    *
+ * straight from the mapping, everything else goes through <block>.                       */
+template <Fhdr::encrypt E, PIPELINE::codec C>
+static bool drain_payload (const uint8_t *body, Fhdr &fhdr, const std::string &key, int fd, uint8_t *block, uint64_t &cksum,
+                           uint64_t from, const Cksum *resume, const Progress &progress) {
+
+    constexpr bool  in_place    = (E == Fhdr::encrypt::FET_UND && C == PIPELINE::codec::NONE);
+    auto            unpacker    = PIPELINE::make_unpacker<E, C> (fhdr.fh_cktype, key);
+
+    /* large bodies: fault in, decrypt and write chunks of one file concurrently */
+    if (fhdr.fh_size - from >= PIPELINE_PARALLEL_MIN) {
+        PIPELINE::Checksum  checksum (fhdr.fh_cktype);
+
+        if (resume) {
+            checksum.state () = *resume;
+        }
+
+        bool status = PIPELINE::run_chunked (fhdr.fh_size - from, PIPELINE::worker_count (),
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                /* reader: faults the mapping in (--max-read-bps paces it a slice at a time) */
+                PhaseTimer timer (SP_READ);
+                STATS.count (SC_BYTES_READ, len);
+                for (size_t done = 0, n; done < len; done += n) {
+                    n = READ_LIMIT.slice (len - done);
+                    memcpy (buf + done, body + from + off + done, n);
+                    READ_LIMIT.take (n);
+                }
+                return true;
+            },
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                /* workers: decrypt -> decompress */
+                PhaseTimer timer (SP_TRANSFORM);
+                PIPELINE::make_decoder<E, C> (key).run (buf, len, from + off);
+                return true;
+            },
+            [&] (uint8_t *buf, size_t len, uint64_t off) {
+                /* writer: checksum of the plain bytes has to be taken in order */
+                {
+                    PhaseTimer timer (SP_TRANSFORM);
+                    checksum (buf, len, from + off);
+                }
+                return (fd == -1 || write_full (fd, buf, len)) &&
+                       (!progress || progress (from + off + len, checksum.state ()));
+            });
+
+        cksum = checksum.digest ();
+        return status;
+    }
+
+    if (resume) {
+        unpacker.template stage<PIPELINE::Checksum> ().state () = *resume;
+    }
+
+    for (uint64_t off = from; off < fhdr.fh_size; off += PIPELINE_BLOCK_SIZE) {
+        size_t  len = std::min ((uint64_t) PIPELINE_BLOCK_SIZE, fhdr.fh_size - off);
+        uint8_t *buf;
+
+        if constexpr (in_place) {
+            buf = (uint8_t *) body + off;           /* only read by the pipeline */
+        }
+        else {
+            PhaseTimer timer (SP_READ);
+            memcpy (block, body + off, len);
+            buf = block;
+        }
+        STATS.count (SC_BYTES_READ, len);
+        READ_LIMIT.take (len);
+
+        {
+            PhaseTimer timer (SP_TRANSFORM);
+            unpacker.run (buf, len, off);
+        }
+
+        if (fd != -1 && write_full (fd, buf, len) == false) {
+            return false;
+        }
+        if (progress && progress (off + len, unpacker.template stage<PIPELINE::Checksum> ().state ()) == false) {
+            return false;
+        }
+    }
+
+    cksum = unpacker.template stage<PIPELINE::Checksum> ().digest ();
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Collects the path (below the extraction root) of every FT_FILE that an  *
+ * FT_LINK entry points at. A link must point back at an earlier FT_FILE,  *
+ * so that in FHT order its target is always extracted first.              *
+ ****************************************************************************/
+bool link_targets (Fhdr *fht, uint64_t fhnum, NametabReader &nametab, LinkTargets &targets) {
+
+    std::vector<std::string>    dirs;
+    std::string                 name;
+
+    for (uint64_t i = 0; i < fhnum; ++i) {
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_LINK) {
+            uint64_t k = fht[i].fh_offset;
+            if (k >= i || fht[k].fh_ftype != Fhdr::ftype::FT_FILE) {
+                log (__FILE__, __FUNCTION__, __LINE__, "hardlink doesn't point at an earlier file");
+                return false;
+            }
+            targets[k];
+        }
+    }
+
+    if (targets.empty()) {
+        return true;
+    }
+
+    for (uint64_t i = 0; i < fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (!dirs.empty()) {
+                dirs.pop_back ();
+            }
+            continue;
+        }
+        if (fht[i].fh_ftype != Fhdr::ftype::FT_DIR && targets.count (i) == 0) {
+            continue;
+        }
+        if (nametab.name (fht[i].fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            return false;
+        }
+        name = dirs.empty() ? name : dirs.back() + "/" + name;
+        if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+            dirs.push_back (name);
+        }
+        else {
+            targets[i] = name;
+        }
+    }
+
+    return true;
+}
+
+
+
+/* Creates <name> in <dirfd> as a hardlink to <target> (relative to <rootfd>). Where the *
+ * filesystem refuses the link, the (already extracted) target is copied instead and     *
+ * the copy handed to <flusher>.                                                        */
+bool make_link (int rootfd, const std::string &target, int dirfd, const std::string &name, Fhdr &fhdr, Flusher &flusher) {
+
+    struct stat sb;
+    int         sfd, dfd;
+    ssize_t     sent;
+
+    if (linkat (rootfd, target.c_str(), dirfd, name.c_str(), 0) == 0) {
+        return true;
+    }
+    if (errno != EPERM && errno != EMLINK && errno != EXDEV && errno != EOPNOTSUPP) {
+        es = "while linking to " + target;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    sfd = openat (rootfd, target.c_str(), O_RDONLY);
+    if (sfd == -1 || fstat (sfd, &sb) == -1) {
+        es = "while opening hardlink target: " + target;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    dfd = openat (dirfd, name.c_str(), O_CREAT|O_WRONLY|O_TRUNC, fhdr.fh_mode);
+    if (dfd == -1) {
+        es = "while creating file named: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (sfd);
+        return false;
+    }
+
+    for (off_t left = sb.st_size; left > 0; left -= sent) {
+        sent = sendfile (dfd, sfd, nullptr, left);
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                sent = 0;
+                continue;
+            }
+            es = "while copying " + target + " in place of a hardlink";
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            close (sfd);
+            close (dfd);
+            return false;
+        }
+    }
+
+    close (sfd);
+
+    /* timestamps go last, writing the body would bump them */
+    if (futimens (dfd, fhdr.fh_time) == -1) {
+        es = "while writing saved timestamps for: " + name;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (dfd);
+        return false;
+    }
+    return flusher.file (dfd, dirfd, name, name);
+}
+
+
+
+/* checks the SIGNATURE and mmaps the KBF portion of SFX. <map> points to the page  *
+ * containing KAVACH_BINARY_SIZE, the KBF itself starts at (map + remainder).       *
+ * <header> is Kbhdr, either leading the KBF or trailing it (KBF_TRAILER).          *
+ * A multi-volume KBF (KBF_VOLUMES) gets room reserved for its whole payload, with  *
+ * every volume mapped into it unless <volumes> is false (see VOLUMES::attach ()). */
+bool map_kbf (int sfxfd, uint8_t *&map, uint64_t &map_size, uint64_t &remainder, Kbhdr *&header, bool volumes) {
+
+    struct stat sfxsb;
+    Elf64_Ehdr  ehdr;
+    uint64_t    stub_size;
+    uint64_t    map_offset;
+    uint64_t    kbf_size;
+    uint64_t    magic;
+    PhaseTimer  timer (SP_MAP);
+
+    /* Verify that I am a packed binary */
+    if (is_packed (sfxfd) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "this program is not a packed kavach binary");
+        return false;
+    }
+
+    if ( fstat(sfxfd, &sfxsb) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while fstat'ing SFX binary");
+        return false;
+    }
+
+    /* the stub's own ELF header tells where it ends (same as KAVACH_BINARY_SIZE for the *
+     * invoked SFX, but SFXs packed by another kavach build can be mapped too)           */
+    if (pread_full (sfxfd, &ehdr, sizeof (ehdr), 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "couldn't read elf header of SFX binary");
+        return false;
+    }
+    stub_size = ehdr.e_shoff + (ehdr.e_shnum * ehdr.e_shentsize);
+
+    if ((uint64_t) sfxsb.st_size < stub_size + sizeof (Kbhdr)) {
+        log (__FILE__, __FUNCTION__, __LINE__, "SFX binary is too small to hold a kavach binary format");
+        return false;
+    }
+
+    /* mmap kavach binary format. Offset to mmap must be a multiple of PAGE_SIZE. */
+    remainder   = (stub_size % PAGE_SIZE);
+    map_offset  = stub_size - remainder;
+    map_size    = sfxsb.st_size - map_offset;
+    kbf_size    = sfxsb.st_size - stub_size;
+
+    map = (uint8_t *) mmap (NULL, map_size, PROT_READ, MAP_SHARED, sfxfd, map_offset);
+    if (map == MAP_FAILED) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while mmap'ing kavach binary format");
+        return false;
+    }
+
+    /* Kbhdr leads the KBF unless the SFX was packed onto a pipe */
+    header = (Kbhdr *) (map + remainder);
+    if (kbf_size >= sizeof (Kbhdr) + sizeof (magic)) {
+        memcpy (&magic, map + map_size - sizeof (magic), sizeof (magic));
+        Kbhdr *trailer = (Kbhdr *) (map + map_size - sizeof (magic) - sizeof (Kbhdr));
+        if (magic == TRAILER_MAGIC && (trailer->k_flags & Kbhdr::flags::KBF_TRAILER)) {
+            header = trailer;
+        }
+    }
+
+    /* a corrupt header mustn't send any reader past the map (the payload of volumes isn't in it) */
+    if ( tables_in_bounds (header, kbf_size) == false ||
+         ( !(header->k_flags & Kbhdr::flags::KBF_VOLUMES) &&
+           (header->k_payloadoff > kbf_size || header->k_payloadsz > kbf_size - header->k_payloadoff) ) ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "corrupt kavach binary header: a table lies outside the KBF");
+        munmap (map, map_size);
+        return false;
+    }
+
+    if (header->k_flags & Kbhdr::flags::KBF_VOLUMES) {
+        uint64_t span = remainder + header->k_payloadoff + header->k_payloadsz;
+        uint8_t  *room;
+
+        /* the tables go back at the start of the reservation, volumes land behind them */
+        room = (uint8_t *) mmap (NULL, std::max (span, map_size), PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if ( room == MAP_FAILED ||
+             mmap (room, map_size, PROT_READ, MAP_SHARED|MAP_FIXED, sfxfd, map_offset) == MAP_FAILED ) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while reserving room for the volumes of kavach binary format");
+            return false;
+        }
+        munmap (map, map_size);
+        map      = room;
+        map_size = std::max (span, map_size);
+        header   = (Kbhdr *) (map + remainder);
+
+        if (volumes && VOLUMES::attach_all (sfxfd, map + remainder, header) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while mapping volumes");
+            munmap (map, map_size);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+/* true if <count> entries of <size> bytes at <off> end within <limit> (without overflowing) */
+static bool span_in (uint64_t off, uint64_t count, uint64_t size, uint64_t limit) {
+
+    return off <= limit && count <= (limit - off) / size;
+}
+
+
+
+/* true if every table <header> describes (FHT, chunk table, nametab, volume table) lies *
+ * within the <kbf_size> bytes of the KBF: readers index them straight off the mapping   */
+bool tables_in_bounds (const Kbhdr *header, uint64_t kbf_size) {
+
+    return header->k_fhentsize == sizeof (Fhdr) &&
+           span_in (header->k_fhtoff,      header->k_fhnum,     sizeof (Fhdr),    kbf_size) &&
+           span_in (header->k_chunktaboff, header->k_chunknum,  sizeof (Kchunk),  kbf_size) &&
+           span_in (header->k_nametaboff,  header->k_nametabsz, 1,                kbf_size) &&
+           span_in (header->k_voltaboff,   header->k_volnum,    sizeof (Kvolume), kbf_size);
+}
+
+
+
+/* true if the body of FT_FILE <fhdr> lies within the payload, and the payload within *
+ * the <kbf_size> bytes mapped: a corrupt FHT mustn't send us reading past the map    */
+bool body_in_bounds (const Kbhdr *header, const Fhdr &fhdr, uint64_t kbf_size) {
+
+    return header->k_payloadoff <= kbf_size && header->k_payloadsz <= kbf_size - header->k_payloadoff &&
+           fhdr.fh_offset <= header->k_payloadsz && fhdr.fh_size <= header->k_payloadsz - fhdr.fh_offset;
+}
+
+
+/****************************************************************************
+ * Returns the FHT index of archived <path> (e.g. "testme/docs/a.txt") or   *
+ * -1 if there is no such entry. Every path component is turned into its   *
+ * fh_namendx once (a binary search for front-coded nametabs) so that the  *
+ * FHT walk itself only compares integers, skipping unmatched subtrees.    *
+ ****************************************************************************/
+int64_t resolve_path (Kbhdr *header, Fhdr *fht, NametabReader &nametab, const std::string &path) {
+
+    std::vector<int64_t> want;
+    size_t  start = 0;
+    uint64_t i = 0;
+
+    /* path components -> fh_namendx ("." and empty components are skipped) */
+    while (start <= path.size()) {
+        size_t end = path.find ('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string component = path.substr (start, end - start);
+        if (!component.empty() && component != ".") {
+            int64_t ndx = nametab.lookup (component);
+            if (ndx == -1) {
+                return -1;
+            }
+            want.push_back (ndx);
+        }
+        start = end + 1;
+    }
+
+    if (want.empty()) {
+        return -1;
+    }
+
+    /* walk one directory level per component */
+    for (size_t level = 0; level < want.size(); ++level) {
+
+        while (i < header->k_fhnum && !fht[i].is_dir_end ()) {
+
+            if (fht[i].fh_namendx == (uint64_t) want[level]) {
+                break;
+            }
+
+            /* not it: step over the entry (and the whole subtree of a directory) */
+            if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+                uint64_t depth = 1;
+                for (++i; i < header->k_fhnum && depth; ++i) {
+                    if (fht[i].fh_ftype == Fhdr::ftype::FT_DIR) {
+                        ++depth;
+                    }
+                    else if (fht[i].is_dir_end ()) {
+                        --depth;
+                    }
+                }
+            }
+            else {
+                ++i;
+            }
+        }
+
+        if (i >= header->k_fhnum || fht[i].is_dir_end ()) {
+            return -1;
+        }
+
+        if (level + 1 < want.size()) {
+            if (fht[i].fh_ftype != Fhdr::ftype::FT_DIR) {
+                return -1;
+            }
+            ++i;                /* descend */
+        }
+    }
+
+    return i;
 }
 
 
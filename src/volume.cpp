@@ -0,0 +1,683 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : volume.cpp                                                        *
+ *                                                                              *
+ * Description: Module responsible for multi-volume archives (--volume-size).   *
+ *              A pack spreads the payload over <sfx>.001, <sfx>.002 ... while  *
+ *              the SFX keeps every table plus a volume table. An unpack maps   *
+ *              each volume right where its bytes belong within the payload     *
+ *              and extracts volumes in parallel, in whatever order they show   *
+ *              up next to the SFX.                                             *
+ *                                                                              *
+ * Code Flow: <main> => <pack>   => <attach_ko> => <VolumeWriter::layout>       *
+ *                                              => <VolumeWriter::open_body>    *
+ *                                              => <VolumeWriter::finish>       *
+ *            <main> => <unpack> => <VOLUMES::extract> => <VOLUMES::attach>     *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/random.h>
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+/* leads every volume (zero padded up to VOLUME_HDR_SIZE). Written once the volume is *
+ * complete, so a volume still being copied in doesn't pass for one.                  */
+struct VolumeHeader {
+    uint64_t            magic;          /* VOLUME_MAGIC */
+    uint64_t            id;             /* Kvolume::v_id */
+    uint64_t            index;
+    uint64_t            count;          /* volumes in the archive */
+    uint64_t            start;          /* Kvolume::v_start */
+    uint64_t            size;           /* Kvolume::v_size */
+};
+
+/* the files of one volume: those whose body starts in it */
+struct VolumeJob {
+    std::vector<uint64_t>   files;      /* FHT indices */
+    uint64_t                last;       /* last volume their bodies reach into */
+    bool                    queued;
+};
+
+
+/* function prototypes */
+static std::string  volume_path     (const std::string &sfx_name, uint64_t v);
+static std::string  sfx_path        (int sfxfd);
+static uint64_t     volume_of       (Kvolume *voltab, uint64_t volnum, uint64_t offset);
+static bool         move_bytes      (int infd, int outfd, uint64_t len);
+
+
+
+/* <sfx_name>.001 for the first volume */
+static std::string volume_path (const std::string &sfx_name, uint64_t v) {
+
+    char suffix[32];
+
+    snprintf (suffix, sizeof (suffix), ".%03lu", v + 1);
+    return sfx_name + suffix;
+}
+
+
+
+VolumeWriter::VolumeWriter (const std::string &sfx_name, uint64_t volume_size) :
+    sfx_name (sfx_name), id (0), pipefd {-1, -1}, spliced (true) {
+
+    /* --volume-size includes the header; volumes have to stay mappable at their place within the payload */
+    this->volume_size = (volume_size - VOLUME_HDR_SIZE) / VOLUME_ALIGN * VOLUME_ALIGN;
+
+    if (getrandom (&id, sizeof (id), 0) != sizeof (id)) {
+        id = ((uint64_t) getpid () << 32) ^ time (NULL);
+    }
+}
+
+
+
+/* an aborted pack still has to join the splicer and let go of its volumes */
+VolumeWriter::~VolumeWriter () {
+
+    close_body ();
+    for (int fd: fds) {
+        if (fd != -1) {
+            close (fd);
+        }
+    }
+}
+
+
+
+/****************************************************************************
+ * Lays out the payload over volumes of volume_size: volume v starts at    *
+ * v * volume_size within it. A body that fits in a volume but not in what *
+ * is left of the current one moves on to the next volume (leaving a gap   *
+ * that is never written); bigger bodies run on over as many volumes as    *
+ * they need. Reassigns fh_offset of every FT_FILE and fills in the volume *
+ * part of ko.header (layout_stream () has already run).                   *
+ ****************************************************************************/
+void VolumeWriter::layout (Kavach &ko) {
+
+    uint64_t cursor = 0;            /* next free offset into the payload */
+    uint64_t left;
+
+    voltab.assign (1, Kvolume (0, 0, id));
+    for (auto &fhdr: ko.fht) {
+
+        if (fhdr.fh_ftype != Fhdr::FT_FILE) {
+            continue;
+        }
+
+        left = volume_size - cursor % volume_size;
+        if (left != volume_size && fhdr.fh_size > left && fhdr.fh_size <= volume_size) {
+            cursor += left;
+        }
+        fhdr.fh_offset = cursor;
+        cursor += fhdr.fh_size;
+
+        /* every volume this body reaches into now ends at least where it does */
+        for (uint64_t v = fhdr.fh_offset / volume_size; fhdr.fh_size && v <= (cursor - 1) / volume_size; ++v) {
+            while (voltab.size() <= v) {
+                voltab.push_back (Kvolume (voltab.size() * volume_size, 0, id));
+            }
+            voltab[v].v_size = std::min (volume_size, cursor - voltab[v].v_start);
+        }
+    }
+
+    /* the SFX ends with the volume table, the (unmapped) payload follows VOLUME_ALIGN aligned */
+    ko.header.k_voltaboff   = (ko.header.k_nametaboff + ko.header.k_nametabsz + 7) & ~7UL;
+    ko.header.k_volnum      = voltab.size();
+    ko.header.k_payloadoff  = KAVACH_BINARY_SIZE + ko.header.k_voltaboff + ko.header.k_volnum * sizeof (Kvolume);
+    ko.header.k_payloadoff  = (ko.header.k_payloadoff + VOLUME_ALIGN - 1) / VOLUME_ALIGN * VOLUME_ALIGN - KAVACH_BINARY_SIZE;
+    ko.header.k_payloadsz   = cursor;
+    ko.header.k_flags       = Kbhdr::flags::KBF_VOLUMES;
+}
+
+
+
+/* creates volume <v> (if not done yet), positioned at the start of its payload */
+bool VolumeWriter::open_volume (uint64_t v) {
+
+    std::string path = volume_path (sfx_name, v);
+
+    if (fds.size() <= v) {
+        fds.resize (v + 1, -1);
+    }
+    if (fds[v] != -1) {
+        return true;
+    }
+
+    fds[v] = open (path.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fds[v] == -1 || lseek (fds[v], VOLUME_HDR_SIZE, SEEK_SET) == -1) {
+        es = "while creating volume " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Returns the fd the body of <fhdr> is to be streamed into. That's its    *
+ * volume, positioned at the body, unless the body runs on into the next   *
+ * volume(s): then it is the write end of a pipe a splicer thread drains   *
+ * into the volumes in turn. close_body () follows every body either way.  *
+ ****************************************************************************/
+int VolumeWriter::open_body (Fhdr &fhdr) {
+
+    uint64_t v      = fhdr.fh_offset / volume_size;
+    uint64_t offset = fhdr.fh_offset % volume_size;
+
+    if (open_volume (v) == false || lseek (fds[v], VOLUME_HDR_SIZE + offset, SEEK_SET) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while seeking to a file body in its volume");
+        return -1;
+    }
+    if (offset + fhdr.fh_size <= volume_size) {
+        return fds[v];
+    }
+
+    /* later volumes only ever start with the tail of this body */
+    for (uint64_t w = v + 1; w <= (fhdr.fh_offset + fhdr.fh_size - 1) / volume_size; ++w) {
+        if (open_volume (w) == false) {
+            return -1;
+        }
+    }
+
+    if (pipe2 (pipefd, O_CLOEXEC) == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating pipe for a body spanning volumes");
+        return -1;
+    }
+    spliced = true;
+    splicer = std::thread (&VolumeWriter::splice_body, this, v, offset, fhdr.fh_size);
+
+    return pipefd[1];
+}
+
+
+
+/* splicer thread: moves <size> bytes from the pipe into volume <v> (from <offset> on) and *
+ * those after it. On failure the rest is drained, the writer must never block on it.      */
+void VolumeWriter::splice_body (uint64_t v, uint64_t offset, uint64_t size) {
+
+    uint64_t    room = volume_size - offset;
+    uint64_t    len;
+    char        sink[0x1000];
+
+    for (; size; size -= len, room = volume_size, ++v) {
+        len = std::min (size, room);
+        if (move_bytes (pipefd[0], fds[v], len) == false) {
+            spliced = false;
+            break;
+        }
+    }
+
+    while (!spliced && read (pipefd[0], sink, sizeof (sink)) > 0);
+}
+
+
+
+/* the body handed out by open_body () is completely written */
+bool VolumeWriter::close_body () {
+
+    if (!splicer.joinable()) {
+        return true;
+    }
+
+    close (pipefd[1]);              /* EOF: a splicer still expecting bytes gives up */
+    splicer.join ();
+    close (pipefd[0]);
+    pipefd[0] = pipefd[1] = -1;
+
+    if (spliced == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing a file body spanning volumes");
+        return false;
+    }
+    return true;
+}
+
+
+
+/* stamps every (complete) volume with its header and writes the volume table to <sfxfd> */
+bool VolumeWriter::finish (int sfxfd, Kavach &ko) {
+
+    VolumeHeader            vh;
+    std::vector<uint8_t>    head (VOLUME_HDR_SIZE, 0);
+
+    for (uint64_t v = 0; v < voltab.size(); ++v) {
+        vh = {VOLUME_MAGIC, id, v, voltab.size(), voltab[v].v_start, voltab[v].v_size};
+        memcpy (head.data(), &vh, sizeof (vh));
+
+        if ( open_volume (v) == false ||
+             ftruncate (fds[v], VOLUME_HDR_SIZE + voltab[v].v_size) == -1 ||
+             pwrite_full (fds[v], head.data(), head.size(), 0) == false ) {
+            es = "while sealing volume " + volume_path (sfx_name, v);
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        close (fds[v]);
+        fds[v] = -1;
+    }
+
+    if (pwrite_full (sfxfd, voltab.data(), voltab.size() * sizeof (Kvolume), KAVACH_BINARY_SIZE + ko.header.k_voltaboff) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing volume table to SFX binary");
+        return false;
+    }
+    return true;
+}
+
+
+
+/* moves <len> bytes from the pipe <infd> to <outfd> at its file position */
+static bool move_bytes (int infd, int outfd, uint64_t len) {
+
+    std::unique_ptr<uint8_t[]> buf;
+    ssize_t nmoved;
+
+    while (len) {
+        nmoved = splice (infd, NULL, outfd, NULL, std::min (len, (uint64_t) PIPELINE_BLOCK_SIZE), SPLICE_F_MOVE);
+        if (nmoved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nmoved == -1 && errno == EINVAL) {
+            break;                  /* filesystem without splice support */
+        }
+        if (nmoved <= 0) {
+            return false;
+        }
+        len -= nmoved;
+    }
+
+    for (buf.reset (len ? new uint8_t[PIPELINE_BLOCK_SIZE] : nullptr); len; len -= nmoved) {
+        nmoved = read (infd, buf.get(), std::min (len, (uint64_t) PIPELINE_BLOCK_SIZE));
+        if (nmoved == -1 && errno == EINTR) {
+            nmoved = 0;
+            continue;
+        }
+        if (nmoved <= 0 || write_full (outfd, buf.get(), nmoved) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/* volumes are looked for next to the SFX, whatever name it was invoked by */
+static std::string sfx_path (int sfxfd) {
+
+    char        link[PATH_MAX];
+    ssize_t     len;
+    std::string fdpath = "/proc/self/fd/" + std::to_string (sfxfd);
+
+    len = readlink (fdpath.c_str(), link, sizeof (link) - 1);
+    if (len == -1) {
+        return "";
+    }
+    return std::string (link, len);
+}
+
+
+
+/* the volume holding payload offset <offset> */
+static uint64_t volume_of (Kvolume *voltab, uint64_t volnum, uint64_t offset) {
+
+    Kvolume *next = std::upper_bound (voltab, voltab + volnum, offset,
+                                      [] (uint64_t off, const Kvolume &vol) { return off < vol.v_start; });
+    return (next == voltab) ? 0 : next - voltab - 1;
+}
+
+
+
+namespace VOLUMES {
+
+/****************************************************************************
+ * Maps volume <v> of the KBF at <kbf> (mapped by map_kbf ()) into its     *
+ * place within the payload. Returns 1 once it is, 0 if it isn't there     *
+ * (yet), -1 if what is there belongs to some other archive.               *
+ ****************************************************************************/
+int attach (int sfxfd, uint8_t *kbf, Kbhdr *header, uint64_t v) {
+
+    Kvolume         *voltab = (Kvolume *) &kbf[header->k_voltaboff];
+    std::string     path    = volume_path (sfx_path (sfxfd), v);
+    VolumeHeader    vh;
+    struct stat     sb;
+    uint8_t         *at;
+    int             fd;
+
+    if (v >= header->k_volnum) {
+        log (__FILE__, __FUNCTION__, __LINE__, "volume index out of volume table bounds");
+        return -1;
+    }
+
+    fd = open (path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        es = "while opening volume " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return -1;
+    }
+
+    /* still being copied in: short, or not stamped yet */
+    if ( fstat (fd, &sb) == -1 || (uint64_t) sb.st_size < VOLUME_HDR_SIZE + voltab[v].v_size ||
+         pread_full (fd, &vh, sizeof (vh), 0) == false || vh.magic != VOLUME_MAGIC ) {
+        close (fd);
+        return 0;
+    }
+
+    if ( vh.id != voltab[v].v_id || vh.index != v || vh.count != header->k_volnum ||
+         vh.start != voltab[v].v_start || vh.size != voltab[v].v_size ) {
+        es = path + " isn't a volume of this archive";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        return -1;
+    }
+
+    at = kbf + header->k_payloadoff + voltab[v].v_start;
+    if ( voltab[v].v_size &&
+         mmap (at, voltab[v].v_size, PROT_READ, MAP_SHARED|MAP_FIXED, fd, VOLUME_HDR_SIZE) == MAP_FAILED ) {
+        es = "while mmap'ing volume " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        close (fd);
+        return -1;
+    }
+    madvise (at, voltab[v].v_size, MADV_SEQUENTIAL);
+
+    close (fd);
+    return 1;
+}
+
+
+
+/* maps every volume, all of them have to be there already */
+bool attach_all (int sfxfd, uint8_t *kbf, Kbhdr *header) {
+
+    for (uint64_t v = 0; v < header->k_volnum; ++v) {
+        switch (attach (sfxfd, kbf, header, v)) {
+            case 1:     break;
+            case 0:     es = volume_path (sfx_path (sfxfd), v) + " is missing (or incomplete)";
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        return false;
+            default:    return false;
+        }
+    }
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Extracts a multi-volume KBF below <rootfd>. Directories are created up  *
+ * front; then the files of every volume are extracted by a pool of       *
+ * workers, a volume as soon as it (and whichever volumes its bodies run   *
+ * on into) has turned up. Volumes may arrive in any order; the unpack     *
+ * gives up once none has for VOLUME_WAIT seconds. Hardlinks and directory *
+ * timestamps come last.                                                   *
+ ****************************************************************************/
+bool extract (int sfxfd, uint8_t *kbf, Kbhdr *header, int rootfd, std::string &key) {
+
+    Fhdr                        *fht     = (Fhdr *)    &kbf[header->k_fhtoff];
+    uint8_t                     *payload = (uint8_t *) &kbf[header->k_payloadoff];
+    Kvolume                     *voltab  = (Kvolume *) &kbf[header->k_voltaboff];
+    NametabReader               nametab ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+    std::vector<std::string>    paths (header->k_fhnum);
+    std::vector<uint64_t>       dirs, open_dirs, links;
+    std::vector<VolumeJob>      jobs (header->k_volnum);
+    std::vector<bool>           mapped (header->k_volnum, false);
+    std::deque<uint64_t>        ready;
+    std::mutex                  lock;
+    std::condition_variable     wakeup;
+    bool                        closed = false;
+    std::atomic<uint64_t>       failed (0);
+    std::vector<std::thread>    workers;
+    unsigned                    nthreads;
+    uint64_t                    queued = 0;
+    time_t                      last_progress = time (NULL);
+    bool                        waiting = false;
+    bool                        status = true;
+    Flusher                     flusher;
+    std::string                 name;
+    Settings                    settings;       /* handed down to the workers */
+
+
+    for (uint64_t v = 0; v < header->k_volnum; ++v) {
+        jobs[v] = {{}, v, false};
+    }
+
+    /* paths of every entry, directories created right away */
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (open_dirs.empty()) {
+                log (__FILE__, __FUNCTION__, __LINE__, "unbalanced end of directory in FHT");
+                return false;
+            }
+            open_dirs.pop_back ();
+            continue;
+        }
+        if (nametab.name (fht[i].fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            return false;
+        }
+        paths[i] = open_dirs.empty() ? name : paths[open_dirs.back()] + "/" + name;
+
+        switch (fht[i].fh_ftype) {
+            case Fhdr::ftype::FT_DIR:
+                        if (mkdirat (rootfd, paths[i].c_str(), fht[i].fh_mode) == -1) {
+                            es = "while creating directory: " + paths[i];
+                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                            return false;
+                        }
+                        open_dirs.push_back (i);
+                        dirs.push_back (i);
+                        break;
+
+            case Fhdr::ftype::FT_FILE:
+                        if (fht[i].fh_etype != Fhdr::encrypt::FET_UND && !(KEY_FLAG && !key.empty())) {
+                            es = "decryption key not supplied for: " + paths[i];
+                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                            return false;
+                        }
+                        if (fht[i].fh_offset + fht[i].fh_size > header->k_payloadsz) {
+                            es = "file body out of payload bounds: " + paths[i];
+                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                            return false;
+                        }
+                        {
+                            VolumeJob &job = jobs[volume_of (voltab, header->k_volnum, fht[i].fh_offset)];
+                            job.files.push_back (i);
+                            if (fht[i].fh_size) {
+                                job.last = std::max (job.last, volume_of (voltab, header->k_volnum, fht[i].fh_offset + fht[i].fh_size - 1));
+                            }
+                        }
+                        break;
+
+            case Fhdr::ftype::FT_LINK:
+                        if (fht[i].fh_offset >= i || fht[fht[i].fh_offset].fh_ftype != Fhdr::ftype::FT_FILE) {
+                            log (__FILE__, __FUNCTION__, __LINE__, "hardlink doesn't point at an earlier file");
+                            return false;
+                        }
+                        links.push_back (i);
+                        break;
+
+            default:
+                        log (__FILE__, __FUNCTION__, __LINE__, "no such file type (while parsing FHT)");
+                        return false;
+        }
+    }
+
+    /* a worker per CPU, each extracting one volume's files at a time */
+    nthreads = CPU_LIMIT.threads (std::thread::hardware_concurrency ());
+    nthreads = std::max (1u, std::min (nthreads, (unsigned) header->k_volnum));
+    settings = Settings::capture ();
+    for (unsigned t = 0; t < nthreads; ++t) {
+        workers.emplace_back ([&] () {
+            settings.apply ();      /* the options are thread_local */
+
+            std::unique_ptr<uint8_t[]> block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+            Flusher     own;
+            uint64_t    v, cksum;
+            int         fd;
+
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> guard (lock);
+                    wakeup.wait (guard, [&] () { return !ready.empty() || closed; });
+                    if (ready.empty()) {
+                        break;
+                    }
+                    v = ready.front ();
+                    ready.pop_front ();
+                }
+
+                for (uint64_t i: jobs[v].files) {
+                    if (failed) {
+                        break;
+                    }
+                    fd = openat (rootfd, paths[i].c_str(), O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, fht[i].fh_mode);
+                    if (fd == -1) {
+                        debug_msg (LOG_ERROR, "while creating " + paths[i] + ": " + strerror (errno));
+                        ++failed;
+                        break;
+                    }
+                    if (unpack_payload (&payload[fht[i].fh_offset], fht[i], key, fd, block.get(), cksum) == false) {
+                        debug_msg (LOG_ERROR, "while writing " + paths[i] + ": " + strerror (errno));
+                        ++failed;
+                        close (fd);
+                        break;
+                    }
+                    if (fht[i].fh_cktype != Fhdr::cksum::FCK_UND && cksum != fht[i].fh_cksum) {
+                        debug_msg (LOG_ERROR, "checksum mismatch (corrupt volume or wrong key): " + paths[i]);
+                        ++failed;
+                        close (fd);
+                        break;
+                    }
+                    if (futimens (fd, fht[i].fh_time) == -1 || own.file (fd, rootfd, paths[i], paths[i]) == false) {
+                        debug_msg (LOG_ERROR, "while finishing " + paths[i]);
+                        ++failed;
+                        break;
+                    }
+                }
+                if (own.flush () == false) {
+                    ++failed;
+                }
+            }
+        });
+    }
+
+    /* hand out every volume whose bodies are all mapped, mapping volumes as they turn up */
+    while (queued < header->k_volnum && !failed) {
+        bool progress = false;
+
+        for (uint64_t v = 0; v < header->k_volnum; ++v) {
+            if (mapped[v]) {
+                continue;
+            }
+            switch (attach (sfxfd, kbf, header, v)) {
+                case 1:     mapped[v] = true;
+                            progress  = true;
+                            break;
+                case -1:    ++failed;
+                            break;
+            }
+        }
+
+        for (uint64_t v = 0; v < header->k_volnum; ++v) {
+            if (jobs[v].queued || !std::all_of (mapped.begin() + v, mapped.begin() + jobs[v].last + 1, [] (bool m) { return m; })) {
+                continue;
+            }
+            jobs[v].queued = true;
+            ++queued;
+            {
+                std::lock_guard<std::mutex> guard (lock);
+                ready.push_back (v);
+            }
+            wakeup.notify_one ();
+        }
+
+        if (queued == header->k_volnum || failed) {
+            break;
+        }
+        if (progress) {
+            last_progress = time (NULL);
+            waiting = false;
+            continue;
+        }
+        if (time (NULL) - last_progress >= VOLUME_WAIT) {
+            es = "gave up waiting for volume(s) of " + sfx_path (sfxfd);
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            ++failed;
+            break;
+        }
+        if (!waiting) {
+            ds = "waiting for volume(s):";
+            for (uint64_t v = 0; v < header->k_volnum; ++v) {
+                if (!mapped[v]) {
+                    ds += " " + volume_path ("", v).substr (1);
+                }
+            }
+            debug_msg (LOG_INFO, ds);
+            waiting = true;
+        }
+        sleep (1);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        closed = true;
+    }
+    wakeup.notify_all ();
+    for (auto &worker: workers) {
+        worker.join ();
+    }
+    if (failed) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while extracting volumes");
+        return false;
+    }
+
+    /* every file is in place: hardlinks to them */
+    for (uint64_t i: links) {
+        size_t      slash  = paths[i].find_last_of ('/');
+        std::string parent = (slash == std::string::npos) ? "." : paths[i].substr (0, slash);
+        int         dirfd  = openat (rootfd, parent.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+        if (dirfd == -1) {
+            es = "while opening directory: " + parent;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+        status = make_link (rootfd, paths[fht[i].fh_offset], dirfd, paths[i].substr (slash + 1), fht[i], flusher) &&
+                 flusher.flush ();
+        close (dirfd);
+        if (status == false) {
+            es = "while creating hardlink: " + paths[i];
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            return false;
+        }
+    }
+
+    /* directory timestamps last (innermost first), nothing is written into them anymore */
+    for (auto d = dirs.rbegin(); d != dirs.rend(); ++d) {
+        int fd = openat (rootfd, paths[*d].c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+        if (fd == -1 || futimens (fd, fht[*d].fh_time) == -1 || flusher.dir (fd) == false) {
+            es = "while writing saved timestamps for directory: " + paths[*d];
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            if (fd != -1) {
+                close (fd);
+            }
+            return false;
+        }
+        close (fd);
+    }
+
+    return flusher.dir (rootfd);
+}
+
+}
@@ -0,0 +1,903 @@
+/********************************************************************************
+ * Author   : Abhinav Thakur                                                    *
+ * Email    : compilepeace@gmail.com                                            *
+ * Filename : watch.cpp                                                         *
+ *                                                                              *
+ * Description: Module responsible for keeping an SFX in sync with a live       *
+ *              directory (--watch). inotify events are coalesced over a short  *
+ *              debounce window, then only the bodies of changed files are      *
+ *              appended to the SFX along with a new generation of its tables   *
+ *              (KBF_TRAILER layout: the last generation is the one found).     *
+ *              Dead payload left behind by older generations is compacted away *
+ *              in the background once it makes up too much of the SFX.        *
+ *                                                                              *
+ * Code Flow: <main> => <watch> => <refresh>          => <write_bodies>         *
+ *                              => <write_generation> => <write_tables>         *
+ *                              => <start_compaction> => <finish_compaction>    *
+ *                                                                              *
+ ********************************************************************************/
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <map>
+#include <set>
+#include <atomic>
+#include <algorithm>
+
+#include "kavach.h"
+#include "pipeline.h"
+
+
+#define WATCH_EVENTS        (IN_CREATE|IN_CLOSE_WRITE|IN_MODIFY|IN_ATTRIB|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+#define WATCH_EVENT_BUFFER  0x10000
+
+
+/* orders paths so that a directory's whole subtree directly follows it ('/' sorts first) */
+struct PathLess {
+    bool operator() (const std::string &a, const std::string &b) const {
+        size_t n = std::min (a.size(), b.size());
+        for (size_t i = 0; i < n; ++i) {
+            if (a[i] != b[i]) {
+                if (a[i] == '/') return true;
+                if (b[i] == '/') return false;
+                return (unsigned char) a[i] < (unsigned char) b[i];
+            }
+        }
+        return a.size() < b.size();
+    }
+};
+
+/* an archived file|directory as of the last generation */
+struct WatchEntry {
+    Fhdr                    fhdr;           /* fh_offset: where its (current) body is in the SFX */
+    std::vector<Kchunk>     chunks;         /* FT_FILE: its .chunktab entries */
+};
+
+typedef std::map<std::string, WatchEntry, PathLess> WatchTree;
+
+/* a background compaction: live bodies of a snapshot copied into <sfx>.compact */
+struct Compaction {
+    std::thread                             worker;
+    std::atomic<bool>                       done {false};
+    bool                                    ok = false;
+    int                                     fd = -1;
+    std::string                             path;
+    std::vector<std::pair<uint64_t, uint64_t>> bodies;  /* (fh_offset, fh_size) live at the snapshot */
+    std::unordered_map<uint64_t, uint64_t>  moved;      /* old fh_offset -> new one */
+    uint64_t                                end = 0;    /* payload end in the compacted SFX */
+};
+
+/* state of a --watch session */
+struct Watch {
+    std::string                             root;       /* watched directory */
+    std::string                             top;        /* its name, the first path component of every key */
+    std::string                             base;       /* base + key => path on disk */
+    std::string                             sfx;
+    std::string                             &key;
+    int                                     infd;       /* inotify instance */
+    std::unordered_map<int, std::string>    dirs;       /* watch descriptor -> key */
+    WatchTree                               tree;       /* keyed by path below base */
+    std::set<std::string, PathLess>         dirty;      /* keys touched since the last generation */
+    bool                                    rescan;     /* walk the whole tree (startup, lost events) */
+    bool                                    busy;       /* SFX is being run (ETXTBSY) */
+    uint64_t                                payload_end;/* KBF offset the next body goes to */
+    uint64_t                                live;       /* payload bytes the tree still refers to */
+    uint64_t                                generation;
+    uint64_t                                removed;    /* entries dropped in this generation */
+    std::unique_ptr<Compaction>             compaction;
+};
+
+
+/* function prototypes */
+static bool     open_sfx            (Watch &w, int kfd);
+static bool     load_generation     (Watch &w, int sfxfd);
+static bool     write_generation    (Watch &w);
+static bool     refresh             (Watch &w, const std::string &key, std::vector<std::string> &stale);
+static void     restat_dir          (Watch &w, const std::string &key);
+static void     drop                (Watch &w, const std::string &key);
+static bool     write_bodies        (Watch &w, int sfxfd, std::vector<std::string> &stale);
+static bool     write_tables        (Watch &w, int sfxfd);
+static void     collect_events      (Watch &w);
+static void     start_compaction    (Watch &w);
+static void     compact_bodies      (Compaction *c, std::string sfx);
+static bool     finish_compaction   (Watch &w);
+static bool     under               (const std::string &key, const std::string &dir);
+static uint64_t now_ms              ();
+
+/* SIGINT|SIGTERM: write what is pending, then stop */
+static volatile sig_atomic_t stop_watching = 0;
+
+
+
+/****************************************************************************
+ * Keeps <of_name>.kgs in sync with the directory <target_path> until it   *
+ * is interrupted. An existing <of_name>.kgs (written by an earlier        *
+ * --watch of the same directory) is picked up where it was left; the      *
+ * first generation then only holds what changed in the meantime.          *
+ ****************************************************************************/
+bool watch (int kfd, std::string &target_path, std::string &key, std::string &of_name) {
+
+    Watch               w {target_path, "", "", of_name + FILE_EXTENSION, key};
+    struct stat         sb;
+    struct sigaction    sa;
+    struct pollfd       pfd;
+    uint64_t            first = 0, last = 0;    /* ms of the first|last event not yet written */
+    uint64_t            deadline;
+    char                *real_root, *real_out;
+    std::string         out_dir;
+    int                 timeout;
+
+    if (of_name == "-") {
+        log (__FILE__, __FUNCTION__, __LINE__, "--watch rewrites its SFX, it can't go to stdout");
+        return false;
+    }
+    while (w.root.size() > 1 && w.root.back() == '/') {
+        w.root.pop_back ();
+    }
+    if (stat (w.root.c_str(), &sb) == -1 || !S_ISDIR (sb.st_mode)) {
+        es = w.root + " isn't a directory to watch";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    w.top  = w.root.substr (w.root.find_last_of ('/') + 1);
+    w.base = w.root.substr (0, w.root.size() - w.top.size());
+
+    /* the SFX growing inside the watched tree would feed itself */
+    out_dir   = (w.sfx.find ('/') == std::string::npos) ? "." : w.sfx.substr (0, w.sfx.find_last_of ('/') + 1);
+    real_root = realpath (w.root.c_str(), NULL);
+    real_out  = realpath (out_dir.c_str(), NULL);
+    if (real_root && real_out && under (std::string (real_out), std::string (real_root))) {
+        log (__FILE__, __FUNCTION__, __LINE__, "--output can't be inside the watched directory");
+        free (real_root);
+        free (real_out);
+        return false;
+    }
+    free (real_root);
+    free (real_out);
+
+    w.infd = inotify_init1 (IN_NONBLOCK|IN_CLOEXEC);
+    if (w.infd == -1) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while creating inotify instance");
+        return false;
+    }
+    w.rescan = true;
+    w.busy = false;
+    w.payload_end = w.live = w.generation = w.removed = 0;
+
+    if (open_sfx (w, kfd) == false || write_generation (w) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing initial generation");
+        return false;
+    }
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = [] (int) { stop_watching = 1; };
+    sigaction (SIGINT, &sa, NULL);          /* no SA_RESTART: poll () returns at once */
+    sigaction (SIGTERM, &sa, NULL);
+
+    ds = "watching " + w.root + " (Ctrl-C to stop)";
+    debug_msg (LOG_INFO, ds);
+
+    pfd = {w.infd, POLLIN, 0};
+    while (!stop_watching) {
+
+        /* sleep until the next event, the end of the debounce window or (compacting) a second */
+        timeout = -1;
+        if (!w.dirty.empty() || w.rescan) {
+            deadline = std::min (last + WATCH_DEBOUNCE, first + WATCH_LATENCY * 1000);
+            timeout  = (deadline > now_ms ()) ? deadline - now_ms () : 0;
+        }
+        if (w.compaction) {
+            timeout = (timeout == -1) ? 1000 : std::min (timeout, 1000);
+        }
+
+        if (poll (&pfd, 1, timeout) > 0) {
+            if (w.dirty.empty() && !w.rescan) {
+                first = now_ms ();
+            }
+            collect_events (w);
+            last = now_ms ();
+        }
+
+        if (w.compaction && w.compaction->done && finish_compaction (w) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while compacting SFX (carrying on uncompacted)");
+        }
+
+        /* quiet for WATCH_DEBOUNCE, or busy for WATCH_LATENCY: write a generation */
+        if ( (!w.dirty.empty() || w.rescan) &&
+             (now_ms () >= last + WATCH_DEBOUNCE || now_ms () >= first + WATCH_LATENCY * 1000) &&
+             write_generation (w) == false ) {
+            return false;
+        }
+    }
+
+    /* interrupted: nothing collected so far is left behind */
+    collect_events (w);
+    if ((!w.dirty.empty() || w.rescan) && write_generation (w) == false) {
+        return false;
+    }
+    if (w.compaction) {
+        w.compaction->worker.join ();
+        if (finish_compaction (w) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while compacting SFX (left uncompacted)");
+        }
+    }
+
+    close (w.infd);
+    ds = "stopped watching " + w.root + " after " + std::to_string (w.generation) + " generation(s)";
+    debug_msg (LOG_INFO, ds);
+    return true;
+}
+
+
+
+/* creates the SFX (a signed stub, nothing archived yet), or loads the last generation of an existing one */
+static bool open_sfx (Watch &w, int kfd) {
+
+    std::unique_ptr<uint8_t[]>  stub (new uint8_t[KAVACH_BINARY_SIZE]);
+    uint64_t                    signature = PACK_SIGNATURE;
+    struct stat                 kb_sb;
+    int                         sfxfd;
+    bool                        status;
+
+    sfxfd = open (w.sfx.c_str(), O_RDONLY|O_CLOEXEC);
+    if (sfxfd != -1) {
+        status = load_generation (w, sfxfd);
+        close (sfxfd);
+        return status;
+    }
+
+    if ( fstat (kfd, &kb_sb) == -1 ||
+         (sfxfd = open (w.sfx.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, kb_sb.st_mode)) == -1 ) {
+        es = "while creating " + w.sfx;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    if (pread_full (kfd, stub.get(), KAVACH_BINARY_SIZE, 0) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while reading kavach binary");
+        close (sfxfd);
+        return false;
+    }
+    memcpy (&stub[0x8], &signature, 0x8);
+    status = write_full (sfxfd, stub.get(), KAVACH_BINARY_SIZE);
+    close (sfxfd);
+
+    if (status == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing SFX stub");
+    }
+    return status;
+}
+
+
+
+/****************************************************************************
+ * Rebuilds the tree from the last generation of an existing SFX. Only an  *
+ * SFX written by --watch (of a directory of the same name, by this very   *
+ * kavach build) can be carried on with: new bodies are appended to it and *
+ * must be found through the same kind of tables.                          *
+ ****************************************************************************/
+static bool load_generation (Watch &w, int sfxfd) {
+
+    uint8_t                     *map;
+    uint64_t                    map_size, remainder;
+    Kbhdr                       *header;
+    struct stat                 sb;
+    std::vector<std::string>    open_dirs;
+    std::string                 name, key;
+    bool                        status = false;
+
+    if (fstat (sfxfd, &sb) == -1 || map_kbf (sfxfd, map, map_size, remainder, header) == false) {
+        es = "while mapping " + w.sfx;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+
+    uint8_t         *kbf     = map + remainder;
+    Fhdr            *fht     = (Fhdr *)   &kbf[header->k_fhtoff];
+    Kchunk          *chunks  = (Kchunk *) &kbf[header->k_chunktaboff];
+    NametabReader   nametab  ((uint8_t *) &kbf[header->k_nametaboff], header->k_nametabsz, header->k_nametabenc);
+
+    if ( !(header->k_flags & Kbhdr::flags::KBF_TRAILER) || header->k_fhentsize != sizeof (Fhdr) ||
+         sb.st_size - map_size + remainder != KAVACH_BINARY_SIZE ) {
+        es = w.sfx + " wasn't written by --watch (with this kavach build), move it out of the way";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        munmap (map, map_size);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < header->k_fhnum; ++i) {
+        if (fht[i].is_dir_end ()) {
+            if (open_dirs.empty()) {
+                log (__FILE__, __FUNCTION__, __LINE__, "unbalanced end of directory in FHT");
+                goto out;
+            }
+            open_dirs.pop_back ();
+            continue;
+        }
+        if (nametab.name (fht[i].fh_namendx, name) == false) {
+            log (__FILE__, __FUNCTION__, __LINE__, "name index out of nametab bounds");
+            goto out;
+        }
+        if (open_dirs.empty() && name != w.top) {
+            es = w.sfx + " archives " + name + ", not " + w.top;
+            log (__FILE__, __FUNCTION__, __LINE__, es);
+            goto out;
+        }
+        key = open_dirs.empty() ? name : open_dirs.back() + "/" + name;
+
+        WatchEntry &entry = w.tree[key];
+        entry.fhdr = fht[i];
+        switch (fht[i].fh_ftype) {
+            case Fhdr::ftype::FT_DIR:
+                        open_dirs.push_back (key);
+                        break;
+
+            case Fhdr::ftype::FT_FILE:
+                        if (fht[i].fh_etype != ENCRYPTION_TYPE) {
+                            es = w.sfx + " was written with another --encrypt type";
+                            log (__FILE__, __FUNCTION__, __LINE__, es);
+                            goto out;
+                        }
+                        entry.chunks.assign (chunks + fht[i].fh_chunkndx,
+                                             chunks + fht[i].fh_chunkndx + (fht[i].fh_size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE);
+                        w.live += fht[i].fh_size;
+                        break;
+
+            default:
+                        es = w.sfx + " holds entries --watch doesn't write (hardlinks?)";
+                        log (__FILE__, __FUNCTION__, __LINE__, es);
+                        goto out;
+        }
+    }
+
+    w.payload_end = sb.st_size - KAVACH_BINARY_SIZE;
+    ds = "carrying on with " + w.sfx + " (" + std::to_string (w.tree.size()) + " entries)";
+    debug_msg (LOG_INFO, ds);
+    status = true;
+
+out:
+    munmap (map, map_size);
+    return status;
+}
+
+
+
+/****************************************************************************
+ * Brings the SFX up to date with everything dirty: refreshes the tree,    *
+ * appends the bodies that changed and then a new generation of tables.    *
+ * While the SFX is being run (ETXTBSY) it can't be written; the changes   *
+ * stay pending and are tried again after the next debounce window.        *
+ ****************************************************************************/
+static bool write_generation (Watch &w) {
+
+    std::set<std::string, PathLess> keys;
+    std::set<std::string>           parents;
+    std::vector<std::string>        stale;
+    std::string                     scanned;        /* last directory walked as a whole */
+    uint64_t                        appended = w.payload_end;
+    int                             sfxfd;
+
+    sfxfd = open (w.sfx.c_str(), O_RDWR|O_CLOEXEC);
+    if (sfxfd == -1 && errno == ETXTBSY) {
+        if (!w.busy) {
+            debug_msg (LOG_INFO, w.sfx + " is being run, changes wait for it to exit");
+        }
+        w.busy = true;
+        return true;
+    }
+    if (sfxfd == -1) {
+        es = "while opening " + w.sfx;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    w.busy = false;
+    w.removed = 0;
+
+    keys.swap (w.dirty);
+    if (w.rescan) {
+        keys = {w.top};
+        w.rescan = false;
+    }
+
+    /* a directory's refresh walks it as a whole: anything dirty below it is covered */
+    for (auto &key: keys) {
+        if (!scanned.empty() && under (key, scanned)) {
+            continue;
+        }
+        if (refresh (w, key, stale) == false) {
+            close (sfxfd);
+            return false;
+        }
+        if (w.tree.count (key) && w.tree[key].fhdr.fh_ftype == Fhdr::FT_DIR) {
+            scanned = key;
+        }
+        if (key != w.top) {
+            parents.insert (key.substr (0, key.find_last_of ('/')));
+        }
+    }
+
+    /* their contents changed, and with them their mtime */
+    for (auto &parent: parents) {
+        restat_dir (w, parent);
+    }
+
+    if (write_bodies (w, sfxfd, stale) == false || write_tables (w, sfxfd) == false) {
+        close (sfxfd);
+        return false;
+    }
+    close (sfxfd);
+
+    ++w.generation;
+    ds = "generation " + std::to_string (w.generation) + ": " + std::to_string (stale.size()) + " file(s) written, " +
+         std::to_string (w.removed) + " removed, " + std::to_string (w.payload_end - appended) + " bytes appended";
+    debug_msg (LOG_INFO, ds);
+
+    start_compaction (w);
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Brings tree[key] in line with <key> on disk, whole subtree included if  *
+ * it is a directory (new ones get watched). Files whose size or mtime     *
+ * changed are queued in <stale> for their bodies to be written again.     *
+ ****************************************************************************/
+static bool refresh (Watch &w, const std::string &key, std::vector<std::string> &stale) {
+
+    std::string                     path = w.base + key;
+    std::set<std::string, PathLess> seen;
+    struct stat                     sb;
+    struct dirent                   *dent;
+    DIR                             *dptr;
+    int                             wd;
+    auto                            it = w.tree.find (key);
+
+    if (key != w.top && w.tree.count (key.substr (0, key.find_last_of ('/'))) == 0) {
+        return true;                /* its parent is gone (or not walked yet): it takes this along */
+    }
+
+    /* gone (or nothing that gets archived anymore: like --pack, symlinks below the root are skipped) */
+    if ( (key == w.top ? stat (path.c_str(), &sb) : lstat (path.c_str(), &sb)) == -1 || !(S_ISREG (sb.st_mode) || S_ISDIR (sb.st_mode)) ||
+         ( key != w.top && !EXCLUDES.empty() &&
+           EXCLUDES.excluded (std::string_view (key).substr (w.top.size() + 1), S_ISDIR (sb.st_mode)) ) ) {
+        drop (w, key);
+        return true;
+    }
+
+    if (it != w.tree.end() && (it->second.fhdr.fh_ftype == Fhdr::FT_DIR) != S_ISDIR (sb.st_mode)) {
+        drop (w, key);
+        it = w.tree.end();
+    }
+
+    Fhdr &fhdr = w.tree[key].fhdr;
+    if (S_ISREG (sb.st_mode)) {
+        if ( it == w.tree.end() || fhdr.fh_size != (uint64_t) sb.st_size ||
+             fhdr.fh_time[1].tv_sec != sb.st_mtim.tv_sec || fhdr.fh_time[1].tv_nsec != sb.st_mtim.tv_nsec ) {
+            stale.push_back (key);
+        }
+        fhdr.fh_ftype   = Fhdr::FT_FILE;
+        fhdr.fh_etype   = ENCRYPTION_TYPE;
+        fhdr.fh_cktype  = CHECKSUM_TYPE;
+        fhdr.fh_mode    = sb.st_mode;
+        memmove (&fhdr.fh_time[0], &sb.st_atim, sizeof (struct timespec));
+        memmove (&fhdr.fh_time[1], &sb.st_mtim, sizeof (struct timespec));
+        return true;
+    }
+
+    fhdr.fh_ftype   = Fhdr::FT_DIR;
+    fhdr.fh_etype   = ENCRYPTION_TYPE;
+    fhdr.fh_mode    = sb.st_mode;
+    fhdr.fh_size    = sb.st_size;
+    memmove (&fhdr.fh_time[0], &sb.st_atim, sizeof (struct timespec));
+    memmove (&fhdr.fh_time[1], &sb.st_mtim, sizeof (struct timespec));
+
+    /* watched before it is read: whatever lands in it from now on shows up as an event */
+    wd = inotify_add_watch (w.infd, path.c_str(), WATCH_EVENTS);
+    if (wd == -1) {
+        es = "while watching " + path + " (fs.inotify.max_user_watches too low?)";
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+    }
+    else {
+        w.dirs[wd] = key;           /* a moved directory keeps its wd, under its new key */
+    }
+
+    dptr = opendir (path.c_str());
+    if (dptr == NULL) {
+        es = "while open'ing directory " + path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        return false;
+    }
+    while ((dent = readdir (dptr)) != NULL) {
+        if ( (dent->d_type == DT_DIR || dent->d_type == DT_REG) &&
+             strcmp (dent->d_name, ".") != 0 && strcmp (dent->d_name, "..") != 0 ) {
+            seen.insert (key + "/" + dent->d_name);
+        }
+    }
+    closedir (dptr);
+
+    /* whatever the tree holds below it that isn't there anymore goes */
+    for (auto child = w.tree.upper_bound (key); child != w.tree.end() && under (child->first, key); ) {
+        const std::string &ckey = child->first;
+        if (ckey.find ('/', key.size() + 1) == std::string::npos && seen.count (ckey) == 0) {
+            std::string gone = ckey;
+            ++child;
+            while (child != w.tree.end() && under (child->first, gone)) {
+                ++child;
+            }
+            drop (w, gone);
+            continue;
+        }
+        ++child;
+    }
+
+    for (auto &child: seen) {
+        if (refresh (w, child, stale) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/* re-reads the mode and times of directory <key> (its entries are taken care of by their own events) */
+static void restat_dir (Watch &w, const std::string &key) {
+
+    struct stat sb;
+    auto        it = w.tree.find (key);
+
+    if (it != w.tree.end() && it->second.fhdr.fh_ftype == Fhdr::FT_DIR && stat ((w.base + key).c_str(), &sb) == 0) {
+        it->second.fhdr.fh_mode = sb.st_mode;
+        memmove (&it->second.fhdr.fh_time[0], &sb.st_atim, sizeof (struct timespec));
+        memmove (&it->second.fhdr.fh_time[1], &sb.st_mtim, sizeof (struct timespec));
+    }
+}
+
+
+
+/* removes <key> and everything below it from the tree, their bodies turn into dead payload */
+static void drop (Watch &w, const std::string &key) {
+
+    auto first = w.tree.lower_bound (key);
+    auto last  = first;
+
+    while (last != w.tree.end() && under (last->first, key)) {
+        if (last->second.fhdr.fh_ftype == Fhdr::FT_FILE) {
+            w.live -= last->second.fhdr.fh_size;
+        }
+        ++w.removed;
+        ++last;
+    }
+    w.tree.erase (first, last);
+}
+
+
+
+/****************************************************************************
+ * Appends the bodies of the <stale> files to the SFX, right after its     *
+ * last generation. A file that vanishes (or shrinks) while it is read is  *
+ * left out of this generation and looked at again in the next one.       *
+ ****************************************************************************/
+static bool write_bodies (Watch &w, int sfxfd, std::vector<std::string> &stale) {
+
+    std::unique_ptr<uint8_t[]>  block (new uint8_t[PIPELINE_BLOCK_SIZE]);
+    std::vector<Kchunk>         chunks;
+    struct stat                 sb;
+    uint64_t                    written;
+    int                         afd;
+
+    for (auto &key: stale) {
+        auto it = w.tree.find (key);
+        if (it == w.tree.end()) {
+            continue;
+        }
+        WatchEntry &entry = it->second;
+
+        afd = open ((w.base + key).c_str(), O_RDONLY|O_CLOEXEC);
+        if (afd == -1 || fstat (afd, &sb) == -1) {
+            if (afd != -1) {
+                close (afd);
+            }
+            drop (w, key);
+            w.dirty.insert (key);
+            continue;
+        }
+
+        /* the size and times that go with what is about to be read */
+        Fhdr fhdr = entry.fhdr;
+        fhdr.fh_size   = sb.st_size;
+        fhdr.fh_offset = w.payload_end;
+        fhdr.fh_mode   = sb.st_mode;
+        memmove (&fhdr.fh_time[0], &sb.st_atim, sizeof (struct timespec));
+        memmove (&fhdr.fh_time[1], &sb.st_mtim, sizeof (struct timespec));
+        chunks.assign ((fhdr.fh_size + KBF_CHUNK_SIZE - 1) / KBF_CHUNK_SIZE, Kchunk ());
+
+        if (lseek (sfxfd, KAVACH_BINARY_SIZE + w.payload_end, SEEK_SET) == -1) {
+            log (__FILE__, __FUNCTION__, __LINE__, "while seeking to the end of SFX payload");
+            close (afd);
+            return false;
+        }
+        posix_fadvise (afd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        written = load_payload_fd (afd, fhdr, chunks.data(), w.key, sfxfd, block.get());
+        close (afd);
+
+        if (written == (uint64_t) -1) {
+            /* whatever made it to the SFX is dead payload now */
+            if (fstat (sfxfd, &sb) == -1) {
+                log (__FILE__, __FUNCTION__, __LINE__, "while fstat'ing SFX");
+                return false;
+            }
+            w.payload_end = std::max (w.payload_end, (uint64_t) sb.st_size - KAVACH_BINARY_SIZE);
+            drop (w, key);
+            w.dirty.insert (key);
+            continue;
+        }
+
+        w.live        += written - (entry.fhdr.fh_ftype == Fhdr::FT_FILE ? entry.fhdr.fh_size : 0);
+        w.payload_end += written;
+        entry.fhdr     = fhdr;
+        entry.chunks.swap (chunks);
+    }
+
+    return true;
+}
+
+
+
+/****************************************************************************
+ * Writes a generation of tables for the whole tree right after the last   *
+ * body (KBF_TRAILER: chunktab, nametab, FHT, Kbhdr, TRAILER_MAGIC) and    *
+ * stretches the stub's .kavach section over it. The next generation's     *
+ * bodies follow it, so the tables of older generations become payload     *
+ * that nothing refers to anymore.                                         *
+ ****************************************************************************/
+static bool write_tables (Watch &w, int sfxfd) {
+
+    Kavach                      ko;
+    std::vector<std::string>    open_dirs;
+    uint8_t                     *map;
+    size_t                      slash;
+
+    for (auto &[key, entry]: w.tree) {
+        while (!open_dirs.empty() && !under (key, open_dirs.back())) {
+            ko.fht.push_back (Fhdr ());
+            open_dirs.pop_back ();
+        }
+
+        Fhdr fhdr = entry.fhdr;
+        slash = key.find_last_of ('/');
+        fhdr.fh_namendx = ko.nametab.intern (std::string_view (key).substr (slash == std::string::npos ? 0 : slash + 1));
+        if (fhdr.fh_ftype == Fhdr::FT_FILE) {
+            fhdr.fh_chunkndx = ko.chunktab.size();
+            ko.chunktab.insert (ko.chunktab.end(), entry.chunks.begin(), entry.chunks.end());
+        }
+        else {
+            open_dirs.push_back (key);
+        }
+        ko.fht.push_back (fhdr);
+    }
+    while (!open_dirs.empty()) {
+        ko.fht.push_back (Fhdr ());
+        open_dirs.pop_back ();
+    }
+
+    if (ko.nametab.finalize (NAMETAB_ENCODING, ko.fht) == false) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while encoding nametab");
+        return false;
+    }
+    ko.header.k_nametabenc = NAMETAB_ENCODING;
+    ko.header.k_payloadsz  = w.payload_end;
+    layout_trailer (ko);
+
+    if ( lseek (sfxfd, KAVACH_BINARY_SIZE + w.payload_end, SEEK_SET) == -1 ||
+         write_trailer (sfxfd, ko) == false ) {
+        log (__FILE__, __FUNCTION__, __LINE__, "while writing a generation of tables");
+        return false;
+    }
+
+    map = (uint8_t *) mmap (NULL, KAVACH_BINARY_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, sfxfd, 0);
+    if (map == MAP_FAILED) {
+        mmap_error ("while mmap'ing SFX stub", errno);
+        return false;
+    }
+    patch_sfx_metadata (sfxfd, map, ko);
+    munmap (map, KAVACH_BINARY_SIZE);
+
+    w.payload_end = ARCHIVE_SIZE;       /* set by layout_trailer (): the end of this generation */
+    return true;
+}
+
+
+
+/* turns pending inotify events into dirty keys */
+static void collect_events (Watch &w) {
+
+    alignas (struct inotify_event) char buf[WATCH_EVENT_BUFFER];
+    struct inotify_event                *ev;
+    ssize_t                             nread;
+
+    while ((nread = read (w.infd, buf, sizeof (buf))) > 0) {
+        for (char *p = buf; p < buf + nread; p += sizeof (struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                w.rescan = true;        /* events were lost, only a full walk can tell */
+                continue;
+            }
+            auto dir = w.dirs.find (ev->wd);
+            if (dir == w.dirs.end()) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                w.dirs.erase (dir);     /* its directory is gone */
+                continue;
+            }
+            w.dirty.insert (ev->len ? dir->second + "/" + ev->name : dir->second);
+        }
+    }
+}
+
+
+
+/* past WATCH_GARBAGE percent of dead payload, copies the live bodies into a fresh SFX in the background */
+static void start_compaction (Watch &w) {
+
+    uint64_t    garbage = w.payload_end - w.live;
+    struct stat sb;
+    Compaction  *c;
+
+    if (w.compaction || garbage < WATCH_COMPACT_MIN || garbage * 100 < w.payload_end * WATCH_GARBAGE) {
+        return;
+    }
+
+    c = new Compaction;
+    c->path = w.sfx + ".compact";
+    c->fd   = (stat (w.sfx.c_str(), &sb) == -1) ? -1 : open (c->path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, sb.st_mode);
+    if (c->fd == -1) {
+        es = "while creating " + c->path;
+        log (__FILE__, __FUNCTION__, __LINE__, es);
+        delete c;
+        return;
+    }
+
+    for (auto &[key, entry]: w.tree) {
+        if (entry.fhdr.fh_ftype == Fhdr::FT_FILE && entry.fhdr.fh_size) {
+            c->bodies.push_back ({entry.fhdr.fh_offset, entry.fhdr.fh_size});
+        }
+    }
+    std::sort (c->bodies.begin(), c->bodies.end());
+
+    debug_msg (LOG_VERBOSE, "compacting " + w.sfx + ": " + std::to_string (garbage) + " of " + std::to_string (w.payload_end) + " payload bytes are dead");
+
+    w.compaction.reset (c);
+    c->worker = std::thread ([c, sfx = w.sfx, settings = Settings::capture ()] () {
+        settings.apply ();          /* KAVACH_BINARY_SIZE and friends are thread_local */
+        compact_bodies (c, sfx);
+    });
+}
+
+
+
+/* compaction thread: the stub and every body of the snapshot, back to back. What it *
+ * reads is never written again (generations only ever append).                      */
+static void compact_bodies (Compaction *c, std::string sfx) {
+
+    uint64_t    out = 0;
+    int         rfd = open (sfx.c_str(), O_RDONLY|O_CLOEXEC);
+
+    c->ok = (rfd != -1) && copy_range (rfd, 0, c->fd, &out, KAVACH_BINARY_SIZE);
+    for (auto &body: c->bodies) {
+        if (!c->ok) {
+            break;
+        }
+        c->moved[body.first] = out - KAVACH_BINARY_SIZE;
+        c->ok = copy_range (rfd, KAVACH_BINARY_SIZE + body.first, c->fd, &out, body.second);
+    }
+    c->end = out - KAVACH_BINARY_SIZE;
+
+    if (rfd != -1) {
+        close (rfd);
+    }
+    c->done = true;
+}
+
+
+
+/****************************************************************************
+ * Completes a compaction whose thread is done: bodies written since its   *
+ * snapshot are copied over as well, the current generation of tables is   *
+ * written behind them and the compacted SFX renamed over the old one. On  *
+ * failure, the tree is left pointing into the old SFX.                    *
+ ****************************************************************************/
+static bool finish_compaction (Watch &w) {
+
+    std::unique_ptr<Compaction>                 c (w.compaction.release ());
+    std::vector<std::pair<WatchEntry *, uint64_t>> relocated;     /* entry, its new fh_offset */
+    uint64_t                                    old_end = w.payload_end;
+    uint64_t                                    out;
+    bool                                        status;
+    int                                         rfd = -1;
+
+    c->worker.join ();
+    status = c->ok;
+
+    if (status) {
+        rfd = open (w.sfx.c_str(), O_RDONLY|O_CLOEXEC);
+        status = (rfd != -1);
+    }
+
+    out = KAVACH_BINARY_SIZE + c->end;
+    for (auto &[key, entry]: w.tree) {
+        if (!status || entry.fhdr.fh_ftype != Fhdr::FT_FILE) {
+            continue;
+        }
+        auto moved = c->moved.find (entry.fhdr.fh_offset);
+        if (entry.fhdr.fh_size == 0) {
+            relocated.push_back ({&entry, 0});
+        }
+        else if (moved != c->moved.end()) {
+            relocated.push_back ({&entry, moved->second});
+        }
+        else {
+            relocated.push_back ({&entry, out - KAVACH_BINARY_SIZE});
+            status = copy_range (rfd, KAVACH_BINARY_SIZE + entry.fhdr.fh_offset, c->fd, &out, entry.fhdr.fh_size);
+        }
+    }
+    if (rfd != -1) {
+        close (rfd);
+    }
+
+    if (status) {
+        for (auto &[entry, to]: relocated) {
+            for (auto &chunk: entry->chunks) {
+                chunk.c_offset = chunk.c_offset - entry->fhdr.fh_offset + to;
+            }
+            std::swap (entry->fhdr.fh_offset, to);      /* <to> keeps the old offset */
+        }
+        w.payload_end = out - KAVACH_BINARY_SIZE;
+        status = write_tables (w, c->fd) && rename (c->path.c_str(), w.sfx.c_str()) == 0;
+
+        if (status == false) {
+            for (auto &[entry, from]: relocated) {
+                for (auto &chunk: entry->chunks) {
+                    chunk.c_offset = chunk.c_offset - entry->fhdr.fh_offset + from;
+                }
+                entry->fhdr.fh_offset = from;
+            }
+            w.payload_end = old_end;
+        }
+    }
+
+    close (c->fd);
+    if (status == false) {
+        unlink (c->path.c_str());
+        return false;
+    }
+
+    ds = "compacted " + w.sfx + ": " + std::to_string (old_end) + " -> " + std::to_string (w.payload_end) + " bytes";
+    debug_msg (LOG_INFO, ds);
+    return true;
+}
+
+
+
+/* <key> is <dir> itself or lies below it */
+static bool under (const std::string &key, const std::string &dir) {
+
+    return key.size() >= dir.size() && key.compare (0, dir.size(), dir) == 0 &&
+           (key.size() == dir.size() || key[dir.size()] == '/');
+}
+
+
+
+static uint64_t now_ms () {
+
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}